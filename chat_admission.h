@@ -0,0 +1,85 @@
+// --- ADMISSION CONTROL ---
+// What keeps a flood of new connections from swamping the server: every
+// client reconnecting at once after a restart, or one address opening
+// connections in a loop.
+//   - The listen backlog (--backlog) is how many connections the kernel
+//     holds for us, TCP handshake done, until we call accept(). The event
+//     loop takes ALL of them on every wakeup, not one per turn.
+//   - Each source address has a token bucket: it may connect --ip-rate
+//     times a second on average, and --ip-burst times in a row. A connection
+//     that finds its bucket empty is closed at once, before it costs a
+//     session or a slot in our tables.
+//   - At most --max-handshakes connections may be between accept() and
+//     their first frame at once. While that many are waiting, the shards
+//     stop accepting and the rest wait in the backlog, where they cost us
+//     nothing. A connection that says nothing for HANDSHAKE_TIMEOUT_MS stops
+//     counting (it may be a client that only listens) but stays connected.
+// Both limits are off (0) unless asked for.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#define HANDSHAKE_TIMEOUT_MS 1000 // A quiet new connection counts as a handshake for this long
+#define ADMIT_TABLE_MAX 65536     // Addresses remembered before idle ones are forgotten
+
+// Shared by all shards (the kernel spreads one address's connections over them).
+class Admission {
+public:
+    double ip_rate = 0;     // Connections per second per address (0 = no limit)
+    double ip_burst = 20;   // ...and how many may come in a row
+    int max_handshakes = 0; // New connections that have not sent a frame yet (0 = no limit)
+
+    // May a new connection from 'address' (IPv4, network order) in? Takes a
+    // token from its bucket if so.
+    bool allow(uint32_t address) {
+        if (ip_rate <= 0) return true;
+        long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buckets.size() >= ADMIT_TABLE_MAX && !buckets.count(address)) forget_idle(now);
+        Bucket& b = buckets[address];
+        if (b.last == 0) b.tokens = ip_burst; // A new address starts with a full bucket
+        else b.tokens = refill(b, now);
+        b.last = now;
+        if (b.tokens < 1) return false;
+        b.tokens -= 1;
+        return true;
+    }
+
+    // Handshakes: counted from accept() to the first frame (or the timeout).
+    bool handshakes_full() const {
+        return max_handshakes > 0 && handshakes.load(std::memory_order_relaxed) >= max_handshakes;
+    }
+    void begin_handshake() { handshakes.fetch_add(1, std::memory_order_relaxed); }
+    void end_handshake() { handshakes.fetch_sub(1, std::memory_order_relaxed); }
+
+private:
+    struct Bucket {
+        double tokens = 0;
+        long long last = 0; // When it was last topped up (ns)
+    };
+
+    double refill(const Bucket& b, long long now) const {
+        double tokens = b.tokens + (now - b.last) * 1e-9 * ip_rate;
+        return tokens < ip_burst ? tokens : ip_burst;
+    }
+
+    // Make room: an address whose bucket has filled up again is the same as
+    // one we never saw. If even that is not enough, forget everyone (that
+    // only ever lets connections in, never keeps them out).
+    void forget_idle(long long now) {
+        for (auto it = buckets.begin(); it != buckets.end();) {
+            if (refill(it->second, now) >= ip_burst) it = buckets.erase(it);
+            else ++it;
+        }
+        if (buckets.size() >= ADMIT_TABLE_MAX) buckets.clear();
+    }
+
+    std::mutex mutex;                                // Guards 'buckets'
+    std::unordered_map<uint32_t, Bucket> buckets;    // Source address -> its bucket
+    std::atomic<int> handshakes{0};                  // Connections accepted that have not sent a frame yet
+};
\ No newline at end of file
@@ -0,0 +1,706 @@
+// --- CHAT CLIENT LIBRARY (C++20 coroutines) ---
+// Everything a program needs to be a chat client, for the console client,
+// the GUI, and bots that keep hundreds of connections in one process.
+// There is no thread per connection. One EventLoop (a Poller, like the
+// server's) drives any number of ChatClients, and code that uses them is
+// written as coroutines that read like blocking code:
+//
+//   Task<void> bot(ChatClient& client) {
+//       if (!co_await client.connect("127.0.0.1", 60000)) co_return;
+//       co_await client.send(hello_frame("bot"));
+//       Frame frame;
+//       while (co_await client.next(frame)) { ... }  // false once the connection is gone
+//   }
+//   EventLoop loop;  ChatClient client(loop);
+//   bot(client).detach();  loop.run();
+//
+//   - connect() finishes when the TCP connection is up (or has failed).
+//   - send() copies the frames into the connection's queue at once; it only
+//     waits while more than CLIENT_SEND_LIMIT bytes are still queued, so a
+//     fast sender is slowed down to what the server takes.
+//   - next() hands out the incoming frames one at a time, as a stream. The
+//     frame points into the client's buffer and is valid until the next
+//     call. FRAME_SHM frames are handled inside and never show up here.
+//
+// Everything runs on the loop's thread. Another thread (a GUI's window
+// thread, a console reading the keyboard) uses send_from_thread() while the
+// loop runs elsewhere.
+//
+// Local clients can move to shared memory as before (request_shm(),
+// chat_shm_channel.h). The server wakes a sleeping client with a futex or
+// semaphore, which a poller can't wait on, so each such client has one
+// small thread that sleeps on it and wakes the loop. Bots stay on TCP and
+// have no extra thread.
+//
+// A Task must be awaited or detach()ed. A ChatClient belongs to the loop it
+// was made with. Its waiters keep their results themselves, so a coroutine
+// woken by close() may still run after the client is gone, as long as it
+// doesn't touch the client again.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "chat_net.h"
+#include "chat_poller.h"
+#include "chat_frame.h"
+#include "chat_shm_channel.h"
+#include "chat_resume.h"
+
+#define CLIENT_SEND_LIMIT (1024 * 1024) // Bytes queued before send() waits for the socket
+#define CLIENT_SHM_RETRY_MS 1           // How soon to try a full shared-memory pipe again
+
+// --- TASK ---
+// A coroutine that returns T. It starts when it is awaited (or detached),
+// and whoever awaited it carries on when it finishes.
+template <class T = void> class Task;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation; // Who awaits us (none if detached)
+    bool detached = false;                // Free the frame when done: nobody will
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept {
+            TaskPromiseBase& promise = done.promise();
+            if (promise.detached) {
+                done.destroy();
+                return std::noop_coroutine();
+            }
+            return promise.continuation ? promise.continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); } // Nothing here throws
+};
+
+template <class T> struct TaskPromise : TaskPromiseBase {
+    T value{};
+    Task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+template <class T> class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle; // Run it straight away, on this thread
+    }
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) return std::move(handle.promise().value);
+    }
+
+    // Start it without waiting for it. It runs until it first waits, right
+    // here, and frees itself when it finishes.
+    void detach() {
+        handle.promise().detached = true;
+        std::exchange(handle, {}).resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <class T> Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+class ChatClient;
+
+// --- EVENT LOOP ---
+// One thread's poller, timers and to-do list. Coroutines woken by I/O are
+// resumed after the poller's whole batch has been handled, never from
+// inside it.
+class EventLoop {
+public:
+    EventLoop() { poller.add(wakeup.socket(), POLL_READ); }
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Run until stop() is called.
+    void run() {
+        stopping = false;
+        while (!stopping) turn();
+    }
+
+    // Run 'task' on THIS thread (the loop must not be running elsewhere)
+    // until it finishes, and return its result.
+    template <class T> T run_until_done(Task<T> task) {
+        bool done = false;
+        if constexpr (std::is_void_v<T>) {
+            finish(std::move(task), done).detach();
+            while (!done) turn();
+        } else {
+            T result{};
+            finish_with(std::move(task), result, done).detach();
+            while (!done) turn();
+            return result;
+        }
+    }
+
+    // Make run() return. Any thread.
+    void stop() {
+        stopping = true;
+        wakeup.signal();
+    }
+
+    // Run 'fn' on the loop's thread, soon. Any thread.
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(posted_mutex);
+            posted.push_back(std::move(fn));
+        }
+        wakeup.signal();
+    }
+
+    // co_await loop.sleep(ms): carry on after 'ms' milliseconds.
+    struct SleepAwaiter {
+        EventLoop& loop;
+        int ms;
+        bool await_ready() const { return ms <= 0; }
+        void await_suspend(std::coroutine_handle<> h) { loop.after(ms, [h]() { h.resume(); }); }
+        void await_resume() {}
+    };
+    SleepAwaiter sleep(int ms) { return SleepAwaiter{*this, ms}; }
+
+    // Loop thread only: call 'fn' after 'ms' milliseconds.
+    void after(int ms, std::function<void()> fn) {
+        timers.emplace(now_ms() + ms, std::move(fn));
+    }
+
+    // Loop thread only: resume 'h' once this turn's events are handled.
+    void resume_soon(std::coroutine_handle<> h) { ready.push_back(h); }
+
+private:
+    friend class ChatClient;
+
+    static Task<void> finish(Task<void> task, bool& done) {
+        co_await task;
+        done = true;
+    }
+    template <class T> static Task<void> finish_with(Task<T> task, T& result, bool& done) {
+        result = co_await task;
+        done = true;
+    }
+
+    static long long now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Wait for something to happen, then deal with all of it.
+    void turn();
+
+    // ChatClient's sockets.
+    void watch(SOCKET sock, ChatClient* client, unsigned interest) {
+        clients[sock] = client;
+        poller.add(sock, interest);
+    }
+    void unwatch(SOCKET sock) {
+        poller.remove(sock);
+        clients.erase(sock);
+    }
+
+    Poller poller;
+    Wakeup wakeup;                                       // For stop(), post() and the shared-memory watchers
+    std::unordered_map<SOCKET, ChatClient*> clients;     // Socket -> the client it belongs to
+    std::vector<ChatClient*> shm_clients;                // Clients whose frames come through shared memory
+    std::multimap<long long, std::function<void()>> timers; // Due time (ms) -> what to do
+    std::vector<std::coroutine_handle<>> ready;          // To resume at the end of this turn
+    std::vector<std::coroutine_handle<>> resuming;       // The list being resumed (swapped with 'ready')
+    std::mutex posted_mutex;                             // Guards 'posted'
+    std::vector<std::function<void()>> posted;           // From other threads
+    std::vector<PollEvent> events;
+    std::atomic<bool> stopping{false};
+};
+
+// --- CLIENT ---
+// One connection to the server.
+class ChatClient {
+public:
+    explicit ChatClient(EventLoop& loop) : loop(loop) {}
+    ChatClient(const ChatClient&) = delete;
+    ChatClient& operator=(const ChatClient&) = delete;
+    ~ChatClient() { close(); }
+
+    bool is_open() const { return state == CLIENT_OPEN; }
+    bool local() const { return down_ready; } // Both directions on shared memory?
+    SOCKET socket() const { return sock; }
+
+    // --- co_await client.connect(host, port) -> true once connected ---
+    struct ConnectAwaiter {
+        ChatClient& client;
+        bool ok = false;
+        std::coroutine_handle<> handle{};
+        bool await_ready() {
+            ok = client.state == CLIENT_OPEN;
+            return client.state != CLIENT_CONNECTING;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            client.connect_waiter = this;
+        }
+        bool await_resume() const { return ok; }
+        void finish(EventLoop& loop, bool result) {
+            ok = result;
+            loop.resume_soon(handle);
+        }
+    };
+    ConnectAwaiter connect(const std::string& host, int port) {
+        close();
+        decoder = FrameDecoder();
+        sockaddr_in address;
+        if (!make_address(address, host, port)) return ConnectAwaiter{*this};
+        sock = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return ConnectAwaiter{*this};
+        set_nonblocking(sock);
+        set_nodelay(sock); // Chat is small frames: don't hold them back
+        state = CLIENT_CONNECTING;
+        if (::connect(sock, (const sockaddr*)&address, sizeof(address)) == 0) state = CLIENT_OPEN;
+#ifdef _WIN32
+        else if (WSAGetLastError() != WSAEWOULDBLOCK) state = CLIENT_CLOSED;
+#else
+        else if (errno != EINPROGRESS) state = CLIENT_CLOSED;
+#endif
+        if (state == CLIENT_CLOSED) {
+            ::closesocket(sock);
+            sock = INVALID_SOCKET;
+            return ConnectAwaiter{*this};
+        }
+        interest = state == CLIENT_CONNECTING ? POLL_WRITE : 0;
+        loop.watch(sock, this, interest);
+        return ConnectAwaiter{*this};
+    }
+
+    // --- co_await client.send(frames) -> false if the connection is gone ---
+    struct SendAwaiter {
+        ChatClient& client;
+        bool ok;
+        std::coroutine_handle<> handle{};
+        bool await_ready() const { return !ok || client.queued() <= CLIENT_SEND_LIMIT; }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            client.send_waiters.push_back(this);
+        }
+        bool await_resume() const { return ok; }
+        void finish(EventLoop& loop, bool result) {
+            ok = result;
+            loop.resume_soon(handle);
+        }
+    };
+    SendAwaiter send(const char* data, size_t length) { return SendAwaiter{*this, queue(data, length)}; }
+    SendAwaiter send(const std::string& frames) { return send(frames.data(), frames.size()); }
+
+    // --- co_await client.next(frame) -> the next frame, or false once closed ---
+    struct NextAwaiter {
+        ChatClient& client;
+        Frame& frame;
+        bool ok = false;
+        std::coroutine_handle<> handle{};
+        bool await_ready() { return client.take_frame(*this); }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            client.next_waiter = this;
+            client.reading = true;
+            client.update_interest();
+        }
+        bool await_resume() const { return ok; }
+        void finish(EventLoop& loop, bool result) {
+            ok = result;
+            loop.resume_soon(handle);
+        }
+    };
+    NextAwaiter next(Frame& frame) { return NextAwaiter{*this, frame}; }
+
+    // Send from a thread other than the loop's, while the loop runs. Waits,
+    // like co_await send(), while too much is queued.
+    bool send_from_thread(const char* data, size_t length) {
+        std::string bytes(data, length);
+        std::promise<bool> sent;
+        loop.post([this, &bytes, &sent]() { forward(*this, bytes, sent).detach(); });
+        return sent.get_future().get();
+    }
+    bool send_from_thread(const std::string& frames) { return send_from_thread(frames.data(), frames.size()); }
+
+    // Ask to switch to shared memory, if the server is on this machine.
+    // Returns false if it isn't (we just stay on TCP).
+    bool request_shm() {
+        if (state != CLIENT_OPEN || !same_host(sock)) return false;
+        char header[FRAME_HEADER_SIZE];
+        write_frame_header(header, FRAME_SHM, SHM_REQUEST, 0);
+        return queue(header, sizeof(header));
+    }
+
+    // Ask the server to number what it sends us and, if we were connected
+    // before, to send what we missed meanwhile (chat_resume.h). Call it right
+    // after connect(), before the hello. The answer is a FRAME_RESUME frame:
+    // RESUME_DONE once the missed frames are through, or RESUME_GAP if the
+    // server no longer has them all (ask for history instead). Repeats and
+    // the numbers themselves never reach next().
+    bool request_resume() {
+        if (state != CLIENT_OPEN) return false;
+        std::string ask = resume.ask();
+        return queue(ask.data(), ask.size());
+    }
+
+    // Hang up. Everyone waiting on this client carries on (with false).
+    void close() {
+        if (state == CLIENT_CLOSED) return;
+        state = CLIENT_CLOSED;
+        if (watcher.joinable()) {
+            watcher_stop = true;
+            nudged.store(false);
+            nudged.notify_one();
+            channel->wake_client(); // In case it sleeps on the futex / semaphore
+            watcher.join();
+        }
+        for (size_t i = 0; i < loop.shm_clients.size(); i++) {
+            if (loop.shm_clients[i] == this) loop.shm_clients.erase(loop.shm_clients.begin() + i);
+        }
+        loop.unwatch(sock);
+        ::closesocket(sock);
+        sock = INVALID_SOCKET;
+        channel.reset();
+        up_ready = down_ready = false;
+        tcp_until = SIZE_MAX;
+        out.clear();
+        out_sent = 0;
+        // The decoder stays: a frame handed out this turn still points into it.
+        if (connect_waiter) std::exchange(connect_waiter, nullptr)->finish(loop, false);
+        if (next_waiter) std::exchange(next_waiter, nullptr)->finish(loop, false);
+        for (SendAwaiter* w : send_waiters) w->finish(loop, false);
+        send_waiters.clear();
+    }
+
+private:
+    friend class EventLoop;
+
+    enum ClientState { CLIENT_CLOSED, CLIENT_CONNECTING, CLIENT_OPEN };
+
+    static Task<void> forward(ChatClient& client, const std::string& bytes, std::promise<bool>& sent) {
+        sent.set_value(co_await client.send(bytes));
+    }
+
+    size_t queued() const { return out.size() - out_sent; }
+
+    // Add bytes to the send queue and push out what the socket (or pipe) takes.
+    bool queue(const char* data, size_t length) {
+        if (state == CLIENT_CLOSED) return false;
+        out.append(data, length);
+        if (state == CLIENT_OPEN) flush();
+        return state != CLIENT_CLOSED;
+    }
+
+    // Write as much of the queue as we can without waiting.
+    void flush() {
+        while (out_sent < out.size()) {
+            if (up_ready) {
+                // Shared memory: the server only needs a ring if it asked for one.
+                ShmPipe& pipe = channel->up();
+                size_t n = shm_pipe_write(pipe, out.data() + out_sent, out.size() - out_sent);
+                out_sent += n;
+                if (n > 0 && shm_take_doorbell(pipe)) ring();
+                if (n > 0) continue;
+                if (channel->layout()->closed.load()) return fail();
+                if (!retry_pending) {
+                    // Full: the server is behind, and won't tell us when it has caught up.
+                    retry_pending = true;
+                    loop.after(CLIENT_SHM_RETRY_MS, [this]() {
+                        retry_pending = false;
+                        if (state == CLIENT_OPEN) flush();
+                    });
+                }
+                break;
+            }
+            // TCP - only up to SHM_ATTACHED, if we are switching.
+            size_t end = tcp_until < out.size() ? tcp_until : out.size();
+            int n = ::send(sock, out.data() + out_sent, (int)(end - out_sent), 0);
+            if (n > 0) {
+                out_sent += n;
+                if (out_sent == tcp_until) up_ready = true; // SHM_ATTACHED is out: the rest goes into the pipe
+                continue;
+            }
+            if (n < 0 && net_would_block()) break;
+            return fail();
+        }
+        if (out_sent == out.size()) {
+            out.clear();
+            if (tcp_until != SIZE_MAX) tcp_until = up_ready ? SIZE_MAX : tcp_until - out_sent;
+            out_sent = 0;
+        }
+        if (queued() <= CLIENT_SEND_LIMIT && !send_waiters.empty()) {
+            for (SendAwaiter* w : send_waiters) w->finish(loop, true);
+            send_waiters.clear();
+        }
+        update_interest();
+    }
+
+    // Wake the server: one byte over the socket (see chat_shm_channel.h).
+    void ring() {
+        char bell = SHM_DOORBELL;
+        ::send(sock, &bell, 1, 0);
+    }
+
+    // Ask the poller for what we need right now: POLL_WRITE while TCP bytes
+    // are waiting, POLL_READ while someone reads frames (and always on
+    // shared memory, where the socket only says that the server has gone).
+    // A reader is between two next() calls most of the time, so POLL_READ
+    // stays on until data arrives and finds nobody waiting for it.
+    void update_interest() {
+        if (state == CLIENT_CLOSED) return;
+        unsigned want = 0;
+        if (state == CLIENT_CONNECTING || (!up_ready && queued() > 0)) want |= POLL_WRITE;
+        if (state == CLIENT_OPEN && (reading || down_ready)) want |= POLL_READ;
+        if (want != interest) {
+            interest = want;
+            loop.poller.modify(sock, want);
+        }
+    }
+
+    // The poller says our socket is ready.
+    void on_ready(unsigned flags) {
+        if (state == CLIENT_CONNECTING) {
+            int error = 0;
+#ifdef _WIN32
+            int length = sizeof(error);
+#else
+            socklen_t length = sizeof(error);
+#endif
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) return fail();
+            state = CLIENT_OPEN;
+            if (connect_waiter) std::exchange(connect_waiter, nullptr)->finish(loop, true);
+            flush(); // Anything queued meanwhile
+            return;
+        }
+        if (flags & POLL_WRITE) flush();
+        if (state != CLIENT_OPEN || !(flags & (POLL_READ | POLL_ERROR))) return;
+        if (down_ready) {
+            // After the switch the server sends nothing over TCP: this is it going away.
+            char bytes[64];
+            int n = recv(sock, bytes, sizeof(bytes), 0);
+            if (n == 0 || (n < 0 && !net_would_block())) fail();
+            return;
+        }
+        if (!next_waiter) {
+            reading = false;
+            update_interest(); // Nobody wants it yet: leave it in the socket
+            return;
+        }
+        char* dst = decoder.write_ptr();
+        int n = recv(sock, dst, (int)decoder.write_space(), 0);
+        if (n > 0) decoder.commit(n);
+        else if (n == 0 || !net_would_block()) return fail();
+        NextAwaiter* waiter = next_waiter;
+        if (take_frame(*waiter)) {
+            next_waiter = nullptr;
+            waiter->finish(loop, waiter->ok);
+        }
+    }
+
+    // Give 'waiter' the next frame, if one is complete (or tell it we are
+    // closed). Returns false if it has to wait.
+    bool take_frame(NextAwaiter& waiter) {
+        while (state == CLIENT_OPEN) {
+            FrameStatus status = decoder.next(waiter.frame);
+            if (status == FRAME_OK) {
+                if (waiter.frame.type == FRAME_SHM) {
+                    switch_shm(waiter.frame);
+                    continue;
+                }
+                if (waiter.frame.type == FRAME_HEARTBEAT) {
+                    if (waiter.frame.flags == HEARTBEAT_PING) answer_ping();
+                    continue; // The server checking we are still there: not for the caller
+                }
+                if (!resume.accept(waiter.frame)) continue; // A number, or a frame we already had
+                waiter.ok = true;
+                return true;
+            }
+            if (status == FRAME_BAD) {
+                fail();
+                break;
+            }
+            if (!down_ready || !pump_shm()) return false;
+        }
+        waiter.ok = false;
+        return true;
+    }
+
+    // Tell the server we are still here.
+    void answer_ping() {
+        char header[FRAME_HEADER_SIZE];
+        write_frame_header(header, FRAME_HEARTBEAT, HEARTBEAT_PONG, 0);
+        out.append(header, sizeof(header));
+        flush();
+    }
+
+    // The server's side of the switch to shared memory (chat_shm_channel.h).
+    void switch_shm(const Frame& frame) {
+        if (frame.flags == SHM_OFFER && !channel) {
+            std::unique_ptr<ShmChannel> mapped(new ShmChannel());
+            bool ok = mapped->attach(std::string(frame.payload, frame.length));
+            char header[FRAME_HEADER_SIZE];
+            write_frame_header(header, FRAME_SHM, ok ? SHM_ATTACHED : SHM_DECLINED, 0);
+            out.append(header, sizeof(header));
+            if (ok) {
+                channel = std::move(mapped);
+                tcp_until = out.size(); // Our last bytes over TCP
+            }
+            flush();
+        } else if (frame.flags == SHM_READY && channel && !down_ready) {
+            down_ready = true; // Nothing more will come over TCP
+            loop.shm_clients.push_back(this);
+            watcher = std::thread(&ChatClient::watch_shm, this);
+            update_interest();
+        }
+    }
+
+    // Move what the server put into the 'down' pipe into the decoder.
+    // Returns true if there was anything.
+    bool pump_shm() {
+        ShmPipe& pipe = channel->down();
+        size_t total = 0;
+        while (true) {
+            char* dst = decoder.write_ptr();
+            size_t n = shm_pipe_read(pipe, dst, decoder.write_space());
+            if (n == 0) break;
+            decoder.commit(n);
+            total += n;
+        }
+        if (total > 0 && shm_take_doorbell(pipe)) ring(); // The server waits for room
+        if (total == 0 && channel->layout()->closed.load()) fail();
+        nudged.store(false);
+        nudged.notify_one(); // The watcher may sleep again
+        return total > 0;
+    }
+
+    // The loop woke up: if the watcher says frames are waiting in the pipe
+    // and someone wants one, hand it over.
+    void on_nudge() {
+        if (!nudged.load() || !next_waiter) return;
+        NextAwaiter* waiter = next_waiter;
+        if (take_frame(*waiter)) {
+            next_waiter = nullptr;
+            waiter->finish(loop, waiter->ok);
+        }
+    }
+
+    // The watcher thread: sleeps until the server writes into 'down' (or
+    // hangs up), wakes the loop, and waits until the loop has read it.
+    void watch_shm() {
+        ShmPipe& pipe = channel->down();
+        while (!watcher_stop) {
+            if (shm_pipe_waiting(pipe) > 0 || channel->layout()->closed.load()) {
+                nudged.store(true);
+                loop.wakeup.signal();
+                nudged.wait(true); // Until pump_shm() (or close()) clears it
+                continue;
+            }
+            // The same steps as ServerConnection::wait(), minus the spinning.
+            pipe.sleeping.store(1, std::memory_order_seq_cst);
+            uint32_t seen = pipe.wake_word.load(std::memory_order_seq_cst);
+            if (shm_pipe_waiting(pipe) == 0 && !channel->layout()->closed.load() && !watcher_stop) {
+                channel->sleep(seen, SHM_CHANNEL_CHECK_MS);
+            }
+            pipe.sleeping.store(0, std::memory_order_seq_cst);
+        }
+    }
+
+    // The connection broke.
+    void fail() { close(); }
+
+    EventLoop& loop;
+    SOCKET sock = INVALID_SOCKET;
+    ClientState state = CLIENT_CLOSED;
+    unsigned interest = 0;               // What the poller watches for now
+    FrameDecoder decoder;                // Incoming bytes, cut into frames
+    std::string out;                     // Bytes queued for the server
+    size_t out_sent = 0;                 // ...of which this many have gone
+    size_t tcp_until = SIZE_MAX;         // Switching: bytes of 'out' that still go over TCP
+    bool retry_pending = false;          // A timer will retry a full pipe
+    ConnectAwaiter* connect_waiter = nullptr;
+    NextAwaiter* next_waiter = nullptr;  // One reader at a time
+    bool reading = false;                // Someone has called next() lately
+    std::vector<SendAwaiter*> send_waiters;
+    std::unique_ptr<ShmChannel> channel; // Set once the segment is mapped
+    bool up_ready = false;               // We send through the 'up' pipe
+    bool down_ready = false;             // We receive through the 'down' pipe
+    std::thread watcher;                 // Sleeps on 'down' for the loop
+    std::atomic<bool> watcher_stop{false};
+    std::atomic<bool> nudged{false};     // The watcher saw frames the loop hasn't read yet
+    ResumeTracker resume;                // What we got, for catching up after a reconnect
+};
+
+// For code on another thread that wants a plain blocking send(data, length),
+// such as send_file() in chat_files.h.
+struct BlockingSender {
+    ChatClient& client;
+    bool send(const char* data, size_t length) { return client.send_from_thread(data, length); }
+};
+
+inline void EventLoop::turn() {
+    int timeout = -1;
+    if (!ready.empty()) timeout = 0;
+    else if (!timers.empty()) {
+        long long wait = timers.begin()->first - now_ms();
+        timeout = wait < 0 ? 0 : (int)wait;
+    }
+    poller.wait(events, timeout);
+    for (const PollEvent& ev : events) {
+        if (ev.sock == wakeup.socket()) {
+            wakeup.clear();
+            std::vector<std::function<void()>> todo;
+            {
+                std::lock_guard<std::mutex> lock(posted_mutex);
+                todo.swap(posted);
+            }
+            for (auto& fn : todo) fn();
+            for (size_t i = 0; i < shm_clients.size(); i++) shm_clients[i]->on_nudge();
+            continue;
+        }
+        auto it = clients.find(ev.sock); // Closed earlier in this batch?
+        if (it != clients.end()) it->second->on_ready(ev.flags);
+    }
+    long long now = now_ms();
+    while (!timers.empty() && timers.begin()->first <= now) {
+        std::function<void()> fn = std::move(timers.begin()->second);
+        timers.erase(timers.begin());
+        fn();
+    }
+    resuming.swap(ready);
+    for (std::coroutine_handle<> h : resuming) h.resume();
+    resuming.clear();
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+// --- DIRECT MESSAGES ---
+// A line for one user, picked by name, instead of for everyone:
+//
+//   DIRECT_SEND      (client -> server)  name length (1 byte) | name | text
+//   DIRECT_RECEIVED  (server -> client)  sender's session ID (4 bytes) | text
+//   DIRECT_UNKNOWN   (server -> client)  the name: nobody of that name is online here
+//
+// The server must not walk through every connection to find the one it is
+// for: with 50,000 users online that is 50,000 name comparisons per message.
+// So it keeps a NameIndex, user name -> where that user is connected, which
+// each shard updates when one of its users says hello and when one leaves,
+// and any shard reads when a direct message comes in. A message costs one
+// hash lookup, however many users are online.
+//
+// Names are not unique: somebody with a phone and a laptop is online twice
+// under one name, and both get the message. Only users of THIS server node
+// can be reached; a direct message is not passed on over relay links, and
+// not kept for the history or for users who reconnect (chat_resume.h).
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_session.h" // Roster
+
+#define DIRECT_STRIPES 64 // Locks in a NameIndex (a power of two)
+
+// One place a user is connected: its shard, socket and connection ID (the
+// ID tells a closed connection apart from a new one on the same socket).
+struct DirectRoute {
+    int shard;
+    SOCKET sock;
+    unsigned long long id;
+};
+
+// --- SERVER SIDE ---
+// User name -> every connection online under that name. The names are
+// spread over DIRECT_STRIPES tables with a lock each, so shards adding,
+// removing and looking up different names rarely wait for one another;
+// each lock is held for one hash lookup (and a copy of a route or two).
+class NameIndex {
+public:
+    void add(const std::string& name, const DirectRoute& route) {
+        Stripe& stripe = stripe_for(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        stripe.users[name].push_back(route);
+    }
+
+    // Forget connection 'id' of 'shard' (a no-op if it isn't there).
+    void remove(const std::string& name, int shard, unsigned long long id) {
+        Stripe& stripe = stripe_for(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.users.find(name);
+        if (it == stripe.users.end()) return;
+        std::vector<DirectRoute>& routes = it->second;
+        for (size_t i = 0; i < routes.size(); i++) {
+            if (routes[i].shard != shard || routes[i].id != id) continue;
+            routes[i] = routes.back(); // Order doesn't matter
+            routes.pop_back();
+            break;
+        }
+        if (routes.empty()) stripe.users.erase(it);
+    }
+
+    // Append every connection online as 'name' to 'out'. Returns how many.
+    size_t find(const std::string& name, std::vector<DirectRoute>& out) {
+        Stripe& stripe = stripe_for(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.users.find(name);
+        if (it == stripe.users.end()) return 0;
+        out.insert(out.end(), it->second.begin(), it->second.end());
+        return it->second.size();
+    }
+
+private:
+    struct Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<DirectRoute>> users;
+    };
+
+    // The low bits pick the bucket inside a table; the stripe comes from others.
+    Stripe& stripe_for(const std::string& name) {
+        return stripes[(std::hash<std::string>()(name) >> 16) & (DIRECT_STRIPES - 1)];
+    }
+
+    Stripe stripes[DIRECT_STRIPES];
+};
+
+// Split a DIRECT_SEND frame into the name it is for and its text.
+// Returns false if it is malformed.
+inline bool parse_direct(const Frame& frame, std::string& name, const char*& text, size_t& text_length) {
+    if (frame.length < 1) return false;
+    size_t name_length = (uint8_t)frame.payload[0];
+    if (name_length == 0 || 1 + name_length > frame.length) return false;
+    name.assign(frame.payload + 1, name_length);
+    text = frame.payload + 1 + name_length;
+    text_length = frame.length - 1 - name_length;
+    return true;
+}
+
+// A DIRECT_RECEIVED frame: 'text' from session 'sender'.
+inline std::string direct_received(uint32_t sender, const char* text, size_t length) {
+    std::string out(FRAME_HEADER_SIZE + SESSION_ID_SIZE + length, '\0');
+    write_frame_header(&out[0], FRAME_DIRECT, DIRECT_RECEIVED, (uint32_t)(SESSION_ID_SIZE + length));
+    write_be(&out[FRAME_HEADER_SIZE], sender, SESSION_ID_SIZE);
+    if (length) memcpy(&out[FRAME_HEADER_SIZE + SESSION_ID_SIZE], text, length);
+    return out;
+}
+
+// --- CLIENT SIDE ---
+// Build a DIRECT_SEND frame for 'text' to user 'name' in 'out'. Names
+// longer than the server keeps (SESSION_NAME_MAX) are cut to that the same
+// way hello_frame() cuts them, on a character boundary, so they still match.
+inline void build_direct_frame(std::string& out, const std::string& name, const char* text, size_t length) {
+    size_t name_length = utf8_prefix_length(name.data(), name.size(), SESSION_NAME_MAX);
+    out.resize(FRAME_HEADER_SIZE + 1 + name_length + length);
+    write_frame_header(&out[0], FRAME_DIRECT, DIRECT_SEND, (uint32_t)(1 + name_length + length));
+    out[FRAME_HEADER_SIZE] = (char)name_length;
+    memcpy(&out[FRAME_HEADER_SIZE + 1], name.data(), name_length);
+    if (length) memcpy(&out[FRAME_HEADER_SIZE + 1 + name_length], text, length);
+}
+
+// A "/msg bob see you at 5" line as a DIRECT_SEND frame in 'out'. Returns
+// false if 'line' is not one.
+inline bool direct_command(std::string& out, const std::string& line) {
+    if (line.compare(0, 5, "/msg ") != 0) return false;
+    size_t space = line.find(' ', 5);
+    if (space == std::string::npos || space == 5) return false;
+    build_direct_frame(out, line.substr(5, space - 5), line.data() + space + 1, line.size() - space - 1);
+    return true;
+}
+
+// A DIRECT_RECEIVED or DIRECT_UNKNOWN frame as a line to show the user
+// ("" for anything else).
+inline std::string format_direct(const Frame& frame, const Roster& roster) {
+    if (frame.flags == DIRECT_UNKNOWN) return "Nobody called " + std::string(frame.payload, frame.length) + " is online.";
+    if (frame.flags != DIRECT_RECEIVED || frame.length < SESSION_ID_SIZE) return "";
+    uint32_t id = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+    return "[" + roster.name_of(id) + " -> you]: " + std::string(frame.payload + SESSION_ID_SIZE, frame.length - SESSION_ID_SIZE);
+}
@@ -0,0 +1,516 @@
+// --- FILE ATTACHMENTS ---
+// A chat line only holds a little text, so files travel in their own
+// FRAME_FILE frames, cut into chunks of FILE_CHUNK_BYTES:
+//
+//   1. The sender streams the file up: FILE_UPLOAD (size and name), the
+//      FILE_CHUNKs in order, then FILE_COMPLETE. The server stores each chunk
+//      as it arrives (<files folder>/<id>.part), so it never holds a whole
+//      file in memory, however big it is.
+//   2. Once the file is complete the server tells everyone, the sender too,
+//      with a FILE_OFFER (file ID, size, who sent it, name). Offers go into
+//      the message log like chat, so people who join later see them in the
+//      history as well.
+//   3. Nobody gets the bytes until they ask: FILE_GET (file ID, offset) starts
+//      a download, which ends with FILE_DONE, or FILE_MISSING if there is no
+//      such file here. The downloader acknowledges what it has written with
+//      FILE_ACK, and the server keeps at most FILE_WINDOW bytes on the way.
+//
+// File data must never hold chat up. The server starts a download's next
+// chunk only when
+//   - that user has no chat waiting to be sent,
+//   - the socket has less than FILE_UNSENT_LIMIT bytes the kernel hasn't
+//     sent yet (so chat that comes later is not stuck behind much file), and
+//   - less than FILE_WINDOW bytes are sent but not acknowledged (so little
+//     file waits in the user's receive buffer, in front of their chat).
+// On Linux the chunks go from the file to the socket with sendfile(), without
+// passing through the server's memory.
+//
+// Uploads must not hold chat up either. They are read at most
+// FILE_READ_BUDGET bytes per loop turn, and the event loops never touch the
+// disk for them: chunks are handed to one disk thread (FileWriter), so a slow
+// disk - or the kernel making writers wait while it flushes - only slows the
+// uploads. Once more than FILE_WRITE_BACKLOG bytes wait for that thread,
+// uploaders are not read from until it has caught up.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_session.h"
+#include "chat_outbound.h" // Payload, for chunks on their way to the disk
+
+#ifndef _WIN32
+#include <sys/stat.h>   // mkdir
+#endif
+
+#define FILE_CHUNK_BYTES (64u * 1024)       // File bytes per FILE_CHUNK frame
+#define FILE_HEADER_SIZE 16                 // File ID + offset, in front of a chunk's bytes
+#define FILE_UNSENT_LIMIT (64 * 1024)       // Download bytes allowed to sit unsent in a user's socket
+#define FILE_WINDOW (512u * 1024)           // Download bytes allowed on the way before the user acknowledges them
+#define FILE_READ_BUDGET (256u * 1024)      // Upload bytes read from one user per loop turn
+#define FILE_WRITE_BACKLOG (16u * 1024 * 1024) // Upload bytes allowed to wait for the disk thread
+#define FILE_NAME_MAX 255                   // Longest file name kept (bytes)
+
+// The flags of a FRAME_FILE frame. IDs, sizes and offsets are 8 big-endian bytes.
+enum FileFlags : uint16_t {
+    FILE_UPLOAD = 0,   // Client: "a file follows": size, then the name
+    FILE_CHUNK = 1,    // Either way: file ID (0 going up), offset, then the bytes
+    FILE_COMPLETE = 2, // Client: "that was all of it" (no payload)
+    FILE_OFFER = 3,    // Server: file ID, size, sender's session ID (4 bytes), then the name
+    FILE_GET = 4,      // Client: "send me file ID from this offset on"
+    FILE_DONE = 5,     // Server: "that was all of file ID"
+    FILE_MISSING = 6,  // Server: "there is no file ID here"
+    FILE_FAILED = 7,   // Server: "your upload was refused or broke off" (no payload)
+    FILE_ACK = 8       // Client: "I have file ID up to this offset"
+};
+
+// Keep only the last part of a path, without anything that could make it a
+// path again when it is saved ("../x" and "C:\x" both become plain names).
+inline std::string clean_file_name(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1, FILE_NAME_MAX);
+    for (char& c : name) {
+        if (c == ':' || (unsigned char)c < 32) c = '_';
+    }
+    if (name.empty() || name == "." || name == "..") name = "file";
+    return name;
+}
+
+// Write a FILE_CHUNK header (frame header, file ID, offset) for 'length'
+// file bytes into 'dst', which must have FRAME_HEADER_SIZE + FILE_HEADER_SIZE bytes.
+inline void write_file_chunk_header(char* dst, uint64_t id, uint64_t offset, size_t length) {
+    write_frame_header(dst, FRAME_FILE, FILE_CHUNK, (uint32_t)(FILE_HEADER_SIZE + length));
+    write_be(dst + FRAME_HEADER_SIZE, id, 8);
+    write_be(dst + FRAME_HEADER_SIZE + 8, offset, 8);
+}
+
+// Append a FRAME_FILE frame whose payload is just 'id' (FILE_DONE, FILE_MISSING).
+inline void encode_file_id(std::string& out, FileFlags kind, uint64_t id) {
+    char payload[8];
+    write_be(payload, id, 8);
+    encode_frame(out, FRAME_FILE, kind, payload, 8);
+}
+
+// Append a FILE_GET frame asking for file 'id' from byte 'offset' on (or,
+// with FILE_ACK, saying we have it up to 'offset').
+inline void encode_file_get(std::string& out, uint64_t id, uint64_t offset, FileFlags kind = FILE_GET) {
+    char payload[16];
+    write_be(payload, id, 8);
+    write_be(payload + 8, offset, 8);
+    encode_frame(out, FRAME_FILE, kind, payload, 16);
+}
+
+// Append a FILE_OFFER frame.
+inline void encode_file_offer(std::string& out, uint64_t id, uint64_t size, uint32_t sender, const std::string& name) {
+    char header[FRAME_HEADER_SIZE + 20];
+    write_frame_header(header, FRAME_FILE, FILE_OFFER, (uint32_t)(20 + name.size()));
+    write_be(header + FRAME_HEADER_SIZE, id, 8);
+    write_be(header + FRAME_HEADER_SIZE + 8, size, 8);
+    write_be(header + FRAME_HEADER_SIZE + 16, sender, SESSION_ID_SIZE);
+    out.append(header, sizeof(header));
+    out.append(name);
+}
+
+// Session ID of whoever shared the file in a FILE_OFFER frame (0 for any other frame).
+inline uint32_t file_offer_sender(const Frame& frame) {
+    if (frame.type != FRAME_FILE || frame.flags != FILE_OFFER || frame.length < 20) return 0;
+    return (uint32_t)read_be(frame.payload + 16, SESSION_ID_SIZE);
+}
+
+// Move a file to 'offset' (works past 2 GB on both systems).
+inline bool file_seek(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(f, (long long)offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// A file's size in bytes (-1 if it can't be told).
+inline long long file_length(FILE* f) {
+#ifdef _WIN32
+    if (_fseeki64(f, 0, SEEK_END) != 0) return -1;
+    return _ftelli64(f);
+#else
+    if (fseeko(f, 0, SEEK_END) != 0) return -1;
+    return (long long)ftello(f);
+#endif
+}
+
+// --- SERVER SIDE ---
+// The folder where uploaded files are kept, named by file ID. Shared by all
+// threads: a download just opens the file by its name, so nothing else needs
+// to be looked up.
+class FileStore {
+public:
+    uint64_t max_bytes = 1024ull * 1024 * 1024 * 4; // Biggest upload accepted (--file-max-mb)
+
+    bool open(const std::string& folder) {
+        dir = folder;
+#ifdef _WIN32
+        CreateDirectoryA(dir.c_str(), NULL);
+#else
+        mkdir(dir.c_str(), 0755);
+#endif
+        // Like relay sequence numbers, IDs start from the time in microseconds,
+        // so a restarted server never hands out an ID it used before.
+        next_id = prefix | ((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() & 0xFFFFFFFFFFFFFFull);
+        FILE* probe = fopen(part_path(0).c_str(), "wb"); // Can we write there at all?
+        if (!probe) return false;
+        fclose(probe);
+        remove(part_path(0).c_str());
+        return true;
+    }
+
+    bool enabled() const { return !dir.empty(); }
+
+    // Put 'node' in the top byte of the IDs (files stay on the node they were
+    // sent to, so a user of another node asking for one gets FILE_MISSING).
+    void set_node(uint32_t node) { prefix = (uint64_t)node << 56; }
+
+    // Start storing a new upload. Returns nullptr if the file can't be created.
+    FILE* create(uint64_t& id) {
+        id = next_id++;
+        return fopen(part_path(id).c_str(), "wb");
+    }
+
+    // The upload is complete: make it available for download.
+    bool finish(FILE* f, uint64_t id) {
+        bool ok = fclose(f) == 0 && rename(part_path(id).c_str(), path(id).c_str()) == 0;
+        if (!ok) remove(part_path(id).c_str());
+        return ok;
+    }
+
+    // The upload broke off: throw away what we have.
+    void discard(FILE* f, uint64_t id) {
+        fclose(f);
+        remove(part_path(id).c_str());
+    }
+
+    // Open a stored file for reading. Returns nullptr if there is none.
+    FILE* open_file(uint64_t id, uint64_t& size) {
+        FILE* f = fopen(path(id).c_str(), "rb");
+        if (!f) return nullptr;
+        long long length = file_length(f);
+        if (length < 0) {
+            fclose(f);
+            return nullptr;
+        }
+        size = (uint64_t)length;
+        return f;
+    }
+
+private:
+    std::string path(uint64_t id) const { return dir + "/" + std::to_string((unsigned long long)id); }
+    std::string part_path(uint64_t id) const { return path(id) + ".part"; }
+
+    std::string dir;                 // "" = attachments are turned off
+    std::atomic<uint64_t> next_id{1};
+    uint64_t prefix = 0;             // Node number << 56
+};
+
+// A file a user is sending us, while it streams in.
+struct FileUpload {
+    FILE* file = nullptr;  // nullptr = no upload running
+    uint64_t id = 0;
+    uint64_t size = 0;     // What FILE_UPLOAD promised
+    uint64_t received = 0; // Bytes written so far
+    std::string name;
+};
+
+// Something for the disk thread to do with an upload.
+enum FileJobKind {
+    FILE_JOB_WRITE,   // Append 'data' to 'file'
+    FILE_JOB_FINISH,  // The upload is complete: store it, then report back
+    FILE_JOB_DISCARD  // The upload broke off: throw it away
+};
+
+struct FileJob {
+    FileJobKind kind = FILE_JOB_WRITE;
+    FILE* file = nullptr;
+    Payload data;                  // WRITE: the bytes
+    // FINISH and DISCARD: the upload, and (FINISH) who to tell once it is stored.
+    uint64_t id = 0;
+    uint64_t size = 0;
+    std::string name;
+    int owner = 0;                 // Shard of the uploader
+    SOCKET sock = INVALID_SOCKET;  // The uploader's connection (it may be gone by then)
+    unsigned long long conn_id = 0;
+    uint32_t session = 0;
+    bool ok = false;               // FINISH, when done: is the file stored?
+};
+
+// The one thread that writes uploads to disk, so no event loop ever waits
+// for it. Jobs are done in the order they were posted.
+class FileWriter {
+public:
+    // Start the thread. 'wake(owner)' is called when shard 'owner' has a
+    // finished upload to collect, or with -1 when the backlog has shrunk
+    // enough for paused uploaders to go on.
+    void start(FileStore* store, std::function<void(int)> wake) {
+        files = store;
+        on_wake = wake;
+        std::thread(&FileWriter::run, this).detach();
+    }
+
+    void post(FileJob& job) {
+        if (job.kind == FILE_JOB_WRITE) backlog_bytes += job.data.size();
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+        ready.notify_one();
+    }
+
+    // Bytes posted but not yet written.
+    size_t backlog() const { return backlog_bytes.load(std::memory_order_relaxed); }
+
+    // Is a finished upload waiting for anyone? (Cheap: checked every loop turn.)
+    bool finished_waiting() const { return finished_count.load(std::memory_order_acquire) > 0; }
+
+    // Take the finished uploads of shard 'owner'.
+    void take_finished(int owner, std::vector<FileJob>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < finished.size();) {
+            if (finished[i].owner != owner) {
+                i++;
+                continue;
+            }
+            out.push_back(std::move(finished[i]));
+            finished.erase(finished.begin() + i);
+            finished_count--;
+        }
+    }
+
+private:
+    void run() {
+        std::unordered_map<FILE*, bool> broken; // Files a write failed on (disk full?)
+        while (true) {
+            FileJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return !jobs.empty(); });
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            if (job.kind == FILE_JOB_WRITE) {
+                size_t n = job.data.size();
+                if (!broken.count(job.file) && fwrite(job.data.data(), 1, n, job.file) != n) broken[job.file] = true;
+                job.data = Payload(); // Give the block back now, not when the next job comes
+                size_t before = backlog_bytes.fetch_sub(n);
+                if (before >= FILE_WRITE_BACKLOG / 2 && before - n < FILE_WRITE_BACKLOG / 2) on_wake(-1);
+                continue;
+            }
+            bool failed = broken.erase(job.file) > 0;
+            if (job.kind == FILE_JOB_DISCARD || failed) files->discard(job.file, job.id);
+            else job.ok = files->finish(job.file, job.id);
+            if (job.kind == FILE_JOB_DISCARD) continue;
+            int owner = job.owner;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.push_back(std::move(job));
+                finished_count++;
+            }
+            on_wake(owner);
+        }
+    }
+
+    FileStore* files = nullptr;
+    std::function<void(int)> on_wake;
+    std::mutex mutex;                    // Guards 'jobs' and 'finished'
+    std::condition_variable ready;
+    std::deque<FileJob> jobs;
+    std::vector<FileJob> finished;       // Stored (or failed) uploads, until their shard takes them
+    std::atomic<int> finished_count{0};
+    std::atomic<size_t> backlog_bytes{0};
+};
+
+// A file we are sending a user, a chunk at a time.
+struct FileDownload {
+    FILE* file = nullptr;
+    uint64_t id = 0;
+    uint64_t size = 0;
+    uint64_t offset = 0;        // Next file byte to send
+    uint64_t acked = 0;         // The user has everything before this
+    // sendfile() only: the frame that is going out right now. Once its header
+    // has started, its bytes must follow before anything else can go.
+    char header[FRAME_HEADER_SIZE + FILE_HEADER_SIZE];
+    size_t header_length = 0;   // Bytes in 'header' (a chunk's, or FILE_DONE)
+    size_t header_sent = 0;     // Of those, already sent
+    size_t data_left = 0;       // File bytes of the chunk not sent yet
+    bool done_sent = false;     // The frame is FILE_DONE: once it is out, so is the download
+
+    bool mid_chunk() const { return header_sent < header_length || data_left > 0; }
+
+    // Is there something we may send now? Not while the window is full.
+    bool ready() const { return mid_chunk() || offset >= size || offset - acked < FILE_WINDOW; }
+};
+
+// --- CLIENT SIDE ---
+// Stream the file at 'path' to the server through 'server' (anything with a
+// send(const char*, size_t), such as ServerConnection). Each chunk is one
+// send, so whatever else the program sends meanwhile goes out between chunks.
+// Returns false, with the reason in 'error', if the file can't be read or
+// the connection breaks.
+template <class Server>
+bool send_file(Server& server, const std::string& path, std::string& error) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        error = "can't open " + path;
+        return false;
+    }
+    long long size = file_length(f);
+    if (size < 0 || !file_seek(f, 0)) {
+        fclose(f);
+        error = "can't read " + path;
+        return false;
+    }
+    std::string frame;
+    char size_bytes[8];
+    write_be(size_bytes, (uint64_t)size, 8);
+    std::string begin(size_bytes, 8);
+    begin += clean_file_name(path);
+    encode_frame(frame, FRAME_FILE, FILE_UPLOAD, begin.data(), begin.size());
+    bool ok = server.send(frame.data(), frame.size());
+
+    const size_t header = FRAME_HEADER_SIZE + FILE_HEADER_SIZE;
+    frame.resize(header + FILE_CHUNK_BYTES);
+    for (uint64_t offset = 0; ok && offset < (uint64_t)size;) {
+        size_t n = fread(&frame[header], 1, FILE_CHUNK_BYTES, f);
+        if (n == 0) {
+            error = "read error in " + path;
+            ok = false;
+            break;
+        }
+        write_file_chunk_header(&frame[0], 0, offset, n);
+        ok = server.send(frame.data(), header + n);
+        offset += n;
+    }
+    fclose(f);
+    if (!ok) {
+        if (error.empty()) error = "lost the connection";
+        return false;
+    }
+    frame.clear();
+    encode_frame(frame, FRAME_FILE, FILE_COMPLETE, "", 0);
+    return server.send(frame.data(), frame.size());
+}
+
+// The files we have been offered, and the downloads we asked for. Used by
+// the receiving thread only.
+class FileReceiver {
+public:
+    // Learn from a FRAME_FILE frame. Returns a line worth showing the user
+    // ("" if none). If the server has to be asked for something (a chunk went
+    // missing because our queue overflowed), that frame is left in 'reply'.
+    std::string apply(const Frame& frame, const Roster& roster, std::string& reply) {
+        if (frame.flags == FILE_FAILED) return "The server refused the file (too big, or it has no room).";
+        if (frame.length < 8) return "";
+        uint64_t id = read_be(frame.payload, 8);
+        switch (frame.flags) {
+        case FILE_OFFER: {
+            if (frame.length < 20) return "";
+            Offer& offer = offers[id];
+            offer.size = read_be(frame.payload + 8, 8);
+            offer.name = clean_file_name(std::string(frame.payload + 20, frame.length - 20));
+            uint32_t sender = (uint32_t)read_be(frame.payload + 16, SESSION_ID_SIZE);
+            return (sender == roster.self ? std::string("You") : roster.name_of(sender)) + " shared " + offer.name +
+                   " (" + describe_size(offer.size) + ") - type /get " + std::to_string((unsigned long long)id) + " to download it.";
+        }
+        case FILE_CHUNK: {
+            if (frame.length < FILE_HEADER_SIZE) return "";
+            uint64_t offset = read_be(frame.payload + 8, 8);
+            auto it = downloads.find(id);
+            if (it == downloads.end()) {
+                if (offset != 0) return ""; // The rest of a download we gave up on
+                it = downloads.emplace(id, Download()).first;
+                it->second.path = std::to_string((unsigned long long)id) + "_" + (offers.count(id) ? offers[id].name : "file");
+                it->second.file = fopen(it->second.path.c_str(), "wb");
+                if (!it->second.file) {
+                    downloads.erase(it);
+                    return "Can't save file " + std::to_string((unsigned long long)id) + " here.";
+                }
+            }
+            Download& d = it->second;
+            if (offset != d.received) {
+                // A chunk was dropped on the way (our queue at the server was
+                // full): ask again from where we are, once per gap.
+                if (d.asked != d.received) {
+                    d.asked = d.received;
+                    encode_file_get(reply, id, d.received);
+                }
+                return "";
+            }
+            size_t n = frame.length - FILE_HEADER_SIZE;
+            if (fwrite(frame.payload + FILE_HEADER_SIZE, 1, n, d.file) != n) {
+                fclose(d.file);
+                std::string path = d.path;
+                downloads.erase(it);
+                return "Could not write " + path + " (disk full?).";
+            }
+            d.received += n;
+            encode_file_get(reply, id, d.received, FILE_ACK); // Room for the next chunk
+            return "";
+        }
+        case FILE_DONE: {
+            auto it = downloads.find(id);
+            if (it == downloads.end()) {
+                // An empty file (no chunks at all), or one we failed to save.
+                if (!offers.count(id) || offers[id].size != 0) return "";
+                std::string path = std::to_string((unsigned long long)id) + "_" + offers[id].name;
+                FILE* f = fopen(path.c_str(), "wb");
+                if (f) fclose(f);
+                return "Saved " + path + ".";
+            }
+            Download& d = it->second;
+            if (offers.count(id) && d.received < offers[id].size) return ""; // The end of a stream we asked again for
+            fclose(d.file);
+            std::string line = "Saved " + d.path + " (" + describe_size(d.received) + ").";
+            downloads.erase(it);
+            return line;
+        }
+        case FILE_MISSING:
+            return "There is no file " + std::to_string((unsigned long long)id) + " on this server.";
+        default:
+            return "";
+        }
+    }
+
+    // "12.3 MB" and friends.
+    static std::string describe_size(uint64_t bytes) {
+        const char* units[] = {"bytes", "KB", "MB", "GB", "TB"};
+        double value = (double)bytes;
+        int unit = 0;
+        while (value >= 1024 && unit < 4) {
+            value /= 1024;
+            unit++;
+        }
+        char text[32];
+        snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+        return text;
+    }
+
+private:
+    struct Offer {
+        uint64_t size = 0;
+        std::string name;
+    };
+    struct Download {
+        FILE* file = nullptr;
+        std::string path;
+        uint64_t received = 0;         // Bytes written so far
+        uint64_t asked = UINT64_MAX;   // Offset we last asked again from
+    };
+
+    std::unordered_map<uint64_t, Offer> offers;
+    std::unordered_map<uint64_t, Download> downloads;
+};
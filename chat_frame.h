@@ -0,0 +1,316 @@
+// --- FRAMING PROTOCOL ---
+// TCP is a stream of bytes, not a stream of messages: one recv() can return
+// half a message, or three messages glued together. So every message on the
+// wire starts with a small fixed header that says how long it is.
+//
+//   byte 0      version  (FRAME_VERSION)
+//   byte 1      type     (FRAME_CHAT, ...)
+//   bytes 2-3   flags    (big-endian, meaning depends on the type)
+//   bytes 4-7   length   (big-endian, number of payload bytes that follow)
+//   ...         payload  (any bytes, NULs included)
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "chat_net.h"
+
+#define FRAME_VERSION 1                    // Bump when the header layout changes
+#define FRAME_HEADER_SIZE 8                // Bytes in the fixed header
+#define FRAME_MAX_PAYLOAD (16u * 1024 * 1024) // Anything bigger is treated as a broken stream
+#define FRAME_KEEP_BUFFER (256u * 1024)       // Receive buffer kept between frames (anything more is given back)
+
+// What kind of message a frame carries.
+enum FrameType : uint8_t {
+    FRAME_CHAT = 1,     // A line of chat text
+    FRAME_HISTORY = 2,  // Ask for old messages (client -> server) or mark the end of them (server -> client)
+    FRAME_HELLO = 3,    // "This is my user name" (client -> server, once, right after connecting)
+    FRAME_WELCOME = 4,  // "Your session ID is ..." (server -> client, the answer to FRAME_HELLO)
+    FRAME_PRESENCE = 5, // Who is who: a session ID and its user name (server -> client)
+    FRAME_LINK = 6,     // "I am server node N" (server <-> server, once, to open a relay link)
+    FRAME_RELAY = 7,    // Frames passed on between servers: origin node, sequence number, frames
+    FRAME_SHM = 8,      // Moving a local client onto shared memory (chat_shm_channel.h)
+    FRAME_FILE = 9,     // File attachments: uploads, offers and downloads (chat_files.h)
+    FRAME_HEARTBEAT = 10, // "Are you still there?" and its answer (either way, no payload)
+    FRAME_RESUME = 11,   // Numbered messages, and catching up on them after a reconnect (chat_resume.h)
+    FRAME_DIRECT = 12,   // A line for one user, picked by name (chat_direct.h)
+    FRAME_ROOM = 13      // Joining and leaving rooms (chat_room.h)
+};
+
+// The flags of a FRAME_CHAT frame.
+enum ChatFlags : uint16_t {
+    CHAT_SENDER = 1, // Payload starts with the sender's session ID (4 big-endian bytes), then the text.
+                     // Senders leave it zero; the server fills it in, so it can't be faked.
+    CHAT_ROOM = 2    // After the sender's ID: the room it is for (4 big-endian bytes), then the text.
+                     // Only with CHAT_SENDER; it goes to that room's members instead of everyone.
+};
+
+// The flags of a FRAME_PRESENCE frame. Payload = session ID (4 big-endian
+// bytes), followed by the user name for everything except PRESENCE_LEAVE.
+enum PresenceFlags : uint16_t {
+    PRESENCE_ONLINE = 0, // Already here when you joined (the roster sent after FRAME_WELCOME)
+    PRESENCE_JOIN = 1,   // Just joined
+    PRESENCE_LEAVE = 2,  // Just left
+    PRESENCE_KNOWN = 3   // Not here any more, but wrote some of the history you asked for
+};
+
+// The flags of a FRAME_HEARTBEAT frame. The server pings a connection that
+// has been quiet for a while and hangs up if nothing at all comes back;
+// whoever gets a ping answers it at once. Servers on a relay link ping
+// each other the same way.
+enum HeartbeatFlags : uint16_t {
+    HEARTBEAT_PING = 0,
+    HEARTBEAT_PONG = 1
+};
+
+// The flags of a FRAME_RESUME frame (chat_resume.h has the payloads).
+enum ResumeFlags : uint16_t {
+    RESUME_ASK = 0,  // Client: "number what you send me, and send what I missed since these numbers"
+    RESUME_MARK = 1, // Server: "the next frames are numbered ..." (only to clients that asked)
+    RESUME_DONE = 2, // Server: "that was everything you missed"
+    RESUME_GAP = 3   // Server: "I don't have all you missed: ask for history instead"
+};
+
+// The flags of a FRAME_DIRECT frame (chat_direct.h has the payloads).
+enum DirectFlags : uint16_t {
+    DIRECT_SEND = 0,     // Client: "give this to the user called ..."
+    DIRECT_RECEIVED = 1, // Server: "... sent you this"
+    DIRECT_UNKNOWN = 2   // Server: "nobody of that name is online"
+};
+
+// The flags of a FRAME_ROOM frame (chat_room.h has the payloads).
+enum RoomFlags : uint16_t {
+    ROOM_JOIN = 0,   // Client: "put me in the room called ..."
+    ROOM_JOINED = 1, // Server: "you are in room ... (its ID)"
+    ROOM_LEAVE = 2,  // Client: "take me out of room ..."
+    ROOM_LEFT = 3,   // Server: "you are out of room ..."
+    ROOM_FAILED = 4  // Server: "you can't join the room called ..."
+};
+
+#define SESSION_ID_SIZE 4   // Bytes of a session ID on the wire
+#define SESSION_NAME_MAX 32 // Longest user name the server keeps (bytes)
+#define ROOM_ID_SIZE 4      // Bytes of a room ID on the wire
+#define ROOM_NAME_MAX 32    // Longest room name (bytes)
+
+// The flags of a FRAME_HISTORY frame say what it means.
+enum HistoryFlags : uint16_t {
+    HISTORY_LAST = 0,  // "Send me the last N messages": payload = N as 4 big-endian bytes
+    HISTORY_SINCE = 1, // "Send me everything since T": payload = Unix time in ms as 8 big-endian bytes
+    HISTORY_END = 2    // Server's reply is complete: payload = messages replayed as 8 big-endian bytes
+};
+
+// A decoded frame. 'payload' points INTO the decoder's buffer (no copy), so it
+// is only valid until the next call to FrameDecoder::write_ptr().
+struct Frame {
+    uint8_t type = 0;
+    uint16_t flags = 0;
+    const char* payload = nullptr;
+    uint32_t length = 0;
+    const char* raw = nullptr;   // Header + payload, exactly as it came off the wire
+    size_t raw_length = 0;
+};
+
+// Result of FrameDecoder::next().
+enum FrameStatus {
+    FRAME_OK,        // 'out' holds a complete frame
+    FRAME_NEED_MORE, // Not enough bytes yet: recv() some more
+    FRAME_BAD        // Wrong version or absurd length: drop the connection
+};
+
+// Write a header into 'dst' (which must have FRAME_HEADER_SIZE bytes).
+inline void write_frame_header(char* dst, uint8_t type, uint16_t flags, uint32_t length) {
+    dst[0] = (char)FRAME_VERSION;
+    dst[1] = (char)type;
+    dst[2] = (char)(flags >> 8);
+    dst[3] = (char)(flags & 0xFF);
+    dst[4] = (char)(length >> 24);
+    dst[5] = (char)(length >> 16);
+    dst[6] = (char)(length >> 8);
+    dst[7] = (char)(length & 0xFF);
+}
+
+// Read / write big-endian numbers inside a payload.
+inline uint64_t read_be(const char* src, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = (value << 8) | (unsigned char)src[i];
+    return value;
+}
+
+inline void write_be(char* dst, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        dst[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+// Read / write numbers as a fixed count of hex digits, for numbers inside
+// chat text (the server only passes on text that is UTF-8).
+inline uint64_t read_hex(const char* src, int digits) {
+    uint64_t value = 0;
+    for (int i = 0; i < digits; i++) {
+        char c = src[i];
+        value = (value << 4) | (uint64_t)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return value;
+}
+
+inline void write_hex(char* dst, uint64_t value, int digits) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; i--) {
+        dst[i] = hex[value & 15];
+        value >>= 4;
+    }
+}
+
+// Append a whole frame (header + payload) to 'out'.
+inline void encode_frame(std::string& out, uint8_t type, uint16_t flags, const char* data, size_t length) {
+    char header[FRAME_HEADER_SIZE];
+    write_frame_header(header, type, flags, (uint32_t)length);
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(data, length);
+}
+
+inline std::string encode_frame(uint8_t type, const std::string& payload, uint16_t flags = 0) {
+    std::string out;
+    out.reserve(FRAME_HEADER_SIZE + payload.size());
+    encode_frame(out, type, flags, payload.data(), payload.size());
+    return out;
+}
+
+// Read the frame at 'data' if all of it is among the 'available' bytes.
+// For walking frames that are already complete in memory (log files,
+// relayed batches); a bad version or size counts as "not there".
+inline bool read_frame_at(const char* data, size_t available, Frame& out) {
+    if (available < FRAME_HEADER_SIZE || (uint8_t)data[0] != FRAME_VERSION) return false;
+    uint32_t length = (uint32_t)read_be(data + 4, 4);
+    if (length > FRAME_MAX_PAYLOAD || available - FRAME_HEADER_SIZE < length) return false;
+    out.type = (uint8_t)data[1];
+    out.flags = (uint16_t)read_be(data + 2, 2);
+    out.length = length;
+    out.raw = data;
+    out.raw_length = FRAME_HEADER_SIZE + (size_t)length;
+    out.payload = data + FRAME_HEADER_SIZE;
+    return true;
+}
+
+// --- INCREMENTAL DECODER ---
+// Owns one growing receive buffer per connection. recv() writes straight into
+// it (write_ptr/commit), and next() hands out frames that point into the same
+// memory, so a message is never copied on its way from the socket to the
+// caller. A big frame's bytes stream in across later reads in place: the
+// buffer doubles towards the frame's size as they arrive, rather than growing
+// to whatever a header alone announces, and a buffer left bigger than
+// FRAME_KEEP_BUFFER is given back once it is empty again.
+class FrameDecoder {
+public:
+    // Where the next recv() should write, with at least 'min_space' bytes free.
+    // Invalidates any Frame returned earlier.
+    char* write_ptr(size_t min_space = 4096) {
+        // Slide unread bytes to the front once everything before them is consumed.
+        if (start > 0) {
+            memmove(buf.data(), buf.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == 0 && buf.size() > FRAME_KEEP_BUFFER) std::vector<char>().swap(buf); // A big frame is gone: so is its room
+        size_t want = end + min_space;
+        if (buf.size() < want) {
+            if (pending_frame > want) want = std::min(pending_frame, std::max(want, buf.size() * 2)); // Double towards the frame in progress
+            buf.resize(want);
+        }
+        return buf.data() + end;
+    }
+
+    // Free space behind write_ptr().
+    size_t write_space() const { return buf.size() - end; }
+
+    // Tell the decoder that recv() put 'n' bytes at write_ptr().
+    void commit(size_t n) { end += n; }
+
+    // Take the next complete frame out of the buffer, if there is one.
+    FrameStatus next(Frame& out) {
+        size_t available = end - start;
+        if (available < FRAME_HEADER_SIZE) return FRAME_NEED_MORE;
+
+        const unsigned char* h = (const unsigned char*)buf.data() + start;
+        if (h[0] != FRAME_VERSION) return FRAME_BAD;
+        uint32_t length = ((uint32_t)h[4] << 24) | ((uint32_t)h[5] << 16) | ((uint32_t)h[6] << 8) | h[7];
+        if (length > FRAME_MAX_PAYLOAD) return FRAME_BAD;
+
+        size_t total = FRAME_HEADER_SIZE + (size_t)length;
+        if (available < total) {
+            pending_frame = total; // Let write_ptr() grow towards all of it
+            return FRAME_NEED_MORE;
+        }
+
+        out.type = h[1];
+        out.flags = (uint16_t)((h[2] << 8) | h[3]);
+        out.length = length;
+        out.raw = buf.data() + start;
+        out.raw_length = total;
+        out.payload = out.raw + FRAME_HEADER_SIZE;
+        start += total;
+        pending_frame = 0;
+        if (start == end) start = end = 0; // Buffer empty: rewind for free
+        return FRAME_OK;
+    }
+
+    // Bytes received but not yet returned as frames.
+    size_t buffered() const { return end - start; }
+    const char* unread() const { return buf.data() + start; }
+
+    // Throw away everything received but not yet returned.
+    void clear() { start = end = pending_frame = 0; }
+
+private:
+    std::vector<char> buf;
+    size_t start = 0;         // First unread byte
+    size_t end = 0;           // One past the last received byte
+    size_t pending_frame = 0; // Size of a frame we have the header of but not all the body
+};
+
+// --- BLOCKING HELPERS (for the simple clients) ---
+
+// Send every byte, looping over partial sends. Returns false if the socket broke.
+inline bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int n = send(sock, data, (int)length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Wrap 'payload' in a frame and send it.
+inline bool send_frame(SOCKET sock, uint8_t type, const std::string& payload, uint16_t flags = 0) {
+    std::string frame = encode_frame(type, payload, flags);
+    return send_all(sock, frame.data(), frame.size());
+}
+
+// A request for old messages. 'value' is a message count for HISTORY_LAST
+// or a Unix time in milliseconds for HISTORY_SINCE.
+inline std::string history_request(HistoryFlags kind, uint64_t value) {
+    char payload[8];
+    int bytes = kind == HISTORY_LAST ? 4 : 8;
+    write_be(payload, value, bytes);
+    return encode_frame(FRAME_HISTORY, std::string(payload, bytes), kind);
+}
+
+// Ask the server for old messages.
+inline bool send_history_request(SOCKET sock, HistoryFlags kind, uint64_t value) {
+    std::string frame = history_request(kind, value);
+    return send_all(sock, frame.data(), frame.size());
+}
+
+// Block until at least one more chunk arrives and feed it to the decoder.
+// Returns false if the connection closed.
+inline bool recv_into(SOCKET sock, FrameDecoder& decoder) {
+    char* dst = decoder.write_ptr();
+    int n = recv(sock, dst, (int)decoder.write_space(), 0);
+    if (n <= 0) return false;
+    decoder.commit(n);
+    return true;
+}
@@ -0,0 +1,199 @@
+// --- HOT RESTART (HANDING CONNECTIONS TO A NEW SERVER) ---
+// Upgrading the server without anyone noticing: the running server hands its
+// listening sockets, every user's socket and what it knows about each user to
+// a newly started server, and exits. The sockets themselves move (the kernel
+// copies open file descriptors from one process to another over a Unix
+// domain socket, SCM_RIGHTS), so the TCP connections never close and the
+// clients see nothing but a short pause.
+//
+//   old server:  server --handoff /run/chat.handoff      (listens there for a successor)
+//   new server:  server --take-over /run/chat.handoff    (connects, takes everything)
+//
+// The exchange, on the Unix socket:
+//   new  connects                 "I am ready to take over"
+//   old  stops every event loop at the end of its tick, writes down each
+//        connection (session, rooms, half-received frames, queued messages) and sends
+//        HEADER (blob size, descriptor count), the DESCRIPTORS in batches, the BLOB
+//   new  maps the log, builds its event loops around the sockets, sends ONE byte
+//   old  exits; its end of the Unix socket closing tells the new server so
+// If the new server gives up before its byte (or dies), the old one simply
+// carries on serving.
+//
+// Linux only (SCM_RIGHTS); the encoding helpers work everywhere.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "chat_frame.h" // write_be / read_be
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, unlink
+#endif
+
+#define HANDOFF_MAGIC 0x43484832u   // "CHH2": starts the blob, so a stranger (or an older layout) is told apart
+#define HANDOFF_FDS_PER_MESSAGE 200 // Descriptors per sendmsg (the kernel takes at most 253)
+
+// --- ENCODING ---
+// The blob is a flat list of big-endian numbers and length-prefixed strings.
+inline void handoff_put(std::string& out, uint64_t value, int bytes) {
+    char buf[8];
+    write_be(buf, value, bytes);
+    out.append(buf, bytes);
+}
+
+inline void handoff_put_bytes(std::string& out, const char* data, size_t length) {
+    handoff_put(out, length, 4);
+    out.append(data, length);
+}
+
+// Reads the blob back. Reading past the end gives zeros and clears 'ok'.
+class HandoffReader {
+public:
+    HandoffReader(const char* data, size_t length) : p(data), left(length) {}
+
+    bool ok = true;
+
+    uint64_t get(int bytes) {
+        if (left < (size_t)bytes) return fail();
+        uint64_t value = read_be(p, bytes);
+        p += bytes;
+        left -= bytes;
+        return value;
+    }
+
+    // A length-prefixed string: points 'data' into the blob.
+    size_t get_bytes(const char*& data) {
+        size_t length = (size_t)get(4);
+        if (left < length) return (size_t)fail();
+        data = p;
+        p += length;
+        left -= length;
+        return length;
+    }
+
+    std::string get_string() {
+        const char* data = nullptr;
+        size_t length = get_bytes(data);
+        return std::string(data ? data : "", length);
+    }
+
+private:
+    uint64_t fail() {
+        ok = false;
+        left = 0;
+        return 0;
+    }
+
+    const char* p;
+    size_t left;
+};
+
+#ifndef _WIN32
+// --- THE UNIX SOCKET ---
+inline bool handoff_address(sockaddr_un& address, const std::string& path) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) return false;
+    strcpy(address.sun_path, path.c_str());
+    return true;
+}
+
+// Old server: wait for a successor at 'path'. Returns -1 on failure.
+inline int handoff_listen(const std::string& path) {
+    sockaddr_un address;
+    if (!handoff_address(address, path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    unlink(path.c_str()); // Left over from the server we took over from (or a crash)
+    if (bind(sock, (sockaddr*)&address, sizeof(address)) != 0 || listen(sock, 1) != 0) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// New server: reach the running server at 'path'. Returns -1 on failure.
+inline int handoff_connect(const std::string& path) {
+    sockaddr_un address;
+    if (!handoff_address(address, path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+inline bool handoff_read_all(int sock, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = recv(sock, data, length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// Send 'blob' and copies of 'fds' (which stay open here too).
+inline bool handoff_send(int sock, const std::string& blob, const std::vector<int>& fds) {
+    char header[12];
+    write_be(header, blob.size(), 8);
+    write_be(header + 8, fds.size(), 4);
+    if (!send_all(sock, header, sizeof(header))) return false;
+    // Each batch rides on one byte: descriptors can't travel without data.
+    for (size_t at = 0; at < fds.size(); at += HANDOFF_FDS_PER_MESSAGE) {
+        size_t count = fds.size() - at < HANDOFF_FDS_PER_MESSAGE ? fds.size() - at : HANDOFF_FDS_PER_MESSAGE;
+        char byte = 'F';
+        iovec io = { &byte, 1 };
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fds[at], count * sizeof(int));
+        if (sendmsg(sock, &msg, 0) != 1) return false;
+    }
+    return send_all(sock, blob.data(), blob.size());
+}
+
+// Receive what handoff_send() sent. The descriptors are ours to close.
+inline bool handoff_receive(int sock, std::string& blob, std::vector<int>& fds) {
+    char header[12];
+    if (!handoff_read_all(sock, header, sizeof(header))) return false;
+    size_t blob_size = (size_t)read_be(header, 8);
+    size_t fd_count = (size_t)read_be(header + 8, 4);
+    while (fds.size() < fd_count) {
+        char byte;
+        iovec io = { &byte, 1 };
+        std::vector<char> control(CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC)) return false;
+        size_t before = fds.size();
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* passed = (const int*)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), passed, passed + count);
+        }
+        if (fds.size() == before) return false; // A batch without descriptors: not our peer
+    }
+    blob.resize(blob_size);
+    return blob_size == 0 || handoff_read_all(sock, &blob[0], blob_size);
+}
+#endif
@@ -0,0 +1,115 @@
+// --- LATENCY HISTOGRAM ---
+// Counts values (usually nanoseconds) into log-spaced buckets: every power of
+// two is split into 16 equal steps, so a percentile read back is within about
+// 6% of the true value over the whole 64-bit range, using one fixed 8 KB table.
+// Recording is a couple of instructions and one increment, cheap enough to do
+// for every single message. Keep one per thread and merge() them for reports.
+//
+// Only ONE thread may record() into a histogram, but any thread may read it
+// at the same time: the counts are atomics updated with plain (relaxed) loads
+// and stores, which cost the same as ordinary memory accesses.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>  // _BitScanReverse64
+#endif
+
+#define HISTOGRAM_SUB_BITS 4                                      // 2^4 = 16 steps per power of two
+#define HISTOGRAM_SUB (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB) // Enough for any uint64_t
+
+class Histogram {
+public:
+    Histogram() { reset(); }
+    Histogram(const Histogram& other) { reset(); merge(other); }
+    Histogram& operator=(const Histogram& other) {
+        if (this != &other) {
+            reset();
+            merge(other);
+        }
+        return *this;
+    }
+
+    void reset() {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i].store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        largest.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value) {
+        bump(counts[bucket_of(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > largest.load(std::memory_order_relaxed)) largest.store(value, std::memory_order_relaxed);
+    }
+
+    // Add another histogram's counts to this one.
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) bump(counts[i], other.bucket_count(i));
+        bump(total, other.count());
+        bump(sum, other.value_sum());
+        if (other.max() > max()) largest.store(other.max(), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+    double mean() const { return count() ? (double)value_sum() / count() : 0.0; }
+
+    // The value below which fraction 'p' (0.0 - 1.0) of all recorded values fall.
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t target = (uint64_t)(p * n);
+        if (target >= n) target = n - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += bucket_count(i);
+            if (seen > target) {
+                uint64_t top = bucket_top(i);
+                return top < max() ? top : max();
+            }
+        }
+        return max();
+    }
+
+    // Raw access, for exporters that print the buckets themselves.
+    static uint64_t bucket_top(size_t i) {
+        if (i < HISTOGRAM_SUB) return i;
+        int shift = (int)(i >> HISTOGRAM_SUB_BITS) - 1;
+        uint64_t low = (uint64_t)(HISTOGRAM_SUB + (i & (HISTOGRAM_SUB - 1))) << shift;
+        return low + ((uint64_t)1 << shift) - 1;
+    }
+    uint64_t bucket_count(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+    uint64_t value_sum() const { return sum.load(std::memory_order_relaxed); }
+
+private:
+    // Single-writer add: no locked instruction needed.
+    static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < HISTOGRAM_SUB) return (size_t)value; // Small values get a bucket each
+        int top_bit = highest_bit(value);
+        int shift = top_bit - HISTOGRAM_SUB_BITS;
+        return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + (size_t)((value >> shift) & (HISTOGRAM_SUB - 1));
+    }
+
+    static int highest_bit(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> largest;
+};
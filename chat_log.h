@@ -0,0 +1,439 @@
+// --- MESSAGE LOG ---
+// The server writes every broadcast message to disk so that people who join
+// later can catch up. The log is a folder of "segment" files:
+//
+//   chat_log/00000000000000000000.log   messages 0, 1, 2, ... back to back
+//   chat_log/00000000000000000000.idx   a few (message number, offset, time) bookmarks
+//   chat_log/00000000000000051234.log   the next segment starts at message 51234
+//   ...
+//
+// - Each .log file is memory-mapped. A message is stored as the exact frame
+//   that went over the wire, so replaying history is just "send this range
+//   of the mapped file" - no parsing, no copying into a new buffer.
+// - The .idx file is SPARSE: one bookmark every LOG_INDEX_INTERVAL messages
+//   (and whenever the clock moves to a new second). To find message N, jump
+//   to the nearest bookmark and skip a few frames forward.
+// - When a segment is full, a new one is started. Old segments are deleted
+//   once the log is over its size limit or they are older than the age limit,
+//   so disk and page cache use stay bounded.
+// - How often the data is forced to disk (fsync) is a setting: after every
+//   write, every N milliseconds, or never (leave it to the OS).
+//
+// Backends: CreateFileMapping/MapViewOfFile on Windows, mmap on Linux.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_pool.h" // HeapGrowth
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>         // _commit, _fileno
+#else
+#include <sys/mman.h>   // mmap, msync
+#include <sys/stat.h>   // mkdir, fstat
+#include <fcntl.h>      // open
+#include <unistd.h>     // ftruncate, fsync, close
+#include <dirent.h>     // Listing the log folder
+#endif
+
+#define LOG_SEGMENT_BYTES (64ull * 1024 * 1024) // Default size of one segment file
+#define LOG_INDEX_INTERVAL 64                    // Messages between two bookmarks (at most)
+
+// When the log forces written messages onto the disk.
+enum LogFsyncPolicy {
+    LOG_FSYNC_NEVER,    // Let the OS write pages back whenever it likes
+    LOG_FSYNC_INTERVAL, // A background thread syncs every few milliseconds
+    LOG_FSYNC_ALWAYS    // Sync after every write (safest, slowest)
+};
+
+// One bookmark in a segment's sparse index.
+struct LogIndexEntry {
+    uint64_t seq;     // Message number
+    uint64_t offset;  // Where its frame starts in the segment
+    int64_t time_ms;  // When it was logged (Unix time, milliseconds)
+};
+
+inline int64_t log_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// --- ONE SEGMENT ---
+// A mapped .log file plus its bookmarks. Segments are shared through
+// std::shared_ptr so a history reply that is still being sent keeps its
+// segment mapped even if the log has already retired it.
+class LogSegment {
+public:
+    uint64_t base = 0;      // Number of the first message in this segment
+    char* data = nullptr;   // The mapped file
+    uint64_t capacity = 0;  // Size of the mapping
+    uint64_t end = 0;       // Bytes used so far (guarded by the log's mutex)
+    uint64_t count = 0;     // Messages stored so far
+    uint64_t synced = 0;    // Bytes known to be on disk
+    int64_t last_time_ms = 0; // When the newest message was logged
+    std::vector<LogIndexEntry> index;
+    bool doomed = false;    // Delete the files once nobody uses the segment any more
+
+    ~LogSegment() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap(data, capacity);
+        if (fd >= 0) ::close(fd);
+#endif
+        if (index_file) fclose(index_file);
+        if (doomed) {
+            remove(log_path.c_str());
+            remove(index_path.c_str());
+        }
+    }
+
+    // Map the segment that starts at message 'first' in folder 'dir', creating
+    // it with 'size' bytes if it does not exist yet.
+    bool open(const std::string& dir, uint64_t first, uint64_t size) {
+        base = first;
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu", (unsigned long long)first);
+        log_path = dir + "/" + name + ".log";
+        index_path = dir + "/" + name + ".idx";
+
+#ifdef _WIN32
+        file = CreateFileA(log_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER existing;
+        if (!GetFileSizeEx(file, &existing)) return false;
+        capacity = existing.QuadPart > 0 ? (uint64_t)existing.QuadPart : size;
+        // Mapping more than the file holds grows the file (zero-filled).
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(capacity >> 32), (DWORD)capacity, NULL);
+        if (!mapping) return false;
+        data = (char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)capacity);
+#else
+        fd = ::open(log_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        capacity = st.st_size > 0 ? (uint64_t)st.st_size : size;
+        // A new file is grown to full size up front. The unwritten part is a
+        // hole, so it takes no disk space until messages land there.
+        if (st.st_size == 0 && ftruncate(fd, (off_t)capacity) != 0) return false;
+        void* view = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        data = view == MAP_FAILED ? nullptr : (char*)view;
+#endif
+        if (!data) return false;
+
+        load_index();
+        index_file = fopen(index_path.c_str(), "ab");
+        return index_file != nullptr;
+    }
+
+    // Add a bookmark for the message about to be written at 'end'.
+    void add_bookmark(uint64_t seq, int64_t time_ms) {
+        LogIndexEntry entry = { seq, end, time_ms };
+        if (index.size() == index.capacity()) {
+            HeapGrowth growth; // The index only ever gets longer
+            index.reserve(index.empty() ? 64 : index.size() * 2);
+        }
+        index.push_back(entry);
+        fwrite(&entry, sizeof(entry), 1, index_file);
+    }
+
+    // Offset of message 'seq' (which must be in this segment).
+    uint64_t offset_of(uint64_t seq) const {
+        // The last bookmark at or before 'seq'...
+        auto it = std::upper_bound(index.begin(), index.end(), seq,
+                                   [](uint64_t s, const LogIndexEntry& e) { return s < e.seq; });
+        uint64_t at = it == index.begin() ? base : (it - 1)->seq;
+        uint64_t offset = it == index.begin() ? 0 : (it - 1)->offset;
+        // ...then hop over whole frames until we reach it.
+        for (; at < seq; at++) offset += FRAME_HEADER_SIZE + read_be(data + offset + 4, 4);
+        return offset;
+    }
+
+    // Force bytes [from, to) and the bookmarks onto the disk.
+    void sync(uint64_t from, uint64_t to) {
+        if (to > from) {
+#ifdef _WIN32
+            FlushViewOfFile(data + from, (SIZE_T)(to - from));
+            FlushFileBuffers(file);
+#else
+            uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+            uint64_t start = from / page * page; // msync wants a page-aligned start
+            msync(data + start, to - start, MS_SYNC);
+#endif
+        }
+        fflush(index_file);
+#ifdef _WIN32
+        _commit(_fileno(index_file));
+#else
+        fsync(fileno(index_file));
+#endif
+    }
+
+private:
+    // Read the bookmarks back, then find where the data really ends by
+    // walking frames from the last bookmark (the unused tail is all zeros).
+    void load_index() {
+        FILE* f = fopen(index_path.c_str(), "rb");
+        if (f) {
+            LogIndexEntry entry;
+            while (fread(&entry, sizeof(entry), 1, f) == 1) index.push_back(entry);
+            fclose(f);
+        }
+        // Drop bookmarks that point past what actually reached the data file.
+        while (!index.empty() && (index.back().offset + FRAME_HEADER_SIZE > capacity ||
+                                  data[index.back().offset] != (char)FRAME_VERSION)) {
+            index.pop_back();
+        }
+        if (!index.empty()) {
+            end = index.back().offset;
+            count = index.back().seq - base;
+            last_time_ms = index.back().time_ms;
+        }
+        while (end + FRAME_HEADER_SIZE <= capacity && data[end] == (char)FRAME_VERSION) {
+            uint64_t total = FRAME_HEADER_SIZE + read_be(data + end + 4, 4);
+            if (end + total > capacity) break;
+            end += total;
+            count++;
+        }
+        synced = end;
+        // Rewrite the index file if bookmarks were dropped, so it matches again.
+        FILE* out = fopen(index_path.c_str(), "wb");
+        if (out) {
+            if (!index.empty()) fwrite(index.data(), sizeof(LogIndexEntry), index.size(), out);
+            fclose(out);
+        }
+    }
+
+    std::string log_path;
+    std::string index_path;
+    FILE* index_file = nullptr;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+// A piece of history to send: bytes [offset, offset + length) of 'segment',
+// which are whole frames exactly as they went over the wire.
+struct LogRange {
+    std::shared_ptr<LogSegment> segment;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// --- THE WHOLE LOG ---
+// Safe to use from every shard at once: appends and lookups take a mutex,
+// but only for as long as a memcpy or a binary search.
+class MessageLog {
+public:
+    // Settings. Change them before open().
+    uint64_t segment_bytes = LOG_SEGMENT_BYTES;
+    LogFsyncPolicy fsync_policy = LOG_FSYNC_INTERVAL;
+    int fsync_interval_ms = 1000;
+    uint64_t max_bytes = 1024ull * 1024 * 1024; // Delete old segments above this total (0 = no limit)
+    int64_t max_age_s = 7 * 24 * 3600;          // Delete segments whose newest message is older (0 = keep)
+
+    // Open (or create) the log in folder 'dir' and start its background thread.
+    bool open(const std::string& dir) {
+        folder = dir;
+        // Every frame must fit into one segment.
+        if (segment_bytes < FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD) segment_bytes = FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD;
+#ifdef _WIN32
+        CreateDirectoryA(dir.c_str(), NULL);
+#else
+        mkdir(dir.c_str(), 0755);
+#endif
+        std::vector<uint64_t> bases = list_segments();
+        std::sort(bases.begin(), bases.end());
+        for (uint64_t first : bases) {
+            std::shared_ptr<LogSegment> segment = std::make_shared<LogSegment>();
+            if (!segment->open(folder, first, segment_bytes)) return false;
+            segments.push_back(segment);
+        }
+        if (segments.empty() && !start_segment(0)) return false;
+        next_seq = segments.back()->base + segments.back()->count;
+        last_time_ms = segments.back()->last_time_ms;
+        enforce_retention();
+
+        std::thread t([this]() { maintenance(); });
+        t.detach();
+        return true;
+    }
+
+    // Store one or more whole frames, back to back (as read() batches them).
+    void append(const char* frames, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = log_now_ms();
+        if (now < last_time_ms) now = last_time_ms; // Keep times in order even if the clock jumps back
+        last_time_ms = now;
+
+        while (length >= FRAME_HEADER_SIZE) {
+            size_t total = FRAME_HEADER_SIZE + (size_t)read_be(frames + 4, 4);
+            if (total > length) break; // Not a whole frame: never happens for decoded input
+            LogSegment* segment = segments.back().get();
+            if (segment->end + total > segment->capacity) {
+                if (!start_segment(next_seq)) return; // Disk trouble: stop logging this batch
+                segment = segments.back().get();
+            }
+            // Bookmark the first message of a segment, every LOG_INDEX_INTERVAL
+            // messages after that, and the first message of each new second.
+            if (segment->index.empty() || next_seq - segment->index.back().seq >= LOG_INDEX_INTERVAL ||
+                segment->index.back().time_ms / 1000 != now / 1000) {
+                segment->add_bookmark(next_seq, now);
+            }
+            memcpy(segment->data + segment->end, frames, total);
+            segment->end += total;
+            segment->count++;
+            segment->last_time_ms = now;
+            next_seq++;
+            frames += total;
+            length -= total;
+        }
+        if (fsync_policy == LOG_FSYNC_ALWAYS) {
+            LogSegment* segment = segments.back().get();
+            segment->sync(segment->synced, segment->end);
+            segment->synced = segment->end;
+        }
+    }
+
+    // Find the last 'n' messages. Returns how many were found.
+    uint64_t last(uint64_t n, std::vector<LogRange>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t first = segments.front()->base;
+        uint64_t start = next_seq - first > n ? next_seq - n : first;
+        size_t s = segments.size() - 1;
+        while (s > 0 && segments[s]->base > start) s--;
+        collect(s, segments[s]->offset_of(start), out);
+        return next_seq - start;
+    }
+
+    // Find every message logged since 'time_ms' (to the second: bookmarks
+    // are made at least once a second). Returns how many were found.
+    uint64_t since(int64_t time_ms, std::vector<LogRange>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t second = time_ms / 1000;
+        for (size_t s = 0; s < segments.size(); s++) {
+            for (const LogIndexEntry& entry : segments[s]->index) {
+                if (entry.time_ms / 1000 < second) continue;
+                collect(s, entry.offset, out);
+                return next_seq - entry.seq;
+            }
+        }
+        return 0;
+    }
+
+    // Force everything written so far onto the disk.
+    void sync() {
+        std::shared_ptr<LogSegment> segment;
+        uint64_t from, to;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            segment = segments.back();
+            from = segment->synced;
+            to = segment->end;
+            segment->synced = to;
+        }
+        segment->sync(from, to); // Slow part: done without holding up appends
+    }
+
+private:
+    // Everything from 'offset' in segments[s] to the newest message.
+    void collect(size_t s, uint64_t offset, std::vector<LogRange>& out) {
+        for (; s < segments.size(); s++) {
+            if (segments[s]->end > offset) {
+                LogRange range = { segments[s], offset, segments[s]->end - offset };
+                out.push_back(range);
+            }
+            offset = 0;
+        }
+    }
+
+    // Close off the current segment and begin a new one at message 'first'.
+    bool start_segment(uint64_t first) {
+        if (!segments.empty() && fsync_policy != LOG_FSYNC_NEVER) {
+            LogSegment* old = segments.back().get();
+            old->sync(old->synced, old->end); // Finish the old one properly
+            old->synced = old->end;
+        }
+        std::shared_ptr<LogSegment> segment = std::make_shared<LogSegment>();
+        if (!segment->open(folder, first, segment_bytes)) return false;
+        segments.push_back(segment);
+        enforce_retention();
+        return true;
+    }
+
+    // Retire the oldest segments while the log is too big or they are too
+    // old. The segment being written to is never retired.
+    void enforce_retention() {
+        uint64_t total = 0;
+        for (auto& segment : segments) total += segment->end;
+        int64_t cutoff = log_now_ms() - max_age_s * 1000;
+        while (segments.size() > 1) {
+            LogSegment* oldest = segments.front().get();
+            bool too_big = max_bytes > 0 && total > max_bytes;
+            bool too_old = max_age_s > 0 && oldest->last_time_ms < cutoff;
+            if (!too_big && !too_old) break;
+            total -= oldest->end;
+            oldest->doomed = true; // Files go once the last history reply using it is sent
+            segments.erase(segments.begin());
+        }
+    }
+
+    // Background thread: periodic fsync and age-based retention.
+    void maintenance() {
+        while (true) {
+            int sleep_ms = fsync_policy == LOG_FSYNC_INTERVAL ? fsync_interval_ms : 1000;
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+            if (fsync_policy == LOG_FSYNC_INTERVAL) sync();
+            std::lock_guard<std::mutex> lock(mutex);
+            enforce_retention();
+        }
+    }
+
+    // Numbers of the segments already in the folder (from their file names).
+    std::vector<uint64_t> list_segments() {
+        std::vector<uint64_t> bases;
+#ifdef _WIN32
+        WIN32_FIND_DATAA found;
+        HANDLE search = FindFirstFileA((folder + "/*.log").c_str(), &found);
+        if (search == INVALID_HANDLE_VALUE) return bases;
+        do {
+            bases.push_back(strtoull(found.cFileName, nullptr, 10));
+        } while (FindNextFileA(search, &found));
+        FindClose(search);
+#else
+        DIR* d = opendir(folder.c_str());
+        if (!d) return bases;
+        while (dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) {
+                bases.push_back(strtoull(name.c_str(), nullptr, 10));
+            }
+        }
+        closedir(d);
+#endif
+        return bases;
+    }
+
+    std::mutex mutex;
+    std::string folder;
+    std::vector<std::shared_ptr<LogSegment>> segments; // Oldest first; the last one is being written
+    uint64_t next_seq = 0;     // Number the next message will get
+    int64_t last_time_ms = 0;  // Time of the newest message
+};
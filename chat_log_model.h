@@ -0,0 +1,126 @@
+// --- CHAT LOG MODEL (for the GUI clients) ---
+// The GUIs used to push every incoming message straight into the chat window
+// (select the end, insert, scroll) while holding a lock. In a busy room that
+// is thousands of window updates per second, and the window's text grows
+// forever, so the program gets slower and slower.
+//
+// Instead, the receive thread now only adds the line to this model, and the
+// window redraws from it at most once per "frame" (CHAT_LOG_FRAME_MS):
+//
+//   - The model keeps the newest CHAT_LOG_LINES lines in a ring. Older lines
+//     scroll away for good, so the window's text stays the same size.
+//   - append() (any thread) stores the line and returns true only if no
+//     redraw has been asked for yet, so a burst of 10,000 messages costs the
+//     GUI one posted window message, not 10,000.
+//   - take() (the window's thread) returns just the CHANGE since the last
+//     redraw: how many characters to cut from the top, and the new text to add
+//     at the bottom. A redraw is two edits, however many lines arrived.
+//
+// Nothing in here touches Windows, so it can be tested and benchmarked on any
+// system (see win_chatlog_bench.cpp).
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define CHAT_LOG_LINES 1000   // Lines kept in the model (and the window)
+#define CHAT_LOG_FRAME_MS 16  // At most one redraw per this many ms (about 60 per second)
+
+// What changed since the last take().
+struct ChatLogUpdate {
+    bool replace = false; // Everything shown has scrolled away: show 'text' instead of it
+    size_t drop = 0;      // Otherwise: characters to remove from the top first...
+    std::string text;     // ...then this goes at the bottom
+    size_t lines = 0;     // Lines in 'text'
+};
+
+class ChatLogModel {
+public:
+    explicit ChatLogModel(size_t max_lines = CHAT_LOG_LINES, int frame_ms = CHAT_LOG_FRAME_MS)
+        : lines(max_lines ? max_lines : 1), frame_ms(frame_ms) {}
+
+    // Add one line (any thread). Returns true if the caller should ask the
+    // window to redraw; false if a redraw is already on its way.
+    bool append(const char* text, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next >= lines.size()) {
+            // The oldest line scrolls away. If the window shows it, it must cut it too.
+            uint64_t oldest = next - lines.size();
+            if (oldest < shown_end) pending_drop += lines[slot(oldest)].size();
+        }
+        lines[slot(next)].assign(text, length); // Reuses the old line's memory
+        next++;
+        if (redraw_asked) return false;
+        redraw_asked = true;
+        return true;
+    }
+    bool append(const std::string& text) { return append(text.data(), text.size()); }
+
+    // Milliseconds to wait before the next take(), so redraws stay at most
+    // one per frame.
+    int redraw_delay_ms() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        long long since = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - last_take).count();
+        return since >= frame_ms ? 0 : frame_ms - (int)since;
+    }
+
+    // Collect what changed since the last call (the window's thread only; the
+    // result stays valid until the next call).
+    const ChatLogUpdate& take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t oldest = next > lines.size() ? next - lines.size() : 0;
+        uint64_t first = shown_end > oldest ? shown_end : oldest;
+        update.text.clear();
+        for (uint64_t i = first; i < next; i++) update.text += lines[slot(i)];
+        update.lines = (size_t)(next - first);
+
+        if (pending_drop > 0 && pending_drop >= shown_chars) {
+            update.replace = true;
+            update.drop = 0;
+            shown_chars = update.text.size();
+        } else {
+            update.replace = false;
+            update.drop = pending_drop;
+            shown_chars += update.text.size() - pending_drop;
+        }
+        pending_drop = 0;
+        shown_end = next;
+        redraw_asked = false;
+        last_take = Clock::now();
+        return update;
+    }
+
+    // Everything the model holds, oldest first (what the window should show
+    // after a take()).
+    std::string text() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out;
+        uint64_t oldest = next > lines.size() ? next - lines.size() : 0;
+        for (uint64_t i = oldest; i < next; i++) out += lines[slot(i)];
+        return out;
+    }
+
+    uint64_t total() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    size_t slot(uint64_t line) const { return (size_t)(line % lines.size()); }
+
+    mutable std::mutex mutex;
+    std::vector<std::string> lines; // The ring: line n lives in lines[n % size]
+    uint64_t next = 0;              // Number of the next line to be added
+    uint64_t shown_end = 0;         // Lines before this one have been handed to the window
+    size_t shown_chars = 0;         // Characters the window is showing
+    size_t pending_drop = 0;        // Characters of shown lines that have scrolled away since
+    bool redraw_asked = false;      // append() has asked for a redraw that hasn't happened yet
+    int frame_ms;
+    Clock::time_point last_take;
+    ChatLogUpdate update;
+};
\ No newline at end of file
@@ -0,0 +1,61 @@
+// --- MAILBOX BETWEEN THREADS ---
+// A fixed-size ring that ONE thread writes and ONE other thread reads,
+// without any lock. Each server shard has one of these for every other
+// shard, so shards can pass messages to each other without ever waiting on
+// a mutex.
+//
+// How it works: the writer only moves 'tail', the reader only moves 'head'.
+// Each side reads the other side's counter to see how much room / data there
+// is. The counters sit on separate cache lines so the two CPUs don't keep
+// stealing the same line from each other.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template <class T>
+class SpscRing {
+public:
+    // 'capacity' is rounded up to a power of two so we can use & instead of %.
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Writer side. Returns false if the ring is full (the item is not moved).
+    bool push(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache == slots.size()) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache == slots.size()) return false;
+        }
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release); // Publish the slot to the reader
+        return true;
+    }
+
+    // Reader side. Returns false if there is nothing to read.
+    bool pop(T& out) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache) return false;
+        }
+        out = std::move(slots[h & mask]);
+        slots[h & mask] = T(); // Drop our reference to whatever the slot held
+        head.store(h + 1, std::memory_order_release); // Give the slot back to the writer
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0}; // Next slot to read (written by the reader)
+    size_t tail_cache = 0;                   // Reader's last look at 'tail'
+    alignas(64) std::atomic<size_t> tail{0}; // Next slot to write (written by the writer)
+    size_t head_cache = 0;                   // Writer's last look at 'head'
+};
@@ -0,0 +1,322 @@
+// --- SERVER METRICS ---
+// Counters and histograms that show what the server is doing while it runs.
+// Every thread (each shard, or each client thread in --threads mode) owns ONE
+// ThreadMetrics block and is the only thread that writes to it, so counting
+// never makes two CPUs fight over the same cache line. A scrape reads all
+// blocks from another thread and adds them up per label.
+//
+// The numbers are served in the Prometheus text format, on a local Unix
+// socket (Linux) or a loopback TCP port (anywhere):
+//
+//   server --metrics /tmp/chat.sock     then:  socat - UNIX-CONNECT:/tmp/chat.sock
+//   server --metrics 9100               then:  curl http://127.0.0.1:9100/metrics
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chat_net.h"
+#include "chat_frame.h"     // send_all
+#include "chat_histogram.h"
+
+#ifndef _WIN32
+#include <sys/un.h>     // Unix-domain socket addresses
+#endif
+
+// A number only its owner thread changes. Plain load + store, no lock prefix.
+class Counter {
+public:
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void sub(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Everything one thread counts.
+struct ThreadMetrics {
+    std::string label;          // Blocks with the same label are added together
+    Counter clients;            // Connected right now (a gauge)
+    Counter accepted;           // Connections taken on
+    Counter refused;            // Connections closed at once: their address connected too often
+    Counter disconnected;       // Connections closed
+    Counter reaped;             // Connections closed for saying nothing, not even to a ping
+    Counter pings;              // Heartbeat pings sent to quiet connections
+    Counter resumes;            // Reconnected users caught up from the resume rings
+    Counter resume_gaps;        // Reconnected users who had missed more than the rings hold
+    Counter invalid_utf8;       // Chat lines and names thrown away for not being UTF-8
+    Counter direct_messages;    // Direct messages delivered (one per connection they went to)
+    Counter direct_unknown;     // Direct messages for a name nobody online has
+    Counter messages_in;        // Chat frames received
+    Counter bytes_in;           // Bytes received
+    Counter messages_out;       // Message copies queued for users
+    Counter bytes_out;          // Bytes actually sent
+    Counter send_calls;         // send()/sendmsg()/WSASend() system calls made
+    Counter dropped;            // Messages thrown away for slow users (SLOW_DROP_OLDEST)
+    Counter slow_disconnects;   // Users hung up on for being slow (SLOW_DISCONNECT)
+    Counter history_requests;   // FRAME_HISTORY requests served
+    Counter allocations;        // Heap allocations made by this thread (if the program counts them)
+    Counter growth_allocations; // ...of which growth to a new high (HeapGrowth, chat_pool.h)
+    Counter links;              // Relay links to other server nodes (a gauge)
+    Counter relayed_in;         // Relay frames taken from other nodes
+    Counter relay_duplicates;   // Relay frames ignored because they were seen before (or are our own)
+    Counter links_refused;      // FRAME_LINK frames hung up on (a bad node number or secret)
+    Counter shm_clients;        // Clients talking to us over shared memory (a gauge)
+    Counter files_uploaded;     // Attachments stored complete
+    Counter file_bytes_out;     // Attachment bytes sent to downloaders
+    Histogram fanout_ns;        // Time to queue one broadcast for every local user
+    Histogram queue_depth;      // A user's outbound queue length, sampled on every flush
+    Histogram mutex_wait_ns;    // Time spent waiting for clients_mutex (--threads mode)
+};
+
+// Measures how long a lock took to get, into 'wait'.
+template <class Mutex>
+std::unique_lock<Mutex> lock_timed(Mutex& mutex, Histogram* wait) {
+    if (!wait) return std::unique_lock<Mutex>(mutex);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::unique_lock<Mutex> lock(mutex);
+    wait->record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    return lock;
+}
+
+// --- REGISTRY ---
+// Knows every live ThreadMetrics block. Blocks of threads that have finished
+// are folded into 'retired' so their counts are not lost.
+class MetricsRegistry {
+public:
+    void add(ThreadMetrics* metrics) {
+        std::lock_guard<std::mutex> lock(mutex);
+        live.push_back(metrics);
+    }
+
+    // The thread owning 'metrics' is about to exit.
+    void remove(ThreadMetrics* metrics) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < live.size(); i++) {
+            if (live[i] != metrics) continue;
+            live.erase(live.begin() + i);
+            ThreadMetrics* sum = find_retired(metrics->label);
+            add_into(*sum, *metrics);
+            break;
+        }
+    }
+
+    // Every metric in the Prometheus text format.
+    std::string render() {
+        // Add up all blocks per label, live and retired.
+        std::vector<ThreadMetrics*> totals;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (ThreadMetrics* r : retired) {
+                ThreadMetrics* t = new ThreadMetrics();
+                t->label = r->label;
+                add_into(*t, *r);
+                totals.push_back(t);
+            }
+            for (ThreadMetrics* m : live) {
+                ThreadMetrics* t = nullptr;
+                for (ThreadMetrics* existing : totals) t = existing->label == m->label ? existing : t;
+                if (!t) {
+                    t = new ThreadMetrics();
+                    t->label = m->label;
+                    totals.push_back(t);
+                }
+                add_into(*t, *m);
+            }
+        }
+
+        std::ostringstream out;
+        out.precision(10);
+        counter(out, totals, "chat_clients", "gauge", "Connected clients.", &ThreadMetrics::clients);
+        counter(out, totals, "chat_connections_accepted_total", "counter", "Connections accepted.", &ThreadMetrics::accepted);
+        counter(out, totals, "chat_connections_refused_total", "counter", "Connections refused by the per-address rate limit.", &ThreadMetrics::refused);
+        counter(out, totals, "chat_connections_closed_total", "counter", "Connections closed.", &ThreadMetrics::disconnected);
+        counter(out, totals, "chat_connections_reaped_total", "counter", "Connections closed for not answering heartbeats.", &ThreadMetrics::reaped);
+        counter(out, totals, "chat_heartbeat_pings_total", "counter", "Heartbeat pings sent to quiet connections.", &ThreadMetrics::pings);
+        counter(out, totals, "chat_resumes_total", "counter", "Reconnected clients sent just what they missed.", &ThreadMetrics::resumes);
+        counter(out, totals, "chat_resume_gaps_total", "counter", "Reconnected clients that had missed too much to resume.", &ThreadMetrics::resume_gaps);
+        counter(out, totals, "chat_invalid_utf8_total", "counter", "Chat lines and names refused for not being valid UTF-8.", &ThreadMetrics::invalid_utf8);
+        counter(out, totals, "chat_direct_messages_total", "counter", "Direct messages delivered to a connection.", &ThreadMetrics::direct_messages);
+        counter(out, totals, "chat_direct_unknown_total", "counter", "Direct messages for a user name that was not online.", &ThreadMetrics::direct_unknown);
+        counter(out, totals, "chat_messages_in_total", "counter", "Chat messages received.", &ThreadMetrics::messages_in);
+        counter(out, totals, "chat_bytes_in_total", "counter", "Bytes received.", &ThreadMetrics::bytes_in);
+        counter(out, totals, "chat_messages_out_total", "counter", "Message copies queued for delivery.", &ThreadMetrics::messages_out);
+        counter(out, totals, "chat_bytes_out_total", "counter", "Bytes sent.", &ThreadMetrics::bytes_out);
+        counter(out, totals, "chat_send_calls_total", "counter", "Send system calls made.", &ThreadMetrics::send_calls);
+        counter(out, totals, "chat_messages_dropped_total", "counter", "Messages dropped for slow clients.", &ThreadMetrics::dropped);
+        counter(out, totals, "chat_slow_disconnects_total", "counter", "Clients disconnected for being slow.", &ThreadMetrics::slow_disconnects);
+        counter(out, totals, "chat_history_requests_total", "counter", "History requests served.", &ThreadMetrics::history_requests);
+        counter(out, totals, "chat_heap_allocations_total", "counter", "Heap allocations (operator new calls).", &ThreadMetrics::allocations);
+        counter(out, totals, "chat_heap_growth_allocations_total", "counter", "Heap allocations that grew a pool, queue or index to a new high.", &ThreadMetrics::growth_allocations);
+        counter(out, totals, "chat_links", "gauge", "Relay links to other server nodes.", &ThreadMetrics::links);
+        counter(out, totals, "chat_relayed_in_total", "counter", "Relay frames accepted from other nodes.", &ThreadMetrics::relayed_in);
+        counter(out, totals, "chat_relay_duplicates_total", "counter", "Relay frames ignored as already seen.", &ThreadMetrics::relay_duplicates);
+        counter(out, totals, "chat_links_refused_total", "counter", "Link requests refused (bad node number or secret).", &ThreadMetrics::links_refused);
+        counter(out, totals, "chat_shm_clients", "gauge", "Clients connected over shared memory.", &ThreadMetrics::shm_clients);
+        counter(out, totals, "chat_files_uploaded_total", "counter", "Attachments uploaded and stored.", &ThreadMetrics::files_uploaded);
+        counter(out, totals, "chat_file_bytes_sent_total", "counter", "Attachment bytes sent to downloaders.", &ThreadMetrics::file_bytes_out);
+        histogram(out, totals, "chat_fanout_seconds", "Time to queue one broadcast for every local client.", &ThreadMetrics::fanout_ns, 1e-9);
+        histogram(out, totals, "chat_outbound_queue_depth", "Outbound queue length of a client, sampled on each flush.", &ThreadMetrics::queue_depth, 1.0);
+        histogram(out, totals, "chat_clients_mutex_wait_seconds", "Time spent waiting for clients_mutex.", &ThreadMetrics::mutex_wait_ns, 1e-9);
+
+        for (ThreadMetrics* t : totals) delete t;
+        return out.str();
+    }
+
+private:
+    static void add_into(ThreadMetrics& to, const ThreadMetrics& from) {
+        to.clients.add(from.clients.get());
+        to.accepted.add(from.accepted.get());
+        to.refused.add(from.refused.get());
+        to.disconnected.add(from.disconnected.get());
+        to.reaped.add(from.reaped.get());
+        to.pings.add(from.pings.get());
+        to.resumes.add(from.resumes.get());
+        to.resume_gaps.add(from.resume_gaps.get());
+        to.invalid_utf8.add(from.invalid_utf8.get());
+        to.direct_messages.add(from.direct_messages.get());
+        to.direct_unknown.add(from.direct_unknown.get());
+        to.messages_in.add(from.messages_in.get());
+        to.bytes_in.add(from.bytes_in.get());
+        to.messages_out.add(from.messages_out.get());
+        to.bytes_out.add(from.bytes_out.get());
+        to.send_calls.add(from.send_calls.get());
+        to.dropped.add(from.dropped.get());
+        to.slow_disconnects.add(from.slow_disconnects.get());
+        to.history_requests.add(from.history_requests.get());
+        to.allocations.add(from.allocations.get());
+        to.growth_allocations.add(from.growth_allocations.get());
+        to.links.add(from.links.get());
+        to.relayed_in.add(from.relayed_in.get());
+        to.relay_duplicates.add(from.relay_duplicates.get());
+        to.links_refused.add(from.links_refused.get());
+        to.shm_clients.add(from.shm_clients.get());
+        to.files_uploaded.add(from.files_uploaded.get());
+        to.file_bytes_out.add(from.file_bytes_out.get());
+        to.fanout_ns.merge(from.fanout_ns);
+        to.queue_depth.merge(from.queue_depth);
+        to.mutex_wait_ns.merge(from.mutex_wait_ns);
+    }
+
+    ThreadMetrics* find_retired(const std::string& label) {
+        for (ThreadMetrics* r : retired) {
+            if (r->label == label) return r;
+        }
+        ThreadMetrics* r = new ThreadMetrics();
+        r->label = label;
+        retired.push_back(r);
+        return r;
+    }
+
+    static void counter(std::ostringstream& out, const std::vector<ThreadMetrics*>& totals, const char* name,
+                        const char* type, const char* help, Counter ThreadMetrics::*field) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        for (ThreadMetrics* t : totals) out << name << "{thread=\"" << t->label << "\"} " << (t->*field).get() << "\n";
+    }
+
+    // Only buckets that hold something are printed; Prometheus buckets are
+    // cumulative, so skipping empty ones loses nothing.
+    static void histogram(std::ostringstream& out, const std::vector<ThreadMetrics*>& totals, const char* name,
+                          const char* help, Histogram ThreadMetrics::*field, double scale) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+        for (ThreadMetrics* t : totals) {
+            const Histogram& h = t->*field;
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                if (h.bucket_count(i) == 0) continue;
+                cumulative += h.bucket_count(i);
+                out << name << "_bucket{thread=\"" << t->label << "\",le=\"" << Histogram::bucket_top(i) * scale
+                    << "\"} " << cumulative << "\n";
+            }
+            out << name << "_bucket{thread=\"" << t->label << "\",le=\"+Inf\"} " << h.count() << "\n";
+            out << name << "_sum{thread=\"" << t->label << "\"} " << h.value_sum() * scale << "\n";
+            out << name << "_count{thread=\"" << t->label << "\"} " << h.count() << "\n";
+        }
+    }
+
+    std::mutex mutex;
+    std::vector<ThreadMetrics*> live;
+    std::vector<ThreadMetrics*> retired;
+};
+
+// --- ENDPOINT ---
+// Answer every connection with the current metrics, then hang up. A request
+// starting with "GET " gets an HTTP header first, so Prometheus can scrape the
+// TCP port directly; anything else (or nothing at all) gets the bare text.
+inline void serve_metrics(SOCKET listener, MetricsRegistry* registry) {
+    while (true) {
+        SOCKET client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET) continue;
+
+        // Give the client a moment to say what it wants; tools like socat may say nothing.
+        char request[512];
+        int got = 0;
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(client, &readable);
+        timeval wait = { 0, 100000 };
+        if (select((int)client + 1, &readable, nullptr, nullptr, &wait) > 0) got = recv(client, request, sizeof(request), 0);
+
+        std::string body = registry->render();
+        std::string reply;
+        if (got >= 4 && memcmp(request, "GET ", 4) == 0) {
+            reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                  + std::to_string(body.size()) + "\r\n\r\n";
+        }
+        reply += body;
+        send_all(client, reply.data(), reply.size());
+        closesocket(client);
+    }
+}
+
+// Start the endpoint on a background thread. 'where' is a Unix socket path
+// (contains a '/', Linux only) or a TCP port number on 127.0.0.1.
+inline bool start_metrics_endpoint(const std::string& where, MetricsRegistry* registry) {
+    SOCKET listener;
+    if (where.find('/') != std::string::npos) {
+#ifdef _WIN32
+        std::cerr << "Unix-socket metrics are not available on Windows; give a port number instead.\n";
+        return false;
+#else
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (where.size() >= sizeof(address.sun_path)) return false;
+        strcpy(address.sun_path, where.c_str());
+        unlink(where.c_str()); // Left over from a previous run
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET) return false;
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(listener);
+            return false;
+        }
+#endif
+    } else {
+        sockaddr_in address;
+        if (!make_address(address, "127.0.0.1", std::atoi(where.c_str()))) return false;
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET) return false;
+        set_reuseaddr(listener);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(listener);
+            return false;
+        }
+    }
+    if (listen(listener, 16) == SOCKET_ERROR) {
+        closesocket(listener);
+        return false;
+    }
+    std::thread t(serve_metrics, listener, registry);
+    t.detach();
+    return true;
+}
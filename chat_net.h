@@ -0,0 +1,230 @@
+// --- PORTABLE SOCKET LAYER ---
+// The chat programs were written against Winsock, but the server also runs on
+// our Linux hosts. This header hides the small differences between the two
+// socket APIs so the same code compiles on both.
+#pragma once
+
+#include <cstdint>      // uint32_t
+#include <cstring>      // memset
+#include <string>       // std::string
+
+#ifdef _WIN32
+#include <winsock2.h>   // The main Windows library for networking (Sockets)
+#include <ws2tcpip.h>   // Helper for converting IP addresses
+#pragma comment(lib, "ws2_32.lib") // Link Winsock library
+#else
+#include <sys/types.h>
+#include <sys/socket.h> // socket, bind, listen, accept, send, recv
+#include <sys/resource.h> // getrlimit/setrlimit for the open-file limit
+#include <sys/time.h>   // timeval (receive timeouts)
+#include <netinet/in.h> // sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>  // inet_pton
+#include <unistd.h>     // close
+#include <fcntl.h>      // fcntl (non-blocking mode)
+#include <errno.h>      // errno
+#include <signal.h>     // signal (ignore SIGPIPE)
+#include <sys/uio.h>    // iovec (several buffers in one send)
+#include <sys/ioctl.h>  // ioctl (unsent bytes in a socket)
+#ifdef __linux__
+#include <linux/sockios.h> // SIOCOUTQNSD
+#endif
+typedef int SOCKET;             // On Linux a socket is just a file descriptor
+#define INVALID_SOCKET (-1)     // What socket()/accept() return on failure
+#define SOCKET_ERROR (-1)       // What bind()/listen()/send() return on failure
+#define closesocket close       // Winsock has its own close function, Linux uses close()
+#endif
+
+// Turn networking on. Winsock needs WSAStartup, Linux only needs to stop
+// SIGPIPE from killing the process when we write to a closed socket.
+inline bool net_startup() {
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+#endif
+}
+
+// Turn networking off again (only does something on Windows).
+inline void net_cleanup() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// Switch a socket to non-blocking mode: recv/send/accept return immediately
+// with a "would block" error instead of waiting.
+inline bool set_nonblocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// True when the last socket call failed only because it would have blocked.
+inline bool net_would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Make a blocking recv() on 'sock' give up after 'ms' milliseconds (0 = wait forever).
+inline void set_recv_timeout(SOCKET sock, long long ms) {
+#ifdef _WIN32
+    DWORD timeout = (DWORD)ms;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#else
+    timeval timeout;
+    timeout.tv_sec = (time_t)(ms / 1000);
+    timeout.tv_usec = (suseconds_t)(ms % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+}
+
+// Did the last recv() fail only because set_recv_timeout()'s time ran out?
+inline bool net_timed_out() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Allow SO_REUSEADDR so a restarted server can bind the port immediately.
+inline void set_reuseaddr(SOCKET sock) {
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+}
+
+// Turn off Nagle's algorithm: small writes go out at once instead of
+// waiting for the previous one to be acknowledged.
+inline void set_nodelay(SOCKET sock) {
+    int yes = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+}
+
+// Raise the per-process open-file limit as far as the OS allows, so the
+// server can hold thousands of sockets at once. Windows has no such limit.
+inline void raise_fd_limit() {
+#ifndef _WIN32
+    rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+#endif
+}
+
+// True if the other end of a connected socket is on this machine: it uses
+// the same address we do (127.0.0.1, or our own network address).
+inline bool same_host(SOCKET sock) {
+    sockaddr_in local, peer;
+#ifdef _WIN32
+    int local_len = sizeof(local), peer_len = sizeof(peer);
+#else
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+#endif
+    if (getsockname(sock, (sockaddr*)&local, &local_len) != 0 || getpeername(sock, (sockaddr*)&peer, &peer_len) != 0) return false;
+    return local.sin_family == AF_INET && peer.sin_family == AF_INET && local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+// The IPv4 address at the other end of a connected socket, in network byte
+// order (0 if it can't be found).
+inline uint32_t peer_address(SOCKET sock) {
+    sockaddr_in peer;
+#ifdef _WIN32
+    int peer_len = sizeof(peer);
+#else
+    socklen_t peer_len = sizeof(peer);
+#endif
+    if (getpeername(sock, (sockaddr*)&peer, &peer_len) != 0 || peer.sin_family != AF_INET) return 0;
+    return (uint32_t)peer.sin_addr.s_addr;
+}
+
+// True if the other end has closed a connection we are not reading from
+// (without waiting, and without taking any data out of it).
+inline bool peer_closed(SOCKET sock) {
+    char byte;
+#ifdef _WIN32
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sock, &readable);
+    timeval now = {0, 0};
+    if (select(0, &readable, NULL, NULL, &now) != 1) return false; // Nothing to read: still open
+    return recv(sock, &byte, 1, MSG_PEEK) <= 0;
+#else
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+#endif
+}
+
+// Bytes written to a socket that the kernel has not sent yet (0 where the
+// system can't tell us). Unlike everything it has sent but not had
+// acknowledged, these can still be held back in favour of other data.
+inline size_t unsent_bytes(SOCKET sock) {
+#ifdef SIOCOUTQNSD
+    int bytes = 0;
+    if (ioctl(sock, SIOCOUTQNSD, &bytes) == 0 && bytes > 0) return (size_t)bytes;
+#else
+    (void)sock;
+#endif
+    return 0;
+}
+
+// Make POLL_WRITE wait until fewer than 'bytes' are unsent in the socket
+// (Linux TCP_NOTSENT_LOWAT; does nothing elsewhere).
+inline void set_unsent_limit(SOCKET sock, int bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+    setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&bytes, sizeof(bytes));
+#else
+    (void)sock;
+    (void)bytes;
+#endif
+}
+
+// Fill a sockaddr_in from a dotted IP string and a port number.
+inline bool make_address(sockaddr_in& addr, const std::string& ip, int port) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;      // Use IPv4
+    addr.sin_port = htons(port);    // htons converts numbers to "Network Byte Order"
+    return inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) == 1;
+}
+
+// --- VECTORED SENDS ---
+// One piece of a multi-buffer send: WSABUF on Windows, iovec elsewhere.
+#ifdef _WIN32
+typedef WSABUF IoSlice;
+inline void set_slice(IoSlice& slice, const char* data, size_t length) {
+    slice.buf = (char*)data;
+    slice.len = (ULONG)length;
+}
+#else
+typedef iovec IoSlice;
+inline void set_slice(IoSlice& slice, const char* data, size_t length) {
+    slice.iov_base = (void*)data;
+    slice.iov_len = length;
+}
+#endif
+
+// Send 'count' buffers, in order, with ONE system call (WSASend / sendmsg).
+// Returns how many bytes went out (possibly only part), or -1 on error.
+inline long send_slices(SOCKET sock, IoSlice* slices, size_t count) {
+#ifdef _WIN32
+    DWORD sent = 0;
+    if (WSASend(sock, slices, (DWORD)count, &sent, 0, NULL, NULL) != 0) return -1;
+    return (long)sent;
+#else
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = slices;
+    msg.msg_iovlen = count;
+    return (long)sendmsg(sock, &msg, 0);
+#endif
+}
@@ -0,0 +1,235 @@
+// --- OUTBOUND QUEUES ---
+// When the server broadcasts, it does not copy the message once per user.
+// The bytes are stored ONCE in a Payload (a read-only, reference-counted
+// block) and every recipient's queue just holds another reference to it.
+// The block frees itself when the last recipient has finished sending it.
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "chat_net.h"  // IoSlice
+#include "chat_pool.h" // Where payload blocks come from
+
+// A shared, immutable chunk of bytes. Copying a Payload only bumps a counter.
+class Payload {
+public:
+    Payload() {}
+    Payload(const Payload& other) : block(other.block) { if (block) block->refs.fetch_add(1, std::memory_order_relaxed); }
+    Payload(Payload&& other) noexcept : block(other.block) { other.block = nullptr; }
+    Payload& operator=(Payload other) { std::swap(block, other.block); return *this; }
+    ~Payload() { release(); }
+
+    // Make a new payload holding a copy of 'data'. This is the ONLY memory
+    // a broadcast needs: the counter, the length and the bytes live together
+    // in one block from the pool, so a warmed-up server never calls malloc.
+    static Payload copy_of(const char* data, size_t length) {
+        char* bytes;
+        Payload p = allocate(length, bytes);
+        memcpy(bytes, data, length);
+        return p;
+    }
+
+    // Make a new payload of 'length' bytes and point 'bytes' at them, to be
+    // filled in before the payload is shared (a file chunk is read straight
+    // into one this way).
+    static Payload allocate(size_t length, char*& bytes) {
+        Payload p;
+        unsigned size_class;
+        void* mem = pool_alloc(sizeof(Block) + length, size_class);
+        p.block = new (mem) Block();
+        p.block->size_class = size_class;
+        p.block->length = length;
+        bytes = p.block->bytes();
+        return p;
+    }
+
+    // Make a payload that points at bytes someone else owns (a mapped log
+    // segment, say) instead of copying them. 'owner' is kept alive until the
+    // last reference to the payload goes away.
+    static Payload view_of(const char* data, size_t length, std::shared_ptr<const void> owner) {
+        Payload p;
+        unsigned size_class;
+        void* mem = pool_alloc(sizeof(Block) + sizeof(Owner), size_class);
+        p.block = new (mem) Block();
+        p.block->size_class = size_class;
+        p.block->length = length;
+        p.block->external = data;
+        new (p.block->bytes()) Owner(std::move(owner)); // Stored where copied bytes would go
+        return p;
+    }
+
+    const char* data() const { return block ? (block->external ? block->external : block->bytes()) : nullptr; }
+    size_t size() const { return block ? block->length : 0; }
+
+private:
+    typedef std::shared_ptr<const void> Owner;
+
+    struct Block {
+        std::atomic<int> refs{1};
+        size_t length = 0;
+        unsigned size_class = 0;        // Pool size class, needed to give the block back
+        const char* external = nullptr; // Set by view_of(): the bytes live elsewhere
+        char* bytes() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    void release() {
+        if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (block->external) reinterpret_cast<Owner*>(block->bytes())->~Owner();
+            unsigned size_class = block->size_class;
+            block->~Block();
+            pool_free(block, size_class);
+        }
+        block = nullptr;
+    }
+
+    Block* block = nullptr;
+};
+
+// What to do when a user's queue is full because they are not reading fast enough.
+enum SlowConsumerPolicy {
+    SLOW_DROP_OLDEST,  // Throw away the oldest waiting message to make room
+    SLOW_DISCONNECT,   // Hang up on the slow user
+    SLOW_PAUSE_SENDER  // Stop reading from whoever is sending until the queue drains
+};
+
+// Turn "drop" / "disconnect" / "pause" from the command line into a policy.
+inline bool parse_slow_policy(const std::string& text, SlowConsumerPolicy& out) {
+    if (text == "drop") out = SLOW_DROP_OLDEST;
+    else if (text == "disconnect") out = SLOW_DISCONNECT;
+    else if (text == "pause") out = SLOW_PAUSE_SENDER;
+    else return false;
+    return true;
+}
+
+// The messages waiting to go out to ONE user, oldest first.
+// They are kept in a circular buffer that only ever grows, so once a user's
+// queue has been as long as it gets, queueing costs no memory allocation.
+class OutboundQueue {
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    size_t bytes() const { return queued_bytes - front_sent; }
+
+    void push(const Payload& payload) {
+        if (count == ring.size()) grow();
+        item(count++) = payload;
+        queued_bytes += payload.size();
+    }
+
+    // Queue a message AHEAD of everything that has not started going out,
+    // and never drop it (a new user's FRAME_WELCOME: when many join at once,
+    // the presence frames queued for them must not push it out).
+    void push_urgent(const Payload& payload) {
+        size_t at = front_sent > 0 ? 1 : 0;
+        if (held > at) at = held;
+        if (kept > at) at = kept; // Behind earlier urgent messages
+        push(payload);
+        for (size_t i = count - 1; i > at; i--) std::swap(item(i), item(i - 1));
+        kept = at + 1;
+    }
+
+    // Queue a message behind everything else, and never drop it or anything
+    // ahead of it (a resumed user's replay: a hole in it would go unnoticed).
+    void push_kept(const Payload& payload) {
+        push(payload);
+        kept = count;
+    }
+
+    // Remove the oldest message that has not started going out yet (a message
+    // that is half sent must be finished, or the stream would be corrupted).
+    // Returns false if there was nothing that could be dropped.
+    bool drop_oldest() {
+        size_t victim = front_sent > 0 ? 1 : 0;
+        if (held > victim) victim = held;
+        if (kept > victim) victim = kept;
+        if (count <= victim) return false;
+        queued_bytes -= item(victim).size();
+        for (size_t i = victim; i > 0; i--) item(i) = std::move(item(i - 1)); // Close the gap from the front
+        pop_front();
+        dropped++;
+        return true;
+    }
+
+    // The bytes that should be written next.
+    const char* front_data() const { return item(0).data() + front_sent; }
+    size_t front_size() const { return item(0).size() - front_sent; }
+
+    // Point up to 'max' slices at the waiting bytes, oldest first, so they
+    // can all be written with one send_slices(). Returns how many it filled.
+    size_t gather(IoSlice* slices, size_t max) const {
+        size_t filled = 0;
+        for (size_t i = 0; i < count && filled < max; i++) {
+            size_t skip = i == 0 ? front_sent : 0;
+            set_slice(slices[filled++], item(i).data() + skip, item(i).size() - skip);
+        }
+        return filled;
+    }
+
+    // Call fn(data, length) for every waiting message, oldest first (the
+    // oldest without what has already been written of it).
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        for (size_t i = 0; i < count; i++) {
+            size_t skip = i == 0 ? front_sent : 0;
+            fn(item(i).data() + skip, item(i).size() - skip);
+        }
+    }
+
+    // An asynchronous send (io_uring) keeps reading the first 'n' messages
+    // after gather() returns, so drop_oldest() must leave them alone until the
+    // send's result is passed to consume().
+    void hold(size_t n) { held = n; }
+
+    // Record that 'n' bytes were written, which may finish several messages.
+    void consume(size_t n) {
+        held = 0;
+        while (n > 0) {
+            size_t left = item(0).size() - front_sent;
+            if (n < left) {
+                front_sent += n;
+                return;
+            }
+            n -= left;
+            queued_bytes -= item(0).size();
+            pop_front();
+            front_sent = 0;
+            if (kept > 0) kept--;
+        }
+    }
+
+    unsigned long long dropped = 0; // Messages thrown away by SLOW_DROP_OLDEST
+
+private:
+    // The i-th oldest message.
+    Payload& item(size_t i) { return ring[(first + i) & (ring.size() - 1)]; }
+    const Payload& item(size_t i) const { return ring[(first + i) & (ring.size() - 1)]; }
+
+    void pop_front() {
+        item(0) = Payload(); // Let go of our reference
+        first = (first + 1) & (ring.size() - 1);
+        count--;
+    }
+
+    // Double the ring (it starts at 16 slots), keeping the order.
+    void grow() {
+        HeapGrowth growth;
+        std::vector<Payload> bigger(ring.empty() ? 16 : ring.size() * 2);
+        for (size_t i = 0; i < count; i++) bigger[i] = std::move(item(i));
+        ring.swap(bigger);
+        first = 0;
+    }
+
+    std::vector<Payload> ring; // Circular buffer; its size is always a power of two
+    size_t first = 0;          // Slot of the oldest message
+    size_t count = 0;          // Messages waiting
+    size_t front_sent = 0;    // Bytes of the oldest message already written
+    size_t queued_bytes = 0;  // Total size of everything waiting
+    size_t held = 0;          // Messages an asynchronous send is still reading
+    size_t kept = 0;          // Messages at the front that must not be dropped
+};
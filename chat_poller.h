@@ -0,0 +1,219 @@
+// --- POLLER: "WHICH SOCKETS ARE READY?" ---
+// Instead of parking one thread inside recv() for every user, the server asks
+// the operating system for the list of sockets that are ready right now and
+// handles them all from one thread. This small class hides which OS facility
+// does the asking:
+//   - Linux:   epoll (scales to tens of thousands of sockets)
+//   - Windows: WSAPoll (same idea, simpler API)
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "chat_net.h"
+
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// What we want to hear about for a socket (can be OR-ed together).
+enum PollFlags {
+    POLL_READ = 1,   // Data (or a new connection) is waiting to be read
+    POLL_WRITE = 2,  // There is room in the send buffer again
+    POLL_ERROR = 4   // The other side hung up or the socket broke
+};
+
+// One "this socket is ready" notification.
+struct PollEvent {
+    SOCKET sock;
+    unsigned flags;
+};
+
+#ifndef _WIN32
+
+class Poller {
+public:
+    Poller() { epfd = epoll_create1(EPOLL_CLOEXEC); }
+    ~Poller() { if (epfd >= 0) close(epfd); }
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    bool ok() const { return epfd >= 0; }
+
+    // Start watching a socket.
+    bool add(SOCKET sock, unsigned interest) { return control(EPOLL_CTL_ADD, sock, interest); }
+
+    // Change what we are watching a socket for (e.g. start waiting for POLL_WRITE).
+    bool modify(SOCKET sock, unsigned interest) { return control(EPOLL_CTL_MOD, sock, interest); }
+
+    // Stop watching a socket. Call this BEFORE closing it.
+    void remove(SOCKET sock) { epoll_ctl(epfd, EPOLL_CTL_DEL, sock, nullptr); }
+
+    // Wait up to timeout_ms (-1 = forever) and fill 'out' with ready sockets.
+    int wait(std::vector<PollEvent>& out, int timeout_ms) {
+        out.clear();
+        if (ready.size() < 256) ready.resize(256);
+        if (out.capacity() < ready.size()) out.reserve(ready.size()); // Room for a full batch up front
+        int n = epoll_wait(epfd, ready.data(), (int)ready.size(), timeout_ms);
+        for (int i = 0; i < n; i++) {
+            unsigned flags = 0;
+            if (ready[i].events & EPOLLIN) flags |= POLL_READ;
+            if (ready[i].events & EPOLLOUT) flags |= POLL_WRITE;
+            if (ready[i].events & (EPOLLERR | EPOLLHUP)) flags |= POLL_ERROR;
+            out.push_back(PollEvent{ ready[i].data.fd, flags });
+        }
+        // If every slot was used there may be more waiting; grow for next time.
+        if (n == (int)ready.size()) ready.resize(ready.size() * 2);
+        return n;
+    }
+
+private:
+    bool control(int op, SOCKET sock, unsigned interest) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        if (interest & POLL_READ) ev.events |= EPOLLIN;
+        if (interest & POLL_WRITE) ev.events |= EPOLLOUT;
+        ev.data.fd = sock;
+        return epoll_ctl(epfd, op, sock, &ev) == 0;
+    }
+
+    int epfd;
+    std::vector<epoll_event> ready; // Reused between calls so waiting never allocates
+};
+
+#else
+
+class Poller {
+public:
+    Poller() {}
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    bool ok() const { return true; }
+
+    bool add(SOCKET sock, unsigned interest) {
+        if (index.count(sock)) return false;
+        WSAPOLLFD pfd;
+        pfd.fd = sock;
+        pfd.events = to_events(interest);
+        pfd.revents = 0;
+        index[sock] = fds.size();
+        fds.push_back(pfd);
+        return true;
+    }
+
+    bool modify(SOCKET sock, unsigned interest) {
+        auto it = index.find(sock);
+        if (it == index.end()) return false;
+        fds[it->second].events = to_events(interest);
+        return true;
+    }
+
+    void remove(SOCKET sock) {
+        auto it = index.find(sock);
+        if (it == index.end()) return;
+        // Swap the last entry into the hole so removal stays O(1).
+        size_t pos = it->second;
+        index.erase(it);
+        if (pos != fds.size() - 1) {
+            fds[pos] = fds.back();
+            index[fds[pos].fd] = pos;
+        }
+        fds.pop_back();
+    }
+
+    int wait(std::vector<PollEvent>& out, int timeout_ms) {
+        out.clear();
+        if (fds.empty()) {
+            Sleep(timeout_ms < 0 ? 10 : timeout_ms);
+            return 0;
+        }
+        if (out.capacity() < fds.size()) out.reserve(fds.size()); // Room for every socket up front
+        int n = WSAPoll(fds.data(), (ULONG)fds.size(), timeout_ms);
+        if (n <= 0) return n;
+        for (const WSAPOLLFD& pfd : fds) {
+            if (pfd.revents == 0) continue;
+            unsigned flags = 0;
+            if (pfd.revents & POLLRDNORM) flags |= POLL_READ;
+            if (pfd.revents & POLLWRNORM) flags |= POLL_WRITE;
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) flags |= POLL_ERROR;
+            out.push_back(PollEvent{ pfd.fd, flags });
+        }
+        return (int)out.size();
+    }
+
+private:
+    static SHORT to_events(unsigned interest) {
+        SHORT ev = 0;
+        if (interest & POLL_READ) ev |= POLLRDNORM;
+        if (interest & POLL_WRITE) ev |= POLLWRNORM;
+        return ev;
+    }
+
+    std::vector<WSAPOLLFD> fds;                 // The array WSAPoll looks at
+    std::unordered_map<SOCKET, size_t> index;   // socket -> position in 'fds'
+};
+
+#endif
+
+// --- WAKEUP ---
+// Lets another thread interrupt a Poller::wait() that is sleeping. Add
+// wakeup.socket() to the poller with POLL_READ; signal() makes it readable
+// and clear() resets it.
+//   - Linux:   an eventfd (a counter the kernel can poll)
+//   - Windows: a UDP socket on 127.0.0.1 that sends a byte to itself
+class Wakeup {
+public:
+    Wakeup() {
+#ifndef _WIN32
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        make_address(self, "127.0.0.1", 0);
+        int len = sizeof(self);
+        if (fd != INVALID_SOCKET && (bind(fd, (sockaddr*)&self, len) == SOCKET_ERROR ||
+                                     getsockname(fd, (sockaddr*)&self, &len) == SOCKET_ERROR)) {
+            closesocket(fd);
+            fd = INVALID_SOCKET;
+        }
+        if (fd != INVALID_SOCKET) set_nonblocking(fd);
+#endif
+    }
+    ~Wakeup() { if (fd != INVALID_SOCKET) closesocket(fd); }
+    Wakeup(const Wakeup&) = delete;
+    Wakeup& operator=(const Wakeup&) = delete;
+
+    bool ok() const { return fd != INVALID_SOCKET; }
+    SOCKET socket() const { return fd; }
+
+    // Called from ANY thread.
+    void signal() {
+#ifndef _WIN32
+        uint64_t one = 1;
+        ssize_t ignored = write(fd, &one, sizeof(one));
+        (void)ignored;
+#else
+        char byte = 1;
+        sendto(fd, &byte, 1, 0, (sockaddr*)&self, sizeof(self));
+#endif
+    }
+
+    // Called by the thread that owns the poller, after it woke up.
+    void clear() {
+#ifndef _WIN32
+        uint64_t count;
+        ssize_t ignored = read(fd, &count, sizeof(count));
+        (void)ignored;
+#else
+        char bytes[64];
+        while (recv(fd, bytes, sizeof(bytes), 0) > 0) {}
+#endif
+    }
+
+private:
+    SOCKET fd = INVALID_SOCKET;
+#ifdef _WIN32
+    sockaddr_in self; // Where signal() sends its byte (our own address)
+#endif
+};
@@ -0,0 +1,152 @@
+// --- MESSAGE BUFFER POOL ---
+// Every broadcast needs a block of memory for its Payload. Asking malloc for
+// one each time is slow under load (and malloc may take a lock shared by all
+// threads), so blocks come from this pool instead:
+//
+//   - Blocks come in size classes: 64 bytes, 128, 256, ... up to 256 KB.
+//     A request is rounded up to the next class.
+//   - Each class is carved out of big slabs, fetched from the heap only when
+//     the pool runs dry. Slabs are never given back, so once the pool has
+//     grown to the busiest moment so far, no more heap memory is needed.
+//   - Each thread keeps its own free list per class, so taking and returning
+//     blocks costs a few instructions and no lock. A block freed on another
+//     thread (a shard releasing the last reference to someone else's message)
+//     goes into THAT thread's list; when a list gets too long, half of it is
+//     moved to a shared depot in one go, where other threads can pick it up.
+//
+// Requests bigger than the largest class go straight to the heap.
+//
+// Fetching a slab is "growth": it only happens at a new high in blocks in
+// use. The pool marks it with a HeapGrowth, and so does everything else that
+// only takes memory at a new high (a user's queue, the resume ring, the
+// log's index), so a program that counts allocations can tell the two apart.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#define POOL_MIN_SHIFT 6                                   // Smallest class: 2^6 = 64 bytes
+#define POOL_MAX_SHIFT 18                                  // Largest class: 2^18 = 256 KB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_HEAP POOL_CLASSES                             // "Class" of blocks that came from the heap
+#define POOL_SLAB_BYTES (64 * 1024)                        // Small classes are carved from slabs this big
+#define POOL_CACHE_BYTES (1024 * 1024)                     // A thread keeps about this much per class
+
+// Set while the current thread grows something that is never given back.
+inline thread_local int heap_growth = 0;
+
+struct HeapGrowth {
+    HeapGrowth() { heap_growth++; }
+    ~HeapGrowth() { heap_growth--; }
+};
+
+// A free block: its first bytes point at the next free block.
+struct PoolNode {
+    PoolNode* next;
+};
+
+// A chain of free blocks.
+struct PoolList {
+    PoolNode* head = nullptr;
+    size_t count = 0;
+
+    void push(PoolNode* node) {
+        node->next = head;
+        head = node;
+        count++;
+    }
+    PoolNode* pop() {
+        PoolNode* node = head;
+        head = node->next;
+        count--;
+        return node;
+    }
+    // Move up to 'n' blocks from this list to 'to'.
+    void move_to(PoolList& to, size_t n) {
+        while (n-- > 0 && head) to.push(pop());
+    }
+};
+
+inline size_t pool_class_bytes(unsigned size_class) { return (size_t)1 << (size_class + POOL_MIN_SHIFT); }
+
+// How many free blocks of one class a thread keeps before sharing them.
+inline size_t pool_cache_limit(unsigned size_class) {
+    size_t n = POOL_CACHE_BYTES / pool_class_bytes(size_class);
+    return n < 8 ? 8 : n;
+}
+
+// The shared depot: one free list per class, behind one lock each.
+struct PoolDepot {
+    std::mutex mutex[POOL_CLASSES];
+    PoolList lists[POOL_CLASSES];
+};
+
+inline PoolDepot& pool_depot() {
+    static PoolDepot* depot = new PoolDepot(); // Never destroyed: threads may still free blocks at exit
+    return *depot;
+}
+
+// One thread's own free lists. When the thread ends they go to the depot.
+struct PoolCache {
+    PoolList lists[POOL_CLASSES];
+
+    ~PoolCache() {
+        PoolDepot& depot = pool_depot();
+        for (unsigned c = 0; c < POOL_CLASSES; c++) {
+            std::lock_guard<std::mutex> lock(depot.mutex[c]);
+            lists[c].move_to(depot.lists[c], lists[c].count);
+        }
+    }
+};
+
+inline PoolCache& pool_cache() {
+    thread_local PoolCache cache;
+    return cache;
+}
+
+// Get a block of at least 'bytes' bytes. 'size_class' is set to what must be
+// passed back to pool_free().
+inline void* pool_alloc(size_t bytes, unsigned& size_class) {
+    if (bytes > pool_class_bytes(POOL_CLASSES - 1)) {
+        size_class = POOL_HEAP;
+        return ::operator new(bytes);
+    }
+    unsigned c = 0;
+    while (pool_class_bytes(c) < bytes) c++;
+    size_class = c;
+
+    PoolList& mine = pool_cache().lists[c];
+    if (!mine.head) {
+        // Refill from the depot, and if that is empty too, from a new slab.
+        PoolDepot& depot = pool_depot();
+        {
+            std::lock_guard<std::mutex> lock(depot.mutex[c]);
+            depot.lists[c].move_to(mine, pool_cache_limit(c) / 2);
+        }
+        if (!mine.head) {
+            size_t block = pool_class_bytes(c);
+            size_t slab = block > POOL_SLAB_BYTES ? block : POOL_SLAB_BYTES;
+            HeapGrowth growth;
+            char* memory = (char*)::operator new(slab);
+            for (size_t at = 0; at + block <= slab; at += block) mine.push((PoolNode*)(memory + at));
+        }
+    }
+    return mine.pop();
+}
+
+// Give a block back (from any thread).
+inline void pool_free(void* block, unsigned size_class) {
+    if (size_class == POOL_HEAP) {
+        ::operator delete(block);
+        return;
+    }
+    PoolList& mine = pool_cache().lists[size_class];
+    mine.push((PoolNode*)block);
+    if (mine.count > pool_cache_limit(size_class)) {
+        PoolDepot& depot = pool_depot();
+        std::lock_guard<std::mutex> lock(depot.mutex[size_class]);
+        mine.move_to(depot.lists[size_class], mine.count / 2);
+    }
+}
@@ -0,0 +1,145 @@
+// --- RELAY LINKS BETWEEN SERVERS ---
+// Several servers ("nodes") can be joined into one chat. Each node is started
+// with its own --node number and a --peer address for each node it should
+// connect to. A link is an ordinary TCP connection to the other node's chat
+// port that starts with a FRAME_LINK frame ("I am node N") instead of a hello.
+//
+// A link is trusted completely: what comes down it is passed on as it is,
+// session IDs and all. So the FRAME_LINK frame also carries a shared secret
+// (--link-secret, the same on every node), and a node hangs up on a link
+// that doesn't know it. Otherwise any client could say FRAME_LINK and then
+// speak for anybody.
+//
+// Whatever a node broadcasts to its own users, it also sends down every link
+// as ONE FRAME_RELAY frame:
+//
+//   origin node (4 bytes) | sequence number (8 bytes) | the chat frames, as sent
+//
+// A node that receives a relay frame hands the chat frames to its own users
+// and passes the relay frame on, unchanged, down all its OTHER links. So the
+// nodes may be linked in any shape (a chain, a ring, every node to every
+// other) and a message still reaches all of them. Loops are cut in two ways:
+//   - a node ignores relay frames that carry its own origin number,
+//   - every node remembers which sequence numbers it has already seen from
+//     each origin (a sliding window, RelayFilter below) and ignores repeats.
+//
+// Relay frames go out through the same send queues as everything else, so
+// many of them travel in one send and nobody waits for an answer before
+// sending the next. If a link breaks, the node that opened it dials again.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "chat_frame.h"
+
+#define RELAY_HEADER_SIZE 12 // Origin node + sequence number, in front of the frames
+#define RELAY_WINDOW 4096    // Sequence numbers remembered per origin (a multiple of 64)
+#define NODE_MAX 255         // Node numbers are 1 ... NODE_MAX (they go in the top byte of session IDs)
+
+// Append a FRAME_LINK frame saying we are node 'node' and know 'secret':
+// node (4 bytes) | secret.
+inline void encode_link_hello(std::string& out, uint32_t node, const std::string& secret) {
+    std::string payload(4, '\0');
+    write_be(&payload[0], node, 4);
+    payload += secret;
+    encode_frame(out, FRAME_LINK, 0, payload.data(), payload.size());
+}
+
+// Does the secret in a FRAME_LINK frame ('given') match ours? Looks at every
+// byte whatever it finds, so the time taken doesn't tell a guesser how much
+// of a guess was right. An empty secret matches nothing.
+inline bool link_secret_matches(const char* given, size_t length, const std::string& secret) {
+    if (secret.empty() || length != secret.size()) return false;
+    unsigned char differ = 0;
+    for (size_t i = 0; i < length; i++) differ |= (unsigned char)(given[i] ^ secret[i]);
+    return differ == 0;
+}
+
+// Append a FRAME_RELAY frame carrying 'frames' (whole frames, back to back).
+inline void encode_relay(std::string& out, uint32_t origin, uint64_t seq, const char* frames, size_t length) {
+    char header[FRAME_HEADER_SIZE + RELAY_HEADER_SIZE];
+    write_frame_header(header, FRAME_RELAY, 0, (uint32_t)(RELAY_HEADER_SIZE + length));
+    write_be(header + FRAME_HEADER_SIZE, origin, 4);
+    write_be(header + FRAME_HEADER_SIZE + 4, seq, 8);
+    out.append(header, sizeof(header));
+    out.append(frames, length);
+}
+
+// The first sequence number a node uses: the time in microseconds. A node
+// that restarts carries on ABOVE what it sent before, so the other nodes
+// don't mistake its new messages for old repeats.
+inline uint64_t relay_first_seq() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Remembers, per origin node, which of the last RELAY_WINDOW sequence numbers
+// have been seen. Shared by all shards (a link may live on any of them).
+class RelayFilter {
+public:
+    // True the first time (origin, seq) is offered; false for a repeat or
+    // for something older than the window.
+    bool accept(uint32_t origin, uint64_t seq) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Window& w = windows[origin];
+        if (!w.started) {
+            w.started = true;
+            w.highest = seq;
+            set(w, seq);
+            return true;
+        }
+        if (seq > w.highest) {
+            // Slide forward, forgetting the numbers that fall out of the window.
+            uint64_t shift = seq - w.highest;
+            if (shift >= RELAY_WINDOW) {
+                for (uint64_t& word : w.bits) word = 0;
+            } else {
+                for (uint64_t s = w.highest + 1; s < seq; s++) clear(w, s);
+            }
+            w.highest = seq;
+            set(w, seq);
+            return true;
+        }
+        if (w.highest - seq >= RELAY_WINDOW) return false; // Too old to tell: assume seen
+        if (is_set(w, seq)) return false;
+        set(w, seq);
+        return true;
+    }
+
+private:
+    struct Window {
+        bool started = false;
+        uint64_t highest = 0;              // Newest sequence number seen
+        uint64_t bits[RELAY_WINDOW / 64] = {}; // Bit (seq % RELAY_WINDOW): seen?
+    };
+
+    static void set(Window& w, uint64_t seq) { w.bits[(seq % RELAY_WINDOW) / 64] |= (uint64_t)1 << (seq % 64); }
+    static void clear(Window& w, uint64_t seq) { w.bits[(seq % RELAY_WINDOW) / 64] &= ~((uint64_t)1 << (seq % 64)); }
+    static bool is_set(const Window& w, uint64_t seq) { return (w.bits[(seq % RELAY_WINDOW) / 64] >> (seq % 64)) & 1; }
+
+    std::mutex mutex;
+    std::unordered_map<uint32_t, Window> windows;
+};
+
+// One node we keep a link to (from --peer HOST:PORT). Its dialer thread
+// connects whenever 'up' is false, and the shard clears 'up' when the link breaks.
+struct RelayPeer {
+    std::string host;
+    int port = 0;
+    std::atomic<bool> up{false};
+    std::atomic<bool> refused{false}; // It hung up on our FRAME_LINK (said once, not on every retry)
+};
+
+// Split "host:port" (or just "port", meaning this machine).
+inline bool parse_peer(const std::string& text, RelayPeer& peer) {
+    size_t colon = text.rfind(':');
+    std::string port = colon == std::string::npos ? text : text.substr(colon + 1);
+    peer.host = colon == std::string::npos ? "127.0.0.1" : text.substr(0, colon);
+    peer.port = std::atoi(port.c_str());
+    return peer.port > 0 && peer.port < 65536 && !peer.host.empty();
+}
\ No newline at end of file
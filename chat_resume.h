@@ -0,0 +1,231 @@
+// --- RESUMING AFTER A RECONNECT ---
+// A client whose connection drops (a flaky Wi-Fi, a laptop lid) wants exactly
+// what was said while it was away: not nothing, and not the whole history.
+// So every event loop ("shard") of the server numbers the messages it
+// publishes, 1, 2, 3, ..., and keeps the most recent ones in memory (a
+// ResumeRing, bounded by --resume-mb). A client that asked for numbers gets
+// each published batch with a mark in front of it:
+//
+//   RESUME_MARK   origin shard (4 bytes) | first number (8 bytes) | frames (4 bytes)
+//
+// and remembers the last number it got from each shard (ResumeTracker). When
+// it reconnects it sends those numbers back, before anything else:
+//
+//   RESUME_ASK    server epoch (8) | old session ID (4) | last number from shard 0, 1, ... (8 each)
+//                 (an empty payload just asks for numbers from now on)
+//
+// and the server answers with every frame after them that is still in its
+// rings (the client's own messages left out), then
+//
+//   RESUME_DONE   server epoch (8) | frames replayed (8) | last number from shard 0, 1, ... (8 each)
+//
+// or, if some of it has already left the rings (or the server restarted,
+// which the epoch tells), nothing but RESUME_GAP with the same payload and
+// 0 replayed, after which the client asks for history instead. A server
+// that doesn't keep rings (--resume-mb 0, --threads) answers RESUME_GAP with
+// epoch 0 and nothing else, and sends no marks.
+//
+// Why one counter per shard, not one for the whole server: a shard delivers
+// what other shards publish a little later than its own messages, so one
+// global counter would reach a user out of order, and "the last number I
+// got" would not mean "everything before it too". The messages of ONE shard
+// reach every user in the order they were numbered.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_outbound.h" // Payload
+#include "chat_files.h"    // FILE_OFFER
+
+#define RESUME_MARK_SIZE (FRAME_HEADER_SIZE + 16) // A whole RESUME_MARK frame
+#define RESUME_ASK_FIXED 12                       // Epoch and session, before the numbers
+
+// How many whole frames 'data' holds.
+inline uint32_t count_frames(const char* data, size_t length) {
+    uint32_t frames = 0;
+    for (size_t at = 0; at + FRAME_HEADER_SIZE <= length; frames++) {
+        at += FRAME_HEADER_SIZE + (size_t)read_be(data + at + 4, 4);
+    }
+    return frames;
+}
+
+// Write a RESUME_MARK frame (RESUME_MARK_SIZE bytes) at 'out'.
+inline void write_resume_mark(char* out, uint32_t origin, uint64_t first, uint32_t frames) {
+    write_frame_header(out, FRAME_RESUME, RESUME_MARK, RESUME_MARK_SIZE - FRAME_HEADER_SIZE);
+    write_be(out + FRAME_HEADER_SIZE, origin, 4);
+    write_be(out + FRAME_HEADER_SIZE + 4, first, 8);
+    write_be(out + FRAME_HEADER_SIZE + 12, frames, 4);
+}
+
+// --- SERVER SIDE ---
+// One published batch, numbered and kept for users who come back.
+struct ResumeEntry {
+    uint64_t first;   // Number of its first frame
+    uint32_t frames;
+    uint32_t sender;  // Session that sent it (0 = the server, or another node)
+    long long at;     // When it was published (ns), to replay shards in a sensible order
+    Payload numbered; // RESUME_MARK + the frames
+};
+
+// The recent batches one shard published, oldest first. Only its own shard
+// adds to it; any shard may read it while answering a RESUME_ASK, so both
+// take the mutex (held for a push_back, or for a binary search and a copy of
+// the references). The batches sit in a circular buffer that only ever
+// grows, like an OutboundQueue, so once it has held as many batches as it
+// gets, numbering a message costs no heap allocation.
+class ResumeRing {
+public:
+    size_t limit = 0; // Bytes kept (0 = numbering is off)
+
+    // The number the next frame will get. Only for the shard that adds.
+    uint64_t next() const { return next_number; }
+
+    void add(uint64_t first, uint32_t frames, uint32_t sender, long long at, const Payload& numbered) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count == ring.size()) grow();
+        entry(count++) = ResumeEntry{first, frames, sender, at, numbered};
+        bytes += numbered.size();
+        next_number = first + frames;
+        while (bytes > limit && count > 1) {
+            bytes -= entry(0).numbered.size();
+            entry(0).numbered = Payload(); // Let go of our reference
+            oldest = (oldest + 1) & (ring.size() - 1);
+            count--;
+        }
+    }
+
+    // The last number given out so far (0 = none).
+    uint64_t last() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next_number - 1;
+    }
+
+    // Append every batch holding a frame after 'after' to 'out', except those
+    // 'skip' sent, and set 'last' as last() does. Returns false if some of
+    // them are gone already (nothing is appended then).
+    bool collect(uint64_t after, uint32_t skip, std::vector<ResumeEntry>& out, uint64_t& last) {
+        std::lock_guard<std::mutex> lock(mutex);
+        last = next_number - 1;
+        if (after >= last) return after == last; // Nothing missed (or a number we never gave)
+        if (count == 0 || entry(0).first > after + 1) return false;
+        size_t low = 0, high = count; // Find the first batch that ends after 'after'
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            const ResumeEntry& e = entry(middle);
+            if (after < e.first + e.frames - 1) high = middle;
+            else low = middle + 1;
+        }
+        for (size_t i = low; i < count; i++) {
+            if (entry(i).sender != skip || skip == 0) out.push_back(entry(i));
+        }
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    ResumeEntry& entry(size_t i) { return ring[(oldest + i) & (ring.size() - 1)]; }
+
+    void grow() {
+        HeapGrowth growth;
+        std::vector<ResumeEntry> bigger(ring.empty() ? 64 : ring.size() * 2);
+        for (size_t i = 0; i < count; i++) bigger[i] = std::move(entry(i));
+        ring.swap(bigger);
+        oldest = 0;
+    }
+
+    std::vector<ResumeEntry> ring; // Circular buffer; its size is always a power of two
+    size_t oldest = 0;             // Slot of the oldest batch
+    size_t count = 0;              // Batches kept
+    size_t bytes = 0;
+    uint64_t next_number = 1;
+};
+
+// --- CLIENT SIDE ---
+// Numbers what a client receives and asks for the rest after a reconnect.
+// Feed it every frame (accept()); it swallows the marks and the repeats.
+class ResumeTracker {
+public:
+    // A RESUME_ASK frame for a (new) connection: the numbers we have, if
+    // this server gave us any, or a plain "number from now on". Send it
+    // before anything else; until the answer comes, published frames that
+    // were not numbered are dropped (the answer replays them, numbered).
+    std::string ask() {
+        std::string payload;
+        if (epoch) {
+            char fixed[RESUME_ASK_FIXED];
+            write_be(fixed, epoch, 8);
+            write_be(fixed + 8, session, 4);
+            payload.append(fixed, sizeof(fixed));
+            for (uint64_t n : last) {
+                char number[8];
+                write_be(number, n, 8);
+                payload.append(number, 8);
+            }
+        }
+        batch_left = 0;
+        waiting = true;
+        return encode_frame(FRAME_RESUME, payload, RESUME_ASK);
+    }
+
+    // True if 'frame' is for the caller; false for marks and repeats.
+    bool accept(const Frame& frame) {
+        if (frame.type == FRAME_RESUME) {
+            if (frame.flags == RESUME_MARK && frame.length == RESUME_MARK_SIZE - FRAME_HEADER_SIZE) {
+                origin = (uint32_t)read_be(frame.payload, 4);
+                batch_next = read_be(frame.payload + 4, 8);
+                batch_left = (uint32_t)read_be(frame.payload + 12, 4);
+                if (origin >= 256) batch_left = 0; // Not a shard number
+                else if (origin >= last.size()) last.resize(origin + 1, 0);
+                return false;
+            }
+            if (frame.flags == RESUME_DONE || frame.flags == RESUME_GAP) caught_up(frame);
+            return true;
+        }
+        if (frame.type == FRAME_WELCOME && frame.length >= SESSION_ID_SIZE) {
+            session = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+        }
+        if (batch_left > 0) {
+            batch_left--;
+            uint64_t n = batch_next++;
+            if (n <= last[origin]) return false; // Had it already (replayed, then live)
+            last[origin] = n;
+            return true;
+        }
+        return !(waiting && published(frame));
+    }
+
+    // The server's epoch (0 = not numbering).
+    uint64_t server() const { return epoch; }
+
+private:
+    // What the server sends to everyone, the kind of frame a replay carries.
+    static bool published(const Frame& frame) {
+        return frame.type == FRAME_CHAT || (frame.type == FRAME_FILE && frame.flags == FILE_OFFER) ||
+               (frame.type == FRAME_PRESENCE && (frame.flags == PRESENCE_JOIN || frame.flags == PRESENCE_LEAVE));
+    }
+
+    // RESUME_DONE / RESUME_GAP: where each shard's numbers stand for us now.
+    void caught_up(const Frame& frame) {
+        waiting = false;
+        epoch = frame.length >= 16 ? read_be(frame.payload, 8) : 0;
+        if (!epoch) {
+            last.clear(); // This server doesn't number
+            return;
+        }
+        size_t shards = (frame.length - 16) / 8;
+        if (frame.flags == RESUME_GAP || shards != last.size()) last.assign(shards, 0);
+        for (size_t s = 0; s < shards; s++) last[s] = std::max(last[s], read_be(frame.payload + 16 + s * 8, 8));
+    }
+
+    uint64_t epoch = 0;          // The server that numbered 'last'
+    uint32_t session = 0;        // Ours, so a replay leaves out what we sent
+    std::vector<uint64_t> last;  // Last number we got from each shard
+    bool waiting = false;        // Asked, no answer yet
+    uint32_t origin = 0;         // The batch being received: its shard,
+    uint64_t batch_next = 0;     // the number of its next frame,
+    uint32_t batch_left = 0;     // and how many of its frames are still to come
+};
@@ -0,0 +1,254 @@
+// --- ROOMS ---
+// Without rooms, every chat line goes to everyone on the server. A room is a
+// named group that users join and leave, and a line for a room reaches its
+// members only:
+//
+//   ROOM_JOIN    (client -> server)  room name (1 to ROOM_NAME_MAX bytes of UTF-8)
+//   ROOM_JOINED  (server -> client)  room ID (4 bytes) | room name: you are in
+//   ROOM_LEAVE   (client -> server)  room ID
+//   ROOM_LEFT    (server -> client)  room ID: you are out
+//   ROOM_FAILED  (server -> client)  room name: you can't join it (a bad name, too many rooms)
+//
+// A line for a room is a FRAME_CHAT with CHAT_SENDER | CHAT_ROOM: sender's
+// session ID (4 bytes) | room ID (4 bytes) | text. Lines without CHAT_ROOM
+// still go to everyone, so older clients carry on as before. A room is made
+// the first time somebody asks for it, and its ID doesn't change while
+// anybody is in it (even across a hot restart); a line carries those 4 bytes
+// instead of the name. Once ROOM_MAX rooms exist, the next new name takes
+// over the ID of a room nobody is in, so nobody can use up the rooms for
+// good by making them and walking away.
+//
+// The server must not look at every user to find a room's members: a line
+// for a room of 100 on a server of 10,000 would cost 10,000 checks. So it
+// keeps a subscription index. Each event loop ("shard") keeps, for every
+// room, an array of ITS users in that room, and fans a room's line out over
+// that array alone. The array is only touched by the loop that owns it, so
+// it needs no lock, and walking it is walking consecutive pointers. The
+// other loops only need to know whether to send a line their way at all:
+// RoomDirectory keeps one bit per loop for every room, set while that loop
+// has members there, which any loop reads with one atomic load.
+//
+// Room lines are not logged, numbered for resuming or passed over relay
+// links: history and links are for the lines everyone gets.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_session.h" // Roster
+#include "chat_utf8.h"    // utf8_truncate
+
+#define ROOM_MAX 65536          // Rooms one server keeps (then empty ones are reused)
+#define ROOM_PER_USER_MAX 1024  // Rooms one connection may be in at once
+#define ROOM_SHARDS_MAX 64      // Event loops a RoomDirectory tells apart (one bit each)
+
+// Room 'id' and its name as a ROOM_JOINED frame, appended to 'out'.
+inline void encode_room(std::string& out, RoomFlags kind, uint32_t id, const std::string& name) {
+    char header[FRAME_HEADER_SIZE + ROOM_ID_SIZE];
+    write_frame_header(header, FRAME_ROOM, kind, (uint32_t)(ROOM_ID_SIZE + name.size()));
+    write_be(header + FRAME_HEADER_SIZE, id, ROOM_ID_SIZE);
+    out.append(header, sizeof(header));
+    out.append(name);
+}
+
+// The room a chat frame is for (0 = everyone, or too short to say).
+inline uint32_t chat_room(const Frame& frame) {
+    if (!(frame.flags & CHAT_ROOM) || !(frame.flags & CHAT_SENDER) || frame.length < SESSION_ID_SIZE + ROOM_ID_SIZE) return 0;
+    return (uint32_t)read_be(frame.payload + SESSION_ID_SIZE, ROOM_ID_SIZE);
+}
+
+// --- SERVER SIDE ---
+// Room names and IDs, and which event loops have members in each room.
+// Names are looked up under a mutex (only when somebody joins); the
+// membership bits are read without one, on every line for a room.
+class RoomDirectory {
+public:
+    RoomDirectory() : present(new std::atomic<uint64_t>[ROOM_MAX + 1]), generation(new std::atomic<uint32_t>[ROOM_MAX + 1]) {
+        for (size_t i = 0; i <= ROOM_MAX; i++) {
+            present[i].store(0, std::memory_order_relaxed);
+            generation[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // The ID of the room called 'name' (1, 2, ...), made if nobody asked
+    // for it before, for a user of loop 'shard' about to join it. Sets that
+    // loop's bit here, under the mutex, so the room can't be handed to
+    // another name before the user is in (clear it again if it doesn't join).
+    // With ROOM_MAX rooms already, a new name reuses a room nobody is in.
+    // 0 = every room has somebody in it.
+    uint32_t open(const std::string& name, int shard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t id;
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            id = it->second;
+        } else if (names.size() < ROOM_MAX) {
+            names.push_back(name);
+            id = (uint32_t)names.size();
+            ids[name] = id;
+        } else {
+            id = reclaim(name);
+            if (id == 0) return 0;
+        }
+        set_present(id, shard, true);
+        return id;
+    }
+
+    std::string name_of(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return id >= 1 && id <= names.size() ? names[id - 1] : std::string();
+    }
+
+    // Loop 'shard' now has (or no longer has) users in room 'id'. Each loop
+    // only changes its own bit.
+    void set_present(uint32_t id, int shard, bool members) {
+        uint64_t bit = (uint64_t)1 << shard;
+        if (members) present[id].fetch_or(bit, std::memory_order_release);
+        else present[id].fetch_and(~bit, std::memory_order_release);
+    }
+
+    // The loops with users in room 'id', one bit each.
+    uint64_t shards_in(uint32_t id) const { return present[id].load(std::memory_order_acquire); }
+
+    // How many times ID 'id' has been given to another room. A line posted
+    // to another loop carries it, and is dropped there if the room it was
+    // said in was emptied and reused on the way.
+    uint32_t generation_of(uint32_t id) const { return generation[id].load(std::memory_order_acquire); }
+
+    // Every room, as ROOM_JOINED frames, for a server taking over from this
+    // one (chat_handoff.h): its users' rooms must keep their IDs.
+    void save(std::string& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < names.size(); i++) encode_room(out, ROOM_JOINED, (uint32_t)(i + 1), names[i]);
+    }
+
+    // Learn every room save() wrote down, under the same IDs.
+    void load(const char* data, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Frame frame;
+        while (read_frame_at(data, length, frame)) {
+            if (frame.type == FRAME_ROOM && frame.length >= ROOM_ID_SIZE) {
+                uint32_t id = (uint32_t)read_be(frame.payload, ROOM_ID_SIZE);
+                if (id >= 1 && id <= ROOM_MAX) {
+                    if (names.size() < id) names.resize(id);
+                    names[id - 1].assign(frame.payload + ROOM_ID_SIZE, frame.length - ROOM_ID_SIZE);
+                    ids[names[id - 1]] = id;
+                }
+            }
+            data += frame.raw_length;
+            length -= frame.raw_length;
+        }
+    }
+
+private:
+    // Give the ID of a room nobody is in to room 'name'. Looks on from where
+    // the last search stopped, so rooms are reused in turn. Called with the
+    // mutex held; returns 0 if every room has members.
+    uint32_t reclaim(const std::string& name) {
+        for (size_t tried = 0; tried < names.size(); tried++) {
+            uint32_t id = (uint32_t)(reclaim_at % names.size()) + 1;
+            reclaim_at++;
+            if (present[id].load(std::memory_order_acquire) != 0) continue;
+            ids.erase(names[id - 1]);
+            names[id - 1] = name;
+            ids[name] = id;
+            generation[id].fetch_add(1, std::memory_order_release);
+            return id;
+        }
+        return 0;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> names;                 // names[id - 1]
+    size_t reclaim_at = 0;                          // Where reclaim() looks next
+    std::unique_ptr<std::atomic<uint64_t>[]> present; // present[id]: bit s = loop s has members
+    std::unique_ptr<std::atomic<uint32_t>[]> generation; // generation[id]: times the ID was reused
+};
+
+// --- CLIENT SIDE ---
+// A ROOM_JOIN frame for the room called 'name' (cut to ROOM_NAME_MAX bytes
+// on a character boundary: the server refuses names that aren't UTF-8).
+inline std::string room_join_frame(const std::string& name) {
+    return encode_frame(FRAME_ROOM, utf8_truncate(name, ROOM_NAME_MAX), ROOM_JOIN);
+}
+
+// A ROOM_LEAVE frame for room 'id'.
+inline std::string room_leave_frame(uint32_t id) {
+    char id_bytes[ROOM_ID_SIZE];
+    write_be(id_bytes, id, ROOM_ID_SIZE);
+    return encode_frame(FRAME_ROOM, std::string(id_bytes, ROOM_ID_SIZE), ROOM_LEAVE);
+}
+
+// Build a chat frame for 'text' in room 'room' in 'out' (reused between
+// messages, like build_chat_frame()).
+inline void build_room_chat_frame(std::string& out, uint32_t room, const char* text, size_t length) {
+    size_t fixed = SESSION_ID_SIZE + ROOM_ID_SIZE;
+    out.resize(FRAME_HEADER_SIZE + fixed + length);
+    write_frame_header(&out[0], FRAME_CHAT, CHAT_SENDER | CHAT_ROOM, (uint32_t)(fixed + length));
+    write_be(&out[FRAME_HEADER_SIZE], 0, SESSION_ID_SIZE);
+    write_be(&out[FRAME_HEADER_SIZE + SESSION_ID_SIZE], room, ROOM_ID_SIZE);
+    if (length) memcpy(&out[FRAME_HEADER_SIZE + fixed], text, length);
+}
+
+// The rooms a client is in, from the server's answers. The network loop
+// feeds it frames; 'current' (where typed lines go) may be read from
+// another thread.
+class RoomList {
+public:
+    std::atomic<uint32_t> current{0}; // The room typed lines go to (0 = everyone)
+
+    // Learn from a FRAME_ROOM frame. Returns a line worth showing the user,
+    // or "" if there is nothing to show. A room joined anew becomes current.
+    std::string apply(const Frame& frame) {
+        if (frame.type != FRAME_ROOM) return "";
+        if (frame.flags == ROOM_FAILED) return "Could not join #" + std::string(frame.payload, frame.length) + ".";
+        if (frame.length < ROOM_ID_SIZE) return "";
+        uint32_t id = (uint32_t)read_be(frame.payload, ROOM_ID_SIZE);
+        if (frame.flags == ROOM_JOINED) {
+            std::string name(frame.payload + ROOM_ID_SIZE, frame.length - ROOM_ID_SIZE);
+            for (auto it = names.begin(); it != names.end(); ++it) {
+                if (it->second != name) continue;
+                // Back in after a reconnect (under a new ID, if the server restarted).
+                if (it->first != id) {
+                    if (current == it->first) current = id;
+                    names.erase(it);
+                    names[id] = name;
+                }
+                return "";
+            }
+            names[id] = name;
+            current = id;
+            return "You are in #" + name + "; what you type goes there (/leave to talk to everyone).";
+        }
+        if (frame.flags == ROOM_LEFT) {
+            auto it = names.find(id);
+            if (it == names.end()) return "";
+            std::string name = it->second;
+            names.erase(it);
+            if (current == id) current = 0;
+            return "You left #" + name + ".";
+        }
+        return "";
+    }
+
+    // A room's chat frame as a line of text: "#games [alice]: hi".
+    std::string format(const Frame& frame, const Roster& roster) const {
+        auto it = names.find(chat_room(frame));
+        return "#" + (it != names.end() ? it->second : std::string("?")) + " " + roster.format(frame);
+    }
+
+    // ROOM_JOIN frames for every room we are in, appended to 'out' (to get
+    // back in after a reconnect).
+    void rejoin(std::string& out) const {
+        for (auto& pair : names) out += room_join_frame(pair.second);
+    }
+
+private:
+    std::unordered_map<uint32_t, std::string> names;
+};
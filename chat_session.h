@@ -0,0 +1,286 @@
+// --- SESSIONS AND THE ROSTER ---
+// A client says who it is ONCE, right after connecting (FRAME_HELLO with its
+// user name), and the server answers with a small number: its session ID
+// (FRAME_WELCOME). From then on every chat frame carries only those 4 bytes
+// instead of the name, and everyone keeps a "roster" that turns IDs back into
+// names. The server keeps the roster up to date with FRAME_PRESENCE frames:
+// the full list right after FRAME_WELCOME, then one frame whenever somebody
+// joins or leaves.
+//
+// The server writes the sender's ID into each chat frame itself, so nobody
+// can pretend to be somebody else, and it can count messages per sender.
+//
+// Session IDs never repeat, not even after a restart (old messages in the
+// history carry them): the server reserves them in blocks and writes the end
+// of the current block to a small file in the log folder. Servers linked
+// into one chat (chat_relay.h) put their node number in the top byte, so
+// their IDs never clash either, and learn each other's users from the
+// presence frames passed along the links. A server on its own has all 32
+// bits; a node has the low 24 (16.7 million IDs). Once they are used up,
+// new users are refused rather than given an old ID again.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "chat_frame.h"
+#include "chat_utf8.h"
+
+#define SESSION_ID_BLOCK 1024      // IDs reserved on disk at a time
+#define SESSION_OFFLINE_MAX 65536  // Users gone offline whose names are still kept
+
+// Append a FRAME_PRESENCE frame to 'out'.
+inline void encode_presence(std::string& out, PresenceFlags kind, uint32_t id, const std::string& name) {
+    char header[FRAME_HEADER_SIZE];
+    size_t name_length = kind == PRESENCE_LEAVE ? 0 : name.size();
+    write_frame_header(header, FRAME_PRESENCE, kind, (uint32_t)(SESSION_ID_SIZE + name_length));
+    out.append(header, FRAME_HEADER_SIZE);
+    char id_bytes[SESSION_ID_SIZE];
+    write_be(id_bytes, id, SESSION_ID_SIZE);
+    out.append(id_bytes, SESSION_ID_SIZE);
+    out.append(name.data(), name_length);
+}
+
+// Session ID of a CHAT_SENDER frame (0 = none or anonymous).
+inline uint32_t chat_sender(const Frame& frame) {
+    if (!(frame.flags & CHAT_SENDER) || frame.length < SESSION_ID_SIZE) return 0;
+    return (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+}
+
+// --- SERVER SIDE ---
+// Everyone online, and the last SESSION_OFFLINE_MAX users who left (their
+// names are still wanted for the history they wrote). Shared by all threads.
+// The online users are also kept in a set of their own, so a roster costs
+// the number of people online, not the number who ever were; older offline
+// users are forgotten, and their old lines show up under "#ID".
+class SessionDirectory {
+public:
+    // Keep the ID reservations in folder 'dir' ("" = start from 1 every run).
+    bool open(const std::string& dir) {
+        path = dir + "/sessions.next";
+        FILE* f = fopen(path.c_str(), "rb");
+        if (f) {
+            unsigned long long saved = 0;
+            if (fscanf(f, "%llu", &saved) == 1 && saved > next_id) next_id = saved;
+            fclose(f);
+        }
+        reserved_until = next_id;
+        return reserve();
+    }
+
+    // Give out IDs with 'node' in the top byte (0 = a server on its own).
+    void set_node(uint32_t node) {
+        prefix = node << 24;
+        last_id = node ? 0xFFFFFF : 0xFFFFFFFF;
+    }
+
+    // Register 'name' (trimmed to SESSION_NAME_MAX bytes, on a character
+    // boundary) and return its new ID, or 0 if every ID is used up.
+    uint32_t join(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next_id > last_id) return 0;
+        uint32_t id = prefix | (uint32_t)next_id++;
+        if (!path.empty() && next_id >= reserved_until) reserve();
+        Entry& entry = entries[id];
+        entry.name = utf8_truncate(name, SESSION_NAME_MAX);
+        if (entry.name.empty()) entry.name = "anonymous";
+        entry.online = true;
+        online.insert(id);
+        return id;
+    }
+
+    // Note a user of another node, from a presence frame it passed on.
+    void learn(uint32_t id, const std::string& name, bool online) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool known = entries.count(id) != 0;
+        Entry& entry = entries[id];
+        entry.name = utf8_truncate(name, SESSION_NAME_MAX);
+        if (online) {
+            entry.online = true;
+            this->online.insert(id);
+        } else if (!known || entry.online) {
+            went_offline(id, entry); // Newly offline (or newly heard of)
+        }
+    }
+
+    void leave(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it != entries.end() && it->second.online) went_offline(id, it->second);
+    }
+
+    std::string name_of(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        return it == entries.end() ? std::string() : it->second.name;
+    }
+
+    // Append a PRESENCE_ONLINE frame for everyone online except 'self' to 'out'.
+    void append_roster(std::string& out, uint32_t self) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t id : online) {
+            if (id != self) encode_presence(out, PRESENCE_ONLINE, id, entries[id].name);
+        }
+    }
+
+    // Append a PRESENCE_KNOWN frame for each of 'ids' that is known but offline
+    // (people who wrote old messages but are not here to be in the roster).
+    void append_known(std::string& out, const std::vector<uint32_t>& ids) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t id : ids) {
+            auto it = entries.find(id);
+            if (it != entries.end() && !it->second.online) encode_presence(out, PRESENCE_KNOWN, id, it->second.name);
+        }
+    }
+
+    // Everyone we know, as presence frames (PRESENCE_ONLINE or
+    // PRESENCE_KNOWN), for a server taking over from this one (chat_handoff.h).
+    // The offline ones go oldest first, so the new server forgets them in
+    // the same order.
+    void save(std::string& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t id : online) encode_presence(out, PRESENCE_ONLINE, id, entries[id].name);
+        for (uint32_t id : offline_order) {
+            auto it = entries.find(id);
+            if (it != entries.end() && !it->second.online) encode_presence(out, PRESENCE_KNOWN, id, it->second.name);
+        }
+    }
+
+    // Learn everyone save() wrote down. New IDs are given out above theirs.
+    void load(const char* data, size_t length) {
+        Frame frame;
+        while (read_frame_at(data, length, frame)) {
+            if (frame.type == FRAME_PRESENCE && frame.length >= SESSION_ID_SIZE) {
+                uint32_t id = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+                learn(id, std::string(frame.payload + SESSION_ID_SIZE, frame.length - SESSION_ID_SIZE),
+                      frame.flags == PRESENCE_ONLINE);
+                std::lock_guard<std::mutex> lock(mutex);
+                uint32_t number = prefix ? id & 0xFFFFFF : id; // Without the node byte
+                if ((prefix == 0 || (id & 0xFF000000u) == prefix) && number >= next_id) next_id = (uint64_t)number + 1;
+            }
+            data += frame.raw_length;
+            length -= frame.raw_length;
+        }
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        bool online = false;
+    };
+
+    // Mark 'entry' offline, and forget the oldest offline users beyond
+    // SESSION_OFFLINE_MAX. Called with the mutex held. (An ID can come back
+    // online if a linked node says so; it is only forgotten while offline.)
+    void went_offline(uint32_t id, Entry& entry) {
+        entry.online = false;
+        online.erase(id);
+        offline_order.push_back(id);
+        while (offline_order.size() > SESSION_OFFLINE_MAX) {
+            auto it = entries.find(offline_order.front());
+            if (it != entries.end() && !it->second.online) entries.erase(it);
+            offline_order.pop_front();
+        }
+    }
+
+    // Write down that IDs up to one more block are taken. Called with the
+    // mutex held (or before any other thread can see the directory).
+    bool reserve() {
+        reserved_until = next_id + SESSION_ID_BLOCK;
+        FILE* f = fopen(path.c_str(), "wb");
+        if (!f) return false;
+        fprintf(f, "%llu\n", (unsigned long long)reserved_until);
+        fclose(f);
+        return true;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<uint32_t, Entry> entries;
+    std::unordered_set<uint32_t> online;    // The IDs of the entries online
+    std::deque<uint32_t> offline_order;     // IDs in the order they went offline, oldest first
+    uint64_t next_id = 1;         // 0 means "no session"
+    uint64_t reserved_until = 1;  // IDs below this are written down as taken
+    uint32_t prefix = 0;          // Node number << 24
+    uint32_t last_id = 0xFFFFFFFF; // Highest number below the node byte
+    std::string path;             // The reservation file ("" = none)
+};
+
+// --- CLIENT SIDE ---
+// The client's copy of who is who.
+class Roster {
+public:
+    uint32_t self = 0; // Our own session ID, once the server has answered
+
+    // Learn from a FRAME_WELCOME or FRAME_PRESENCE frame. Returns a line worth
+    // showing the user ("alice joined"), or "" if there is nothing to show.
+    std::string apply(const Frame& frame) {
+        if (frame.length < SESSION_ID_SIZE) return "";
+        uint32_t id = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+        if (frame.type == FRAME_WELCOME) {
+            self = id;
+            return "";
+        }
+        if (frame.type != FRAME_PRESENCE) return "";
+        std::string name(frame.payload + SESSION_ID_SIZE, frame.length - SESSION_ID_SIZE);
+        switch (frame.flags) {
+        case PRESENCE_JOIN:
+            names[id] = name;
+            return name + " joined.";
+        case PRESENCE_LEAVE:
+            // Keep the name: their messages may still be on the way.
+            return names.count(id) ? names[id] + " left." : "";
+        default:
+            names[id] = name;
+            return "";
+        }
+    }
+
+    // The name behind a session ID ("#17" if we were never told).
+    std::string name_of(uint32_t id) const {
+        auto it = names.find(id);
+        return it != names.end() ? it->second : "#" + std::to_string(id);
+    }
+
+    // A chat frame as a line of text: "[alice]: hi" for stamped frames, the
+    // text as it is for frames from clients that don't use sessions. (A
+    // room's lines look the same: chat_room.h's RoomList names the room.)
+    std::string format(const Frame& frame) const {
+        if (!(frame.flags & CHAT_SENDER) || frame.length < SESSION_ID_SIZE) return std::string(frame.payload, frame.length);
+        uint32_t id = chat_sender(frame);
+        size_t skip = SESSION_ID_SIZE + (frame.flags & CHAT_ROOM ? ROOM_ID_SIZE : 0);
+        std::string text(frame.payload + std::min<size_t>(skip, frame.length), frame.length - std::min<size_t>(skip, frame.length));
+        return "[" + (id ? name_of(id) : std::string("anonymous")) + "]: " + text;
+    }
+
+private:
+    std::unordered_map<uint32_t, std::string> names;
+};
+
+// The hello frame that registers 'name' with the server (cut to what the
+// server keeps without splitting a character).
+inline std::string hello_frame(const std::string& name) {
+    return encode_frame(FRAME_HELLO, utf8_truncate(name, SESSION_NAME_MAX));
+}
+
+// Say hello: register 'name' with the server.
+inline bool send_hello(SOCKET sock, const std::string& name) {
+    std::string frame = hello_frame(name);
+    return send_all(sock, frame.data(), frame.size());
+}
+
+// Build a chat frame for 'text' in 'out' (reused between messages, so sending
+// costs no allocation once it is big enough). The sender ID is left zero for
+// the server to fill in.
+inline void build_chat_frame(std::string& out, const char* text, size_t length) {
+    out.resize(FRAME_HEADER_SIZE + SESSION_ID_SIZE + length);
+    write_frame_header(&out[0], FRAME_CHAT, CHAT_SENDER, (uint32_t)(SESSION_ID_SIZE + length));
+    write_be(&out[FRAME_HEADER_SIZE], 0, SESSION_ID_SIZE);
+    if (length) memcpy(&out[FRAME_HEADER_SIZE + SESSION_ID_SIZE], text, length);
+}
\ No newline at end of file
@@ -0,0 +1,400 @@
+// --- SHARED-MEMORY CHANNEL (local clients <-> server) ---
+// A client on the same machine as the server still starts with an ordinary
+// TCP connection, but right after connecting it asks to move to shared
+// memory. If the server agrees, it makes a small segment just for that
+// client holding two byte pipes, one per direction, and from then on the
+// frames travel through those pipes instead of the loopback TCP stack. The
+// frames themselves don't change at all: the same decoder reads them, so
+// sessions, history and everything else work exactly as over TCP.
+//
+// The switch, all on the TCP connection (FRAME_SHM frames):
+//   client  SHM_REQUEST   "I am on your machine"
+//   server  SHM_OFFER     the segment's name (or SHM_REFUSED: stay on TCP)
+//   client  SHM_ATTACHED  its LAST frame over TCP; everything after goes into the
+//                         'up' pipe (or SHM_DECLINED if it couldn't map the segment)
+//   server  SHM_READY     its LAST frame over TCP; everything after goes into 'down'
+//
+// After the switch the TCP connection stays open, for two jobs: when either
+// side goes away the other sees it close, and it is the DOORBELL. The server
+// sleeps in its poller like for any other user, so a client that writes into
+// an empty 'up' pipe also sends one byte over the socket to wake it. Only
+// when the server has asked for that (a flag in the pipe) - while the server
+// is busy reading, the client writes without any system call. The same flag
+// lets the server ask for a ring once the client has made room in a full
+// 'down' pipe. The client, being a simple blocking program, waits for the
+// server the way the shared-memory chat's readers do: it spins briefly, then
+// sleeps on a futex (Linux) or a named semaphore (Windows).
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "chat_frame.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>    // mmap, shm_open, shm_unlink
+#include <sys/stat.h>    // File permission bits
+#include <fcntl.h>       // O_CREAT, O_EXCL, O_RDWR
+#include <unistd.h>      // ftruncate, close
+#include <sys/syscall.h> // syscall(SYS_futex, ...)
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <time.h>        // timespec
+#endif
+
+#define SHM_CHANNEL_BYTES (256u * 1024) // Bytes each pipe can hold (a power of two)
+#define SHM_CHANNEL_MAGIC 0x43484331u   // "CHC1": marks a segment laid out like this
+#define SHM_CHANNEL_SPIN_MIN 64         // Fewest checks a waiting client makes before sleeping
+#define SHM_CHANNEL_SPIN_MAX 16384      // Most checks a waiting client makes before sleeping
+#define SHM_CHANNEL_CHECK_MS 250        // A sleeping client checks this often that the server is still there
+
+// The flags of a FRAME_SHM frame say which step of the switch it is.
+enum ShmFlags : uint16_t {
+    SHM_REQUEST = 0,  // Client: "can we use shared memory?" (no payload)
+    SHM_OFFER = 1,    // Server: "map this" (payload = segment name)
+    SHM_REFUSED = 2,  // Server: "no, stay on TCP"
+    SHM_ATTACHED = 3, // Client: "mapped; everything I send from now on is in the pipe"
+    SHM_DECLINED = 4, // Client: "couldn't map it; staying on TCP"
+    SHM_READY = 5     // Server: "everything I send from now on is in the pipe"
+};
+
+#define SHM_DOORBELL '!' // The byte sent over the socket to wake the other side
+
+// One direction: a ring of bytes that ONE process writes and ONE reads.
+// 'head' and 'tail' count bytes since the start and never wrap; the byte
+// at position p lives in data[p % SHM_CHANNEL_BYTES].
+struct ShmPipe {
+    alignas(64) std::atomic<uint64_t> head;      // Bytes the reader has taken (moved by the reader)
+    alignas(64) std::atomic<uint64_t> tail;      // Bytes the writer has put in (moved by the writer)
+    alignas(64) std::atomic<uint32_t> doorbell;  // 1 = the other side wants a ring after our next move
+    std::atomic<uint32_t> wake_word;             // Bumped after writes; a sleeping reader waits on it
+    std::atomic<uint32_t> sleeping;              // 1 while the reader is asleep in the kernel
+    alignas(64) char data[SHM_CHANNEL_BYTES];
+};
+
+// The whole segment. All-zero bytes are two empty pipes, so a freshly
+// created segment needs no setup beyond the magic number.
+struct ShmChannelLayout {
+    std::atomic<uint32_t> magic;  // SHM_CHANNEL_MAGIC
+    std::atomic<uint32_t> closed; // Set by the server when it hangs up
+    ShmPipe up;                   // Client -> server
+    ShmPipe down;                 // Server -> client
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the channel needs lock-free 64-bit atomics");
+
+// --- PIPE OPERATIONS ---
+// Copy up to 'length' bytes in (as many as fit). Returns how many.
+inline size_t shm_pipe_write(ShmPipe& pipe, const char* src, size_t length) {
+    uint64_t tail = pipe.tail.load(std::memory_order_relaxed);
+    size_t space = SHM_CHANNEL_BYTES - (size_t)(tail - pipe.head.load(std::memory_order_acquire));
+    if (length > space) length = space;
+    size_t at = (size_t)(tail % SHM_CHANNEL_BYTES);
+    size_t first = length < SHM_CHANNEL_BYTES - at ? length : SHM_CHANNEL_BYTES - at;
+    memcpy(pipe.data + at, src, first);
+    memcpy(pipe.data, src + first, length - first); // The part that wrapped around
+    pipe.tail.store(tail + length, std::memory_order_release);
+    return length;
+}
+
+// Copy up to 'max' waiting bytes out. Returns how many.
+inline size_t shm_pipe_read(ShmPipe& pipe, char* dst, size_t max) {
+    uint64_t head = pipe.head.load(std::memory_order_relaxed);
+    size_t length = (size_t)(pipe.tail.load(std::memory_order_acquire) - head);
+    if (length > max) length = max;
+    size_t at = (size_t)(head % SHM_CHANNEL_BYTES);
+    size_t first = length < SHM_CHANNEL_BYTES - at ? length : SHM_CHANNEL_BYTES - at;
+    memcpy(dst, pipe.data + at, first);
+    memcpy(dst + first, pipe.data, length - first);
+    pipe.head.store(head + length, std::memory_order_release);
+    return length;
+}
+
+inline size_t shm_pipe_waiting(const ShmPipe& pipe) {
+    return (size_t)(pipe.tail.load(std::memory_order_acquire) - pipe.head.load(std::memory_order_acquire));
+}
+
+inline size_t shm_pipe_space(const ShmPipe& pipe) { return SHM_CHANNEL_BYTES - shm_pipe_waiting(pipe); }
+
+// Ask the other side for a doorbell after its next move. The caller must
+// look at the pipe once more AFTER this: if the other side moved just
+// before, it didn't see the request.
+inline void shm_ask_doorbell(ShmPipe& pipe) {
+    pipe.doorbell.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Called after a move: did the other side ask for a doorbell? (Each request
+// is answered once.) The fence pairs with the one in shm_ask_doorbell(), so
+// of a move and a request made at the same time, at least one sees the other.
+inline bool shm_take_doorbell(ShmPipe& pipe) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return pipe.doorbell.load(std::memory_order_relaxed) && pipe.doorbell.exchange(0) == 1;
+}
+
+// --- MAPPING THE SEGMENT ---
+class ShmChannel {
+public:
+    ShmChannel() {}
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    ~ShmChannel() { close(); }
+
+    // Server: make a new, empty channel called 'name' (which must not exist).
+    bool create(const std::string& name) { return map(name, true); }
+
+    // Client: map the channel the server offered.
+    bool attach(const std::string& name) { return map(name, false); }
+
+#ifndef _WIN32
+    // Server: the segment's descriptor (kept open so it can be handed to a
+    // server taking over, chat_handoff.h), its name, and whether removing
+    // the name is still up to us (the client hasn't mapped it yet).
+    int descriptor() const { return segment_fd; }
+    const std::string& name() const { return segment_name; }
+    bool owns_name() const { return created; }
+
+    // Server: map a channel the previous server handed over. Takes 'handed'.
+    bool adopt(int handed, const std::string& name, bool owns_name) {
+        segment_name = name;
+        created = owns_name;
+        segment_fd = handed;
+        view = mmap(nullptr, sizeof(ShmChannelLayout), PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+        if (view == MAP_FAILED) view = nullptr;
+        return view && layout()->magic.load(std::memory_order_acquire) == SHM_CHANNEL_MAGIC;
+    }
+#endif
+
+    // Server: remove the name once the client has mapped the channel (or
+    // given up), so nothing is left behind if a process crashes later. The
+    // memory stays until both sides have let go of it.
+    void unlink() {
+#ifndef _WIN32
+        if (created && !segment_name.empty()) shm_unlink(segment_name.c_str());
+#endif
+        created = false;
+    }
+
+    void close() {
+        unlink();
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (wake) CloseHandle(wake);
+        mapping = NULL;
+        wake = NULL;
+#else
+        if (view) munmap(view, sizeof(ShmChannelLayout));
+        if (segment_fd >= 0) ::close(segment_fd);
+        segment_fd = -1;
+#endif
+        view = nullptr;
+    }
+
+    ShmChannelLayout* layout() const { return (ShmChannelLayout*)view; }
+    ShmPipe& up() const { return layout()->up; }
+    ShmPipe& down() const { return layout()->down; }
+
+    // Server: after writing into 'down', wake the client if it is asleep.
+    void wake_client() {
+        ShmPipe& pipe = down();
+        pipe.wake_word.fetch_add(1, std::memory_order_seq_cst);
+        if (pipe.sleeping.load(std::memory_order_seq_cst) == 0) return;
+#ifdef _WIN32
+        ReleaseSemaphore(wake, 1, NULL);
+#else
+        syscall(SYS_futex, &pipe.wake_word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+    // Server: tell the client we are gone, and wake it so it notices.
+    void hang_up() {
+        layout()->closed.store(1, std::memory_order_seq_cst);
+        wake_client();
+    }
+
+    // Client: sleep until the server bumps down's wake_word away from
+    // 'seen', or 'timeout_ms' passes. The caller must set 'sleeping' BEFORE
+    // reading 'seen' and looking at the pipe one last time.
+    void sleep(uint32_t seen, int timeout_ms) {
+#ifdef _WIN32
+        (void)seen;
+        WaitForSingleObject(wake, (DWORD)timeout_ms);
+#else
+        timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, &down().wake_word, FUTEX_WAIT, seen, &ts, nullptr, 0);
+#endif
+    }
+
+private:
+    bool map(const std::string& name, bool create_new) {
+        segment_name = name;
+#ifdef _WIN32
+        if (create_new) {
+            mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShmChannelLayout), name.c_str());
+            if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) return false; // Someone else's
+        } else {
+            mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        }
+        if (!mapping) return false;
+        view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmChannelLayout));
+        if (!view) return false;
+        wake = CreateSemaphoreA(NULL, 0, LONG_MAX, (name + "_wake").c_str()); // Opens it if it exists
+        if (!wake) return false;
+#else
+        // Only our own user may map it (0600), and never one that already exists.
+        int fd = shm_open(name.c_str(), create_new ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+        if (fd < 0) return false;
+        created = create_new;
+        struct stat st;
+        bool sized = create_new ? ftruncate(fd, sizeof(ShmChannelLayout)) == 0
+                                : fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ShmChannelLayout);
+        if (sized) view = mmap(nullptr, sizeof(ShmChannelLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (create_new) segment_fd = fd; // Kept for a hot restart (chat_handoff.h)
+        else ::close(fd);              // The mapping keeps the memory alive on its own
+        if (view == MAP_FAILED) view = nullptr;
+        if (!view) return false;
+#endif
+        if (create_new) layout()->magic.store(SHM_CHANNEL_MAGIC, std::memory_order_release);
+        return layout()->magic.load(std::memory_order_acquire) == SHM_CHANNEL_MAGIC;
+    }
+
+    void* view = nullptr;
+    std::string segment_name;
+    bool created = false; // We made the name and should remove it
+#ifdef _WIN32
+    HANDLE mapping = NULL;
+    HANDLE wake = NULL;   // Named semaphore the client sleeps on
+#else
+    int segment_fd = -1;  // Server: the segment, see descriptor()
+#endif
+};
+
+// --- CLIENT SIDE ---
+// The client's end of its connection to the server: TCP at first, shared
+// memory in both directions once the switch above is done. One thread may
+// receive while others send.
+class ServerConnection {
+public:
+    explicit ServerConnection(SOCKET s = INVALID_SOCKET) : sock(s) {}
+
+    SOCKET socket() const { return sock; }
+    bool local() const { return down_ready; } // Both directions on shared memory?
+
+    // Ask to switch to shared memory, if the server is on this machine.
+    // Returns false if it isn't (we just stay on TCP).
+    bool request_shm() {
+        if (!same_host(sock)) return false;
+        char header[FRAME_HEADER_SIZE];
+        write_frame_header(header, FRAME_SHM, SHM_REQUEST, 0);
+        return send(header, sizeof(header));
+    }
+
+    // Send bytes (whole frames) to the server, over whichever way is current.
+    bool send(const char* data, size_t length) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        if (!up_ready) return send_all(sock, data, length);
+        ShmPipe& pipe = channel->up();
+        while (true) {
+            size_t n = shm_pipe_write(pipe, data, length);
+            data += n;
+            length -= n;
+            if (n > 0 && shm_take_doorbell(pipe) && !ring()) return false;
+            if (length == 0) return true;
+            // Full: the server is behind. Give it a moment.
+            if (channel->layout()->closed.load(std::memory_order_relaxed)) return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    bool send(const std::string& frames) { return send(frames.data(), frames.size()); }
+
+    // Block until at least one more chunk arrives and feed it to the decoder
+    // (the receiving thread only). Returns false if the connection closed.
+    bool receive(FrameDecoder& decoder) {
+        if (!down_ready) return recv_into(sock, decoder);
+        ShmPipe& pipe = channel->down();
+        while (true) {
+            char* dst = decoder.write_ptr();
+            size_t n = shm_pipe_read(pipe, dst, decoder.write_space());
+            if (n > 0) {
+                decoder.commit(n);
+                if (shm_take_doorbell(pipe) && !ring()) return false; // The server waits for room
+                return true;
+            }
+            if (!wait()) return false;
+        }
+    }
+
+    // Deal with a FRAME_SHM frame the receiving thread got (the switch), or
+    // a heartbeat ping. Returns true if 'frame' was one of those; it is not
+    // for the user either way.
+    bool handle(const Frame& frame) {
+        if (frame.type == FRAME_HEARTBEAT) {
+            char header[FRAME_HEADER_SIZE];
+            write_frame_header(header, FRAME_HEARTBEAT, HEARTBEAT_PONG, 0);
+            if (frame.flags == HEARTBEAT_PING) send(header, sizeof(header));
+            return true;
+        }
+        if (frame.type != FRAME_SHM) return false;
+        if (frame.flags == SHM_OFFER && !channel) {
+            std::unique_ptr<ShmChannel> mapped(new ShmChannel());
+            bool ok = mapped->attach(std::string(frame.payload, frame.length));
+            char header[FRAME_HEADER_SIZE];
+            write_frame_header(header, FRAME_SHM, ok ? SHM_ATTACHED : SHM_DECLINED, 0);
+            std::lock_guard<std::mutex> lock(send_mutex); // Nothing may go out between these two steps
+            send_all(sock, header, sizeof(header));
+            if (ok) {
+                channel = std::move(mapped);
+                up_ready = true;
+            }
+        } else if (frame.flags == SHM_READY && channel) {
+            down_ready = true; // Nothing more will come over TCP
+        }
+        return true;
+    }
+
+private:
+    // Wake the server: one byte over the socket.
+    bool ring() {
+        char bell = SHM_DOORBELL;
+        return ::send(sock, &bell, 1, 0) == 1;
+    }
+
+    // Wait for the server to write into 'down': spin briefly (a busy server's
+    // next frame is usually microseconds away), then sleep. Returns false if
+    // the server has gone.
+    bool wait() {
+        ShmPipe& pipe = channel->down();
+        for (unsigned i = 0; i < spin_budget; i++) {
+            if (shm_pipe_waiting(pipe) > 0) {
+                if (spin_budget < SHM_CHANNEL_SPIN_MAX) spin_budget *= 2;
+                return true;
+            }
+            if ((i & 63) == 63) std::this_thread::yield();
+        }
+        if (spin_budget > SHM_CHANNEL_SPIN_MIN) spin_budget /= 2;
+
+        pipe.sleeping.store(1, std::memory_order_seq_cst);
+        uint32_t seen = pipe.wake_word.load(std::memory_order_seq_cst);
+        if (shm_pipe_waiting(pipe) == 0 && !channel->layout()->closed.load()) channel->sleep(seen, SHM_CHANNEL_CHECK_MS);
+        pipe.sleeping.store(0, std::memory_order_seq_cst);
+        if (shm_pipe_waiting(pipe) > 0) return true;
+        return !channel->layout()->closed.load() && !peer_closed(sock); // A server that crashed never says so
+    }
+
+    SOCKET sock;
+    std::mutex send_mutex;               // Senders take turns, and the switch happens between two sends
+    std::unique_ptr<ShmChannel> channel; // Set once the segment is mapped
+    std::atomic<bool> up_ready{false};   // We send through the 'up' pipe
+    std::atomic<bool> down_ready{false}; // We receive through the 'down' pipe
+    unsigned spin_budget = SHM_CHANNEL_SPIN_MIN;
+};
\ No newline at end of file
@@ -0,0 +1,319 @@
+// --- SHARED-MEMORY MESSAGE RING ---
+// The shared-memory chat used to keep exactly ONE message in RAM: every
+// writer overwrote it, so a reader that looked away for a moment missed
+// messages without knowing. Now the segment holds a ring of message slots:
+//
+//   - A writer claims the next slot by bumping an atomic counter (no lock,
+//     many writers at once are fine), fills it in, then stamps it with the
+//     message's sequence number to say "ready".
+//   - Every reader keeps its own cursor (the next sequence number it wants)
+//     and reads slots in order.
+//   - If writers lap a slow reader, the reader notices the newer stamp and
+//     is told exactly how many messages it lost.
+//   - A reader with nothing to do spins briefly, then sleeps in the kernel
+//     until a writer wakes it (futex on Linux, a named semaphore on Windows).
+//
+// Backends: CreateFileMapping/MapViewOfFile on Windows, shm_open/mmap on Linux.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>   // mmap, shm_open
+#include <sys/stat.h>   // File permission bits
+#include <fcntl.h>      // O_CREAT, O_RDWR
+#include <unistd.h>     // ftruncate, close
+#include <sys/syscall.h> // syscall(SYS_futex, ...)
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <time.h>       // timespec
+#endif
+
+#define SHM_RING_SLOTS 1024        // Messages the ring remembers (power of two)
+#define SHM_SENDER_SIZE 50         // Max bytes in a sender name (incl. terminator)
+#define SHM_MESSAGE_SIZE 256       // Max bytes in a message (incl. terminator)
+#define SHM_RING_MAGIC 0x43485232u // "CHR2": marks a segment laid out like this
+#define SHM_SPIN_MIN 64            // Fewest checks a reader makes before sleeping
+#define SHM_SPIN_MAX 16384         // Most checks a reader makes before sleeping
+
+// One message slot. Each slot starts on its own 64-byte cache line so two
+// writers filling neighbouring slots don't slow each other down.
+//
+// 'stamp' says what the slot holds: for message number n it is 2n+1 while
+// the writer is filling it in and 2n+2 once it is ready. 0 means "never used".
+struct alignas(64) ShmSlot {
+    std::atomic<uint64_t> stamp;
+    uint32_t length;                 // Bytes used in 'message'
+    char sender[SHM_SENDER_SIZE];
+    char message[SHM_MESSAGE_SIZE];
+};
+
+// The whole shared segment. All-zero bytes are a valid empty ring, so a
+// freshly created segment needs no setup.
+struct ShmRing {
+    alignas(64) std::atomic<uint32_t> magic;     // SHM_RING_MAGIC once someone has attached
+    alignas(64) std::atomic<uint64_t> next;      // Sequence number the next writer will claim
+    alignas(64) std::atomic<uint32_t> wake_word; // Bumped after every message; sleepers wait on it
+    std::atomic<uint32_t> sleepers;              // Readers currently asleep in the kernel
+    ShmSlot slots[SHM_RING_SLOTS];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock-free 64-bit atomics");
+
+// --- WRITING ---
+// Add a message to the ring. Text that does not fit is cut short, between
+// two UTF-8 characters.
+// Returns the message's sequence number. This does NOT wake sleeping
+// readers; ShmSegment::publish() below does both.
+inline uint64_t shm_publish(ShmRing* ring, const char* sender, const char* text, size_t length) {
+    uint64_t n = ring->next.fetch_add(1, std::memory_order_relaxed); // Claim message number n
+    ShmSlot& slot = ring->slots[n % SHM_RING_SLOTS];
+
+    // Take the slot over from whatever it held before (message n - SLOTS).
+    uint64_t current = slot.stamp.load(std::memory_order_relaxed);
+    while (true) {
+        if (current >= 2 * n + 1) return n; // Lapped already by a newer writer: nothing to do
+        if (current & 1) {                  // Another writer is still filling it in: wait
+            current = slot.stamp.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (slot.stamp.compare_exchange_weak(current, 2 * n + 1, std::memory_order_acquire)) break;
+    }
+
+    if (length > SHM_MESSAGE_SIZE - 1) {
+        length = SHM_MESSAGE_SIZE - 1;
+        while (length > 0 && ((unsigned char)text[length] & 0xC0) == 0x80) length--; // Not inside a character
+    }
+    strncpy(slot.sender, sender, SHM_SENDER_SIZE - 1);
+    slot.sender[SHM_SENDER_SIZE - 1] = '\0';
+    memcpy(slot.message, text, length);
+    slot.message[length] = '\0';
+    slot.length = (uint32_t)length;
+
+    slot.stamp.store(2 * n + 2, std::memory_order_release); // Ready!
+    return n;
+}
+
+// The segment for chat room 'room': 'base' with the room's name after it
+// ("" = 'base' itself, the room everybody is in). Only the copies of the
+// program that open the same room share a ring. A segment name can't hold
+// every byte, so anything but letters, digits, '-' and '_' is written in hex.
+inline std::string shm_room_name(const std::string& base, const std::string& room) {
+    if (room.empty()) return base;
+    static const char digits[] = "0123456789abcdef";
+    std::string name = base + "_";
+    for (unsigned char c : room) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            name += (char)c;
+        } else {
+            name += '%';
+            name += digits[c >> 4];
+            name += digits[c & 15];
+        }
+    }
+    return name;
+}
+
+// --- MAPPING THE SEGMENT ---
+// Create the named segment (or open it if another process already did) and
+// map it into this process.
+class ShmSegment {
+public:
+    ~ShmSegment() { close(); }
+
+    bool open(const std::string& name) {
+#ifdef _WIN32
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShmRing), name.c_str());
+        if (!mapping) return false;
+        view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmRing));
+#else
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0) return false;
+        // Grow the segment to full size (new segments are zero-filled).
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(ShmRing) && ftruncate(fd, sizeof(ShmRing)) != 0)) {
+            ::close(fd);
+            return false;
+        }
+        view = mmap(nullptr, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd); // The mapping keeps the memory alive on its own
+        if (view == MAP_FAILED) view = nullptr;
+#endif
+        if (!view) return false;
+
+        // Claim an empty segment for our layout, or check that it already uses it.
+        uint32_t expected = 0;
+        ring()->magic.compare_exchange_strong(expected, SHM_RING_MAGIC);
+        if (ring()->magic.load() != SHM_RING_MAGIC) return false;
+
+#ifdef _WIN32
+        // Sleeping readers wait on this. Writers release one count per sleeper.
+        wake = CreateSemaphoreA(NULL, 0, LONG_MAX, (name + "_wake").c_str());
+        if (!wake) return false;
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        if (wake) CloseHandle(wake);
+        mapping = NULL;
+        wake = NULL;
+#else
+        if (view) munmap(view, sizeof(ShmRing));
+#endif
+        view = nullptr;
+    }
+
+    ShmRing* ring() const { return (ShmRing*)view; }
+
+    // Add a message, then wake any reader that is asleep waiting for one.
+    uint64_t publish(const char* sender, const char* text, size_t length) {
+        uint64_t n = shm_publish(ring(), sender, text, length);
+        ring()->wake_word.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t sleeping = ring()->sleepers.load(std::memory_order_seq_cst);
+        if (sleeping > 0) {
+#ifdef _WIN32
+            ReleaseSemaphore(wake, (LONG)sleeping, NULL);
+#else
+            syscall(SYS_futex, &ring()->wake_word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        }
+        return n;
+    }
+
+    uint64_t publish(const std::string& sender, const std::string& text) {
+        return publish(sender.c_str(), text.data(), text.size());
+    }
+
+    // Sleep in the kernel until a writer bumps wake_word away from 'seen', or
+    // 'timeout_ms' passes (-1 = no limit). The caller must count itself in
+    // 'sleepers' BEFORE reading 'seen' and checking the ring one last time,
+    // so a writer can never slip a message in unnoticed.
+    void sleep(uint32_t seen, int timeout_ms) {
+#ifdef _WIN32
+        (void)seen;
+        WaitForSingleObject(wake, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+#else
+        timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        // FUTEX_WAIT returns at once if wake_word is no longer 'seen'.
+        syscall(SYS_futex, &ring()->wake_word, FUTEX_WAIT, seen, timeout_ms < 0 ? nullptr : &ts, nullptr, 0);
+#endif
+    }
+
+private:
+    void* view = nullptr;
+#ifdef _WIN32
+    HANDLE mapping = NULL;
+    HANDLE wake = NULL; // Named semaphore that sleeping readers wait on
+#endif
+};
+
+// --- READING ---
+// A private copy of one message, taken out of the ring.
+struct ShmMessage {
+    uint64_t sequence;
+    uint32_t length;
+    char sender[SHM_SENDER_SIZE];
+    char message[SHM_MESSAGE_SIZE];
+};
+
+enum ShmReadStatus {
+    SHM_READ_OK,      // 'out' holds the next message
+    SHM_READ_EMPTY,   // Nothing new yet
+    SHM_READ_OVERRUN  // Writers lapped us: 'lost' messages were skipped, try again
+};
+
+// One reader's position in the ring. Every process (or thread) that wants to
+// see all messages has its own.
+class ShmReader {
+public:
+    // Start at the current end of the ring, or 'replay' messages before it
+    // so a newcomer sees some of what was said before they joined. The ring
+    // only remembers SHM_RING_SLOTS messages, so that is the most it can replay.
+    explicit ShmReader(ShmRing* r, uint64_t replay = 0) : ring(r), cursor(r->next.load(std::memory_order_acquire)) {
+        if (replay > SHM_RING_SLOTS) replay = SHM_RING_SLOTS;
+        cursor -= replay < cursor ? replay : cursor;
+    }
+
+    uint64_t position() const { return cursor; }
+    unsigned long long lost = 0; // Total messages this reader has missed so far
+    uint64_t last_gap = 0;       // How many messages the most recent overrun skipped
+
+    // Would read() return something other than SHM_READ_EMPTY right now?
+    bool has_message() const {
+        uint64_t stamp = ring->slots[cursor % SHM_RING_SLOTS].stamp.load(std::memory_order_acquire);
+        return stamp >= 2 * cursor + 2 || ring->next.load(std::memory_order_relaxed) - cursor > SHM_RING_SLOTS;
+    }
+
+    // Block until has_message() or until 'timeout_ms' passes (-1 = no limit).
+    // First spins for a short while, because under a burst the next message
+    // is usually only microseconds away; then sleeps in the kernel. The spin
+    // budget adapts: it doubles when spinning paid off and halves when it didn't.
+    bool wait(ShmSegment& segment, int timeout_ms = -1) {
+        for (unsigned i = 0; i < spin_budget; i++) {
+            if (has_message()) {
+                if (spin_budget < SHM_SPIN_MAX) spin_budget *= 2;
+                return true;
+            }
+            if ((i & 63) == 63) std::this_thread::yield();
+        }
+        if (spin_budget > SHM_SPIN_MIN) spin_budget /= 2;
+
+        // Count ourselves as a sleeper FIRST, then look one last time.
+        ring->sleepers.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seen = ring->wake_word.load(std::memory_order_seq_cst);
+        if (!has_message()) segment.sleep(seen, timeout_ms);
+        ring->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+        return has_message();
+    }
+
+    ShmReadStatus read(ShmMessage& out) {
+        ShmSlot& slot = ring->slots[cursor % SHM_RING_SLOTS];
+        uint64_t ready = 2 * cursor + 2;
+        uint64_t before = slot.stamp.load(std::memory_order_acquire);
+        if (before < ready) {
+            // Not written yet (or still being written) - unless writers have
+            // already gone a whole lap past it, in which case it never will be.
+            if (ring->next.load(std::memory_order_relaxed) - cursor <= SHM_RING_SLOTS) return SHM_READ_EMPTY;
+        } else if (before == ready) {
+            // Copy it out, then check nobody started overwriting it meanwhile.
+            out.length = slot.length;
+            if (out.length > SHM_MESSAGE_SIZE - 1) out.length = SHM_MESSAGE_SIZE - 1;
+            memcpy(out.sender, slot.sender, SHM_SENDER_SIZE);
+            memcpy(out.message, slot.message, out.length);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.stamp.load(std::memory_order_relaxed) == ready) {
+                out.sender[SHM_SENDER_SIZE - 1] = '\0';
+                out.message[out.length] = '\0';
+                out.sequence = cursor++;
+                return SHM_READ_OK;
+            }
+        }
+
+        // The slot now holds a newer message: we were lapped. Jump to the
+        // oldest message that is still safe to read and report the gap.
+        uint64_t newest = ring->next.load(std::memory_order_acquire);
+        uint64_t oldest = newest > SHM_RING_SLOTS / 2 ? newest - SHM_RING_SLOTS / 2 : 0;
+        if (oldest <= cursor) oldest = cursor + 1;
+        lost += oldest - cursor;
+        last_gap = oldest - cursor;
+        cursor = oldest;
+        return SHM_READ_OVERRUN;
+    }
+
+private:
+    ShmRing* ring;
+    uint64_t cursor;                     // Sequence number of the next message we want
+    unsigned spin_budget = SHM_SPIN_MIN; // How many checks wait() makes before sleeping
+};
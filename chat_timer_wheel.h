@@ -0,0 +1,164 @@
+// --- HIERARCHICAL TIMER WHEEL ---
+// Timers for many connections at once (heartbeats and idle timeouts, one
+// per connection) without a sorted structure that costs O(log n) per
+// change. Time is cut into ticks of WHEEL_TICK_MS. The first level is a
+// ring of 256 slots, one per tick; each higher level is a ring of 64 slots
+// that each cover a whole turn of the level below. A timer is put in the
+// slot for its due tick on the lowest level that reaches that far, so:
+//   - schedule() and cancel() are O(1): a timer is a node in its slot's
+//     doubly linked list, and the node lives inside its owner (no
+//     allocation, and 100,000 connections are 100,000 nodes, not 100,000
+//     entries in a tree).
+//   - advance() visits one first-level slot per tick. Every 256 ticks the
+//     next slot up is emptied and its timers are spread over the level
+//     below ("cascading"), so a timer moves at most once per level.
+// Four levels reach 256 * 64^3 ticks, about 77 days at 100 ms; later timers
+// are kept at that limit. Not thread-safe: each event loop has its own.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define WHEEL_TICK_MS 100   // Resolution of the wheel
+#define WHEEL_ROOT_BITS 8   // First level: 256 slots
+#define WHEEL_LEVEL_BITS 6  // Higher levels: 64 slots each
+#define WHEEL_LEVELS 4
+
+// One timer. Embed it in whatever it is for and point 'owner' back at that.
+struct WheelTimer {
+    WheelTimer* prev = nullptr; // Neighbours in its slot (nullptr = not scheduled)
+    WheelTimer* next = nullptr;
+    uint64_t due = 0;           // The tick it fires on
+    int level = 0;              // Which level its slot is on
+    void* owner = nullptr;
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+class TimerWheel {
+public:
+    TimerWheel() {
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            slots[level].resize(slot_count(level));
+            for (WheelTimer& head : slots[level]) head.prev = head.next = &head; // Empty ring
+        }
+    }
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Start counting from 'now_ms' (any clock in milliseconds). Call once, empty.
+    void start(long long now_ms) { current = (uint64_t)now_ms / WHEEL_TICK_MS; }
+
+    // Fire 't' at 'due_ms' (rounded up to a tick; at the latest in the next
+    // one if that is already past). A scheduled timer is moved.
+    void schedule(WheelTimer& t, long long due_ms) {
+        cancel(t);
+        uint64_t due = due_ms <= 0 ? 0 : ((uint64_t)due_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        t.due = due > current ? due : current + 1;
+        place(t);
+        count[t.level]++;
+    }
+
+    void cancel(WheelTimer& t) {
+        if (!t.scheduled()) return;
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.prev = t.next = nullptr;
+        count[t.level]--;
+    }
+
+    // Move time on to 'now_ms' and append every timer that is due to
+    // 'expired' (they are no longer scheduled; schedule them again to repeat).
+    void advance(long long now_ms, std::vector<WheelTimer*>& expired) {
+        uint64_t target = (uint64_t)now_ms / WHEEL_TICK_MS;
+        if (size() == 0 && target > current) current = target; // Nothing to step through
+        while (current < target) {
+            current++;
+            size_t index = current & root_mask();
+            if (index == 0) cascade(1);
+            count[0] -= take(slots[0][index], expired);
+        }
+    }
+
+    // When advance() next has something to do (ms), or -1 if no timer is set.
+    long long next_due_ms() const {
+        if (size() == 0) return -1;
+        // The first level covers the next 256 ticks; past the end of its
+        // turn, timers come down from the levels above.
+        uint64_t turn_end = (current | root_mask()) + 1;
+        for (uint64_t tick = current + 1; tick <= current + root_mask() + 1; tick++) {
+            if (tick == turn_end && size() > count[0]) return (long long)(tick * WHEEL_TICK_MS);
+            const WheelTimer& head = slots[0][tick & root_mask()];
+            if (head.next != &head) return (long long)(tick * WHEEL_TICK_MS);
+        }
+        return (long long)(turn_end * WHEEL_TICK_MS);
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (int level = 0; level < WHEEL_LEVELS; level++) total += count[level];
+        return total;
+    }
+
+private:
+    static size_t slot_count(int level) { return (size_t)1 << (level == 0 ? WHEEL_ROOT_BITS : WHEEL_LEVEL_BITS); }
+    static uint64_t root_mask() { return ((uint64_t)1 << WHEEL_ROOT_BITS) - 1; }
+    static int shift(int level) { return level == 0 ? 0 : WHEEL_ROOT_BITS + (level - 1) * WHEEL_LEVEL_BITS; }
+
+    // Link 't' into the slot for its due tick, on the lowest level that reaches it.
+    void place(WheelTimer& t) {
+        uint64_t limit = ((uint64_t)1 << shift(WHEEL_LEVELS)) - 1;
+        if (t.due - current > limit) t.due = current + limit; // As late as we can reach
+        uint64_t delta = t.due - current;
+        int level = 0;
+        while (level + 1 < WHEEL_LEVELS && delta >= ((uint64_t)1 << shift(level + 1))) level++;
+        size_t index = (size_t)(t.due >> shift(level)) & (slot_count(level) - 1);
+        WheelTimer& head = slots[level][index];
+        t.level = level;
+        t.prev = head.prev;
+        t.next = &head;
+        head.prev->next = &t;
+        head.prev = &t;
+    }
+
+    // Empty this turn's slot on 'level' into the levels below (after the
+    // level above has refilled it, if this slot starts a new turn there too).
+    void cascade(int level) {
+        size_t index = (size_t)(current >> shift(level)) & (slot_count(level) - 1);
+        if (index == 0 && level + 1 < WHEEL_LEVELS) cascade(level + 1);
+        WheelTimer& head = slots[level][index];
+        if (head.next == &head) return;
+        // Cut the chain off the slot first (place() may link into it again),
+        // then walk it: no list of the timers, so no allocation.
+        WheelTimer* t = head.next;
+        head.prev->next = nullptr;
+        head.prev = head.next = &head;
+        while (t) {
+            WheelTimer* next = t->next;
+            count[level]--;
+            place(*t);
+            count[t->level]++;
+            t = next;
+        }
+    }
+
+    // Unlink every timer in a slot and append them to 'out'.
+    static size_t take(WheelTimer& head, std::vector<WheelTimer*>& out) {
+        size_t n = 0;
+        WheelTimer* t = head.next;
+        while (t != &head) {
+            WheelTimer* next = t->next;
+            t->prev = t->next = nullptr;
+            out.push_back(t);
+            t = next;
+            n++;
+        }
+        head.prev = head.next = &head;
+        return n;
+    }
+
+    std::vector<WheelTimer> slots[WHEEL_LEVELS]; // Each slot is the list head of a ring
+    size_t count[WHEEL_LEVELS] = {};             // Timers on each level
+    uint64_t current = 0;                        // The last tick advance() handled
+};
\ No newline at end of file
@@ -0,0 +1,288 @@
+// --- IO_URING (Linux only) ---
+// io_uring lets a program hand the kernel a whole batch of I/O requests
+// through two rings of shared memory, and pick up the results the same way,
+// with ONE system call for the lot (often none at all). The server can use it
+// instead of epoll + recv + send (run it with --io uring):
+//
+//   - one "multishot" accept request keeps accepting new users until cancelled,
+//   - one multishot recv request per user keeps receiving until cancelled,
+//     each time into a buffer the kernel takes from a "provided buffer ring"
+//     (a shared pool, so idle users don't each need their own buffer),
+//   - all sends of one event-loop tick are submitted together.
+//
+// This is a small hand-written wrapper over the raw system calls, so no extra
+// library is needed. uring_supported() checks at startup that the running
+// kernel has every feature we use (kernel 6.0 or newer); if not, the server
+// falls back to epoll.
+#pragma once
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT   // Headers new enough for everything below
+#define CHAT_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#ifdef CHAT_HAVE_URING
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <poll.h>         // POLLIN
+#include <sys/mman.h>     // Mapping the rings
+#include <sys/socket.h>   // socketpair (for the startup check)
+#include <sys/syscall.h>  // syscall(__NR_io_uring_*)
+#include <time.h>         // __kernel_timespec
+#include <unistd.h>
+
+class IoUring {
+public:
+    ~IoUring() {
+        if (buf_ring) munmap(buf_ring, buf_ring_bytes);
+        delete[] buf_base;
+        if (sqes) munmap(sqes, sqes_bytes);
+        if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_bytes);
+        if (sq_ptr) munmap(sq_ptr, sq_bytes);
+        if (fd >= 0) close(fd);
+    }
+
+    // Create the rings. Returns false (with 'error' set) if the kernel can't.
+    bool init(unsigned entries, std::string& error) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4; // Multishot requests can post many results each
+        fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            error = std::string("io_uring_setup: ") + strerror(errno);
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+            error = "kernel too old (needs IORING_FEAT_EXT_ARG and IORING_FEAT_NODROP)";
+            return false;
+        }
+
+        // Map the submission ring, the completion ring and the request array.
+        sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sq_bytes = cq_bytes = sq_bytes > cq_bytes ? sq_bytes : cq_bytes;
+        sq_ptr = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) { sq_ptr = nullptr; error = "mmap of the submission ring failed"; return false; }
+        cq_ptr = sq_ptr;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            cq_ptr = mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) { cq_ptr = nullptr; error = "mmap of the completion ring failed"; return false; }
+        }
+        sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) { error = "mmap of the request array failed"; return false; }
+        sqes = (io_uring_sqe*)s;
+
+        char* sq = (char*)sq_ptr;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        local_tail = *sq_tail;
+        char* cq = (char*)cq_ptr;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Register 'count' (a power of two) buffers of 'size' bytes as buffer group 'group'.
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size, std::string& error) {
+        buf_count = count;
+        buf_size = size;
+        buf_ring_bytes = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, buf_ring_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) { error = "mmap of the buffer ring failed"; return false; }
+        buf_ring = (io_uring_buf_ring*)ring;
+        buf_base = new char[(size_t)count * size];
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            error = std::string("registering the buffer ring: ") + strerror(errno);
+            return false;
+        }
+        for (unsigned i = 0; i < count; i++) recycle_buffer((uint16_t)i);
+        publish_buffers();
+        return true;
+    }
+
+    char* buffer(uint16_t id) { return buf_base + (size_t)id * buf_size; }
+
+    // Give a buffer back to the kernel (takes effect at publish_buffers()).
+    void recycle_buffer(uint16_t id) {
+        // Entry 0 starts at the ring itself (its last field doubles as the tail).
+        // Not buf_ring->bufs[]: compiled as C++, the kernel header puts that 8 bytes too far.
+        io_uring_buf& b = ((io_uring_buf*)buf_ring)[buf_tail & (buf_count - 1)];
+        b.addr = (uint64_t)(uintptr_t)buffer(id);
+        b.len = buf_size;
+        b.bid = id;
+        buf_tail++;
+    }
+
+    void publish_buffers() { __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE); }
+
+    // A blank request to fill in, or nullptr if the submission ring is full
+    // (call submit() and try again).
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries) return nullptr;
+        unsigned index = local_tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        local_tail++;
+        return sqe;
+    }
+
+    // Hand every request filled in so far to the kernel, and wait until at
+    // least 'wait_nr' results are ready or 'timeout_ms' passes (-1 = no limit).
+    int submit(unsigned wait_nr = 0, int timeout_ms = -1) {
+        unsigned to_submit = local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned flags = 0;
+        io_uring_getevents_arg arg;
+        __kernel_timespec ts;
+        if (wait_nr > 0) {
+            flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+            memset(&arg, 0, sizeof(arg));
+            if (timeout_ms >= 0) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+            }
+        }
+        int ret = (int)syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+                               wait_nr > 0 ? (void*)&arg : nullptr, sizeof(arg));
+        if (ret < 0 && (errno == ETIME || errno == EINTR)) return 0; // Timed out / interrupted: fine
+        return ret;
+    }
+
+    // Call f(cqe) for every result that is ready, then release them. Returns how many.
+    template <class F>
+    unsigned for_each_completion(F f) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned seen = 0;
+        for (; head != tail; head++, seen++) f(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+private:
+    int fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_bytes = 0, cq_bytes = 0, sqes_bytes = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned local_tail = 0;   // Requests filled in, submitted or not
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    io_uring_buf_ring* buf_ring = nullptr;
+    size_t buf_ring_bytes = 0;
+    char* buf_base = nullptr;
+    unsigned buf_count = 0, buf_size = 0;
+    uint16_t buf_tail = 0;
+};
+
+// --- REQUEST HELPERS ---
+
+inline void uring_prep_multishot_accept(io_uring_sqe* sqe, int listener, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+// Receive into buffers from group 'group', over and over, until cancelled.
+inline void uring_prep_multishot_recv(io_uring_sqe* sqe, int sock, uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+inline void uring_prep_sendmsg(io_uring_sqe* sqe, int sock, const msghdr* msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+// Tell us every time 'fd' becomes readable, until cancelled.
+inline void uring_prep_multishot_poll(io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+// Stop the request that was submitted with 'target' as its user_data.
+inline void uring_prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+// Does this kernel do everything the io_uring backend needs? Sets up a tiny
+// ring with a buffer group, starts a multishot recv on a socket pair and
+// checks that a byte arrives through it with "more to come" set.
+inline bool uring_supported(std::string& error) {
+    IoUring ring;
+    if (!ring.init(8, error) || !ring.setup_buffers(0, 2, 64, error)) return false;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        error = "socketpair failed";
+        return false;
+    }
+    uring_prep_multishot_recv(ring.get_sqe(), pair[0], 0, 1);
+    bool ok = write(pair[1], "x", 1) == 1 && ring.submit(1, 1000) >= 0;
+    bool more = false;
+    int result = 0;
+    ring.for_each_completion([&](const io_uring_cqe& cqe) {
+        result = cqe.res;
+        more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    });
+    close(pair[0]);
+    close(pair[1]);
+    if (!ok || result != 1 || !more) {
+        error = result < 0 ? std::string("multishot recv: ") + strerror(-result) : "multishot recv not supported";
+        return false;
+    }
+    return true;
+}
+
+#else
+
+#include <string>
+
+// Not Linux, or kernel headers too old: the io_uring backend is never used.
+inline bool uring_supported(std::string& error) {
+    error = "not built with io_uring support";
+    return false;
+}
+
+#endif
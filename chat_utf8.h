@@ -0,0 +1,425 @@
+// --- UTF-8 CHECKING AND CONVERSION ---
+// Chat text travels as UTF-8. The server checks every chat line and name
+// before passing it on (utf8_valid), so a client can trust what it shows;
+// the Windows GUIs convert it to and from the UTF-16 that Win32 wants
+// (utf8_to_wide, wide_to_utf8) instead of copying byte by byte, which
+// mangled anything that wasn't English.
+//
+// Well-formed UTF-8 (Unicode, table 3-7) is:
+//   00-7F
+//   C2-DF 80-BF
+//   E0 A0-BF 80-BF   E1-EC 80-BF 80-BF   ED 80-9F 80-BF   EE-EF 80-BF 80-BF
+//   F0 90-BF 80-BF 80-BF   F1-F3 80-BF 80-BF 80-BF   F4 80-8F 80-BF 80-BF
+// so no overlong forms (C0 80 for NUL), no surrogates (ED A0 80) and nothing
+// past U+10FFFF.
+//
+// Three validators, picked once at start-up by what the CPU has:
+//   - scalar: eight bytes at a time while they are ASCII, then one character
+//     at a time (any CPU);
+//   - SSE2: sixteen bytes at a time while they are ASCII, characters one by
+//     one only where there is something else (every x86-64 CPU);
+//   - AVX2: 32 bytes at a time whatever they hold, with the table lookups of
+//     Keiser and Lemire ("Validating UTF-8 in less than one instruction per
+//     byte", 2021): three 16-entry tables classify each byte by its high
+//     nibble, the high nibble of the byte before it and that byte's low
+//     nibble, and AND-ing the three leaves a bit set only where two bytes
+//     can't follow each other.
+// Chat lines are short and mostly ASCII, where SSE2 and AVX2 are close; AVX2
+// pulls ahead on other scripts (see win_utf8_bench.cpp).
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHAT_UTF8_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h> // __cpuidex, _BitScanForward
+#define CHAT_TARGET_AVX2
+#else
+#define CHAT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#define UTF8_REPLACEMENT 0xFFFD // Shown for bytes that aren't UTF-8
+
+// How long the well-formed character at 'p' is (1-4), with 'left' bytes to
+// go; 0 if it is not one.
+inline size_t utf8_char_length(const unsigned char* p, size_t left) {
+    unsigned char b = p[0];
+    if (b < 0x80) return 1;
+    if (b < 0xC2) return 0; // A continuation byte, or the lead of an overlong pair
+    if (b < 0xE0) return left >= 2 && (p[1] & 0xC0) == 0x80 ? 2 : 0;
+    if (b < 0xF0) {
+        if (left < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) return 0;
+        if (b == 0xE0 && p[1] < 0xA0) return 0; // Overlong
+        if (b == 0xED && p[1] > 0x9F) return 0; // A surrogate
+        return 3;
+    }
+    if (b > 0xF4 || left < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) return 0;
+    if (b == 0xF0 && p[1] < 0x90) return 0; // Overlong
+    if (b == 0xF4 && p[1] > 0x8F) return 0; // Past U+10FFFF
+    return 4;
+}
+
+// The code point of a well-formed character of 'n' bytes (utf8_char_length).
+inline uint32_t utf8_decode(const unsigned char* p, size_t n) {
+    switch (n) {
+    case 1: return p[0];
+    case 2: return ((uint32_t)(p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+    case 3: return ((uint32_t)(p[0] & 0x0F) << 12) | ((uint32_t)(p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+    default: return ((uint32_t)(p[0] & 0x07) << 18) | ((uint32_t)(p[1] & 0x3F) << 12) | ((uint32_t)(p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+    }
+}
+
+// Write 'c' as UTF-8 at 'out' (up to 4 bytes); returns how many.
+inline size_t utf8_encode(uint32_t c, char* out) {
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xC0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xE0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+inline bool utf8_valid_scalar(const char* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    size_t i = 0;
+    while (i < length) {
+        if (i + 8 <= length) {
+            uint64_t word;
+            memcpy(&word, p + i, 8);
+            if ((word & 0x8080808080808080ULL) == 0) { // Eight ASCII bytes
+                i += 8;
+                continue;
+            }
+        }
+        size_t n = utf8_char_length(p + i, length - i);
+        if (n == 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+#ifdef CHAT_UTF8_X86
+// Index of the lowest set bit ('mask' is not 0).
+inline unsigned utf8_lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+inline bool utf8_valid_sse2(const char* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    size_t i = 0;
+    while (i + 16 <= length) {
+        unsigned high = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+        if (high == 0) { // Sixteen ASCII bytes
+            i += 16;
+            continue;
+        }
+        // Skip the ASCII before the first other byte, then check characters
+        // up to the end of the block (the last may run past it).
+        size_t end = i + 16;
+        i += utf8_lowest_bit(high);
+        while (i < end) {
+            size_t n = utf8_char_length(p + i, length - i);
+            if (n == 0) return false;
+            i += n;
+        }
+    }
+    return utf8_valid_scalar(data + i, length - i);
+}
+
+// The error bits of Keiser and Lemire's tables: which two bytes in a row
+// (the one before, then this one) can't be.
+#define UTF8_TOO_SHORT  (1 << 0) // A lead, then no continuation
+#define UTF8_TOO_LONG   (1 << 1) // ASCII, then a continuation
+#define UTF8_OVERLONG_3 (1 << 2) // E0 80-9F
+#define UTF8_TOO_LARGE  (1 << 3) // F4 90-BF, F5-FF 80-BF
+#define UTF8_SURROGATE  (1 << 4) // ED A0-BF
+#define UTF8_OVERLONG_2 (1 << 5) // C0-C1 80-BF
+#define UTF8_TOO_LARGE_1000 (1 << 6) // F5-FF 80-8F
+#define UTF8_OVERLONG_4 (1 << 6)     // F0 80-8F (same bit: both only with 1000____ after)
+#define UTF8_TWO_CONTS  (1 << 7) // Two continuations: fine only as byte 3 or 4
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS) // Errors that don't depend on the low nibble
+
+// 'input' shifted up by 'n' bytes, the last 'n' bytes of 'previous' coming in at the bottom.
+#define UTF8_PREV(input, previous, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - (n))
+
+// One 32-byte block (its bytes following 'previous'): the bits left set are errors.
+CHAT_TARGET_AVX2 inline __m256i utf8_block_errors_avx2(__m256i input, __m256i previous) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, // 0___
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,                                                      // 10__
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,                                                                                   // 1100
+        UTF8_TOO_SHORT,                                                                                                     // 1101
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,                                                                  // 1110
+        (char)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),                                    // 1111
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        (char)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4));
+    const char large = (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4), // ____0000
+        (char)(UTF8_CARRY | UTF8_OVERLONG_2),                                     // ____0001
+        (char)UTF8_CARRY, (char)UTF8_CARRY,                                       // ____001_
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE),                                      // ____0100
+        large, large, large,                                                      // ____0101 - ____0111
+        large, large, large, large, large,                                        // ____1000 - ____1100
+        (char)(large | UTF8_SURROGATE),                                           // ____1101
+        large, large,
+        (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+        (char)(UTF8_CARRY | UTF8_OVERLONG_2),
+        (char)UTF8_CARRY, (char)UTF8_CARRY,
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE),
+        large, large, large,
+        large, large, large, large, large,
+        (char)(large | UTF8_SURROGATE),
+        large, large);
+    const char cont_1000 = (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const char cont_1001 = (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE);
+    const char cont_101 = (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, // 0___
+        cont_1000, cont_1001, cont_101, cont_101,                                                                                        // 10__
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,                                                                  // 11__
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        cont_1000, cont_1001, cont_101, cont_101,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+    __m256i prev1 = UTF8_PREV(input, previous, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Two continuations in a row are right exactly where the byte two back
+    // leads three or more bytes, or the byte three back leads four.
+    __m256i third = _mm256_subs_epu8(UTF8_PREV(input, previous, 2), _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(UTF8_PREV(input, previous, 3), _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_be_cont = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_be_cont, special);
+}
+
+// Set where a block's last three bytes start a character it doesn't finish.
+CHAT_TARGET_AVX2 inline __m256i utf8_incomplete_avx2(__m256i input) {
+    const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm256_subs_epu8(input, max);
+}
+
+CHAT_TARGET_AVX2 inline bool utf8_valid_avx2(const char* data, size_t length) {
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i*)(data + i));
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, incomplete); // ASCII can't finish what the last block began
+            incomplete = _mm256_setzero_si256();
+        } else {
+            error = _mm256_or_si256(error, utf8_block_errors_avx2(input, previous));
+            incomplete = utf8_incomplete_avx2(input);
+        }
+        previous = input;
+    }
+    if (!_mm256_testz_si256(error, error)) return false;
+    if (i == length) return _mm256_testz_si256(incomplete, incomplete) != 0;
+    // Less than a block left: check it with SSE2, from the start of the
+    // last character the blocks may have left unfinished.
+    size_t from = i;
+    for (size_t back = 1; back <= 3 && back <= i; back++) {
+        if ((unsigned char)data[i - back] >= 0xC0) {
+            from = i - back;
+            break;
+        }
+    }
+    return utf8_valid_sse2(data + from, length - from);
+}
+
+inline bool utf8_have_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6; // OSXSAVE, and the OS keeps YMM state
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Is this well-formed UTF-8? Uses the fastest validator the CPU has.
+inline bool utf8_valid(const char* data, size_t length) {
+#ifdef CHAT_UTF8_X86
+    static const bool avx2 = utf8_have_avx2();
+    return avx2 ? utf8_valid_avx2(data, length) : utf8_valid_sse2(data, length);
+#else
+    return utf8_valid_scalar(data, length);
+#endif
+}
+
+// How many of the first 'max' bytes of 'data' to keep so that a cut there
+// doesn't split a character: cutting a name at byte 32 could leave half of
+// one behind, which is no longer UTF-8 (and the server hangs up on that).
+inline size_t utf8_prefix_length(const char* data, size_t length, size_t max) {
+    if (length <= max) return length;
+    size_t n = max;
+    while (n > 0 && ((unsigned char)data[n] & 0xC0) == 0x80) n--; // Back to the start of the cut character
+    return n;
+}
+
+// 'text' cut to at most 'max' bytes, on a character boundary.
+inline std::string utf8_truncate(const std::string& text, size_t max) {
+    return text.substr(0, utf8_prefix_length(text.data(), text.size(), max));
+}
+
+// Write code point 'c' as one or two UTF-16 units; returns how many.
+template <class Unit>
+size_t utf16_put(uint32_t c, Unit* out) {
+    if (c < 0x10000) {
+        out[0] = (Unit)c;
+        return 1;
+    }
+    out[0] = (Unit)(0xD800 + ((c - 0x10000) >> 10));
+    out[1] = (Unit)(0xDC00 + (c & 0x3FF));
+    return 2;
+}
+
+// Decode UTF-8 into UTF-16 units at 'out' (char16_t, or wchar_t on Windows),
+// which needs room for 'length' units. A byte that doesn't start a
+// well-formed character becomes one U+FFFD. Returns the units written.
+// With SSE2, sixteen bytes are widened at once and as many of them count as
+// were ASCII; the character after them is decoded on its own.
+template <class Unit>
+size_t utf8_to_utf16(const char* data, size_t length, Unit* out) {
+    const unsigned char* p = (const unsigned char*)data;
+    Unit* o = out;
+    size_t i = 0;
+    while (i < length) {
+#ifdef CHAT_UTF8_X86
+        if (sizeof(Unit) == 2 && i + 16 <= length) {
+            // (Sixteen units fit: there are at least sixteen bytes to go.)
+            __m128i block = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i zero = _mm_setzero_si128();
+            _mm_storeu_si128((__m128i*)o, _mm_unpacklo_epi8(block, zero));
+            _mm_storeu_si128((__m128i*)(o + 8), _mm_unpackhi_epi8(block, zero));
+            unsigned high = (unsigned)_mm_movemask_epi8(block);
+            size_t ascii = high == 0 ? 16 : utf8_lowest_bit(high);
+            i += ascii;
+            o += ascii;
+            if (high == 0) continue;
+        }
+#endif
+        size_t n = utf8_char_length(p + i, length - i);
+        if (n == 0) {
+            *o++ = (Unit)UTF8_REPLACEMENT;
+            i++;
+            continue;
+        }
+        uint32_t c = utf8_decode(p + i, n);
+        if (c >= 0x10000) {
+            *o++ = (Unit)(0xD800 + ((c - 0x10000) >> 10));
+            *o++ = (Unit)(0xDC00 + (c & 0x3FF));
+        } else {
+            *o++ = (Unit)c;
+        }
+        i += n;
+    }
+    return (size_t)(o - out);
+}
+
+// Encode UTF-16 units as UTF-8 at 'out', which needs room for 3 bytes per
+// unit. A surrogate without its other half becomes U+FFFD. Returns the bytes
+// written. With SSE2, eight units are narrowed at once and as many of them
+// count as were ASCII.
+template <class Unit>
+size_t utf16_to_utf8(const Unit* data, size_t length, char* out) {
+    char* o = out;
+    size_t i = 0;
+    while (i < length) {
+#ifdef CHAT_UTF8_X86
+        if (sizeof(Unit) == 2 && i + 8 <= length) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+            __m128i wide = _mm_and_si128(block, _mm_set1_epi16((short)0xFF80));
+            _mm_storel_epi64((__m128i*)o, _mm_packus_epi16(block, block));
+            unsigned other = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(wide, _mm_setzero_si128())) & 0xFFFF; // Two bits per unit
+            size_t ascii = other == 0 ? 8 : utf8_lowest_bit(other) / 2;
+            i += ascii;
+            o += ascii;
+            if (other == 0) continue;
+        }
+#endif
+        uint32_t c = (uint32_t)data[i++] & 0xFFFF;
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            uint32_t low = i < length ? (uint32_t)data[i] & 0xFFFF : 0;
+            if (c <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            } else {
+                c = UTF8_REPLACEMENT;
+            }
+        }
+        o += utf8_encode(c, o);
+    }
+    return (size_t)(o - out);
+}
+
+inline std::u16string utf8_to_utf16(const std::string& text) {
+    std::u16string out(text.size(), u'\0');
+    out.resize(utf8_to_utf16(text.data(), text.size(), &out[0]));
+    return out;
+}
+
+inline std::string utf16_to_utf8(const std::u16string& text) {
+    std::string out(text.size() * 3, '\0');
+    out.resize(utf16_to_utf8(text.data(), text.size(), &out[0]));
+    return out;
+}
+
+#ifdef _WIN32
+// Win32's wide strings are UTF-16.
+inline std::wstring utf8_to_wide(const std::string& text) {
+    std::wstring out(text.size(), L'\0');
+    out.resize(utf8_to_utf16(text.data(), text.size(), &out[0]));
+    return out;
+}
+
+inline std::string wide_to_utf8(const std::wstring& text) {
+    std::string out(text.size() * 3, '\0');
+    out.resize(utf16_to_utf8(text.data(), text.size(), &out[0]));
+    return out;
+}
+#endif
@@ -0,0 +1,183 @@
+// --- BOT BENCHMARK ---
+// How many chat sessions can ONE client process keep going with the
+// coroutine client library (chat_client.h)? This tool runs --bots sessions
+// against a running server, all on one thread and one EventLoop; each bot
+// is two coroutines, no thread of its own.
+//   1. Setup: every bot connects and says hello at once. Reports how long
+//      until each got its FRAME_WELCOME (p50 / p99 / max).
+//   2. Chat: once everyone is in, each bot sends --messages chat lines,
+//      one every --interval-ms (spread out, so they don't all send at the
+//      same moment). Each line carries the time it was sent, and every
+//      other bot checks how long it took to arrive.
+// Reports the delivery latency (p50 / p99 / max), how many of the expected
+// deliveries arrived (the server may drop some for a bot that can't keep
+// up, see --slow-policy), and the CPU time this process used per 1000
+// deliveries. Returns 1 if the bots couldn't get in or deliveries are
+// still missing --timeout seconds after the last send.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <algorithm>
+#include "chat_client.h"
+#include "chat_session.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int bots = 1000;          // Sessions in this one process
+    int messages = 5;         // Chat lines each bot sends
+    int interval_ms = 1000;   // Time between one bot's lines
+    int timeout_sec = 30;     // Give up on a step after this long
+};
+
+// What all bots add up together (there is one thread: no atomics needed).
+struct Totals {
+    int connected = 0;        // Connections that came up
+    int failed = 0;           // ...or didn't
+    int welcomed = 0;         // Bots that got their session ID
+    int done_sending = 0;     // Bots that sent all their lines (or gave up)
+    long long sent = 0;       // Chat lines sent
+    long long delivered = 0;  // Chat lines that reached another bot
+    long long start = 0;      // When the bots started (ns)
+    Histogram setup_ns;       // Start until each bot's welcome
+    Histogram latency_ns;     // Send until arrival, per delivery
+};
+
+struct Bot {
+    int index;
+    ChatClient client;
+    Bot(int index, EventLoop& loop) : index(index), client(loop) {}
+};
+
+// A bot's reader: counts the welcome and every line from the other bots.
+static Task<void> read_frames(Bot& bot, Totals& totals) {
+    Frame frame;
+    uint32_t self = 0;
+    while (co_await bot.client.next(frame)) {
+        if (frame.type == FRAME_WELCOME && frame.length >= SESSION_ID_SIZE) {
+            self = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+            totals.welcomed++;
+            totals.setup_ns.record((uint64_t)(now_ns() - totals.start));
+            continue;
+        }
+        if (frame.type != FRAME_CHAT || frame.length != SESSION_ID_SIZE + 16 || chat_sender(frame) == self) continue;
+        long long sent_at = (long long)read_hex(frame.payload + SESSION_ID_SIZE, 16);
+        totals.latency_ns.record((uint64_t)(now_ns() - sent_at));
+        totals.delivered++;
+    }
+}
+
+// A bot: connect, say hello, wait until everyone is in, then chat.
+static Task<void> run_bot(Bot& bot, EventLoop& loop, const Options& opt, Totals& totals) {
+    bool connected = co_await bot.client.connect(opt.host, opt.port);
+    if (!connected) {
+        totals.failed++;
+        totals.done_sending++;
+        co_return;
+    }
+    totals.connected++;
+    co_await bot.client.send(hello_frame("bot" + std::to_string(bot.index)));
+    read_frames(bot, totals).detach();
+    // Everyone should hear every line, so nobody talks before all are in.
+    while (totals.welcomed + totals.failed < opt.bots) {
+        if (!bot.client.is_open()) break;
+        co_await loop.sleep(10);
+    }
+    // Bots take turns across the interval instead of all sending at once.
+    co_await loop.sleep((int)((long long)opt.interval_ms * bot.index / opt.bots));
+    std::string frame;
+    char stamp[16]; // The time it was sent, in hex (chat lines are text)
+    for (int i = 0; i < opt.messages && bot.client.is_open(); i++) {
+        if (i > 0) co_await loop.sleep(opt.interval_ms);
+        write_hex(stamp, (uint64_t)now_ns(), 16);
+        build_chat_frame(frame, stamp, sizeof(stamp));
+        bool sent = co_await bot.client.send(frame);
+        if (sent) totals.sent++;
+    }
+    totals.done_sending++;
+}
+
+// One more turn of the loop.
+static Task<void> settle(EventLoop& loop) {
+    co_await loop.sleep(1);
+}
+
+// The whole run. Returns false if it didn't finish in time.
+static Task<bool> run_bench(EventLoop& loop, const Options& opt, std::vector<std::unique_ptr<Bot>>& bots, Totals& totals) {
+    totals.start = now_ns();
+    for (auto& bot : bots) run_bot(*bot, loop, opt, totals).detach();
+
+    long long deadline = totals.start + opt.timeout_sec * 1000000000LL;
+    while (totals.welcomed + totals.failed < opt.bots && now_ns() < deadline) co_await loop.sleep(5);
+    const Histogram& s = totals.setup_ns;
+    std::cout << "setup: " << totals.welcomed << " of " << opt.bots << " bots in after " << s.max() / 1e6
+              << " ms  (p50 " << s.percentile(0.50) / 1e6 << " ms, p99 " << s.percentile(0.99) / 1e6 << " ms)\n";
+    if (totals.welcomed < opt.bots) {
+        std::cerr << totals.failed << " bots could not connect; " << opt.bots - totals.welcomed - totals.failed
+                  << " got no welcome within " << opt.timeout_sec << " s.\n";
+        co_return false;
+    }
+
+    std::clock_t cpu_start = std::clock();
+    deadline = now_ns() + ((long long)opt.messages * opt.interval_ms / 1000 + opt.timeout_sec) * 1000000000LL;
+    while (totals.done_sending < opt.bots && now_ns() < deadline) co_await loop.sleep(5);
+    // Every line should reach every other bot.
+    long long expected = totals.sent * (opt.bots - 1);
+    deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while (totals.delivered < expected && now_ns() < deadline) co_await loop.sleep(5);
+    double cpu_sec = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    const Histogram& l = totals.latency_ns;
+    std::cout << "chat:  " << totals.sent << " lines sent, " << totals.delivered << " of " << expected << " deliveries arrived\n"
+              << "       latency p50 " << l.percentile(0.50) / 1e3 << " us, p99 " << l.percentile(0.99) / 1e3
+              << " us, max " << l.max() / 1e3 << " us\n"
+              << "       client CPU " << cpu_sec << " s (" << (totals.delivered ? cpu_sec * 1e6 / totals.delivered * 1000 : 0)
+              << " us per 1000 deliveries), one thread\n";
+    co_return totals.delivered >= expected;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") opt.host = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--bots") opt.bots = std::max(2, std::stoi(argv[++i]));
+        else if (arg == "--messages") opt.messages = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--interval-ms") opt.interval_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: bot_bench.exe [--host IP] [--port N] [--bots N] [--messages N]\n"
+                      << "                     [--interval-ms N] [--timeout SECONDS]\n";
+            return 1;
+        }
+    }
+    if (!net_startup()) return 1;
+    raise_fd_limit(); // One socket per bot
+    bool ok;
+    {
+        EventLoop loop;
+        std::vector<std::unique_ptr<Bot>> bots;
+        for (int i = 0; i < opt.bots; i++) bots.emplace_back(new Bot(i, loop));
+        Totals totals;
+        ok = loop.run_until_done(run_bench(loop, opt, bots, totals));
+        for (auto& bot : bots) bot->client.close();
+        loop.run_until_done(settle(loop)); // Let the readers see the close and finish
+    }
+    net_cleanup();
+    return ok ? 0 : 1;
+}
\ No newline at end of file
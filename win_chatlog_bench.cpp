@@ -0,0 +1,131 @@
+// --- CHAT LOG MODEL BENCHMARK ---
+// Runs the GUI's chat log model (chat_log_model.h) without any window:
+//   - a "receive" thread appends --rate lines per second of --size bytes,
+//   - a "window" thread waits to be told, like the GUI waits for its posted
+//     message, then waits out the frame delay, takes the update and applies
+//     it to a plain string standing in for the EDIT control.
+// It reports how many redraws that took, how long appends and redraws took
+// (p50 / p99 / max), and how big the "window" got. At the end it checks that
+// the window shows exactly the lines the model holds; if not, it says so and
+// returns 1.
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include "chat_log_model.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Stands in for PostMessage(): wakes the window thread.
+std::mutex post_mutex;
+std::condition_variable post_cv;
+bool posted = false;
+std::atomic<bool> producing(true);
+
+static void post_redraw() {
+    std::lock_guard<std::mutex> lock(post_mutex);
+    posted = true;
+    post_cv.notify_one();
+}
+
+int main(int argc, char* argv[]) {
+    long long rate = 100000;  // Lines per second
+    double seconds = 5;
+    size_t size = 64;         // Bytes per line, "\r\n" included
+    size_t max_lines = CHAT_LOG_LINES;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--rate") rate = std::max(1LL, std::stoll(argv[++i]));
+        else if (arg == "--seconds") seconds = std::stod(argv[++i]);
+        else if (arg == "--size") size = std::max((size_t)3, (size_t)std::stoul(argv[++i]));
+        else if (arg == "--lines") max_lines = std::stoul(argv[++i]);
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    ChatLogModel model(max_lines);
+    Histogram append_ns;   // Recorded by the receive thread only
+    Histogram redraw_ns;   // Recorded by the window thread only
+    std::string window;    // What the EDIT control would show
+    size_t largest_window = 0;
+    uint64_t redraws = 0;
+    uint64_t lines_drawn = 0;
+
+    // The window thread: one redraw per posted message, at most one per frame.
+    std::thread ui([&]() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(post_mutex);
+                post_cv.wait(lock, [] { return posted || !producing.load(); });
+                if (!posted && !producing.load()) return;
+                posted = false;
+            }
+            int delay = model.redraw_delay_ms();
+            if (delay > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+            long long start = now_ns();
+            const ChatLogUpdate& update = model.take();
+            if (update.replace) window = update.text;
+            else window.erase(0, update.drop).append(update.text);
+            redraw_ns.record((uint64_t)(now_ns() - start));
+            redraws++;
+            lines_drawn += update.lines;
+            largest_window = std::max(largest_window, window.size());
+        }
+    });
+
+    // The receive thread (this one): lines arrive in 1 ms batches at the given rate.
+    std::string line(size, 'x');
+    line[size - 2] = '\r';
+    line[size - 1] = '\n';
+    long long total = (long long)(rate * seconds);
+    long long start = now_ns();
+    for (long long sent = 0; sent < total; ) {
+        long long due = std::min(total, (long long)((now_ns() - start) / 1e9 * rate) + 1);
+        for (; sent < due; sent++) {
+            std::string number = std::to_string(sent);
+            memcpy(&line[0], number.data(), std::min(number.size(), size - 2)); // Make lines tell apart
+            long long t = now_ns();
+            bool ask = model.append(line);
+            append_ns.record((uint64_t)(now_ns() - t));
+            if (ask) post_redraw();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Let the window catch up with the last lines, then stop it.
+    std::this_thread::sleep_for(std::chrono::milliseconds(CHAT_LOG_FRAME_MS * 3));
+    producing = false;
+    post_cv.notify_one();
+    ui.join();
+
+    bool ok = window == model.text();
+    std::cout << "Appended " << total << " lines in " << elapsed << " s (" << (long long)(total / elapsed) << " lines/s)\n";
+    std::cout << "Redraws: " << redraws << " (" << (long long)(redraws / elapsed) << "/s), "
+              << (redraws ? lines_drawn / redraws : 0) << " lines each on average\n";
+    std::cout << "Append: p50 " << append_ns.percentile(0.50) << " ns, p99 " << append_ns.percentile(0.99)
+              << " ns, max " << append_ns.max() << " ns\n";
+    std::cout << "Redraw: p50 " << redraw_ns.percentile(0.50) / 1000.0 << " us, p99 " << redraw_ns.percentile(0.99) / 1000.0
+              << " us, max " << redraw_ns.max() / 1000.0 << " us\n";
+    std::cout << "Window: " << window.size() << " chars (largest " << largest_window << ")\n";
+    std::cout << "Check: " << (ok ? "window matches the model" : "WINDOW DOES NOT MATCH THE MODEL") << "\n";
+    return ok ? 0 : 1;
+}
\ No newline at end of file
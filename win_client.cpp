@@ -1,80 +1,235 @@
 #include <iostream>     // For printing
 #include <string>       // For text
-#include <thread>       // For running receive and send at same time
-#include <winsock2.h>   // Windows Networking
-#include <ws2tcpip.h>   // Helper for converting IP addresses
-
-#pragma comment(lib, "ws2_32.lib") // Link Winsock library
+#include <thread>       // For running the network loop while we wait for the keyboard
+#include <cstdlib>      // For system()
+#include "chat_net.h"   // Windows Networking (Winsock) or Linux sockets
+#include "chat_frame.h" // Length-prefixed message frames
+#include "chat_session.h" // Session IDs and who is who
+#include "chat_client.h" // Connecting, sending and receiving (shared memory too, when the server is on this machine)
+#include "chat_files.h" // Sending and fetching attachments
+#include "chat_direct.h" // Messages for one user
+#include "chat_room.h"   // Rooms
+#include <atomic>       // For the "upload running" and "online" flags
+#include <algorithm>    // For std::min
+#include <chrono>       // For the time the connection dropped
 
 #define PORT 60000
+#define HISTORY_ON_JOIN 20 // How many earlier messages to show when we join
+#define RECONNECT_MAX_MS 30000 // Longest wait between two tries to get back in
 
-// Thread function: Listens for incoming messages from server
-void listen_for_messages(SOCKET sock) {
-    char buffer[1024];
-    while (true) {
-        ZeroMemory(buffer, 1024); // Clear buffer
-        
-        // Wait to receive data
-        int bytes_received = recv(sock, buffer, 1024, 0);
-        
-        // If connection lost
-        if (bytes_received <= 0) {
-            std::cout << "\nDisconnected from server.\n";
-            break;
+RoomList rooms; // The rooms we are in (the keyboard thread reads rooms.current)
+
+// Connect and say who we are. If the server is on this machine, ask to
+// talk over shared memory instead of TCP; everything else works the same
+// either way. Coming back after a drop, the server sends only what we missed,
+// and we go back into our rooms.
+Task<bool> join(ChatClient& client, std::string username, bool first) {
+    bool connected = co_await client.connect("10.223.0.249", PORT);
+    if (!connected) co_return false;
+// if andrew server (10.223.0.249)
+// if Bevnoty server (10.223.0.8)
+    client.request_shm();
+    client.request_resume();
+    // Tell the server who we are, then catch up on what was said before we arrived.
+    co_await client.send(hello_frame(username));
+    if (first) co_await client.send(history_request(HISTORY_LAST, HISTORY_ON_JOIN));
+    std::string rejoin;
+    rooms.rejoin(rejoin);
+    if (!rejoin.empty()) co_await client.send(rejoin);
+    co_return true;
+}
+
+bool leaving = false;             // We hung up ourselves (set on the loop's thread)
+std::atomic<bool> online(false);  // Connected and said hello (the keyboard thread checks it)
+int64_t lost_at_ms = 0;           // When the connection last dropped (Unix time; 0 = it never did)
+
+// Coroutine: prints incoming messages until the connection is gone. It runs
+// on the network loop's thread, while main() waits for the keyboard.
+Task<void> listen_for_messages(ChatClient& client, Roster& roster, FileReceiver& files) {
+    Frame frame;
+    std::string reply;    // Anything the file downloads need to ask the server again
+    while (co_await client.next(frame)) {
+        if (frame.type == FRAME_HISTORY && frame.flags == HISTORY_END && frame.length == 8) {
+            std::cout << "\r--- " << read_be(frame.payload, 8) << " earlier message(s) above ---\n> " << std::flush;
+            continue;
+        }
+        if (frame.type == FRAME_RESUME && lost_at_ms) { // Back after a drop
+            if (frame.flags == RESUME_DONE && frame.length >= 16 && read_be(frame.payload + 8, 8) > 0) {
+                std::cout << "\r--- " << read_be(frame.payload + 8, 8) << " message(s) you missed above ---\n> " << std::flush;
+            } else if (frame.flags == RESUME_GAP) {
+                // The server no longer has all of it in memory: fetch it from the history.
+                co_await client.send(history_request(HISTORY_SINCE, (uint64_t)lost_at_ms));
+            }
+            continue;
         }
+        if (frame.type == FRAME_WELCOME || frame.type == FRAME_PRESENCE) {
+            std::string notice = roster.apply(frame);
+            if (!notice.empty()) std::cout << "\r* " << notice << "\n> " << std::flush;
+            continue;
+        }
+        if (frame.type == FRAME_FILE) {
+            std::string notice = files.apply(frame, roster, reply);
+            if (!reply.empty()) {
+                co_await client.send(reply);
+                reply.clear();
+            }
+            if (!notice.empty()) std::cout << "\r* " << notice << "\n> " << std::flush;
+            continue;
+        }
+        if (frame.type == FRAME_ROOM) {
+            std::string notice = rooms.apply(frame);
+            if (!notice.empty()) std::cout << "\r* " << notice << "\n> " << std::flush;
+            continue;
+        }
+        if (frame.type == FRAME_DIRECT) {
+            std::string line = format_direct(frame, roster);
+            if (!line.empty()) std::cout << "\r" << line << "\n> " << std::flush;
+            continue;
+        }
+        if (frame.type != FRAME_CHAT) continue;
         // Print the message. \r moves cursor to start of line to look pretty.
-        std::cout << "\r" << buffer << "\n> " << std::flush;
+        std::cout << "\r" << (chat_room(frame) ? rooms.format(frame, roster) : roster.format(frame)) << "\n> " << std::flush;
     }
 }
 
+// Coroutine: keeps us in the chat until we leave. When the connection drops
+// (or the server sends something garbled), it dials again, waiting longer
+// after each failed try.
+Task<void> stay_connected(EventLoop& loop, ChatClient& client, std::string username) {
+    Roster roster;        // Turns the sender IDs in messages back into names
+    FileReceiver files;   // Files we were offered, and the ones we are downloading
+    while (true) {
+        online = true;
+        co_await listen_for_messages(client, roster, files);
+        online = false;
+        if (leaving) co_return;
+        lost_at_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::cout << "\r* Disconnected from server; reconnecting...\n> " << std::flush;
+        int wait_ms = 500;
+        while (true) {
+            co_await loop.sleep(wait_ms);
+            if (leaving) co_return;
+            bool back = co_await join(client, username, false);
+            if (back) break;
+            wait_ms = std::min(wait_ms * 2, RECONNECT_MAX_MS);
+        }
+        std::cout << "\r* Reconnected.\n> " << std::flush;
+    }
+}
+
+// Thread function: streams a file to the server. The chunks share the
+// connection with whatever we type meanwhile, which goes out between them.
+std::atomic<bool> uploading(false);
+void upload_file(ChatClient* client, std::string path) {
+    std::string error;
+    BlockingSender sender{*client};
+    if (send_file(sender, path, error)) std::cout << "\r* Sent " << path << "; the server will offer it to everyone.\n> " << std::flush;
+    else std::cout << "\r* Could not send the file: " << error << "\n> " << std::flush;
+    uploading = false;
+}
+
 int main() {
     // 1. Start Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return -1;
+    if (!net_startup()) return -1;
+#ifdef _WIN32
+    SetConsoleCP(CP_UTF8);       // Type and show UTF-8, the server passes on nothing else
+    SetConsoleOutputCP(CP_UTF8);
+#endif
 
-    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in serv_addr;
     std::string username;
 
     std::cout << "Enter Username: ";
     std::getline(std::cin, username); // Get username from keyboard
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    
-    // Convert "127.0.0.1" (Localhost) to binary format
-    inet_pton(AF_INET, "10.223.0.249", &serv_addr.sin_addr);
-// if andrew server (10.223.0.249)
-// if Bevnoty server (10.223.0.8)
-    // 2. Connect to the Server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+
+    // 2. Connect to the Server (the loop runs on this thread until that is done)
+    EventLoop loop;
+    ChatClient client(loop);
+    if (!loop.run_until_done(join(client, username, true))) {
         std::cout << "\nConnection Failed (Is Server Running?)\n";
         return -1;
     }
 
+#ifdef _WIN32
     system("cls"); // Clear the terminal screen
+#else
+    system("clear");
+#endif
     std::cout << "--- CHAT ROOM (" << username << ") ---\n> ";
 
-    // 3. Start the listener thread (so we can receive while typing)
-    std::thread t(listen_for_messages, sock);
-    t.detach();
+    // 3. Start the listener, and the loop on its own thread (so we can
+    // receive while typing). From here on this thread only sends, with
+    // send_from_thread().
+    stay_connected(loop, client, username).detach();
+    std::thread network([&loop]() { loop.run(); });
 
     // 4. Main Loop: Reading Keyboard Input
+    // Both strings are reused for every line.
+    std::string msg;
+    std::string frame;
     while (true) {
-        std::string msg;
-        std::getline(std::cin, msg); // Wait for user to type line
-        
+        if (!std::getline(std::cin, msg)) break; // Wait for user to type line (stop at end of input)
+
         if (msg == "exit") break; // Allow user to quit
+        if (!online) { // Between a drop and the reconnect
+            std::cout << "* Not connected right now; that was not sent.\n> ";
+            continue;
+        }
+        if (msg.compare(0, 9, "/history ") == 0) { // "/history 50" shows the last 50 messages again
+            client.send_from_thread(history_request(HISTORY_LAST, std::strtoull(msg.c_str() + 9, nullptr, 10)));
+            std::cout << "> ";
+            continue;
+        }
+        if (msg.compare(0, 6, "/send ") == 0) { // "/send notes.pdf" shares a file with everyone
+            if (uploading.exchange(true)) {
+                std::cout << "* One file at a time, please: the last one is still going.\n> ";
+                continue;
+            }
+            std::thread(upload_file, &client, msg.substr(6)).detach();
+            std::cout << "> ";
+            continue;
+        }
+        if (direct_command(frame, msg)) { // "/msg bob see you at 5" is for bob's eyes only
+            client.send_from_thread(frame);
+            std::cout << "> ";
+            continue;
+        }
+        if (msg.compare(0, 6, "/join ") == 0) { // "/join games": what you type goes to #games
+            client.send_from_thread(room_join_frame(msg.substr(6)));
+            std::cout << "> ";
+            continue;
+        }
+        if (msg == "/leave") { // Out of the current room, back to everyone
+            uint32_t room = rooms.current.exchange(0);
+            if (room) client.send_from_thread(room_leave_frame(room));
+            else std::cout << "* You are not in a room.\n";
+            std::cout << "> ";
+            continue;
+        }
+        if (msg.compare(0, 5, "/get ") == 0) { // "/get 1234" downloads a file someone shared
+            std::string request;
+            encode_file_get(request, std::strtoull(msg.c_str() + 5, nullptr, 10), 0);
+            client.send_from_thread(request);
+            std::cout << "> ";
+            continue;
+        }
+
+        // Only the text goes out: the server adds who sent it (as a session ID).
+        uint32_t room = rooms.current;
+        if (room) build_room_chat_frame(frame, room, msg.data(), msg.size());
+        else build_chat_frame(frame, msg.data(), msg.size());
+        client.send_from_thread(frame);
 
-        std::string full_msg = "[" + username + "]: " + msg;
-        
-        // Send message to server
-        send(sock, full_msg.c_str(), full_msg.length(), 0);
-        
         std::cout << "> "; // Print the prompt again
     }
 
-    closesocket(sock);
-    WSACleanup();
+    // Hang up on the loop's thread, then stop it.
+    loop.post([&]() {
+        leaving = true;
+        client.close();
+        loop.stop();
+    });
+    network.join();
+    net_cleanup();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,273 @@
+// --- DIRECT MESSAGE BENCHMARK ---
+// What does a direct message ("/msg bob ...", chat_direct.h) cost when a
+// lot of users are online? The server finds the user in a NameIndex, so
+// the answer should not depend on how many there are. This tool measures:
+//   1. Lookup, in this process: --users names in a NameIndex, and the same
+//      names in a plain list searched from the front (what finding a user
+//      costs without the index). Reports the time per lookup of each.
+//   2. Delivery, against a running server: --users sessions connect and say
+//      hello ("dm0", "dm1", ...), all on one thread with the client library.
+//      Once everyone is in and the join announcements have died down,
+//      --senders of them each send --messages direct messages, one every
+//      --interval-ms, to users picked at random. Each message carries the
+//      time it was sent, and its receiver checks how long it took to arrive.
+//      Every sender ends with one message for a name nobody has, which the
+//      server must answer with DIRECT_UNKNOWN.
+// Reports the delivery latency (p50 / p99 / max) and how many arrived.
+// Returns 1 if users couldn't get in, or messages or answers are still
+// missing --timeout seconds after the last send.
+//
+// One host address reaches at most ~28,000 connections from one machine
+// (the ephemeral ports); --host takes a comma-separated list, and the users
+// are spread over them (127.0.0.1,127.0.0.2 both reach a local server).
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "chat_client.h"
+#include "chat_session.h"
+#include "chat_direct.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::vector<std::string> hosts{"127.0.0.1"};
+    int port = 60000;
+    int users = 50000;        // Sessions online (one socket each)
+    int senders = 100;        // How many of them send direct messages
+    int messages = 20;        // Direct messages each sender sends
+    int interval_ms = 100;    // Time between one sender's messages
+    int timeout_sec = 60;     // Give up on a step after this long
+    bool lookup_only = false; // Step 1 only: no server needed
+};
+
+// --- STEP 1: LOOKUP ---
+// Time 'rounds' lookups of random names in the index and in a plain list.
+static void measure_lookup(const Options& opt) {
+    NameIndex index;
+    std::vector<std::pair<std::string, DirectRoute>> list; // Without an index: search it
+    for (int i = 0; i < opt.users; i++) {
+        std::string name = "dm" + std::to_string(i);
+        DirectRoute route{i % 4, (SOCKET)i, (unsigned long long)i + 1};
+        index.add(name, route);
+        list.push_back(std::make_pair(name, route));
+    }
+    std::mt19937 random(1);
+    std::vector<std::string> wanted;
+    for (int i = 0; i < 100000; i++) wanted.push_back("dm" + std::to_string(random() % opt.users));
+
+    std::vector<DirectRoute> found;
+    size_t hits = 0;
+    long long start = now_ns();
+    for (const std::string& name : wanted) {
+        found.clear();
+        hits += index.find(name, found);
+    }
+    double index_ns = (double)(now_ns() - start) / wanted.size();
+
+    size_t scans = std::min<size_t>(wanted.size(), 2000); // A scan is slow: fewer of them
+    start = now_ns();
+    for (size_t i = 0; i < scans; i++) {
+        for (const auto& entry : list) {
+            if (entry.first == wanted[i]) {
+                hits++;
+                break;
+            }
+        }
+    }
+    double scan_ns = (double)(now_ns() - start) / scans;
+    std::cout << "lookup: " << opt.users << " names, index " << index_ns << " ns, list search " << scan_ns / 1e3
+              << " us per direct message (" << hits << " found)\n";
+}
+
+// --- STEP 2: DELIVERY ---
+// What all users add up together (there is one thread: no atomics needed).
+struct Totals {
+    int connected = 0;        // Connections that came up
+    int failed = 0;           // ...or didn't
+    int welcomed = 0;         // Users that got their session ID
+    int done_sending = 0;     // Senders that sent all their messages (or gave up)
+    bool go = false;          // Everyone is in and the joins have settled: send
+    long long frames = 0;     // Frames of any kind received, to see things settle
+    long long sent = 0;       // Direct messages sent to a user who is online
+    long long delivered = 0;  // ...and received by that user
+    long long wrong = 0;      // Received by somebody else, or garbled
+    int unknown = 0;          // DIRECT_UNKNOWN answers to the messages for nobody
+    long long start = 0;      // When the users started (ns)
+    Histogram latency_ns;     // Send until arrival, per direct message
+};
+
+struct User {
+    int index;
+    ChatClient client;
+    User(int index, EventLoop& loop) : index(index), client(loop) {}
+};
+
+// A user's reader: counts its welcome, the direct messages for it, and
+// the answers about names nobody has. Everything else (the roster, joins)
+// is only counted as traffic.
+static Task<void> read_frames(User& user, Totals& totals) {
+    Frame frame;
+    while (co_await user.client.next(frame)) {
+        totals.frames++;
+        if (frame.type == FRAME_WELCOME) {
+            totals.welcomed++;
+            continue;
+        }
+        if (frame.type != FRAME_DIRECT) continue;
+        if (frame.flags == DIRECT_UNKNOWN) {
+            totals.unknown++;
+            continue;
+        }
+        // Text: the receiver's number (8 hex) and the time it was sent (16 hex).
+        if (frame.flags != DIRECT_RECEIVED || frame.length != SESSION_ID_SIZE + 24 ||
+            (int)read_hex(frame.payload + SESSION_ID_SIZE, 8) != user.index) {
+            totals.wrong++;
+            continue;
+        }
+        long long sent_at = (long long)read_hex(frame.payload + SESSION_ID_SIZE + 8, 16);
+        totals.latency_ns.record((uint64_t)(now_ns() - sent_at));
+        totals.delivered++;
+    }
+}
+
+// A user: connect, say hello, and (for the first --senders) wait for the
+// signal, then send direct messages to users picked at random.
+static Task<void> run_user(User& user, EventLoop& loop, const Options& opt, Totals& totals) {
+    const std::string& host = opt.hosts[user.index % opt.hosts.size()];
+    bool connected = co_await user.client.connect(host, opt.port);
+    if (!connected) {
+        totals.failed++;
+        if (user.index < opt.senders) totals.done_sending++;
+        co_return;
+    }
+    totals.connected++;
+    co_await user.client.send(hello_frame("dm" + std::to_string(user.index)));
+    read_frames(user, totals).detach();
+    if (user.index >= opt.senders) co_return; // Only listens
+    while (!totals.go && user.client.is_open()) co_await loop.sleep(10);
+    // Senders take turns across the interval instead of all sending at once.
+    co_await loop.sleep((int)((long long)opt.interval_ms * user.index / opt.senders));
+    std::mt19937 random((unsigned)user.index + 1);
+    std::string frame;
+    char text[24];
+    for (int i = 0; i < opt.messages && user.client.is_open(); i++) {
+        if (i > 0) co_await loop.sleep(opt.interval_ms);
+        int to = (int)(random() % opt.users);
+        write_hex(text, (uint64_t)to, 8);
+        write_hex(text + 8, (uint64_t)now_ns(), 16);
+        build_direct_frame(frame, "dm" + std::to_string(to), text, sizeof(text));
+        bool sent = co_await user.client.send(frame);
+        if (sent) totals.sent++;
+    }
+    build_direct_frame(frame, "nobody", "?", 1);
+    co_await user.client.send(frame);
+    totals.done_sending++;
+}
+
+// One more turn of the loop.
+static Task<void> settle(EventLoop& loop) {
+    co_await loop.sleep(1);
+}
+
+// The whole run. Returns false if it didn't finish in time.
+static Task<bool> run_bench(EventLoop& loop, const Options& opt, std::vector<std::unique_ptr<User>>& users, Totals& totals) {
+    totals.start = now_ns();
+    for (auto& user : users) run_user(*user, loop, opt, totals).detach();
+
+    long long deadline = totals.start + opt.timeout_sec * 1000000000LL;
+    while (totals.welcomed + totals.failed < opt.users && now_ns() < deadline) co_await loop.sleep(5);
+    std::cout << "setup: " << totals.welcomed << " of " << opt.users << " users in after "
+              << (now_ns() - totals.start) / 1000000 << " ms\n";
+    if (totals.welcomed < opt.users) {
+        std::cerr << totals.failed << " users could not connect; " << opt.users - totals.welcomed - totals.failed
+                  << " got no welcome within " << opt.timeout_sec << " s.\n";
+        co_return false;
+    }
+    // Every join is announced to everyone: wait until that traffic is over,
+    // so it doesn't queue in front of the direct messages.
+    long long frames = -1;
+    while (totals.frames != frames && now_ns() < deadline) {
+        frames = totals.frames;
+        co_await loop.sleep(500);
+    }
+    std::cout << "       " << totals.frames << " frames of rosters and joins, settled after "
+              << (now_ns() - totals.start) / 1000000 << " ms\n";
+
+    totals.go = true;
+    deadline = now_ns() + ((long long)opt.messages * opt.interval_ms / 1000 + opt.timeout_sec) * 1000000000LL;
+    while (totals.done_sending < opt.senders && now_ns() < deadline) co_await loop.sleep(5);
+    deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while ((totals.delivered + totals.wrong < totals.sent || totals.unknown < opt.senders) && now_ns() < deadline) {
+        co_await loop.sleep(5);
+    }
+
+    const Histogram& l = totals.latency_ns;
+    std::cout << "direct: " << totals.sent << " sent, " << totals.delivered << " arrived, " << totals.wrong
+              << " at the wrong user; " << totals.unknown << " of " << opt.senders << " unknown names answered\n"
+              << "        latency p50 " << l.percentile(0.50) / 1e3 << " us, p99 " << l.percentile(0.99) / 1e3
+              << " us, max " << l.max() / 1e3 << " us\n";
+    co_return totals.delivered == totals.sent && totals.wrong == 0 && totals.unknown == opt.senders;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--lookup-only") {
+            opt.lookup_only = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") {
+            opt.hosts.clear();
+            std::string list = argv[++i];
+            for (size_t at = 0; at <= list.size();) {
+                size_t comma = std::min(list.find(',', at), list.size());
+                if (comma > at) opt.hosts.push_back(list.substr(at, comma - at));
+                at = comma + 1;
+            }
+            if (opt.hosts.empty()) opt.hosts.push_back("127.0.0.1");
+        }
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--users") opt.users = std::max(2, std::stoi(argv[++i]));
+        else if (arg == "--senders") opt.senders = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--messages") opt.messages = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--interval-ms") opt.interval_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: dm_bench.exe [--host IP[,IP...]] [--port N] [--users N] [--senders N]\n"
+                      << "                    [--messages N] [--interval-ms N] [--timeout SECONDS] [--lookup-only]\n";
+            return 1;
+        }
+    }
+    opt.senders = std::min(opt.senders, opt.users);
+    measure_lookup(opt);
+    if (opt.lookup_only) return 0;
+
+    if (!net_startup()) return 1;
+    raise_fd_limit(); // One socket per user
+    bool ok;
+    {
+        EventLoop loop;
+        std::vector<std::unique_ptr<User>> users;
+        for (int i = 0; i < opt.users; i++) users.emplace_back(new User(i, loop));
+        Totals totals;
+        ok = loop.run_until_done(run_bench(loop, opt, users, totals));
+        for (auto& user : users) user->client.close();
+        loop.run_until_done(settle(loop)); // Let the readers see the close and finish
+    }
+    net_cleanup();
+    return ok ? 0 : 1;
+}
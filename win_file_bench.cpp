@@ -0,0 +1,292 @@
+// --- ATTACHMENT BENCHMARK (chat latency under file traffic) ---
+// Shows that file transfers (chat_files.h) don't slow chat down. Against a
+// running server it connects three clients - a chatter, a watcher and an
+// uploader - and:
+//   0. The uploader sends a --file-mb file, for the watcher to download later.
+//   1. Quiet: the chatter sends --messages messages, one every --interval-us
+//      microseconds, each carrying its send time; the watcher reports how
+//      long they took to arrive (p50 / p99 / max).
+//   2. Busy: the same again, while the uploader streams files to the server
+//      at --upload-mbs MB/s AND the watcher downloads the file from step 0
+//      over and over, as fast as it goes - on the very connection its chat
+//      arrives on.
+// If chat really goes first, step 2's latencies stay close to step 1's.
+// All clients live in this process, so they read the same clock. With
+// --shm they talk to the server over shared memory instead of TCP.
+// "--upload-mbs 0" uploads flat out; on a machine with few cores the
+// uploader then mostly measures how much CPU it takes from everyone else.
+// Returns 1 if a step fails.
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "chat_net.h"
+#include "chat_frame.h"
+#include "chat_shm_channel.h"
+#include "chat_files.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int messages = 2000;     // Chat messages per step
+    int interval_us = 1000;  // Pause between them
+    int size = 64;           // Payload bytes per message (at least 16: the send time, in hex)
+    int file_mb = 64;        // Size of each file sent
+    int upload_mbs = 200;    // Upload rate in step 2 (0 = as fast as possible)
+    bool shm = false;        // Shared memory instead of TCP
+};
+
+// What one client has seen. Only its own thread writes to it.
+struct Client {
+    ServerConnection* server = nullptr;
+    size_t size = 0;                             // Chat messages have exactly this much payload
+    std::atomic<Histogram*> latency{nullptr};    // Where chat latencies go (ns), if anywhere
+    std::atomic<long long> chat{0};              // Chat messages received
+    std::atomic<uint64_t> offered{0};            // ID of the newest file offered (0 = none yet)
+    std::atomic<long long> offers{0};            // Offers received
+    std::atomic<long long> file_bytes{0};        // Download bytes received
+    std::atomic<bool> keep_downloading{false};   // Ask for 'offered' again whenever it is done
+    std::atomic<bool> failed{false};             // The server refused an upload, or a download
+};
+
+// Keep reading until the connection closes.
+static void receive_loop(Client* c) {
+    FrameDecoder decoder;
+    Frame frame;
+    std::string request;
+    while (c->server->receive(decoder)) {
+        FrameStatus status;
+        while ((status = decoder.next(frame)) == FRAME_OK) {
+            if (c->server->handle(frame)) continue;
+            if (frame.type == FRAME_CHAT && frame.length == c->size) {
+                long long sent = (long long)read_hex(frame.payload, 16);
+                Histogram* h = c->latency.load(std::memory_order_acquire);
+                if (h) h->record((uint64_t)(now_ns() - sent));
+                c->chat.fetch_add(1, std::memory_order_release);
+                continue;
+            }
+            if (frame.type != FRAME_FILE) continue;
+            if (frame.flags == FILE_CHUNK && frame.length >= FILE_HEADER_SIZE) {
+                c->file_bytes.fetch_add(frame.length - FILE_HEADER_SIZE, std::memory_order_relaxed);
+                request.clear(); // Acknowledge it, like a real client writing it to disk
+                encode_file_get(request, read_be(frame.payload, 8), read_be(frame.payload + 8, 8) + frame.length - FILE_HEADER_SIZE, FILE_ACK);
+                c->server->send(request);
+            } else if (frame.flags == FILE_OFFER && frame.length >= 8) {
+                c->offered = read_be(frame.payload, 8);
+                c->offers++;
+            } else if (frame.flags == FILE_DONE && c->keep_downloading) {
+                request.clear();
+                encode_file_get(request, c->offered, 0);
+                c->server->send(request);
+            } else if (frame.flags == FILE_MISSING || frame.flags == FILE_FAILED) {
+                c->failed = true;
+            }
+        }
+        if (status == FRAME_BAD) break;
+    }
+}
+
+static SOCKET open_connection(const Options& opt) {
+    sockaddr_in addr;
+    if (!make_address(addr, opt.host, opt.port)) return INVALID_SOCKET;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    set_nodelay(sock); // Don't let Nagle hold single messages back
+    return sock;
+}
+
+// Wait until 'counter' reaches 'count' (false after 'timeout_s' seconds or a refusal).
+static bool wait_for(const std::atomic<long long>& counter, long long count, const Client& c, double timeout_s) {
+    Clock::time_point start = Clock::now();
+    while (counter.load(std::memory_order_acquire) < count) {
+        if (c.failed || std::chrono::duration<double>(Clock::now() - start).count() > timeout_s) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Stream files of 'bytes' to the server until 'stop' is set (or just one if
+// 'once'), at 'mbs' MB/s (0 = flat out). Returns the bytes sent. The last
+// file, cut short, is thrown away by the server when we hang up.
+static long long upload(ServerConnection& server, uint64_t bytes, bool once, int mbs, const std::atomic<bool>& stop) {
+    std::string frame;
+    const size_t header = FRAME_HEADER_SIZE + FILE_HEADER_SIZE;
+    std::string chunk(header + FILE_CHUNK_BYTES, 'f');
+    long long sent = 0;
+    long long start = now_ns();
+    do {
+        char size_bytes[8];
+        write_be(size_bytes, bytes, 8);
+        std::string begin(size_bytes, 8);
+        begin += "bench.bin";
+        frame.clear();
+        encode_frame(frame, FRAME_FILE, FILE_UPLOAD, begin.data(), begin.size());
+        if (!server.send(frame)) return sent;
+        for (uint64_t offset = 0; offset < bytes; offset += FILE_CHUNK_BYTES) {
+            if (stop) return sent;
+            size_t n = (size_t)std::min<uint64_t>(FILE_CHUNK_BYTES, bytes - offset);
+            write_file_chunk_header(&chunk[0], 0, offset, n);
+            if (!server.send(chunk.data(), header + n)) return sent;
+            sent += n;
+            if (mbs > 0) { // Wait until 'sent' is due at that rate
+                long long due = start + (long long)(sent / (mbs * 1048576.0) * 1e9);
+                long long now = now_ns();
+                if (due > now) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+        }
+        frame.clear();
+        encode_frame(frame, FRAME_FILE, FILE_COMPLETE, "", 0);
+        if (!server.send(frame)) return sent;
+    } while (!once && !stop);
+    return sent;
+}
+
+// Send the chat messages of one step and wait for them all to arrive.
+static bool chat_step(const Options& opt, ServerConnection& chatter, Client& watcher, Histogram& latency) {
+    std::string message;
+    encode_frame(message, FRAME_CHAT, 0, std::string(opt.size, 'x').data(), opt.size);
+    long long target = watcher.chat.load() + opt.messages;
+    watcher.latency.store(&latency, std::memory_order_release);
+    for (int i = 0; i < opt.messages; i++) {
+        long long sent = now_ns();
+        write_hex(&message[FRAME_HEADER_SIZE], (uint64_t)sent, 16); // In hex: the server only passes on UTF-8 chat
+        if (!chatter.send(message)) return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(opt.interval_us));
+    }
+    bool ok = wait_for(watcher.chat, target, watcher, 30);
+    watcher.latency.store(nullptr, std::memory_order_release);
+    if (!ok) std::cerr << "Only " << watcher.chat.load() - (target - opt.messages) << " of " << opt.messages << " chat messages arrived.\n";
+    return ok;
+}
+
+static void print_latency(const char* title, const Histogram& h) {
+    std::cout << title << "p50 " << h.percentile(0.50) / 1000.0 << " us, p99 " << h.percentile(0.99) / 1000.0
+              << " us, max " << h.max() / 1000.0 << " us\n";
+}
+
+static bool run(const Options& opt) {
+    SOCKET socks[3];
+    for (SOCKET& s : socks) s = open_connection(opt);
+    if (socks[0] == INVALID_SOCKET || socks[1] == INVALID_SOCKET || socks[2] == INVALID_SOCKET) {
+        std::cerr << "Could not connect to " << opt.host << ":" << opt.port << " (is the server running?)\n";
+        return false;
+    }
+    ServerConnection chatter(socks[0]), watcher(socks[1]), uploader(socks[2]);
+    Client from_chatter, to_watcher, from_uploader; // Everyone's incoming side is read, to stay switched
+    from_chatter.server = &chatter;
+    to_watcher.server = &watcher;
+    from_uploader.server = &uploader;
+    from_chatter.size = to_watcher.size = from_uploader.size = (size_t)opt.size;
+    std::thread threads[3] = {std::thread(receive_loop, &from_chatter), std::thread(receive_loop, &to_watcher),
+                              std::thread(receive_loop, &from_uploader)};
+
+    bool ok = true;
+    if (opt.shm) {
+        ok = chatter.request_shm() && watcher.request_shm() && uploader.request_shm();
+        for (int i = 0; ok && i < 2000 && !(chatter.local() && watcher.local() && uploader.local()); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (!(chatter.local() && watcher.local() && uploader.local())) {
+            std::cerr << "The server did not switch to shared memory.\n";
+            ok = false;
+        }
+    }
+
+    uint64_t file_bytes = (uint64_t)opt.file_mb * 1024 * 1024;
+    std::atomic<bool> stop(false);
+    if (ok) {
+        // 0. A file to download.
+        long long start = now_ns();
+        upload(uploader, file_bytes, true, 0, stop);
+        ok = wait_for(to_watcher.offers, 1, from_uploader, 120);
+        if (!ok) std::cerr << "The server did not offer the uploaded file (started with --no-files?).\n";
+        else std::cout << "upload of " << opt.file_mb << " MB took " << (now_ns() - start) / 1e6 << " ms\n";
+    }
+
+    Histogram quiet, busy;
+    double upload_rate = 0, download_rate = 0;
+    if (ok) ok = chat_step(opt, chatter, to_watcher, quiet); // 1.
+    if (ok) {
+        // 2. The same, with the uploader and the watcher's download going flat out.
+        long long uploaded = 0;
+        std::thread upload_thread([&]() { uploaded = upload(uploader, file_bytes, false, opt.upload_mbs, stop); });
+        long long downloaded_before = to_watcher.file_bytes.load();
+        to_watcher.keep_downloading = true;
+        std::string request;
+        encode_file_get(request, to_watcher.offered, 0);
+        watcher.send(request);
+        long long start = now_ns();
+        ok = chat_step(opt, chatter, to_watcher, busy);
+        double seconds = (now_ns() - start) / 1e9;
+        stop = true;
+        to_watcher.keep_downloading = false;
+        upload_thread.join();
+        upload_rate = uploaded / seconds / (1024 * 1024);
+        download_rate = (to_watcher.file_bytes.load() - downloaded_before) / seconds / (1024 * 1024);
+        if (to_watcher.failed || from_uploader.failed) {
+            std::cerr << "The server refused an upload or a download.\n";
+            ok = false;
+        }
+    }
+
+    for (SOCKET s : socks) {
+#ifdef _WIN32
+        shutdown(s, SD_BOTH); // The receive loops end once the server sees us go
+#else
+        shutdown(s, SHUT_RDWR);
+#endif
+    }
+    for (std::thread& t : threads) t.join();
+    for (SOCKET s : socks) closesocket(s);
+    if (!ok) return false;
+
+    print_latency("chat, quiet:               ", quiet);
+    print_latency("chat, upload + download:   ", busy);
+    std::cout << "  meanwhile: upload " << (long long)upload_rate << " MB/s, download " << (long long)download_rate
+              << " MB/s (on the watcher's own connection)\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--shm") {
+            opt.shm = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") opt.host = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--messages") opt.messages = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--interval-us") opt.interval_us = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--size") opt.size = std::max(16, std::stoi(argv[++i]));
+        else if (arg == "--file-mb") opt.file_mb = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--upload-mbs") opt.upload_mbs = std::max(0, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: file_bench.exe [--host IP] [--port N] [--messages N] [--interval-us N] [--size BYTES]\n"
+                      << "                      [--file-mb N] [--upload-mbs N] [--shm]\n";
+            return 1;
+        }
+    }
+    if (!net_startup()) return 1;
+    bool ok = run(opt);
+    net_cleanup();
+    return ok ? 0 : 1;
+}
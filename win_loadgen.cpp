@@ -0,0 +1,451 @@
+// --- CHAT SERVER LOAD GENERATOR ---
+// Pretends to be lots of chat users at once so we can measure the server.
+//   1. Opens many idle connections (they only listen, like lurkers in a chat).
+//   2. A few "sender" connections send messages: as one burst, as fast as
+//      possible, or at a steady --rate per sender.
+//   3. We count how long it takes for every copy of every message to arrive.
+//      Each message carries the time it was sent in its first 16 bytes (as
+//      hex digits: the server drops chat text that isn't UTF-8), so every
+//      delivered copy also gives one fan-out latency sample.
+// With --json the report is a single JSON object, handy for tracking
+// regressions between builds. With --metrics (the same address given to
+// the server's --metrics) it also reports how many send system calls and
+// heap allocations the server made per delivered message. --warmup N sends
+// N messages per sender first and only measures what comes after them, so
+// the allocation count shows the steady state. The only allocations allowed
+// there are growth to a new high (a pool slab, a longer queue or index: the
+// server counts them apart); with --warmup, any other makes the run fail.
+// With --ports A,B,... the senders connect to the first port and the idle
+// users are spread over the others, so against servers linked with --node
+// and --peer every delivery crosses a relay link: the report then gives
+// cross-node latency and the throughput of all nodes together.
+// Run it once against "server.exe" and once against "server.exe --threads"
+// to compare the event loop with the thread-per-client design, or against
+// "server.exe --shards N" for N = 1, 2, 4, 8 (with --threads N here too, so
+// the load generator itself is not the bottleneck) to see how shards scale.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include "chat_net.h"
+#include "chat_poller.h"
+#include "chat_frame.h"
+#include "chat_histogram.h" // Latency percentiles
+#ifndef _WIN32
+#include <sys/un.h>          // Reading metrics from a Unix socket
+#endif
+
+// Settings that can be changed from the command line.
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int idle = 1000;        // Connections that only receive (split across threads)
+    int senders = 4;        // Connections that send the burst (split across threads)
+    int messages = 200;     // Messages each sender sends
+    int warmup = 0;         // Extra messages each sender sends before measuring starts
+    int size = 64;          // Bytes per message (at least 16: the send time goes in front)
+    double rate = 0;        // Messages per second per sender (0 = as fast as possible)
+    int threads = 1;        // Load generator threads, each with its own share of clients
+    int timeout_sec = 60;   // Give up waiting after this long
+    bool json = false;      // Print the report as JSON
+    std::string metrics;    // The server's --metrics address ("" = don't ask)
+    std::vector<int> ports; // --ports: senders on the first, idle users on the rest (empty = --port for all)
+};
+
+#define SEND_AHEAD 65536 // Bytes a fast sender may queue before it waits for the socket
+
+// State for one simulated user.
+struct SimClient {
+    SOCKET sock = INVALID_SOCKET;
+    bool sender = false;
+    int messages_left = 0;  // How many messages this sender still has to send
+    long long next_due = 0; // When the next message should go out (ns, --rate only)
+    std::string pending;    // Stamped messages not yet taken by the socket
+    size_t partial = 0;     // Bytes of 'pending' already sent
+    bool want_write = false; // Are we asking the poller for POLL_WRITE?
+    FrameDecoder decoder;   // Cuts received bytes back into messages
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Shared between all worker threads.
+std::atomic<int> workers_connected(0);              // Workers that finished phase 1
+std::atomic<bool> burst_go(false);                  // Set once everyone is connected
+std::atomic<bool> measuring(false);                 // Set once the warm-up messages have arrived
+std::atomic<int> workers_finished(0);               // Workers done sending and receiving
+std::atomic<bool> measured(false);                  // Server counters read: connections may close
+std::atomic<bool> failed(false);                    // Some worker hit an error
+std::atomic<unsigned long long> total_received(0);  // Messages that arrived, all workers
+std::atomic<unsigned long long> total_bytes(0);     // Bytes that arrived, all workers
+std::vector<Histogram> latencies;                   // latencies[t] = worker t's fan-out latency (ns)
+
+// Open one blocking TCP connection, then switch it to non-blocking.
+static SOCKET open_connection(const sockaddr_in& addr) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    set_nonblocking(sock);
+    return sock;
+}
+
+// Queue every message that is due (or, without --rate, as many as fit in
+// SEND_AHEAD), stamped with the current time, then push what the socket takes.
+// Returns false if the connection broke.
+static bool pump_sender(SimClient& sim, const std::string& message, long long now, long long interval) {
+    while (sim.messages_left > 0 && sim.pending.size() - sim.partial < SEND_AHEAD && (interval == 0 || sim.next_due <= now)) {
+        size_t at = sim.pending.size();
+        sim.pending += message;
+        write_hex(&sim.pending[at + FRAME_HEADER_SIZE], (uint64_t)now, 16); // Send time goes in front
+        sim.messages_left--;
+        sim.next_due += interval;
+    }
+    while (sim.partial < sim.pending.size()) {
+        int n = send(sim.sock, sim.pending.data() + sim.partial, (int)(sim.pending.size() - sim.partial), 0);
+        if (n > 0) {
+            sim.partial += n;
+            continue;
+        }
+        if (n < 0 && net_would_block()) break; // Socket full: wait for POLL_WRITE
+        return false;
+    }
+    if (sim.partial == sim.pending.size() || sim.partial > SEND_AHEAD) {
+        sim.pending.erase(0, sim.partial); // Forget what the socket already took
+        sim.partial = 0;
+    }
+    return true;
+}
+
+// Ask the server's metrics endpoint for one counter, added up over all its
+// threads. Returns -1 if the endpoint can't be reached.
+static double scrape_metric(const std::string& where, const std::string& name) {
+    SOCKET sock;
+    if (where.find('/') != std::string::npos) {
+#ifdef _WIN32
+        return -1;
+#else
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, where.c_str(), sizeof(address.sun_path) - 1);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return -1;
+        if (connect(sock, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(sock);
+            return -1;
+        }
+#endif
+    } else {
+        sockaddr_in address;
+        if (!make_address(address, "127.0.0.1", std::atoi(where.c_str()))) return -1;
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return -1;
+        if (connect(sock, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(sock);
+            return -1;
+        }
+    }
+    send_all(sock, "metrics\n", 8);
+    std::string text;
+    char buf[4096];
+    int n;
+    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) text.append(buf, n);
+    closesocket(sock);
+
+    // Lines look like:  chat_send_calls_total{thread="0"} 1234
+    double total = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.compare(0, name.size(), name) != 0) continue;
+        if (line.size() <= name.size() || (line[name.size()] != '{' && line[name.size()] != ' ')) continue;
+        total += std::atof(line.c_str() + line.rfind(' ') + 1);
+    }
+    return total;
+}
+
+// One worker thread: its own poller, its own share of the simulated users.
+static void run_worker(const Options& opt, int worker, sockaddr_in sender_addr, std::vector<sockaddr_in> idle_addrs,
+                       int idle, int senders, unsigned long long expected) {
+    Histogram& latency = latencies[worker];
+
+    // --- PHASE 1: CONNECT ---
+    Poller poller;
+    std::unordered_map<SOCKET, SimClient> sims;
+    std::vector<SimClient*> sender_list;
+    for (int i = 0; i < idle + senders; i++) {
+        SOCKET sock = open_connection(i < idle ? idle_addrs[(worker + i) % idle_addrs.size()] : sender_addr);
+        if (sock == INVALID_SOCKET) {
+            std::cerr << "Connection " << i << " failed (is the server running?)\n";
+            failed = true;
+            break;
+        }
+        SimClient& sim = sims[sock];
+        sim.sock = sock;
+        sim.sender = i >= idle;
+        sim.messages_left = sim.sender ? opt.warmup + opt.messages : 0;
+        poller.add(sock, POLL_READ);
+    }
+    for (auto& entry : sims) {
+        if (entry.second.sender) sender_list.push_back(&entry.second);
+    }
+
+    // Wait until every worker is connected, so every message reaches everyone.
+    workers_connected++;
+    while (!burst_go && !failed) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // --- PHASE 2: SEND AND RECEIVE ---
+    std::string message = encode_frame(FRAME_CHAT, std::string(opt.size, 'x'));
+    long long interval = opt.rate > 0 ? (long long)(1e9 / opt.rate) : 0;
+    long long now = now_ns();
+    for (size_t i = 0; i < sender_list.size(); i++) {
+        // Spread the senders' start times over one interval so they don't all fire together.
+        sender_list[i]->next_due = now + (long long)(interval * (double)i / sender_list.size());
+    }
+
+    std::vector<PollEvent> events;
+    Frame frame;
+    Clock::time_point start = Clock::now();
+    while (!failed && total_received < expected && seconds_since(start) < opt.timeout_sec) {
+        // Top up every sender, and sleep no longer than until the next one is due.
+        now = now_ns();
+        long long next_due = now + 100000000LL;
+        for (SimClient* sim : sender_list) {
+            if (!pump_sender(*sim, message, now, interval)) {
+                std::cerr << "Server closed a connection.\n";
+                failed = true;
+            }
+            bool need_write = sim->partial < sim->pending.size();
+            if (need_write != sim->want_write) {
+                sim->want_write = need_write;
+                poller.modify(sim->sock, POLL_READ | (need_write ? POLL_WRITE : 0));
+            }
+            if (sim->messages_left > 0 && !need_write) {
+                long long due = interval ? sim->next_due : now;
+                if (due < next_due) next_due = due;
+            }
+        }
+        int timeout = next_due <= now ? 0 : (int)((next_due - now + 999999) / 1000000);
+        poller.wait(events, timeout);
+
+        now = now_ns();
+        for (const PollEvent& ev : events) {
+            SimClient& sim = sims[ev.sock];
+            if (!(ev.flags & (POLL_READ | POLL_ERROR))) continue; // Writable senders are topped up above
+
+            // Drain whatever arrived.
+            while (true) {
+                char* dst = sim.decoder.write_ptr();
+                int n = recv(sim.sock, dst, (int)sim.decoder.write_space(), 0);
+                if (n > 0) {
+                    sim.decoder.commit(n);
+                    total_bytes += n;
+                    unsigned long long got = 0;
+                    FrameStatus status;
+                    while ((status = sim.decoder.next(frame)) == FRAME_OK) {
+                        if (frame.type != FRAME_CHAT) continue;
+                        got++;
+                        if (frame.length >= 16 && measuring) {
+                            long long sent = (long long)read_hex(frame.payload, 16);
+                            latency.record((uint64_t)(now > sent ? now - sent : 0));
+                        }
+                    }
+                    total_received += got;
+                    if (status == FRAME_BAD) {
+                        std::cerr << "Server sent a garbled frame.\n";
+                        failed = true;
+                    }
+                    continue;
+                }
+                if (n == 0 || !net_would_block()) {
+                    std::cerr << "Server closed a connection.\n";
+                    failed = true;
+                }
+                break;
+            }
+        }
+    }
+
+    // Hang up only after the server's counters have been read, so the
+    // disconnects don't show up in them.
+    workers_finished++;
+    while (!measured) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    for (auto& entry : sims) closesocket(entry.first);
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key == "--json") {
+            opt.json = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << key << " needs a value\n";
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (key == "--host") opt.host = value;
+        else if (key == "--port") opt.port = std::stoi(value);
+        else if (key == "--idle") opt.idle = std::stoi(value);
+        else if (key == "--senders") opt.senders = std::stoi(value);
+        else if (key == "--messages") opt.messages = std::stoi(value);
+        else if (key == "--warmup") opt.warmup = std::max(0, std::stoi(value));
+        else if (key == "--size") opt.size = std::max(16, std::stoi(value));
+        else if (key == "--rate") opt.rate = std::stod(value);
+        else if (key == "--threads") opt.threads = std::max(1, std::stoi(value));
+        else if (key == "--timeout") opt.timeout_sec = std::stoi(value);
+        else if (key == "--metrics") opt.metrics = value;
+        else if (key == "--ports") {
+            for (size_t at = 0; at < value.size(); ) { // "60000,60001,60002"
+                size_t comma = value.find(',', at);
+                if (comma == std::string::npos) comma = value.size();
+                opt.ports.push_back(std::stoi(value.substr(at, comma - at)));
+                at = comma + 1;
+            }
+        }
+        else {
+            std::cerr << "Unknown option " << key << "\n";
+            return 1;
+        }
+    }
+
+    if (!net_startup()) return 1;
+    raise_fd_limit();
+
+    // Senders go to the first port; idle users to the others (or the same one).
+    if (opt.ports.empty()) opt.ports.push_back(opt.port);
+    std::vector<sockaddr_in> addrs(opt.ports.size());
+    for (size_t i = 0; i < opt.ports.size(); i++) {
+        if (!make_address(addrs[i], opt.host, opt.ports[i])) {
+            std::cerr << "Bad address " << opt.host << "\n";
+            return 1;
+        }
+    }
+    std::vector<sockaddr_in> idle_addrs(addrs.size() > 1 ? addrs.begin() + 1 : addrs.begin(), addrs.end());
+
+    // Every message is delivered to every connection except its sender.
+    int total = opt.idle + opt.senders;
+    unsigned long long expected = (unsigned long long)opt.senders * (opt.warmup + opt.messages) * (total - 1);
+    unsigned long long warm_expected = (unsigned long long)opt.senders * opt.warmup * (total - 1);
+
+    // Split the users across the worker threads and start them all.
+    latencies.resize(opt.threads);
+    Clock::time_point connect_start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < opt.threads; t++) {
+        int idle = opt.idle / opt.threads + (t < opt.idle % opt.threads ? 1 : 0);
+        int senders = opt.senders / opt.threads + (t < opt.senders % opt.threads ? 1 : 0);
+        workers.push_back(std::thread(run_worker, std::cref(opt), t, addrs[0], idle_addrs, idle, senders, expected));
+    }
+    while (workers_connected < opt.threads) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double connect_time = seconds_since(connect_start);
+    if (!opt.json) {
+        std::cout << "Connected " << total << " clients in " << connect_time << " s ("
+                  << (int)(total / connect_time) << " conn/s)\n";
+    }
+
+    // Everyone is in: start the burst. With --warmup, let the warm-up
+    // messages through first; measuring starts once they have all arrived.
+    Clock::time_point burst_start = Clock::now();
+    if (opt.warmup > 0) {
+        burst_go = true;
+        while (total_received < warm_expected && !failed && seconds_since(burst_start) < opt.timeout_sec) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    double calls_before = opt.metrics.empty() ? -1 : scrape_metric(opt.metrics, "chat_send_calls_total");
+    double allocs_before = opt.metrics.empty() ? -1 : scrape_metric(opt.metrics, "chat_heap_allocations_total");
+    double growth_before = opt.metrics.empty() ? -1 : scrape_metric(opt.metrics, "chat_heap_growth_allocations_total");
+    unsigned long long received_before = total_received;
+    unsigned long long bytes_before = total_bytes;
+    measuring = true;
+    burst_start = Clock::now();
+    burst_go = true;
+    while (workers_finished < opt.threads) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    double burst_time = seconds_since(burst_start);
+    double calls_after = calls_before < 0 ? -1 : scrape_metric(opt.metrics, "chat_send_calls_total");
+    double send_calls = calls_before >= 0 && calls_after >= calls_before ? calls_after - calls_before : -1;
+    double allocs_after = allocs_before < 0 ? -1 : scrape_metric(opt.metrics, "chat_heap_allocations_total");
+    double allocations = allocs_before >= 0 && allocs_after >= allocs_before ? allocs_after - allocs_before : -1;
+    double growth_after = growth_before < 0 ? -1 : scrape_metric(opt.metrics, "chat_heap_growth_allocations_total");
+    double growth = growth_before >= 0 && growth_after >= growth_before ? growth_after - growth_before : 0;
+    bool allocating = opt.warmup > 0 && allocations - growth > 0; // Warm, and still allocating per message
+    measured = true;
+    for (std::thread& w : workers) w.join();
+
+    // --- REPORT ---
+    // Only what arrived after the warm-up counts.
+    bool complete = total_received >= expected;
+    unsigned long long received = total_received - received_before;
+    double received_bytes = (double)(total_bytes - bytes_before);
+    expected -= received_before;
+    Histogram latency;
+    for (const Histogram& h : latencies) latency.merge(h);
+    auto us = [&](double p) { return latency.percentile(p) / 1000.0; };
+
+    if (opt.json) {
+        std::cout.precision(10);
+        std::cout << "{\"clients\": " << total << ", \"senders\": " << opt.senders
+                  << ", \"messages_per_sender\": " << opt.messages << ", \"warmup_per_sender\": " << opt.warmup
+                  << ", \"size\": " << opt.size
+                  << ", \"rate_per_sender\": " << opt.rate << ", \"threads\": " << opt.threads << ", \"ports\": " << opt.ports.size()
+                  << ", \"connect_seconds\": " << connect_time << ", \"connects_per_sec\": " << total / connect_time
+                  << ", \"expected\": " << expected << ", \"delivered\": " << received
+                  << ", \"seconds\": " << burst_time << ", \"msgs_per_sec\": " << received / burst_time
+                  << ", \"bytes_per_sec\": " << received_bytes / burst_time
+                  << ", \"latency_us\": {\"p50\": " << us(0.50) << ", \"p99\": " << us(0.99)
+                  << ", \"p999\": " << us(0.999) << ", \"max\": " << latency.max() / 1000.0
+                  << ", \"mean\": " << latency.mean() / 1000.0 << "}";
+        if (send_calls >= 0) {
+            std::cout << ", \"server_send_calls\": " << send_calls
+                      << ", \"send_calls_per_message\": " << (received ? send_calls / received : 0.0);
+        }
+        if (allocations >= 0) {
+            std::cout << ", \"server_heap_allocations\": " << allocations
+                      << ", \"server_growth_allocations\": " << growth
+                      << ", \"allocations_per_message\": " << (received ? allocations / received : 0.0);
+        }
+        std::cout << "}" << std::endl;
+    } else {
+        std::cout << "Delivered " << received << " of " << expected << " messages in " << burst_time << " s\n";
+        std::cout << "Throughput: " << (unsigned long long)(received / burst_time) << " msg/s, "
+                  << (received_bytes / burst_time) / (1024.0 * 1024.0) << " MB/s\n";
+        std::cout << "Fan-out latency: p50 " << us(0.50) << " us, p99 " << us(0.99) << " us, p999 "
+                  << us(0.999) << " us, max " << latency.max() / 1000.0 << " us\n";
+        if (send_calls >= 0) {
+            std::cout << "Server send calls: " << (unsigned long long)send_calls << " ("
+                      << (received ? send_calls / received : 0.0) << " per delivered message)\n";
+        }
+        if (allocations >= 0) {
+            std::cout << "Server heap allocations: " << (unsigned long long)allocations << " ("
+                      << (received ? allocations / received : 0.0) << " per delivered message), "
+                      << (unsigned long long)growth << " of them growth to a new high\n";
+        }
+    }
+    if (allocating) {
+        std::cerr << "The warm server made " << (unsigned long long)(allocations - growth)
+                  << " heap allocations that were not growth (should be 0).\n";
+    }
+
+    net_cleanup();
+    return complete && !allocating ? 0 : 1;
+}
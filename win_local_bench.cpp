@@ -0,0 +1,212 @@
+// --- LOCAL CLIENT BENCHMARK (TCP vs shared memory) ---
+// Shows what the shared-memory channel (chat_shm_channel.h) saves a client
+// on the same machine as the server. Against a running server it connects
+// two clients, a sender and a receiver, first over TCP and then over shared
+// memory (--mode tcp|shm|both), and for each:
+//   1. Latency: the sender sends --messages messages, one every --interval-us
+//      microseconds, each carrying its send time; the receiver reports how long
+//      they took to arrive through the server (p50 / p99 / p999 / max).
+//   2. Throughput: the sender sends --burst messages as fast as it can; we
+//      time how long until the receiver has all of them.
+// Both clients live in this process, so they read the same clock. Use a
+// server nobody else is talking on, that holds senders back instead of
+// dropping messages: "server.exe --no-log --shards 1 --slow-policy pause".
+// Returns 1 if a run fails (or the server would not switch to shared memory).
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "chat_net.h"
+#include "chat_frame.h"
+#include "chat_shm_channel.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int messages = 20000;    // Latency messages
+    int interval_us = 100;   // Pause between latency messages
+    int burst = 200000;      // Throughput messages
+    int size = 64;           // Payload bytes per message (at least 16: the send time, in hex)
+    std::string mode = "both";
+};
+
+// What one receiver has seen. Only its own thread writes to it.
+struct Receiver {
+    ServerConnection* server = nullptr;
+    size_t size = 0;                     // Our messages have exactly this much payload
+    long long measure = 0;               // Record the latency of this many first messages (the burst's aren't stamped)
+    Histogram latency;                   // ns
+    std::atomic<long long> received{0};
+    std::atomic<long long> last_at{0};   // When the newest message arrived (ns)
+};
+
+// Keep reading until the connection closes. Also takes care of the switch
+// to shared memory, so the sender needs one of these too.
+static void receive_loop(Receiver* r) {
+    FrameDecoder decoder;
+    Frame frame;
+    while (r->server->receive(decoder)) {
+        FrameStatus status;
+        while ((status = decoder.next(frame)) == FRAME_OK) {
+            if (r->server->handle(frame) || frame.type != FRAME_CHAT || frame.length != r->size) continue;
+            long long now = now_ns();
+            if (r->received.load(std::memory_order_relaxed) < r->measure) {
+                long long sent = (long long)read_hex(frame.payload, 16);
+                r->latency.record((uint64_t)(now - sent));
+            }
+            r->last_at.store(now, std::memory_order_relaxed);
+            r->received.fetch_add(1, std::memory_order_release);
+        }
+        if (status == FRAME_BAD) break;
+    }
+}
+
+static SOCKET open_connection(const Options& opt) {
+    sockaddr_in addr;
+    if (!make_address(addr, opt.host, opt.port)) return INVALID_SOCKET;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    set_nodelay(sock); // Over TCP, don't let Nagle hold single messages back
+    return sock;
+}
+
+// Wait until 'r' has 'count' messages (false after 'timeout_s' seconds).
+static bool wait_for(const Receiver& r, long long count, double timeout_s) {
+    Clock::time_point start = Clock::now();
+    while (r.received.load(std::memory_order_acquire) < count) {
+        if (std::chrono::duration<double>(Clock::now() - start).count() > timeout_s) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// One full run over TCP (shm = false) or shared memory. Prints its results.
+static bool run(const Options& opt, bool shm) {
+    const char* name = shm ? "shared memory" : "TCP";
+    SOCKET sender_sock = open_connection(opt);
+    SOCKET receiver_sock = open_connection(opt);
+    if (sender_sock == INVALID_SOCKET || receiver_sock == INVALID_SOCKET) {
+        std::cerr << "Could not connect to " << opt.host << ":" << opt.port << " (is the server running?)\n";
+        return false;
+    }
+    ServerConnection sender(sender_sock), receiver(receiver_sock);
+    Receiver from_sender, to_receiver; // The sender's own incoming side is only read to stay switched
+    from_sender.server = &sender;
+    to_receiver.server = &receiver;
+    from_sender.size = to_receiver.size = (size_t)opt.size;
+    to_receiver.measure = opt.messages;
+    std::thread sender_thread(receive_loop, &from_sender);
+    std::thread receiver_thread(receive_loop, &to_receiver);
+
+    bool ok = true;
+    if (shm) {
+        if (!sender.request_shm() || !receiver.request_shm()) {
+            std::cerr << "The server is not on this machine, so there is no shared memory to use.\n";
+            ok = false;
+        }
+        for (int i = 0; ok && i < 2000 && !(sender.local() && receiver.local()); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (ok && !(sender.local() && receiver.local())) {
+            std::cerr << "The server did not switch to shared memory (started with --no-shm, --threads or --io uring?).\n";
+            ok = false;
+        }
+    }
+
+    std::string message;
+    encode_frame(message, FRAME_CHAT, 0, std::string(opt.size, 'x').data(), opt.size);
+    if (ok) {
+        // 1. Latency, one message at a time.
+        for (int i = 0; i < opt.messages && ok; i++) {
+            long long sent = now_ns();
+            write_hex(&message[FRAME_HEADER_SIZE], (uint64_t)sent, 16); // As text: the server drops chat that isn't UTF-8
+            ok = sender.send(message);
+            std::this_thread::sleep_for(std::chrono::microseconds(opt.interval_us));
+        }
+        if (ok && !wait_for(to_receiver, opt.messages, 10)) {
+            std::cerr << name << ": only " << to_receiver.received.load() << " of " << opt.messages << " messages arrived.\n";
+            ok = false;
+        }
+    }
+    double rate = 0;
+    if (ok) {
+        // 2. Throughput: everything at once, in batches of 64 messages per send.
+        std::string batch;
+        for (int i = 0; i < 64; i++) batch += message;
+        long long start = now_ns();
+        for (int sent = 0; sent < opt.burst && ok; sent += 64) {
+            ok = sender.send(batch.data(), message.size() * std::min(64, opt.burst - sent));
+        }
+        if (ok && !wait_for(to_receiver, (long long)opt.messages + opt.burst, 60)) {
+            std::cerr << name << ": the burst did not arrive in full.\n";
+            ok = false;
+        }
+        if (ok) rate = opt.burst / ((to_receiver.last_at.load() - start) / 1e9);
+    }
+
+#ifdef _WIN32
+    shutdown(sender_sock, SD_BOTH); // Both receive loops end once the server sees us go
+    shutdown(receiver_sock, SD_BOTH);
+#else
+    shutdown(sender_sock, SHUT_RDWR);
+    shutdown(receiver_sock, SHUT_RDWR);
+#endif
+    sender_thread.join();
+    receiver_thread.join();
+    closesocket(sender_sock);
+    closesocket(receiver_sock);
+    if (!ok) return false;
+
+    std::cout << name << ":\n";
+    std::cout << "  latency   p50 " << to_receiver.latency.percentile(0.50) / 1000.0 << " us, p99 "
+              << to_receiver.latency.percentile(0.99) / 1000.0 << " us, p999 " << to_receiver.latency.percentile(0.999) / 1000.0
+              << " us, max " << to_receiver.latency.max() / 1000.0 << " us\n";
+    std::cout << "  burst     " << (long long)rate << " messages/s\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") opt.host = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--messages") opt.messages = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--interval-us") opt.interval_us = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--burst") opt.burst = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--size") opt.size = std::max(16, std::stoi(argv[++i]));
+        else if (arg == "--mode") opt.mode = argv[++i];
+        else {
+            std::cerr << "Usage: local_bench.exe [--host IP] [--port N] [--messages N] [--interval-us N] [--burst N]\n"
+                      << "                       [--size BYTES] [--mode tcp|shm|both]\n";
+            return 1;
+        }
+    }
+    if (opt.mode != "tcp" && opt.mode != "shm" && opt.mode != "both") {
+        std::cerr << "--mode must be tcp, shm or both.\n";
+        return 1;
+    }
+    if (!net_startup()) return 1;
+    bool ok = true;
+    if (opt.mode != "shm") ok = run(opt, false) && ok;
+    if (opt.mode != "tcp") ok = run(opt, true) && ok;
+    net_cleanup();
+    return ok ? 0 : 1;
+}
\ No newline at end of file
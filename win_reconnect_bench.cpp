@@ -0,0 +1,323 @@
+// --- RECONNECT STORM BENCHMARK ---
+// What happens when every client comes back at the same moment, as they do
+// after the server restarts? This tool keeps --clients connections to a
+// running server, all from one thread. Each one connects, says hello, and
+// counts as "back" once its FRAME_WELCOME arrives.
+//   1. Cold start: all clients connect at once.
+//   2. The storm: every connection is dropped at once, and every client
+//      dials again straight away. With --restart we don't drop them
+//      ourselves; we wait for you to restart the server instead.
+// A client whose connection fails, or is closed before its welcome (the
+// server's --ip-rate turned it away), tries again after a random back-off
+// that doubles each time, from --backoff-ms up to --backoff-max-ms, as well-behaved
+// clients do. Each step reports the RECOVERY TIME (from the drop until the
+// last client is back), when clients got back (p50 / p99 / max), and how
+// many connection attempts that took. Compare servers started with
+// different --backlog, --ip-rate and --max-handshakes settings.
+// Returns 1 if not everyone got back within --timeout seconds.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include "chat_net.h"
+#include "chat_poller.h"
+#include "chat_frame.h"
+#include "chat_session.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int clients = 2000;       // Connections kept open
+    int backoff_ms = 20;      // First pause before trying again
+    int backoff_max_ms = 1000; // Longest pause
+    int timeout_sec = 60;     // Give up on a step after this long
+    bool restart = false;     // Wait for the server to restart instead of dropping everyone ourselves
+};
+
+enum ClientState {
+    CLIENT_IDLE,        // Not connected, not trying (yet)
+    CLIENT_WAITING,     // Backing off until 'retry_at'
+    CLIENT_CONNECTING,  // connect() is in progress
+    CLIENT_HELLO,       // Connected and said hello; waiting for the welcome
+    CLIENT_UP           // Welcomed
+};
+
+struct Client {
+    SOCKET sock = INVALID_SOCKET;
+    ClientState state = CLIENT_IDLE;
+    int failures = 0;        // Failed attempts in a row (for the back-off)
+    long long retry_at = 0;  // When to try again (ns, CLIENT_WAITING)
+    FrameDecoder decoder;
+};
+
+// Counts for one step.
+struct StepResult {
+    long long attempts = 0;  // connect() calls
+    long long failed = 0;    // Connections that failed or timed out
+    long long turned_away = 0; // Connections closed by the server before the welcome
+    Histogram back_ns;       // Time from the drop until each client was back
+};
+
+class Storm {
+public:
+    Storm(const Options& opt) : opt(opt), clients(opt.clients), random(12345) {
+        make_address(address, opt.host, opt.port);
+    }
+    ~Storm() {
+        for (Client& c : clients) drop(c);
+    }
+
+    // Step 1: everyone connects at once.
+    bool cold_start(StepResult& result) {
+        for (Client& c : clients) c.state = CLIENT_WAITING; // retry_at = 0: now
+        return run_until_all_up(now_ns(), result);
+    }
+
+    // Step 2: everyone is dropped at once (by us, or by a server restart), and dials again.
+    bool storm(StepResult& result) {
+        long long start;
+        if (opt.restart) {
+            std::cout << "All " << opt.clients << " clients are connected. Restart the server now." << std::endl;
+            start = wait_for_first_drop();
+        } else {
+            for (Client& c : clients) {
+                drop(c);
+                c.state = CLIENT_WAITING;
+                c.retry_at = 0;
+            }
+            start = now_ns();
+        }
+        return run_until_all_up(start, result);
+    }
+
+private:
+    // Close a client's socket (if it has one).
+    void drop(Client& c) {
+        if (c.sock == INVALID_SOCKET) return;
+        poller.remove(c.sock);
+        by_socket.erase(c.sock);
+        closesocket(c.sock);
+        c.sock = INVALID_SOCKET;
+        c.decoder = FrameDecoder();
+    }
+
+    // This attempt failed: close it and back off before the next one.
+    void back_off(Client& c) {
+        drop(c);
+        long long limit = (long long)opt.backoff_ms << std::min(c.failures, 20);
+        if (limit > opt.backoff_max_ms) limit = opt.backoff_max_ms;
+        c.failures++;
+        // Jitter (half to all of the limit), so the retries don't all land at once again.
+        std::uniform_int_distribution<long long> pick(limit / 2, limit);
+        c.retry_at = now_ns() + pick(random) * 1000000LL;
+        c.state = CLIENT_WAITING;
+    }
+
+    // Start a non-blocking connect.
+    void dial(Client& c, StepResult& result) {
+        result.attempts++;
+        c.sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (c.sock == INVALID_SOCKET || !set_nonblocking(c.sock)) {
+            result.failed++;
+            back_off(c);
+            return;
+        }
+        c.state = CLIENT_CONNECTING;
+        if (connect(c.sock, (const sockaddr*)&address, sizeof(address)) == 0) {
+            say_hello(c, result);
+            return;
+        }
+#ifdef _WIN32
+        bool started = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool started = errno == EINPROGRESS;
+#endif
+        if (!started || !poller.add(c.sock, POLL_WRITE)) {
+            result.failed++;
+            back_off(c);
+            return;
+        }
+        by_socket[c.sock] = (int)(&c - clients.data());
+    }
+
+    // Connected: say hello and wait for the welcome.
+    void say_hello(Client& c, StepResult& result) {
+        std::string hello = hello_frame("storm" + std::to_string(&c - clients.data()));
+        if (send(c.sock, hello.data(), (int)hello.size(), 0) != (int)hello.size()) { // A fresh socket has room for it
+            result.failed++;
+            back_off(c);
+            return;
+        }
+        c.state = CLIENT_HELLO;
+        by_socket[c.sock] = (int)(&c - clients.data());
+        if (!poller.modify(c.sock, POLL_READ)) poller.add(c.sock, POLL_READ);
+    }
+
+    // Did the non-blocking connect work?
+    static bool connected(SOCKET sock) {
+        int error = 0;
+#ifdef _WIN32
+        int length = sizeof(error);
+#else
+        socklen_t length = sizeof(error);
+#endif
+        return getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == 0 && error == 0;
+    }
+
+    // Read what has arrived. Returns false if the connection is gone.
+    bool read(Client& c, long long start, StepResult& result) {
+        while (true) {
+            char* dst = c.decoder.write_ptr();
+            int n = recv(c.sock, dst, (int)c.decoder.write_space(), 0);
+            if (n > 0) {
+                c.decoder.commit(n);
+                Frame frame;
+                while (c.decoder.next(frame) == FRAME_OK) {
+                    if (frame.type != FRAME_WELCOME || c.state != CLIENT_HELLO) continue; // Presence etc.: just drained
+                    c.state = CLIENT_UP;
+                    c.failures = 0;
+                    result.back_ns.record((uint64_t)(now_ns() - start));
+                    up++;
+                }
+                continue;
+            }
+            if (n < 0 && net_would_block()) return true;
+            return false;
+        }
+    }
+
+    // Run the event loop until every client is up (or the timeout passes).
+    bool run_until_all_up(long long start, StepResult& result) {
+        up = 0;
+        for (Client& c : clients) up += c.state == CLIENT_UP;
+        long long deadline = start + opt.timeout_sec * 1000000000LL;
+        std::vector<PollEvent> events;
+        while (up < opt.clients) {
+            long long now = now_ns();
+            if (now > deadline) {
+                std::cerr << "Only " << up << " of " << opt.clients << " clients got back within " << opt.timeout_sec << " s.\n";
+                return false;
+            }
+            // Dial everyone whose back-off is over; sleep until the next one is due.
+            long long next_retry = 0;
+            for (Client& c : clients) {
+                if (c.state != CLIENT_WAITING) continue;
+                if (c.retry_at <= now) dial(c, result);
+                else if (next_retry == 0 || c.retry_at < next_retry) next_retry = c.retry_at;
+            }
+            int timeout = next_retry ? (int)std::max(0LL, (next_retry - now + 999999) / 1000000) : 100;
+            poller.wait(events, std::min(timeout, 100));
+            for (const PollEvent& ev : events) {
+                auto it = by_socket.find(ev.sock);
+                if (it == by_socket.end()) continue;
+                Client& c = clients[it->second];
+                if (c.state == CLIENT_CONNECTING) {
+                    if (connected(c.sock)) say_hello(c, result);
+                    else {
+                        result.failed++;
+                        back_off(c);
+                    }
+                    continue;
+                }
+                if (!read(c, start, result)) {
+                    if (c.state == CLIENT_UP) {
+                        // Dropped after getting back: dial again (counts as a new attempt).
+                        up--;
+                        c.failures = 0;
+                    } else {
+                        result.turned_away++;
+                    }
+                    back_off(c);
+                }
+            }
+        }
+        return true;
+    }
+
+    // --restart: read until the first connection drops (the server went
+    // away); that client and every later one dials again as soon as it notices.
+    long long wait_for_first_drop() {
+        std::vector<PollEvent> events;
+        StepResult ignored;
+        while (true) {
+            poller.wait(events, 1000);
+            for (const PollEvent& ev : events) {
+                auto it = by_socket.find(ev.sock);
+                if (it == by_socket.end()) continue;
+                Client& c = clients[it->second];
+                if (read(c, 0, ignored)) continue;
+                long long start = now_ns();
+                // From here run_until_all_up() notices the rest one by one.
+                drop(c);
+                c.state = CLIENT_WAITING;
+                c.retry_at = 0;
+                return start;
+            }
+        }
+    }
+
+    const Options& opt;
+    sockaddr_in address;
+    Poller poller;
+    std::vector<Client> clients;
+    std::unordered_map<SOCKET, int> by_socket; // Socket -> index in 'clients'
+    int up = 0;                                // Clients welcomed
+    std::mt19937_64 random;                    // For the back-off jitter
+};
+
+static void report(const char* title, const StepResult& r) {
+    const Histogram& h = r.back_ns;
+    std::cout << title << "recovered in " << h.max() / 1e6 << " ms  (back: p50 " << h.percentile(0.50) / 1e6
+              << " ms, p99 " << h.percentile(0.99) / 1e6 << " ms)\n"
+              << "    " << r.attempts << " connection attempts, " << r.failed << " failed, "
+              << r.turned_away << " turned away by the server\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--restart") {
+            opt.restart = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") opt.host = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--clients") opt.clients = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--backoff-ms") opt.backoff_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--backoff-max-ms") opt.backoff_max_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: reconnect_bench.exe [--host IP] [--port N] [--clients N] [--backoff-ms N]\n"
+                      << "                           [--backoff-max-ms N] [--timeout SECONDS] [--restart]\n";
+            return 1;
+        }
+    }
+    if (!net_startup()) return 1;
+    raise_fd_limit(); // One socket per client
+    bool ok;
+    {
+        Storm storm(opt);
+        StepResult cold, again;
+        ok = storm.cold_start(cold);
+        if (ok) report("cold start: ", cold);
+        ok = ok && storm.storm(again);
+        if (ok) report("storm:      ", again);
+    }
+    net_cleanup();
+    return ok ? 0 : 1;
+}
\ No newline at end of file
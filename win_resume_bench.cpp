@@ -0,0 +1,272 @@
+// --- RESUME BENCHMARK ---
+// Does a client that loses its connection get back exactly what it missed,
+// and what does that cost? This tool runs against a running server (with
+// the event loops and its default --resume-mb), all on one thread with the
+// client library (chat_client.h):
+//   - --talkers sessions send numbered chat lines, --rate per second in
+//     total, for --seconds;
+//   - --clients listeners ask for numbered messages (request_resume) and
+//     check every line: per talker, the numbers must arrive in order with
+//     none missing and none twice;
+//   - every --every-ms, --drop percent of the listeners lose their
+//     connection at once (we hang up on the server), stay away for
+//     --away-ms, and connect again, asking to resume.
+// Reports how many reconnects caught up (RESUME_DONE) and how many had
+// missed too much (RESUME_GAP, which a real client follows with a history
+// request), the frames replayed per reconnect, and the catch-up time from
+// dialling again until RESUME_DONE (p50 / p99 / max). Returns 1 if a line
+// was lost or repeated on a reconnect that caught up, or if not every
+// listener got back within --timeout seconds.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "chat_client.h"
+#include "chat_session.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 60000;
+    int clients = 500;        // Listeners that get dropped and come back
+    int talkers = 4;          // Sessions that send the lines (never dropped)
+    int rate = 1000;          // Lines per second, all talkers together
+    int seconds = 10;         // How long they talk
+    int every_ms = 1000;      // Time between two drops
+    int drop = 20;            // Percent of the listeners dropped each time (100 = all at once)
+    int away_ms = 300;        // How long a dropped listener stays away
+    int timeout_sec = 30;     // Give up waiting after this long
+};
+
+// What all clients add up together (one thread: no atomics needed).
+struct Totals {
+    int welcomed = 0;
+    long long sent = 0;
+    long long lost = 0;          // Lines missing from a talker's numbers
+    long long repeated = 0;      // Lines that came twice, or out of order
+    long long dropped = 0;       // Connections we hung up on
+    long long resumed = 0;       // Reconnects answered with RESUME_DONE
+    long long gaps = 0;          // ...and with RESUME_GAP
+    long long replayed = 0;      // Frames the RESUME_DONEs said were replayed
+    long long redials = 0;       // Connection attempts that failed and were tried again
+    Histogram catch_up_ns;       // Dialling again until RESUME_DONE
+};
+
+struct Listener {
+    int index;
+    ChatClient chat;
+    std::vector<uint64_t> next_from; // The number we expect next from each talker
+    std::vector<bool> resync;        // After a gap: take the next number as it comes (none came yet)
+    bool away = false;               // Dropped, not back yet
+    bool welcomed = false;
+    long long dialled_at = 0;        // When we dialled again (0 = not resuming)
+    Listener(int index, int talkers, EventLoop& loop) : index(index), chat(loop), next_from(talkers, 0), resync(talkers, false) {}
+};
+
+struct Talker {
+    ChatClient chat;
+    uint64_t next_seq = 0;
+    explicit Talker(EventLoop& loop) : chat(loop) {}
+};
+
+// A listener's reader, for one connection: checks every line.
+static Task<void> read_lines(Listener& l, Totals& totals) {
+    Frame frame;
+    while (co_await l.chat.next(frame)) {
+        if (frame.type == FRAME_WELCOME) {
+            if (!l.welcomed) totals.welcomed++;
+            l.welcomed = true;
+            continue;
+        }
+        if (frame.type == FRAME_RESUME && l.dialled_at) {
+            if (frame.flags == RESUME_DONE && frame.length >= 16) {
+                totals.resumed++;
+                totals.replayed += (long long)read_be(frame.payload + 8, 8);
+                totals.catch_up_ns.record((uint64_t)(now_ns() - l.dialled_at));
+            } else if (frame.flags == RESUME_GAP) {
+                totals.gaps++; // A real client asks for history now; we just stop counting what is missing
+                std::fill(l.resync.begin(), l.resync.end(), true);
+            }
+            l.dialled_at = 0;
+            continue;
+        }
+        if (frame.type != FRAME_CHAT || frame.length != SESSION_ID_SIZE + 24) continue;
+        uint32_t talker = (uint32_t)read_hex(frame.payload + SESSION_ID_SIZE, 8);
+        uint64_t seq = read_hex(frame.payload + SESSION_ID_SIZE + 8, 16);
+        if (talker >= l.next_from.size()) continue;
+        uint64_t& expected = l.next_from[talker];
+        if (l.resync[talker]) {
+            l.resync[talker] = false;
+            expected = seq;
+        }
+        if (seq < expected) {
+            totals.repeated++;
+            continue;
+        }
+        totals.lost += (long long)(seq - expected);
+        expected = seq + 1;
+    }
+}
+
+// Connect, ask for numbers (and what we missed), say hello. Tries again
+// every 100 ms until it works.
+static Task<void> join(Listener& l, EventLoop& loop, const Options& opt, Totals& totals) {
+    while (true) {
+        bool connected = co_await l.chat.connect(opt.host, opt.port);
+        if (connected) break;
+        totals.redials++;
+        co_await loop.sleep(100);
+    }
+    l.chat.request_resume();
+    co_await l.chat.send(hello_frame("listener" + std::to_string(l.index)));
+    read_lines(l, totals).detach();
+}
+
+// Drop a listener, and bring it back after --away-ms.
+static Task<void> drop_and_return(Listener& l, EventLoop& loop, const Options& opt, Totals& totals) {
+    l.away = true;
+    l.chat.close();
+    totals.dropped++;
+    co_await loop.sleep(opt.away_ms);
+    l.dialled_at = now_ns();
+    co_await join(l, loop, opt, totals);
+    l.away = false;
+}
+
+static Task<void> settle(EventLoop& loop) {
+    co_await loop.sleep(1);
+}
+
+static Task<bool> run_bench(EventLoop& loop, const Options& opt, std::vector<std::unique_ptr<Listener>>& listeners,
+                            std::vector<std::unique_ptr<Talker>>& talkers, Totals& totals) {
+    for (auto& l : listeners) join(*l, loop, opt, totals).detach();
+    for (size_t t = 0; t < talkers.size(); t++) {
+        bool connected = co_await talkers[t]->chat.connect(opt.host, opt.port);
+        if (!connected) {
+            std::cerr << "A talker could not connect.\n";
+            co_return false;
+        }
+        co_await talkers[t]->chat.send(hello_frame("talker" + std::to_string(t)));
+    }
+    long long deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while (totals.welcomed < opt.clients && now_ns() < deadline) co_await loop.sleep(5);
+    if (totals.welcomed < opt.clients) {
+        std::cerr << "Only " << totals.welcomed << " of " << opt.clients << " listeners got in.\n";
+        co_return false;
+    }
+    std::cout << opt.clients << " listeners in; " << opt.talkers << " talkers at " << opt.rate << " lines/s, dropping "
+              << opt.drop << "% of the listeners every " << opt.every_ms << " ms for " << opt.away_ms << " ms" << std::endl;
+
+    std::mt19937 random(12345);
+    std::vector<size_t> order(listeners.size()); // Who is dropped next
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    long long start = now_ns();
+    long long interval = 1000000000LL / opt.rate;
+    long long end = start + opt.seconds * 1000000000LL;
+    long long next_drop = start + opt.every_ms * 1000000LL;
+    std::string line;
+    char body[24]; // Talker and number, in hex (chat lines are text)
+    for (long long i = 0; now_ns() < end; i++) {
+        long long due = start + i * interval;
+        if (due > now_ns()) co_await loop.sleep((int)((due - now_ns()) / 1000000));
+        if (now_ns() >= next_drop) {
+            std::shuffle(order.begin(), order.end(), random);
+            int count = (int)((long long)opt.clients * opt.drop / 100);
+            for (int n = 0; n < count; n++) {
+                Listener& l = *listeners[order[n]];
+                if (!l.away) drop_and_return(l, loop, opt, totals).detach();
+            }
+            next_drop += opt.every_ms * 1000000LL;
+        }
+        size_t t = (size_t)(i % (long long)talkers.size());
+        write_hex(body, t, 8);
+        write_hex(body + 8, talkers[t]->next_seq++, 16);
+        build_chat_frame(line, body, sizeof(body));
+        bool sent = co_await talkers[t]->chat.send(line);
+        if (sent) totals.sent++;
+    }
+
+    // Everyone back, and every line everywhere.
+    deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    bool complete = false;
+    while (!complete && now_ns() < deadline) {
+        co_await loop.sleep(10);
+        complete = true;
+        for (auto& l : listeners) {
+            if (l->away) complete = false;
+            for (size_t t = 0; t < talkers.size(); t++) complete = complete && (l->resync[t] || l->next_from[t] >= talkers[t]->next_seq);
+        }
+    }
+    int away = 0;
+    for (auto& l : listeners) {
+        if (l->away) away++;
+        for (size_t t = 0; t < talkers.size(); t++) {
+            if (!l->resync[t] && l->next_from[t] < talkers[t]->next_seq) totals.lost += (long long)(talkers[t]->next_seq - l->next_from[t]);
+        }
+    }
+    if (away) std::cerr << away << " listeners did not get back.\n";
+    co_return away == 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") opt.host = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--clients") opt.clients = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--talkers") opt.talkers = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--rate") opt.rate = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--seconds") opt.seconds = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--every-ms") opt.every_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--drop") opt.drop = std::min(100, std::max(0, std::stoi(argv[++i])));
+        else if (arg == "--away-ms") opt.away_ms = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: resume_bench.exe [--host IP] [--port N] [--clients N] [--talkers N] [--rate PER_SECOND]\n"
+                      << "                        [--seconds N] [--every-ms N] [--drop PERCENT] [--away-ms N] [--timeout SECONDS]\n";
+            return 1;
+        }
+    }
+    if (!net_startup()) return 1;
+    raise_fd_limit(); // One socket per client
+    bool ok;
+    Totals totals;
+    {
+        EventLoop loop;
+        std::vector<std::unique_ptr<Listener>> listeners;
+        std::vector<std::unique_ptr<Talker>> talkers;
+        for (int i = 0; i < opt.clients; i++) listeners.emplace_back(new Listener(i, opt.talkers, loop));
+        for (int i = 0; i < opt.talkers; i++) talkers.emplace_back(new Talker(loop));
+        ok = loop.run_until_done(run_bench(loop, opt, listeners, talkers, totals));
+        for (auto& l : listeners) l->chat.close();
+        for (auto& t : talkers) t->chat.close();
+        loop.run_until_done(settle(loop)); // Let the readers see the close and finish
+    }
+    net_cleanup();
+
+    const Histogram& c = totals.catch_up_ns;
+    std::cout << "lines:      " << totals.sent << " sent, " << totals.lost << " lost, " << totals.repeated << " repeated\n"
+              << "reconnects: " << totals.dropped << " dropped, " << totals.resumed << " resumed, " << totals.gaps
+              << " gaps, " << totals.redials << " failed dials\n"
+              << "replayed:   " << totals.replayed << " frames (" << (totals.resumed ? (double)totals.replayed / totals.resumed : 0)
+              << " per reconnect)\n"
+              << "catch-up:   p50 " << c.percentile(0.50) / 1e6 << " ms, p99 " << c.percentile(0.99) / 1e6
+              << " ms, max " << c.max() / 1e6 << " ms\n";
+    bool passed = ok && totals.lost == 0 && totals.repeated == 0;
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,312 @@
+// --- ROOM BENCHMARK ---
+// What does a line said in a room (chat_room.h) cost, with many rooms or
+// one very big one? The server walks the room's members, not all of its
+// users, so a room of 100 should cost 100 deliveries however many other
+// users and rooms there are. This tool measures:
+//   1. Fan-out, in this process: --users users spread over --rooms rooms of
+//      --members each, the way the server keeps them (an array of members
+//      per room), against looking at every user and checking whether it is
+//      in the room. Reports the time per line of each.
+//   2. Delivery, against a running server: --users sessions connect and say
+//      hello ("rb0", "rb1", ...), all on one thread with the client library.
+//      Room r ("r0", "r1", ...) gets --members of them, users r*members,
+//      r*members+1, ... (counted round the users), so each user is in
+//      rooms*members/users rooms. Once every ROOM_JOINED is back and the
+//      join announcements have died down, --senders users each say
+//      --messages lines, one every --interval-ms, each in one of their rooms
+//      picked at random. Each line carries the time it was sent, and every
+//      other member checks how long it took to arrive.
+// Reports the latency (p50 / p99 / max), how many of the expected
+// deliveries arrived, and whether any reached a user outside the room.
+// Returns 1 if users couldn't get in, a delivery is still missing
+// --timeout seconds after the last send, or one went to the wrong user.
+//
+//   10,000 rooms of 100:   room_bench.exe --users 10000 --rooms 10000 --members 100
+//   one room of 10,000:    room_bench.exe --users 10000 --rooms 1 --members 10000
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include "chat_client.h"
+#include "chat_session.h"
+#include "chat_room.h"
+#include "chat_histogram.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::vector<std::string> hosts{"127.0.0.1"};
+    int port = 60000;
+    int users = 10000;        // Sessions online (one socket each)
+    int rooms = 10000;        // Rooms
+    int members = 100;        // Users in each room
+    int senders = 100;        // How many users say something
+    int messages = 5;         // Lines each sender says
+    int interval_ms = 1000;   // Time between one sender's lines
+    int timeout_sec = 60;     // Give up on a step after this long
+    bool fanout_only = false; // Step 1 only: no server needed
+};
+
+// The users of room 'r', by number.
+static int member_of(const Options& opt, int room, int j) {
+    return (int)(((long long)room * opt.members + j) % opt.users);
+}
+
+// --- STEP 1: FAN-OUT ---
+// One user as the server sees it: where its messages go, and its rooms.
+struct FakeUser {
+    std::vector<uint32_t> rooms;
+    uint64_t queued = 0;
+};
+
+static void measure_fanout(const Options& opt) {
+    std::vector<FakeUser> users(opt.users);
+    std::vector<std::vector<FakeUser*>> members(opt.rooms); // The subscription index
+    for (int r = 0; r < opt.rooms; r++) {
+        for (int j = 0; j < opt.members; j++) {
+            FakeUser& user = users[member_of(opt, r, j)];
+            user.rooms.push_back((uint32_t)r);
+            members[r].push_back(&user);
+        }
+    }
+    std::mt19937 random(1);
+    std::vector<uint32_t> said;
+    for (int i = 0; i < 20000; i++) said.push_back((uint32_t)(random() % opt.rooms));
+
+    long long start = now_ns();
+    for (uint32_t room : said) {
+        for (FakeUser* user : members[room]) user->queued++;
+    }
+    double index_ns = (double)(now_ns() - start) / said.size();
+
+    size_t scans = std::min<size_t>(said.size(), 200); // A scan is slow: fewer of them
+    start = now_ns();
+    for (size_t i = 0; i < scans; i++) {
+        for (FakeUser& user : users) {
+            if (std::find(user.rooms.begin(), user.rooms.end(), said[i]) != user.rooms.end()) user.queued++;
+        }
+    }
+    double scan_ns = (double)(now_ns() - start) / scans;
+    uint64_t queued = 0;
+    for (const FakeUser& user : users) queued += user.queued;
+    std::cout << "fan-out: " << opt.rooms << " rooms of " << opt.members << " among " << opt.users << " users, member array "
+              << index_ns / 1e3 << " us, checking every user " << scan_ns / 1e3 << " us per line (" << queued << " queued)\n";
+}
+
+// --- STEP 2: DELIVERY ---
+// What all users add up together (there is one thread: no atomics needed).
+struct Totals {
+    int connected = 0;        // Connections that came up
+    int failed = 0;           // ...or didn't
+    int welcomed = 0;         // Users that got their session ID
+    long long joined = 0;     // ROOM_JOINED answers
+    int refused = 0;          // ROOM_FAILED answers
+    int done_sending = 0;     // Senders that said all their lines (or gave up)
+    bool go = false;          // Everyone is in and the joins have settled: talk
+    long long frames = 0;     // Frames of any kind received, to see things settle
+    long long sent = 0;       // Lines said in a room
+    long long expected = 0;   // Deliveries those should make (members - 1 each)
+    long long delivered = 0;  // Lines received by a member
+    long long wrong = 0;      // Received by somebody outside the room, or garbled
+    long long start = 0;      // When the users started (ns)
+    std::unordered_map<uint32_t, int> room_index; // Room ID -> room number
+    Histogram latency_ns;     // Send until arrival, per delivery
+};
+
+struct User {
+    int index;
+    ChatClient client;
+    std::vector<int> rooms;   // Room numbers, in order
+    User(int index, EventLoop& loop) : index(index), client(loop) {}
+};
+
+// A user's reader: counts its welcome, its rooms, and every line said in
+// them by somebody else.
+static Task<void> read_frames(User& user, Totals& totals) {
+    Frame frame;
+    while (co_await user.client.next(frame)) {
+        totals.frames++;
+        if (frame.type == FRAME_WELCOME) {
+            totals.welcomed++;
+            continue;
+        }
+        if (frame.type == FRAME_ROOM) {
+            if (frame.flags == ROOM_FAILED) totals.refused++;
+            if (frame.flags != ROOM_JOINED || frame.length <= ROOM_ID_SIZE) continue;
+            std::string name(frame.payload + ROOM_ID_SIZE, frame.length - ROOM_ID_SIZE);
+            totals.room_index[(uint32_t)read_be(frame.payload, ROOM_ID_SIZE)] = std::stoi(name.substr(1));
+            totals.joined++;
+            continue;
+        }
+        uint32_t room = chat_room(frame);
+        if (frame.type != FRAME_CHAT || !room) continue;
+        auto it = totals.room_index.find(room);
+        if (it == totals.room_index.end() || frame.length != SESSION_ID_SIZE + ROOM_ID_SIZE + 16 ||
+            !std::binary_search(user.rooms.begin(), user.rooms.end(), it->second)) {
+            totals.wrong++;
+            continue;
+        }
+        long long sent_at = (long long)read_hex(frame.payload + SESSION_ID_SIZE + ROOM_ID_SIZE, 16);
+        totals.latency_ns.record((uint64_t)(now_ns() - sent_at));
+        totals.delivered++;
+    }
+}
+
+// A user: connect, say hello, join its rooms, and (for the first
+// --senders) wait for the signal, then talk in them.
+static Task<void> run_user(User& user, EventLoop& loop, const Options& opt, Totals& totals,
+                           const std::vector<uint32_t>& room_ids) {
+    const std::string& host = opt.hosts[user.index % opt.hosts.size()];
+    bool connected = co_await user.client.connect(host, opt.port);
+    if (!connected) {
+        totals.failed++;
+        if (user.index < opt.senders) totals.done_sending++;
+        co_return;
+    }
+    totals.connected++;
+    std::string hello = hello_frame("rb" + std::to_string(user.index));
+    for (int room : user.rooms) hello += room_join_frame("r" + std::to_string(room));
+    co_await user.client.send(hello);
+    read_frames(user, totals).detach();
+    if (user.index >= opt.senders) co_return; // Only listens
+    while (!totals.go && user.client.is_open()) co_await loop.sleep(10);
+    // Senders take turns across the interval instead of all talking at once.
+    co_await loop.sleep((int)((long long)opt.interval_ms * user.index / opt.senders));
+    std::mt19937 random((unsigned)user.index + 1);
+    std::string frame;
+    char stamp[16]; // The time it was sent, in hex (chat lines are text)
+    for (int i = 0; i < opt.messages && user.client.is_open() && !user.rooms.empty(); i++) {
+        if (i > 0) co_await loop.sleep(opt.interval_ms);
+        int room = user.rooms[random() % user.rooms.size()];
+        write_hex(stamp, (uint64_t)now_ns(), 16);
+        build_room_chat_frame(frame, room_ids[room], stamp, sizeof(stamp));
+        bool sent = co_await user.client.send(frame);
+        if (sent) {
+            totals.sent++;
+            totals.expected += opt.members - 1;
+        }
+    }
+    totals.done_sending++;
+}
+
+// One more turn of the loop.
+static Task<void> settle(EventLoop& loop) {
+    co_await loop.sleep(1);
+}
+
+// The whole run. Returns false if it didn't finish in time.
+static Task<bool> run_bench(EventLoop& loop, const Options& opt, std::vector<std::unique_ptr<User>>& users, Totals& totals) {
+    std::vector<uint32_t> room_ids(opt.rooms, 0); // Filled in once the answers are back
+    totals.start = now_ns();
+    for (auto& user : users) run_user(*user, loop, opt, totals, room_ids).detach();
+
+    long long deadline = totals.start + opt.timeout_sec * 1000000000LL;
+    long long memberships = (long long)opt.rooms * opt.members;
+    while ((totals.welcomed + totals.failed < opt.users || totals.joined + totals.refused < memberships) && now_ns() < deadline) {
+        co_await loop.sleep(5);
+    }
+    std::cout << "setup: " << totals.welcomed << " of " << opt.users << " users in, " << totals.joined << " of "
+              << memberships << " room joins answered after " << (now_ns() - totals.start) / 1000000 << " ms\n";
+    if (totals.welcomed < opt.users || totals.joined < memberships) {
+        std::cerr << totals.failed << " users could not connect, " << totals.refused << " joins were refused, "
+                  << "the rest got no answer within " << opt.timeout_sec << " s.\n";
+        co_return false;
+    }
+    for (auto& pair : totals.room_index) room_ids[pair.second] = pair.first;
+    // Every join is announced to everyone: wait until that traffic is over,
+    // so it doesn't queue in front of the lines.
+    long long frames = -1;
+    while (totals.frames != frames && now_ns() < deadline) {
+        frames = totals.frames;
+        co_await loop.sleep(500);
+    }
+    std::cout << "       " << totals.frames << " frames of rosters, joins and answers, settled after "
+              << (now_ns() - totals.start) / 1000000 << " ms\n";
+
+    totals.go = true;
+    deadline = now_ns() + ((long long)opt.messages * opt.interval_ms / 1000 + opt.timeout_sec) * 1000000000LL;
+    while (totals.done_sending < opt.senders && now_ns() < deadline) co_await loop.sleep(5);
+    deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while (totals.delivered < totals.expected && now_ns() < deadline) co_await loop.sleep(5);
+
+    const Histogram& l = totals.latency_ns;
+    std::cout << "rooms: " << totals.sent << " lines said, " << totals.delivered << " of " << totals.expected
+              << " deliveries arrived, " << totals.wrong << " outside the room\n"
+              << "       latency p50 " << l.percentile(0.50) / 1e3 << " us, p99 " << l.percentile(0.99) / 1e3
+              << " us, max " << l.max() / 1e3 << " us\n";
+    co_return totals.delivered == totals.expected && totals.wrong == 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--fanout-only") {
+            opt.fanout_only = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--host") {
+            opt.hosts.clear();
+            std::string list = argv[++i];
+            for (size_t at = 0; at <= list.size();) {
+                size_t comma = std::min(list.find(',', at), list.size());
+                if (comma > at) opt.hosts.push_back(list.substr(at, comma - at));
+                at = comma + 1;
+            }
+            if (opt.hosts.empty()) opt.hosts.push_back("127.0.0.1");
+        }
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--users") opt.users = std::max(2, std::stoi(argv[++i]));
+        else if (arg == "--rooms") opt.rooms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--members") opt.members = std::max(2, std::stoi(argv[++i]));
+        else if (arg == "--senders") opt.senders = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--messages") opt.messages = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--interval-ms") opt.interval_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: room_bench.exe [--host IP[,IP...]] [--port N] [--users N] [--rooms N] [--members N]\n"
+                      << "                      [--senders N] [--messages N] [--interval-ms N] [--timeout SECONDS]\n"
+                      << "                      [--fanout-only]\n";
+            return 1;
+        }
+    }
+    opt.members = std::min(opt.members, opt.users);
+    opt.senders = std::min(opt.senders, opt.users);
+    if ((long long)opt.rooms * opt.members > (long long)opt.users * ROOM_PER_USER_MAX || opt.rooms > ROOM_MAX) {
+        std::cerr << "That puts users in more than " << ROOM_PER_USER_MAX << " rooms each (or makes more than "
+                  << ROOM_MAX << " rooms).\n";
+        return 1;
+    }
+    measure_fanout(opt);
+    if (opt.fanout_only) return 0;
+
+    if (!net_startup()) return 1;
+    raise_fd_limit(); // One socket per user
+    bool ok;
+    {
+        EventLoop loop;
+        std::vector<std::unique_ptr<User>> users;
+        for (int i = 0; i < opt.users; i++) users.emplace_back(new User(i, loop));
+        for (int r = 0; r < opt.rooms; r++) {
+            for (int j = 0; j < opt.members; j++) users[member_of(opt, r, j)]->rooms.push_back(r); // In order of r
+        }
+        Totals totals;
+        ok = loop.run_until_done(run_bench(loop, opt, users, totals));
+        for (auto& user : users) user->client.close();
+        loop.run_until_done(settle(loop)); // Let the readers see the close and finish
+    }
+    net_cleanup();
+    return ok ? 0 : 1;
+}
@@ -4,148 +4,3087 @@
 #include <string>       // Allows us to use text strings
 #include <thread>       // Allows the program to do multiple things at once (Multithreading)
 #include <mutex>        // "Mutual Exclusion" - prevents two threads from messing up data at the same time
-#include <winsock2.h>   // The main Windows library for networking (Sockets)
+#include <unordered_map> // A fast lookup table: socket -> connection state
 #include <algorithm>    // Helper functions to find/remove items from lists
-
-// --- LINKING ---
-// This tells the compiler to grab the "ws2_32.lib" system file. 
-// Without this, Windows won't understand any networking commands.
-#pragma comment(lib, "ws2_32.lib")
+#include <cstdlib>      // malloc/free, under the counting operator new
+#include <new>          // std::bad_alloc
+#ifndef _WIN32
+#include <pthread.h>    // Pinning threads to CPU cores
+#endif
+#include "chat_net.h"   // Winsock on Windows, BSD sockets on Linux (also links ws2_32.lib)
+#include "chat_poller.h" // epoll on Linux, WSAPoll on Windows
+#include "chat_frame.h"  // Length-prefixed message frames
+#include "chat_outbound.h" // Shared message payloads and per-user send queues
+#include "chat_mailbox.h" // Lock-free mailboxes between shards
+#include "chat_log.h"     // Memory-mapped message history on disk
+#include "chat_metrics.h" // Per-thread counters, served to monitoring tools
+#include "chat_uring.h"   // Optional io_uring backend (Linux)
+#include "chat_session.h" // Session IDs and who is who
+#include "chat_relay.h"   // Links that join several servers into one chat
+#include "chat_shm_channel.h" // Shared memory for clients on this machine
+#include "chat_files.h"   // File attachments
+#include "chat_admission.h" // Limits on new connections
+#include "chat_timer_wheel.h" // Heartbeat timers, one per connection
+#include "chat_handoff.h" // Handing everything to a new server (hot restart)
+#include "chat_resume.h"  // Numbered messages, and catching up after a reconnect
+#include "chat_utf8.h"    // Checking that chat text is UTF-8
+#include "chat_direct.h"  // Direct messages, and who is connected where
+#include "chat_room.h"    // Rooms, and who is in each
+#ifdef __linux__
+#include <sys/sendfile.h> // File chunks straight from disk to socket
+#endif
+#include <memory>         // std::unique_ptr
+#include <deque>          // Handshakes waiting, oldest first
+#include <condition_variable> // Shards waiting out a handoff
 
 // --- CONSTANTS ---
-#define PORT 60000       // We will listen on port 8080. Like a specific door number on a building.
+#define PORT 60000       // We will listen on port 60000. Like a specific door number on a building.
+#define BACKLOG SOMAXCONN // How many people can wait on hold before accept() picks them up (default for --backlog).
+
+// =====================================================================
+// MODE 1: THREAD-PER-CLIENT (the original design, kept for comparison)
+// Run with:  server.exe --threads
+// =====================================================================
 
 // --- GLOBAL VARIABLES ---
 std::vector<SOCKET> clients; // A list that holds the ID cards (sockets) of everyone connected
 std::mutex clients_mutex;    // A lock. Only one thread can touch the 'clients' list when this is locked.
 
+MetricsRegistry metrics_registry;                 // Every thread's counters (both modes)
+SessionDirectory sessions;                        // Who has said hello (both modes)
+NameIndex direct_index;                           // Where each user name is connected (both modes)
+RoomDirectory rooms;                              // Room names and IDs (both modes)
+std::unordered_map<uint32_t, std::vector<SOCKET>> room_sockets; // Threads mode: who is in each room (under clients_mutex)
+Admission admission;                              // Who may connect right now (chat_admission.h)
+int listen_backlog = BACKLOG;                     // Connections the kernel holds for us (--backlog)
+long long heartbeat_ms = 30000;                   // Ping a connection that has been quiet this long (--heartbeat, 0 = never)
+long long idle_timeout_ms = 90000;                // Hang up on one that has been quiet this long, ping or not (--idle-timeout)
+thread_local ThreadMetrics* thread_metrics = nullptr; // This thread's own counters, if it has any
+
+// --- HEAP ALLOCATION COUNTER ---
+// Every 'new' in the server (including inside std::string, std::vector and
+// friends) comes through here and is counted for the thread that made it,
+// so the metrics show whether the message path allocates once warmed up.
+// Growth to a new high (HeapGrowth) is counted separately as well.
+void* operator new(size_t size) {
+    if (thread_metrics) {
+        thread_metrics->allocations.add();
+        if (heap_growth) thread_metrics->growth_allocations.add();
+    }
+    void* memory = malloc(size ? size : 1);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+void* operator new[](size_t size) { return operator new(size); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // GCC doesn't see that new above is malloc
+#endif
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 // --- FUNCTION: BROADCAST ---
 // This function sends a message to everyone EXCEPT the person who sent it.
-void broadcast(std::string message, SOCKET sender_socket) {
+// The message is sent straight out of the sender's receive buffer: no copy.
+void broadcast(const char* message, size_t length, SOCKET sender_socket) {
     // Lock the door! We are reading the client list, so nobody else should add/remove clients right now.
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    
+    // (lock_timed also records how long we had to wait for it.)
+    std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &thread_metrics->mutex_wait_ns);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
     // Loop through every client in our list
     for (SOCKET client : clients) {
         // If this client is NOT the sender...
         if (client != sender_socket) {
             // Send the message to them!
-            // .c_str() turns the C++ string into a raw style C-string that the network understands.
-            send(client, message.c_str(), message.size(), 0);
+            int sent = send(client, message, (int)length, 0);
+            thread_metrics->send_calls.add();
+            thread_metrics->messages_out.add();
+            if (sent > 0) thread_metrics->bytes_out.add(sent);
         }
     }
+    thread_metrics->fanout_ns.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
     // The lock is automatically unlocked here when the function finishes.
 }
 
+// --- FUNCTION: CHAT TEXT VALID ---
+// Is a chat frame's text (after the sender's ID and room, if it has them) UTF-8?
+bool chat_text_valid(const Frame& chat) {
+    size_t skip = chat.flags & CHAT_SENDER ? SESSION_ID_SIZE : 0;
+    if (chat.flags & CHAT_ROOM) skip += ROOM_ID_SIZE;
+    return skip <= chat.length && utf8_valid(chat.payload + skip, chat.length - skip);
+}
+
+// --- FUNCTION: ROOM NAME VALID ---
+// Is a ROOM_JOIN frame's name one we can make a room for?
+bool room_name_valid(const Frame& join) {
+    return join.length >= 1 && join.length <= ROOM_NAME_MAX && utf8_valid(join.payload, join.length);
+}
+
+// --- FUNCTION: SEND DIRECT ---
+// Give a direct message to everyone online under the name it is for, or
+// tell the sender that nobody is. The index is read under the clients lock:
+// a leaving client drops out of it under that lock before its socket is
+// closed, so a socket found here still belongs to the user it was found for.
+void send_direct(SOCKET client_socket, uint32_t session, const Frame& frame) {
+    std::string name;
+    const char* text;
+    size_t text_length;
+    if (frame.flags != DIRECT_SEND || !parse_direct(frame, name, text, text_length)) return;
+    if (!utf8_valid(text, text_length)) {
+        thread_metrics->invalid_utf8.add();
+        return;
+    }
+    std::string message = direct_received(session, text, text_length);
+    std::vector<DirectRoute> routes;
+    std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &thread_metrics->mutex_wait_ns);
+    if (direct_index.find(name, routes) == 0) {
+        std::string unknown;
+        encode_frame(unknown, FRAME_DIRECT, DIRECT_UNKNOWN, name.data(), name.size());
+        send_all(client_socket, unknown.data(), unknown.size());
+        thread_metrics->direct_unknown.add();
+        return;
+    }
+    for (const DirectRoute& route : routes) {
+        send_all(route.sock, message.data(), message.size());
+        thread_metrics->send_calls.add();
+        thread_metrics->messages_out.add();
+        thread_metrics->bytes_out.add(message.size());
+        thread_metrics->direct_messages.add();
+    }
+}
+
+// --- FUNCTION: BROADCAST TO ROOM ---
+// Like broadcast(), but only to the members of one room.
+void broadcast_room(const char* message, size_t length, uint32_t room, SOCKET sender_socket) {
+    std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &thread_metrics->mutex_wait_ns);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (SOCKET client : room_sockets[room]) {
+        if (client == sender_socket) continue;
+        int sent = send(client, message, (int)length, 0);
+        thread_metrics->send_calls.add();
+        thread_metrics->messages_out.add();
+        if (sent > 0) thread_metrics->bytes_out.add(sent);
+    }
+    thread_metrics->fanout_ns.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// --- FUNCTION: LEAVE ROOM ---
+// Take a socket out of a room's member list (clients_mutex held). The last
+// one out lets the room go, so its ID can be reused (chat_room.h); threads
+// mode counts as loop 0 of the RoomDirectory.
+void leave_room(uint32_t room, SOCKET client_socket) {
+    auto it = room_sockets.find(room);
+    if (it == room_sockets.end()) return;
+    std::vector<SOCKET>& members = it->second;
+    members.erase(std::remove(members.begin(), members.end(), client_socket), members.end());
+    if (!members.empty()) return;
+    room_sockets.erase(it);
+    rooms.set_present(room, 0, false);
+}
+
+// --- FUNCTION: ROOM REQUEST ---
+// The client wants to join or leave a room (chat_room.h). 'joined' is the
+// list of rooms it is in, kept by its own thread.
+void room_request(SOCKET client_socket, const Frame& frame, std::vector<uint32_t>& joined) {
+    std::string reply;
+    std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &thread_metrics->mutex_wait_ns);
+    if (frame.flags == ROOM_JOIN) {
+        std::string name(frame.payload, frame.length);
+        uint32_t id = room_name_valid(frame) ? rooms.open(name, 0) : 0;
+        bool member = std::find(joined.begin(), joined.end(), id) != joined.end();
+        if (id == 0 || (!member && joined.size() >= ROOM_PER_USER_MAX)) {
+            if (id != 0 && !room_sockets.count(id)) rooms.set_present(id, 0, false); // open() marked it for nothing
+            encode_frame(reply, FRAME_ROOM, ROOM_FAILED, frame.payload, frame.length);
+        } else {
+            if (!member) {
+                joined.push_back(id);
+                room_sockets[id].push_back(client_socket);
+            }
+            encode_room(reply, ROOM_JOINED, id, name);
+        }
+    } else if (frame.flags == ROOM_LEAVE && frame.length == ROOM_ID_SIZE) {
+        uint32_t id = (uint32_t)read_be(frame.payload, ROOM_ID_SIZE);
+        auto it = std::find(joined.begin(), joined.end(), id);
+        if (it == joined.end()) return;
+        joined.erase(it);
+        leave_room(id, client_socket);
+        encode_room(reply, ROOM_LEFT, id, "");
+    }
+    if (!reply.empty()) send_all(client_socket, reply.data(), reply.size());
+}
+
+// Every session ID this server may give out is taken. Old IDs are in the
+// history, so they are never handed out again: new users are turned away
+// instead. Said once, not once per user.
+void out_of_session_ids() {
+    static std::atomic<bool> said{false};
+    if (!said.exchange(true)) std::cout << "Out of session IDs: new users are being turned away." << std::endl;
+}
+
+// --- FUNCTION: START SESSION ---
+// The client said hello: give it a session ID, tell it who is already here,
+// and tell everyone else that it joined. Returns the new ID.
+uint32_t start_session(SOCKET client_socket, const Frame& hello) {
+    std::string name(hello.payload, hello.length);
+    uint32_t id = sessions.join(name);
+    if (!id) {
+        out_of_session_ids();
+        return 0;
+    }
+    direct_index.add(sessions.name_of(id), DirectRoute{-1, client_socket, (unsigned long long)client_socket});
+
+    std::string reply;
+    char id_bytes[SESSION_ID_SIZE];
+    write_be(id_bytes, id, SESSION_ID_SIZE);
+    encode_frame(reply, FRAME_WELCOME, 0, id_bytes, SESSION_ID_SIZE);
+    sessions.append_roster(reply, id);
+    {
+        // Other threads send to this socket too (under the lock), so ours
+        // must not land in the middle of one of theirs.
+        std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &thread_metrics->mutex_wait_ns);
+        send_all(client_socket, reply.data(), reply.size());
+    }
+
+    std::string joined;
+    encode_presence(joined, PRESENCE_JOIN, id, sessions.name_of(id));
+    broadcast(joined.data(), joined.size(), client_socket);
+    return id;
+}
+
 // --- FUNCTION: HANDLE CLIENT ---
 // This function runs on a separate thread for EACH user.
 // It listens for their messages forever until they disconnect.
 void handle_client(SOCKET client_socket) {
-    char buffer[1024]; // A temporary container to hold incoming messages (max 1024 characters)
-    
+    FrameDecoder decoder; // Collects bytes until whole frames are available
+    Frame frame;
+    uint32_t session = 0;  // Our session ID, once the client has said hello
+    uint64_t sent = 0;     // Chat messages this client has sent
+    std::vector<uint32_t> joined; // Rooms it is in
+
+    // This thread's own counters, added to the "threads" total when it ends.
+    ThreadMetrics metrics;
+    metrics.label = "threads";
+    metrics.clients.add();
+    thread_metrics = &metrics;
+    metrics_registry.add(&metrics);
+
+    // Heartbeats: recv() gives up after a quiet spell, so a client that
+    // went silent (or whose machine vanished without closing the
+    // connection) gets a ping, and is hung up on if it stays silent.
+    long long quiet_ms = 0; // How long the client has said nothing
+    bool pinged = false;
+    if (heartbeat_ms > 0) set_recv_timeout(client_socket, heartbeat_ms);
+
     while (true) {
-        // Clean the buffer (fill it with zeros) so old messages don't get mixed in
-        ZeroMemory(buffer, 1024);
-        
         // recv() waits here until data arrives. It is "blocking".
-        // It returns the number of bytes received.
-        int bytes_received = recv(client_socket, buffer, 1024, 0);
-        
-        // If bytes_received is 0 or less, it means the user closed the window or lost internet.
-        if (bytes_received <= 0) {
+        // If it fails, the user closed the window or lost internet.
+        char* dst = decoder.write_ptr();
+        int received = recv(client_socket, dst, (int)decoder.write_space(), 0);
+        if (received < 0 && heartbeat_ms > 0 && net_timed_out()) {
+            quiet_ms += pinged ? idle_timeout_ms - heartbeat_ms : heartbeat_ms;
+            if (!pinged && quiet_ms < idle_timeout_ms) {
+                char ping[FRAME_HEADER_SIZE];
+                write_frame_header(ping, FRAME_HEARTBEAT, HEARTBEAT_PING, 0);
+                {
+                    std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+                    send_all(client_socket, ping, sizeof(ping));
+                }
+                metrics.pings.add();
+                pinged = true;
+                set_recv_timeout(client_socket, idle_timeout_ms - heartbeat_ms); // The rest of its time
+                continue;
+            }
+            metrics.reaped.add(); // Silent even after the ping: treat it as gone
+            received = 0;
+        }
+        bool connected = received > 0;
+        if (connected) {
+            decoder.commit(received);
+            metrics.bytes_in.add(received);
+            if (pinged) set_recv_timeout(client_socket, heartbeat_ms);
+            quiet_ms = 0;
+            pinged = false;
+        }
+
+        // One recv() can hold several messages, or only part of one.
+        FrameStatus status = FRAME_NEED_MORE;
+        while (connected && (status = decoder.next(frame)) == FRAME_OK) {
+            if (frame.type == FRAME_HELLO && session == 0) {
+                if (!utf8_valid(frame.payload, frame.length)) { // A name that isn't text: hang up
+                    metrics.invalid_utf8.add();
+                    connected = false;
+                    break;
+                }
+                session = start_session(client_socket, frame);
+                if (!session) { // No IDs left: hang up
+                    connected = false;
+                    break;
+                }
+                continue;
+            }
+            if (frame.type == FRAME_HEARTBEAT && frame.flags == HEARTBEAT_PING) {
+                char pong[FRAME_HEADER_SIZE];
+                write_frame_header(pong, FRAME_HEARTBEAT, HEARTBEAT_PONG, 0);
+                std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+                send_all(client_socket, pong, sizeof(pong));
+                continue;
+            }
+            if (frame.type == FRAME_FILE && frame.flags == FILE_UPLOAD) {
+                // Attachments need the event loops: say no, so the sender doesn't wait.
+                std::string refused;
+                encode_frame(refused, FRAME_FILE, FILE_FAILED, "", 0);
+                std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+                send_all(client_socket, refused.data(), refused.size());
+                continue;
+            }
+            if (frame.type == FRAME_RESUME && frame.flags == RESUME_ASK) {
+                // Nothing is numbered in this mode: the client asks for history instead.
+                char gap[FRAME_HEADER_SIZE];
+                write_frame_header(gap, FRAME_RESUME, RESUME_GAP, 0);
+                std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+                send_all(client_socket, gap, sizeof(gap));
+                continue;
+            }
+            if (frame.type == FRAME_DIRECT) {
+                if (session) send_direct(client_socket, session, frame);
+                continue;
+            }
+            if (frame.type == FRAME_ROOM) {
+                if (session) room_request(client_socket, frame, joined);
+                continue;
+            }
+            // Send this message (header and all) to everyone else
+            if (frame.type != FRAME_CHAT) continue;
+            if (frame.flags & CHAT_SENDER) {
+                if (frame.length < SESSION_ID_SIZE) continue;
+                write_be((char*)frame.payload, session, SESSION_ID_SIZE); // Stamp the real sender
+            }
+            if (!chat_text_valid(frame)) {
+                metrics.invalid_utf8.add(); // Not passed on: every client can trust what it shows
+                continue;
+            }
+            uint32_t room = chat_room(frame);
+            if ((frame.flags & CHAT_ROOM) && std::find(joined.begin(), joined.end(), room) == joined.end()) {
+                continue; // Only members may talk in a room
+            }
+            metrics.messages_in.add();
+            sent++;
+            if (room) broadcast_room(frame.raw, frame.raw_length, room, client_socket);
+            else broadcast(frame.raw, frame.raw_length, client_socket);
+        }
+        if (connected && status == FRAME_BAD) connected = false; // Garbage on the wire: hang up
+
+        if (!connected) {
+            if (session) {
+                // Out of the name index and the rooms before the socket number can be reused.
+                std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+                direct_index.remove(sessions.name_of(session), -1, (unsigned long long)client_socket);
+                for (uint32_t room : joined) leave_room(room, client_socket);
+            }
+
             // Close the connection properly
             closesocket(client_socket);
-            
+
             // Lock the list again because we are about to remove someone
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            
-            // Find this client in the list and remove them
-            clients.erase(std::remove(clients.begin(), clients.end(), client_socket), clients.end());
-            
-            std::cout << "Client disconnected." << std::endl;
+            {
+                std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+
+                // Find this client in the list and remove them
+                clients.erase(std::remove(clients.begin(), clients.end(), client_socket), clients.end());
+            }
+
+            if (session) {
+                std::string left;
+                encode_presence(left, PRESENCE_LEAVE, session, "");
+                sessions.leave(session);
+                broadcast(left.data(), left.size(), INVALID_SOCKET);
+                std::cout << "Client disconnected: " << sessions.name_of(session) << " (#" << session << "), "
+                          << sent << " messages sent." << std::endl;
+            } else {
+                std::cout << "Client disconnected." << std::endl;
+            }
+            metrics.clients.sub();
+            metrics.disconnected.add();
+            metrics_registry.remove(&metrics);
             break; // Break the loop to stop this thread
         }
-
-        // If we got a message, convert it to a string
-        std::string msg(buffer);
-        
-        // Send this message to everyone else
-        broadcast(msg, client_socket);
     }
 }
 
-// --- MAIN FUNCTION ---
-// This is where the program starts.
-int main() {
-    // 1. STARTUP WINSOCK
-    WSADATA wsaData; // Structure to hold Windows socket data
-    // WSAStartup turns on the networking capability in Windows.
-    // MAKEWORD(2, 2) asks for version 2.2.
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "WSAStartup failed.\n"; // Print error if it fails
-        return 1; // Exit program with error code
+// The original accept loop: one new thread for every person who connects.
+void run_thread_per_client(SOCKET server_socket) {
+    ThreadMetrics metrics; // The accept loop's own counters
+    metrics.label = "threads";
+    metrics_registry.add(&metrics);
+
+    while (true) {
+        // accept() stops and waits here until someone tries to connect.
+        // When they do, it returns a NEW socket just for that person.
+        SOCKET new_socket = accept(server_socket, nullptr, nullptr);
+        if (new_socket == INVALID_SOCKET) {
+            continue; // If connection failed, just try again (continue loop)
+        }
+        if (!admission.allow(peer_address(new_socket))) {
+            closesocket(new_socket); // This address is connecting too often
+            metrics.refused.add();
+            continue;
+        }
+
+        // Add the new person to our list (Thread safe!)
+        {
+            std::unique_lock<std::mutex> lock = lock_timed(clients_mutex, &metrics.mutex_wait_ns);
+            clients.push_back(new_socket);
+        }
+        metrics.accepted.add();
+
+        // Create a new thread (a worker) to handle this specific person.
+        // detach() lets the thread run on its own in the background.
+        std::thread t(handle_client, new_socket);
+        t.detach();
     }
+}
+
+// =====================================================================
+// MODE 2: EVENT LOOPS (the default)
+// Each event loop ("shard") owns its sockets. The poller tells us which
+// sockets are ready, and we only ever call accept/recv/send when they will
+// not block. Idle users cost a few bytes of bookkeeping instead of a whole
+// thread. Run with:  server.exe --shards 4 --pin
+// =====================================================================
 
-    // 2. CREATE THE SERVER SOCKET
+// --- FUNCTION: OPEN LISTENER ---
+// Create, bind and start a listening socket on 'port'. With 'reuseport' set,
+// several sockets may listen on the same port (one per shard) and the kernel
+// spreads incoming connections across them.
+SOCKET open_listener(int port, bool reuseport) {
     SOCKET server_socket;
     // AF_INET = IPv4 (Standard internet address)
     // SOCK_STREAM = TCP (Reliable connection, like a phone call)
     if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
         std::cerr << "Socket creation failed.\n";
-        return 1;
+        return INVALID_SOCKET;
+    }
+    set_reuseaddr(server_socket); // Let a restarted server reuse the port straight away
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        int yes = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&yes, sizeof(yes));
     }
+#else
+    (void)reuseport;
+#endif
 
-    // 3. SETUP ADDRESS STRUCTURE
+    // SETUP ADDRESS STRUCTURE
     sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET; // Use IPv4
     address.sin_addr.s_addr = INADDR_ANY; // Accept connections from any IP address on this computer
-    address.sin_port = htons(PORT); // Set the port (8080). htons converts numbers to "Network Byte Order"
+    address.sin_port = htons(port); // Set the port. htons converts numbers to "Network Byte Order"
 
-    // 4. BIND
+    // BIND
     // Assign the IP and Port to our socket.
     if (bind(server_socket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
         std::cerr << "Bind failed.\n";
-        return 1;
+        closesocket(server_socket);
+        return INVALID_SOCKET;
     }
 
-    // 5. LISTEN
-    // Start listening for incoming calls. '3' is the backlog (how many people can wait on hold).
-    if (listen(server_socket, 3) == SOCKET_ERROR) {
+    // LISTEN
+    // Start listening for incoming calls. The backlog is how many people can wait on hold
+    // (the system may cap it: net.core.somaxconn on Linux).
+    if (listen(server_socket, listen_backlog) == SOCKET_ERROR) {
         std::cerr << "Listen failed.\n";
-        return 1;
+        closesocket(server_socket);
+        return INVALID_SOCKET;
     }
+    return server_socket;
+}
+
+// --- SETTINGS (changed from the command line in main) ---
+size_t queue_limit = 1024;                           // Max messages waiting for one user
+SlowConsumerPolicy slow_policy = SLOW_DROP_OLDEST;   // What to do when that limit is hit
+int shard_count = 1;                                 // How many event loops (one per core)
+bool pin_threads = false;                            // Lock each event loop onto its own core?
+std::string metrics_where;                           // Unix socket path or port for metrics ("" = off)
+std::string log_folder = "chat_log";                 // Where message history is kept ("" = keep none)
+MessageLog message_log;                              // Every broadcast message, for late joiners
+size_t send_batch = 64;                              // Queued messages written per send system call
+long long coalesce_ns = 0;                           // Hold small writes back this long to batch them (0 = off)
+size_t coalesce_bytes = 16384;                       // ...unless this many bytes are already waiting
+bool use_uring = false;                              // Run the shards on io_uring instead of the poller (--io uring)
+int listen_port = PORT;                              // Where users (and other nodes) connect
+uint32_t node_id = 0;                                // This server's node number (0 = not linked to others)
+std::string link_secret;                             // Every linked node knows it (--link-secret)
+std::vector<RelayPeer*> peers;                       // Nodes we dial and keep a link to (--peer)
+RelayFilter relay_filter;                            // Relay frames already seen, per origin node
+std::atomic<uint64_t> relay_seq(0);                  // Next sequence number for our own relay frames
+std::atomic<int> link_count(0);                      // Live links on all shards (0 = no relay needed)
+bool offer_shm = true;                               // Move local clients onto shared memory when they ask (--no-shm = never)
+std::string files_folder = "chat_files";             // Where uploaded attachments are kept ("" = no attachments)
+FileStore files;                                     // Those attachments, by file ID
+FileWriter file_writer;                              // The thread that writes uploads to disk
+std::string handoff_path;                            // Wait here for a new server to take over from us (--handoff)
+std::string take_over_path;                          // Take over from the server waiting here (--take-over)
+size_t resume_bytes = 4 * 1024 * 1024;               // Recent messages each shard keeps for reconnecting users (0 = none)
+uint64_t server_epoch = 0;                           // Tells this run of the server apart in RESUME frames
+
+#define MAILBOX_SLOTS 32768 // Messages that can wait for one shard, shared out among the shards that write to it
+#define MAILBOX_MIN 256     // ...but never fewer than this from each of them
+#define MAX_SEND_BATCH 256 // Upper limit for send_batch (slices on the stack)
+#define URING_ENTRIES 4096    // Requests one io_uring_enter() can hand over
+#define URING_BUFFERS 1024    // Receive buffers shared by all users of one shard (a power of two)
+#define URING_BUFFER_SIZE 8192 // Bytes per receive buffer
+#define URING_GROUP 0         // Buffer group id of those buffers
+#define LINK_QUEUE_LIMIT 65536 // Relay frames allowed to wait for one link
+#define LINK_RETRY_MS 1000    // How often a broken link is dialled again
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
 
-    std::cout << "Server listening on port " << PORT << "..." << std::endl;
+#ifdef CHAT_HAVE_URING
+// What an io_uring request was for; kept in the low byte of its user_data.
+enum UringOp { URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_WAKEUP, URING_CANCEL };
 
-    // 6. ACCEPT LOOP
-    // This loop runs forever, accepting new people.
+// io_uring reads a sendmsg's slice list after we hand it over, so the list
+// has to stay put until the send completes.
+struct UringSend {
+    msghdr msg;
+    IoSlice slices[MAX_SEND_BATCH];
+};
+#endif
+
+// Everything we remember about one connected user.
+struct Connection {
+    SOCKET sock = INVALID_SOCKET;
+    unsigned long long id = 0; // Never reused, unlike socket numbers
+    FrameDecoder decoder;      // Incoming bytes, cut into frames
+    OutboundQueue outbox;      // Messages waiting to be sent to this user
+    bool want_write = false;   // Are we currently asking the poller for POLL_WRITE?
+    bool in_flush_list = false; // Already queued for the end-of-tick flush?
+    long long queued_at = 0;   // When the outbox last went from empty to non-empty (ns)
+    int paused_by = 0;         // How many slow users are holding back our reads
+    std::vector<std::pair<SOCKET, unsigned long long>> paused_senders; // Senders WE are holding back
+    uint32_t session = 0;      // Session ID, once the user has said hello
+    uint64_t messages_sent = 0; // Chat messages this user has sent
+    uint32_t link_node = 0;    // Another server node, once it has said FRAME_LINK
+    int link_peer = -1;        // Index in 'peers' if WE dialled this link
+    std::unique_ptr<ShmChannel> shm; // Shared-memory channel, once offered to a local client
+    bool shm_up = false;       // The client's frames now come through shm->up()
+    bool shm_down = false;     // Ours now go through shm->down()
+    size_t tcp_left = 0;       // Queued messages still to go over TCP before shm_down (SHM_READY is the last)
+    FileUpload upload;         // The file this user is sending us, if any
+    bool disk_paused = false;  // Not read from until the disk thread catches up
+    std::vector<FileDownload> downloads; // Files we are sending this user, in the order asked for
+    bool handshaking = false;  // Counted in admission's handshakes until its first frame
+    WheelTimer heartbeat;      // Due when we should ping it, or give up on it
+    long long heard_at = 0;    // When it last sent us anything (ms, the shard's clock)
+    bool pinged = false;       // A ping went out since then
+    bool numbered = false;     // Gets a RESUME_MARK in front of what is published (chat_resume.h)
+    std::vector<uint32_t> rooms; // Rooms it is in (chat_room.h)
+#ifdef CHAT_HAVE_URING
+    bool recv_armed = false;               // io_uring: is a multishot recv running for us?
+    bool sending = false;                  // io_uring: is a sendmsg running for us?
+    std::unique_ptr<UringSend> send_op;    // io_uring: the slices that sendmsg reads
+#endif
+};
+
+// Does a user have file data we may send right now?
+static bool file_ready(const Connection& conn) {
+    return !conn.downloads.empty() && conn.downloads.front().ready();
+}
+
+#ifdef CHAT_HAVE_URING
+// A request's user_data: socket, low bits of the connection id, and the op.
+// The id tells a late result for a closed user apart from one for a new user
+// who got the same socket number.
+static uint64_t uring_tag(const Connection& conn, UringOp op) {
+    return (uint64_t)conn.sock << 32 | (conn.id & 0xFFFFFF) << 8 | op;
+}
+#endif
+
+// A new user that counts as a handshake until it sends its first frame, or
+// until 'due' (ns).
+struct PendingHandshake {
+    long long due;
+    SOCKET sock;
+    unsigned long long id;
+};
+
+// Something one shard hands to another: a message to deliver to all of its
+// users (or to those in one room), a direct message for one of them, or (on
+// systems without SO_REUSEPORT) a freshly accepted socket.
+struct MailItem {
+    Payload payload;
+    Payload relay;                 // The same as a FRAME_RELAY, for links (empty = none)
+    Payload numbered;              // The same with a RESUME_MARK in front, for users who asked
+    uint32_t messages = 0;         // How many chat frames 'payload' holds
+    SOCKET adopt = INVALID_SOCKET;
+    SOCKET to = INVALID_SOCKET;    // A direct message: only for this user,
+    unsigned long long to_id = 0;  // if it is still the same connection
+    uint32_t room = 0;             // A room's line: only for its members,
+    uint32_t room_generation = 0;  // if the room wasn't reused on the way
+};
+
+// A user handed over by the server we took over from (chat_handoff.h),
+// waiting for its shard to start.
+struct TakenConnection {
+    SOCKET sock = INVALID_SOCKET;
+    int shm_fd = -1;           // Its shared-memory channel, if it has one
+    std::string shm_name;
+    bool shm_owns_name = false;
+    bool shm_up = false;
+    bool shm_down = false;
+    size_t tcp_left = 0;
+    uint32_t session = 0;
+    uint64_t messages_sent = 0;
+    uint32_t link_node = 0;
+    int link_peer = -1;
+    std::vector<uint32_t> rooms;
+    std::string unread;               // Received, not yet a whole frame
+    std::vector<std::string> queued;  // Its outbox, oldest first
+};
+
+// --- SHARD ---
+// One event loop running on its own thread, with its own listening socket,
+// its own poller and its own users. Shards never share a connection table;
+// a broadcast reaches users on other shards through lock-free mailboxes.
+struct Shard {
+    int index = 0;
+    Poller poller;                                      // Watches this shard's sockets
+    Wakeup wakeup;                                      // Lets other shards interrupt poller.wait()
+    SOCKET listener = INVALID_SOCKET;                   // This shard's listening socket (if any)
+    std::unordered_map<SOCKET, Connection> connections; // socket -> that user's state
+    std::vector<SOCKET> flush_list;                     // Users with new messages queued this tick
+    unsigned long long next_connection_id = 1;
+    std::vector<SpscRing<MailItem>*> inbox;             // inbox[s] = mail FROM shard s
+    std::vector<std::vector<MailItem>> outgoing;        // outgoing[s] = mail TO shard s, not yet posted
+    size_t next_handoff = 0;                            // Round-robin target for handed-off sockets
+    ThreadMetrics metrics;                              // Counted only by this shard's thread
+#ifdef CHAT_HAVE_URING
+    std::unique_ptr<IoUring> ring;                      // Set when this shard runs on io_uring
+    std::vector<std::pair<SOCKET, unsigned long long>> resume_list; // Unpaused users to read again
+    std::unordered_map<uint64_t, Connection> graveyard; // Closed users whose last send is still running
+    bool accept_armed = false;                          // io_uring: is a multishot accept running?
+#endif
+    std::mutex dialed_mutex;                            // Guards 'dialed'
+    std::vector<std::pair<SOCKET, int>> dialed;         // Links the dialer threads opened: socket, peer index
+    std::string relay_scratch;                          // Reused to build relay frames
+    std::vector<DirectRoute> direct_routes;             // Reused to look up direct messages
+    std::unordered_map<uint32_t, std::vector<Connection*>> room_members; // Our users in each room (chat_room.h)
+    std::vector<std::pair<SOCKET, unsigned long long>> shm_resume; // Unpaused shared-memory users to read again
+    std::vector<std::pair<SOCKET, unsigned long long>> disk_paused; // Uploaders waiting for the disk thread
+    std::vector<FileJob> stored;                        // Uploads the disk thread has finished, being announced
+    std::deque<PendingHandshake> handshakes;            // New users that have not sent a frame yet, oldest first
+    bool accepting = true;                              // False while too many handshakes are running
+    TimerWheel timers;                                  // Every connection's heartbeat timer
+    std::vector<WheelTimer*> expired;                   // Reused: timers that came due this tick
+    std::vector<std::pair<SOCKET, unsigned long long>> quiet; // Reused: their connections
+    Payload heartbeat_frames[2];                        // A ping and a pong, built once and shared
+    long long clock_ms = 0;                             // The time at the start of this tick (ms)
+    std::vector<TakenConnection> taken;                 // Users from the server we took over from, to adopt
+    std::string handed;                                 // Handoff: our users, written down for the new server
+    std::vector<int> handed_fds;                        // Handoff: their sockets (and channels), in that order
+    std::vector<uint32_t> handed_dropped;               // Handoff: sessions of users that can't move
+    size_t handed_count = 0;                            // Handoff: users in 'handed'
+    ResumeRing resume_ring;                             // What this shard published lately, numbered
+
+    void update_interest(Connection& conn);
+    void resume_paused_senders(Connection& conn);
+    void close_connection(SOCKET sock);
+    bool flush(Connection& conn);
+    long long flush_pending();
+    bool apply_slow_policy(Connection& conn, Connection* sender, std::vector<SOCKET>& slow);
+    void deliver(const Payload& payload, const Payload& numbered, const Payload& relay, uint32_t messages, Connection* sender);
+    void publish(const Payload& payload, const Payload& relay, uint32_t messages, Connection* sender);
+    Payload number(const Payload& payload, Connection* sender);
+    void resume_session(Connection& conn, const Frame& ask);
+    Payload make_relay(const char* data, size_t len);
+    void broadcast(const char* data, size_t len, uint32_t messages, Connection& sender);
+    bool start_session(Connection& conn, const Frame& hello);
+    void end_session(uint32_t session, uint64_t messages_sent);
+    void direct_message(Connection& conn, const Frame& frame);
+    void deliver_direct(SOCKET sock, unsigned long long id, const Payload& payload);
+    void room_request(Connection& conn, const Frame& frame);
+    void enter_room(Connection& conn, uint32_t room);
+    void leave_room(Connection& conn, uint32_t room);
+    void say_in_room(Connection& conn, const Frame& chat);
+    void deliver_room(const Payload& payload, uint32_t room, Connection* sender);
+    bool start_link(Connection& conn, const Frame& hello);
+    bool relay_in(Connection& conn, const Frame& relay);
+    void adopt_dialed();
+    void send_history(Connection& conn, const Frame& request);
+    void switch_shm(Connection& conn, const Frame& request);
+    bool flush_shm(Connection& conn);
+    bool pump_shm(Connection& conn);
+    void read_shm(Connection& conn);
+    void resume_shm();
+    bool file_in(Connection& conn, const Frame& frame);
+    bool end_upload(Connection& conn, bool complete);
+    void finish_uploads();
+    void service_files();
+    void queue_file_chunk(Connection& conn);
+#ifdef __linux__
+    bool send_file_data(Connection& conn);
+#endif
+    Connection* adopt(SOCKET sock, bool handshake = false);
+    bool admit(SOCKET sock);
+    void end_handshake(Connection& conn);
+    void set_accepting(bool on);
+    long long check_handshakes(long long next_due);
+    void send_heartbeat(Connection& conn, HeartbeatFlags kind);
+    long long check_heartbeats();
+    void accept_all();
+#ifndef _WIN32
+    void handoff_barrier(std::atomic<int>& arrived);
+    void hand_off();
+    void pack_handoff();
+    void adopt_taken();
+#endif
+    bool process_input(Connection& conn);
+    void read(Connection& conn);
+    void drain_mailbox();
+    bool post_outgoing();
+    void run();
+#ifdef CHAT_HAVE_URING
+    bool setup_uring(std::string& error);
+    io_uring_sqe* sqe();
+    void arm_recv(Connection& conn);
+    bool flush_uring(Connection& conn);
+    void on_completion(const io_uring_cqe& cqe);
+    void run_uring();
+#endif
+};
+
+std::vector<Shard*> shards;
+
+#ifndef _WIN32
+// A handoff to a new server in progress (--handoff). The handoff thread sets
+// 'requested'; each shard stops at the end of its tick, and they go through
+// the steps together (see Shard::hand_off()).
+struct HandoffControl {
+    std::atomic<bool> requested{false};
+    std::atomic<int> stopped{0};   // Shards that have stopped reading
+    std::atomic<int> delivered{0}; // Shards that have delivered the last mail
+    std::mutex mutex;              // Guards the rest
+    std::condition_variable cv;
+    int packed = 0;                // Shards that have written down their users
+    int released = 0;              // Shards that went back to work after a failed handoff
+    bool carry_on = false;         // The new server did not take over
+};
+HandoffControl handoff;
+
+// What the server we took over from handed us (--take-over).
+std::vector<SOCKET> taken_listeners;
+std::vector<uint32_t> taken_dropped; // Sessions of users it could not hand over: they have left
+std::string taken_roster;            // Everyone it knew (SessionDirectory::save)
+std::string taken_rooms;             // Every room it had (RoomDirectory::save)
+int handoff_peer = -1;               // Our end of the exchange, until the old server is gone
+long long take_over_start = 0;       // When we asked (ns)
+#endif
+
+// Tell the poller what we want to hear about for this user right now.
+void Shard::update_interest(Connection& conn) {
+#ifdef CHAT_HAVE_URING
+    if (ring) {
+        // io_uring: stop the running recv of a paused user; once unpaused,
+        // the loop handles what it already sent and starts a new one.
+        if (conn.paused_by > 0 && conn.recv_armed) uring_prep_cancel(sqe(), uring_tag(conn, URING_RECV), URING_CANCEL);
+        else if (conn.paused_by == 0) resume_list.push_back(std::make_pair(conn.sock, conn.id));
+        return;
+    }
+#endif
+    // A shared-memory user's frames don't arrive on the socket, so an unpaused
+    // one has to be read again by hand.
+    if (conn.shm_up && conn.paused_by == 0) shm_resume.push_back(std::make_pair(conn.sock, conn.id));
+    unsigned interest = 0;
+    if (conn.paused_by == 0) interest |= POLL_READ;   // Paused senders are not read from
+    if (conn.want_write) interest |= POLL_WRITE;
+    poller.modify(conn.sock, interest);
+}
+
+// Let every sender that 'conn' was holding back read again.
+void Shard::resume_paused_senders(Connection& conn) {
+    for (auto& paused : conn.paused_senders) {
+        auto it = connections.find(paused.first);
+        if (it == connections.end() || it->second.id != paused.second) continue; // Already gone
+        if (--it->second.paused_by == 0) update_interest(it->second);
+    }
+    conn.paused_senders.clear();
+}
+
+// Forget about a connection and close its socket.
+void Shard::close_connection(SOCKET sock) {
+    auto it = connections.find(sock);
+    if (it == connections.end()) return;
+    uint32_t session = it->second.session;
+    uint64_t messages_sent = it->second.messages_sent;
+    uint32_t link_node = it->second.link_node;
+    int link_peer = it->second.link_peer;
+    if (session) direct_index.remove(sessions.name_of(session), index, it->second.id); // No more direct messages
+    for (uint32_t room : it->second.rooms) leave_room(it->second, room); // No more room lines
+    it->second.rooms.clear();
+    timers.cancel(it->second.heartbeat);
+    resume_paused_senders(it->second);
+    if (it->second.handshaking) end_handshake(it->second);
+    if (it->second.upload.file) end_upload(it->second, false); // Half a file is no use to anyone
+    for (FileDownload& d : it->second.downloads) fclose(d.file);
+    it->second.downloads.clear();
+    if (it->second.shm) it->second.shm->hang_up(); // A client asleep on the channel wakes and sees it
+    if (it->second.shm_up) metrics.shm_clients.sub();
+    poller.remove(sock);       // Stop watching it first...
+#ifdef CHAT_HAVE_URING
+    if (ring) {
+        // Running requests keep the socket open until they finish; shutdown()
+        // makes them finish now. A running send still reads this user's queue,
+        // so the connection is kept in the graveyard until its result arrives.
+        ring->submit(); // Requests queued for this socket must go in before it is closed
+        shutdown(sock, SHUT_RDWR);
+        if (it->second.sending) graveyard.emplace(uring_tag(it->second, URING_SEND), std::move(it->second));
+    }
+#endif
+    closesocket(sock);         // ...then close it
+    connections.erase(it);
+    metrics.clients.sub();
+    metrics.disconnected.add();
+    if (link_node) {
+        link_count--;
+        metrics.links.sub();
+    }
+    if (link_peer >= 0) peers[link_peer]->up = false; // Its dialer tries again
+    if (link_peer >= 0 && !link_node) { // Hung up before it answered our FRAME_LINK
+        RelayPeer& peer = *peers[link_peer];
+        if (!peer.refused.exchange(true)) {
+            std::cout << "Node " << peer.host << ":" << peer.port << " refused our link (is --link-secret the same on both?);"
+                      << " will keep trying." << std::endl;
+        }
+        return;
+    }
+    if (link_node || link_peer >= 0) {
+        std::cout << "Lost the link to node " << link_node << (link_peer >= 0 ? "; dialling again." : ".") << std::endl;
+        return;
+    }
+    // Announced only now that the user is out of the table: telling everyone
+    // may disconnect slow users, which must not be able to reach this one.
+    if (session) end_session(session, messages_sent);
+    else std::cout << "Client disconnected." << std::endl;
+}
+
+// Push as much of a user's queue into the socket as it will take right now.
+// Up to 'send_batch' queued messages go out in ONE vectored send, so a burst
+// costs one system call per user per tick instead of one per message.
+// File downloads only get the room that chat leaves over (chat_files.h).
+// Returns false if the connection broke (the caller closes it).
+bool Shard::flush(Connection& conn) {
+#ifdef CHAT_HAVE_URING
+    if (ring) return flush_uring(conn);
+#endif
+    if (conn.shm_down) return flush_shm(conn);
+    if (!conn.outbox.empty()) metrics.queue_depth.record(conn.outbox.size());
+#ifdef __linux__
+    // A file chunk that has started going out has to finish before anything else can.
+    if (!conn.downloads.empty() && conn.downloads.front().mid_chunk() && !send_file_data(conn)) return false;
+    bool chunk_open = !conn.downloads.empty() && conn.downloads.front().mid_chunk();
+#else
+    if (conn.outbox.empty() && file_ready(conn)) queue_file_chunk(conn); // One chunk per turn, behind nothing
+    bool chunk_open = false;
+#endif
+    IoSlice slices[MAX_SEND_BATCH];
+    while (!chunk_open && !conn.outbox.empty()) {
+        // While switching to shared memory, only what is queued up to SHM_READY goes over TCP.
+        size_t count = conn.outbox.gather(slices, conn.tcp_left && conn.tcp_left < send_batch ? conn.tcp_left : send_batch);
+        long n = send_slices(conn.sock, slices, count);
+        metrics.send_calls.add();
+        if (n > 0) {
+            size_t before = conn.outbox.size();
+            conn.outbox.consume(n);
+            metrics.bytes_out.add(n);
+            if (conn.tcp_left && (conn.tcp_left -= before - conn.outbox.size()) == 0) {
+                conn.shm_down = true; // SHM_READY is out: the rest goes through the channel
+                return flush_shm(conn);
+            }
+            continue;
+        }
+        if (n < 0 && net_would_block()) break; // Socket buffer is full, try again later
+        return false;
+    }
+#ifdef __linux__
+    // Chat is out: file chunks may have what room is left.
+    if (conn.outbox.empty() && !conn.downloads.empty() && !send_file_data(conn)) return false;
+#endif
+
+    // Once the queue has drained to half, the senders we paused may continue.
+    if (!conn.paused_senders.empty() && conn.outbox.size() <= queue_limit / 2) resume_paused_senders(conn);
+
+    // Only ask for POLL_WRITE while something is left over.
+    bool need_write = !conn.outbox.empty() || file_ready(conn);
+    if (need_write != conn.want_write) {
+        conn.want_write = need_write;
+        update_interest(conn);
+    }
+    return true;
+}
+
+// Flush every user that got new messages during this tick.
+// With coalescing on, a user with only a little waiting is held back (like
+// Nagle's algorithm) until enough piles up or the oldest message has waited
+// 'coalesce_ns'. Returns when the earliest held-back user is due (0 = none).
+long long Shard::flush_pending() {
+    long long now = coalesce_ns > 0 ? now_ns() : 0;
+    long long next_due = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < flush_list.size(); i++) {
+        SOCKET sock = flush_list[i];
+        auto it = connections.find(sock);
+        if (it == connections.end()) continue;
+        Connection& conn = it->second;
+        if (coalesce_ns > 0 && !conn.want_write && conn.outbox.bytes() < coalesce_bytes) {
+            long long due = conn.queued_at + coalesce_ns;
+            if (due > now) {
+                flush_list[kept++] = sock; // Not yet: stay on the list
+                if (next_due == 0 || due < next_due) next_due = due;
+                continue;
+            }
+        }
+        conn.in_flush_list = false;
+        if (!flush(conn)) close_connection(sock);
+    }
+    flush_list.resize(kept);
+    return next_due;
+}
+
+// When a user's queue is full, do what --slow-policy says: drop its oldest
+// message, stop reading from the sender until it catches up, or put it on
+// 'slow' to be disconnected once the caller is done looping (and return
+// false: queue nothing for it). A user switching to shared memory is left
+// alone: SHM_READY must not be dropped. 'sender' is nullptr when the
+// message came from another shard; such senders can't be paused from
+// here, so SLOW_PAUSE_SENDER falls back to dropping.
+bool Shard::apply_slow_policy(Connection& conn, Connection* sender, std::vector<SOCKET>& slow) {
+    if (conn.outbox.size() < queue_limit || conn.tcp_left != 0) return true;
+    if (slow_policy == SLOW_DISCONNECT) {
+        slow.push_back(conn.sock);
+        return false;
+    }
+    if (slow_policy == SLOW_DROP_OLDEST || !sender) {
+        if (conn.outbox.drop_oldest()) metrics.dropped.add();
+    } else {
+        // Queue it anyway, but stop reading from the sender until this user catches up.
+        bool already = false;
+        for (auto& paused : conn.paused_senders) already = already || paused.second == sender->id;
+        if (!already) {
+            conn.paused_senders.push_back(std::make_pair(sender->sock, sender->id));
+            if (sender->paused_by++ == 0) update_interest(*sender);
+        }
+    }
+    return true;
+}
+
+// Queue a message for every user on THIS shard except the sender, its
+// 'numbered' form instead for users who asked for numbers (if it has one),
+// and its 'relay' form for every link to another node (if there is one).
+// 'sender' is nullptr when the message came from another shard.
+void Shard::deliver(const Payload& payload, const Payload& numbered, const Payload& relay, uint32_t messages, Connection* sender) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<SOCKET> slow; // Can't close sockets while looping over the map
+    uint64_t queued = 0;
+    for (auto& entry : connections) {
+        Connection& conn = entry.second;
+        if (&conn == sender) continue; // Don't echo back to the sender
+        bool link = conn.link_node || conn.link_peer >= 0;
+        if (link && !relay.data()) continue;
+
+        if (link && conn.outbox.size() >= LINK_QUEUE_LIMIT) {
+            // A link is never paused or hung up on for being slow: it carries everyone's messages.
+            if (conn.outbox.drop_oldest()) metrics.dropped.add();
+        } else if (!link && !apply_slow_policy(conn, sender, slow)) {
+            continue;
+        }
+
+        if (conn.outbox.empty()) conn.queued_at = coalesce_ns > 0 ? now_ns() : 0;
+        conn.outbox.push(link ? relay : conn.numbered && numbered.data() ? numbered : payload);
+        queued++;
+        if (!conn.in_flush_list) {
+            conn.in_flush_list = true;
+            flush_list.push_back(conn.sock);
+        }
+    }
+    metrics.messages_out.add(queued * messages);
+    metrics.fanout_ns.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    for (SOCKET sock : slow) {
+        std::cout << "Disconnecting slow client." << std::endl;
+        metrics.slow_disconnects.add();
+        close_connection(sock);
+    }
+}
+
+// Queue a payload for every user on EVERY shard except the sender (and the
+// relay form for every link): users on this shard get a reference in their
+// queue, and every other shard gets a reference through its mailbox.
+void Shard::publish(const Payload& payload, const Payload& relay, uint32_t messages, Connection* sender) {
+    Payload numbered = number(payload, sender);
+    for (int s = 0; s < shard_count; s++) {
+        if (s == index) continue;
+        MailItem item;
+        item.payload = payload;
+        item.numbered = numbered;
+        item.relay = relay;
+        item.messages = messages;
+        outgoing[s].push_back(std::move(item));
+    }
+    deliver(payload, numbered, relay, messages, sender);
+}
+
+// Give the frames of a payload this shard's next numbers: a copy with a
+// RESUME_MARK in front, which is also kept in the resume ring for users who
+// reconnect. Returns an empty payload when numbering is off.
+Payload Shard::number(const Payload& payload, Connection* sender) {
+    if (resume_ring.limit == 0) return Payload();
+    uint32_t frames = count_frames(payload.data(), payload.size());
+    char* bytes;
+    Payload numbered = Payload::allocate(RESUME_MARK_SIZE + payload.size(), bytes);
+    write_resume_mark(bytes, index, resume_ring.next(), frames);
+    memcpy(bytes + RESUME_MARK_SIZE, payload.data(), payload.size());
+    resume_ring.add(resume_ring.next(), frames, sender ? sender->session : 0, now_ns(), numbered);
+    return numbered;
+}
+
+// Wrap frames that start on THIS node in a FRAME_RELAY for the links.
+// Returns an empty payload when there are no links to send it to.
+Payload Shard::make_relay(const char* data, size_t len) {
+    if (link_count.load(std::memory_order_relaxed) == 0) return Payload();
+    relay_scratch.clear();
+    encode_relay(relay_scratch, node_id, relay_seq++, data, len);
+    return Payload::copy_of(relay_scratch.data(), relay_scratch.size());
+}
+
+// Same job as broadcast() above, but it never waits for a slow user.
+// The message is stored once and published to everyone.
+void Shard::broadcast(const char* data, size_t len, uint32_t messages, Connection& sender) {
+    if (!log_folder.empty()) message_log.append(data, len); // Remember it for people who join later
+    publish(Payload::copy_of(data, len), make_relay(data, len), messages, &sender); // The one and only copy
+}
+
+// The user said hello: give them a session ID and the roster, and tell
+// everyone else they joined. Presence frames are not logged. Returns false
+// if the name isn't UTF-8 (hang up).
+bool Shard::start_session(Connection& conn, const Frame& hello) {
+    if (conn.session) return true; // One hello per connection
+    if (!utf8_valid(hello.payload, hello.length)) { // A name that isn't text: hang up
+        metrics.invalid_utf8.add();
+        return false;
+    }
+    conn.session = sessions.join(std::string(hello.payload, hello.length));
+    if (!conn.session) { // No IDs left: hang up
+        out_of_session_ids();
+        return false;
+    }
+    direct_index.add(sessions.name_of(conn.session), DirectRoute{index, conn.sock, conn.id});
+
+    std::string reply;
+    char id_bytes[SESSION_ID_SIZE];
+    write_be(id_bytes, conn.session, SESSION_ID_SIZE);
+    encode_frame(reply, FRAME_WELCOME, 0, id_bytes, SESSION_ID_SIZE);
+    sessions.append_roster(reply, conn.session);
+    conn.outbox.push_urgent(Payload::copy_of(reply.data(), reply.size())); // Ahead of what was queued before the hello
+    if (conn.tcp_left) conn.tcp_left++; // (One more message to go before SHM_READY)
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+
+    std::string joined;
+    encode_presence(joined, PRESENCE_JOIN, conn.session, sessions.name_of(conn.session));
+    publish(Payload::copy_of(joined.data(), joined.size()), make_relay(joined.data(), joined.size()), 1, &conn);
+    return true;
+}
+
+// A user with a session left: tell everyone.
+void Shard::end_session(uint32_t session, uint64_t messages_sent) {
+    sessions.leave(session);
+    std::string left;
+    encode_presence(left, PRESENCE_LEAVE, session, "");
+    publish(Payload::copy_of(left.data(), left.size()), make_relay(left.data(), left.size()), 1, nullptr);
+    std::cout << "Client disconnected: " << sessions.name_of(session) << " (#" << session << "), "
+              << messages_sent << " messages sent." << std::endl;
+}
+
+// A user sent a line to another user by name (chat_direct.h). The name
+// index says where that user is connected: one lookup, not a search through
+// everyone. Users on this shard get it queued at once; those on other shards
+// get it through the mailbox. Not numbered, logged or relayed.
+void Shard::direct_message(Connection& conn, const Frame& frame) {
+    std::string name;
+    const char* text;
+    size_t text_length;
+    if (frame.flags != DIRECT_SEND || !conn.session || !parse_direct(frame, name, text, text_length)) return;
+    if (!utf8_valid(text, text_length)) {
+        metrics.invalid_utf8.add();
+        return;
+    }
+    direct_routes.clear();
+    if (direct_index.find(name, direct_routes) == 0) {
+        std::string unknown;
+        encode_frame(unknown, FRAME_DIRECT, DIRECT_UNKNOWN, name.data(), name.size());
+        conn.outbox.push(Payload::copy_of(unknown.data(), unknown.size()));
+        if (!conn.in_flush_list) {
+            conn.in_flush_list = true;
+            flush_list.push_back(conn.sock);
+        }
+        metrics.direct_unknown.add();
+        return;
+    }
+    std::string message = direct_received(conn.session, text, text_length);
+    Payload payload = Payload::copy_of(message.data(), message.size());
+    for (const DirectRoute& route : direct_routes) {
+        if (route.shard == index) {
+            deliver_direct(route.sock, route.id, payload);
+            continue;
+        }
+        MailItem item;
+        item.payload = payload;
+        item.messages = 1;
+        item.to = route.sock;
+        item.to_id = route.id;
+        outgoing[route.shard].push_back(std::move(item));
+    }
+}
+
+// Queue a direct message for one user of this shard, unless it has gone
+// (or its socket now belongs to somebody else). A slow user loses its
+// oldest message instead; nobody is paused for a single line.
+void Shard::deliver_direct(SOCKET sock, unsigned long long id, const Payload& payload) {
+    auto it = connections.find(sock);
+    if (it == connections.end() || it->second.id != id) return;
+    Connection& conn = it->second;
+    if (conn.outbox.size() >= queue_limit && conn.tcp_left == 0) {
+        if (slow_policy == SLOW_DISCONNECT) {
+            std::cout << "Disconnecting slow client." << std::endl;
+            metrics.slow_disconnects.add();
+            close_connection(sock);
+            return;
+        }
+        if (conn.outbox.drop_oldest()) metrics.dropped.add();
+    }
+    if (conn.outbox.empty()) conn.queued_at = coalesce_ns > 0 ? now_ns() : 0;
+    conn.outbox.push(payload);
+    metrics.messages_out.add();
+    metrics.direct_messages.add();
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// A user wants to join or leave a room (chat_room.h). Joining a room it is
+// in already just gets ROOM_JOINED again.
+void Shard::room_request(Connection& conn, const Frame& frame) {
+    if (!conn.session) return;
+    std::string reply;
+    if (frame.flags == ROOM_JOIN) {
+        std::string name(frame.payload, frame.length);
+        uint32_t id = room_name_valid(frame) ? rooms.open(name, index) : 0;
+        bool member = std::find(conn.rooms.begin(), conn.rooms.end(), id) != conn.rooms.end();
+        if (id == 0 || (!member && conn.rooms.size() >= ROOM_PER_USER_MAX)) {
+            if (id != 0 && !room_members.count(id)) rooms.set_present(id, index, false); // open() set our bit for nothing
+            encode_frame(reply, FRAME_ROOM, ROOM_FAILED, frame.payload, frame.length);
+        } else {
+            if (!member) enter_room(conn, id);
+            encode_room(reply, ROOM_JOINED, id, name);
+        }
+    } else if (frame.flags == ROOM_LEAVE && frame.length == ROOM_ID_SIZE) {
+        uint32_t id = (uint32_t)read_be(frame.payload, ROOM_ID_SIZE);
+        auto it = std::find(conn.rooms.begin(), conn.rooms.end(), id);
+        if (it == conn.rooms.end()) return;
+        conn.rooms.erase(it);
+        leave_room(conn, id);
+        encode_room(reply, ROOM_LEFT, id, "");
+    }
+    if (reply.empty()) return;
+    // Never dropped: when many join at once, the presence frames queued for
+    // a user would push its answers out, and it couldn't talk in its rooms.
+    conn.outbox.push_urgent(Payload::copy_of(reply.data(), reply.size()));
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// Put a user in a room: in its own list of rooms and in the room's
+// subscription index. The first of our users in a room sets our bit, so
+// other shards start sending us its lines.
+void Shard::enter_room(Connection& conn, uint32_t room) {
+    conn.rooms.push_back(room);
+    std::vector<Connection*>& members = room_members[room];
+    members.push_back(&conn);
+    if (members.size() == 1) rooms.set_present(room, index, true);
+}
+
+// Take a user out of a room's subscription index (the caller takes the room
+// out of conn.rooms). The order of the others doesn't matter, so the last
+// one takes its place; the last of our users to leave clears our bit.
+void Shard::leave_room(Connection& conn, uint32_t room) {
+    auto it = room_members.find(room);
+    if (it == room_members.end()) return;
+    std::vector<Connection*>& members = it->second;
+    for (size_t i = 0; i < members.size(); i++) {
+        if (members[i] != &conn) continue;
+        members[i] = members.back();
+        members.pop_back();
+        break;
+    }
+    if (!members.empty()) return;
+    room_members.erase(it);
+    rooms.set_present(room, index, false);
+}
+
+// A user said something in a room. Only members may; the line goes to the
+// other members on this shard at once, and to each shard whose bit is set
+// through its mailbox, one item per shard however many members it has.
+void Shard::say_in_room(Connection& conn, const Frame& chat) {
+    uint32_t room = chat_room(chat);
+    if (std::find(conn.rooms.begin(), conn.rooms.end(), room) == conn.rooms.end()) return; // Not a member (or no room)
+    metrics.messages_in.add();
+    conn.messages_sent++;
+    Payload payload = Payload::copy_of(chat.raw, chat.raw_length);
+    uint64_t present = rooms.shards_in(room);
+    uint32_t generation = rooms.generation_of(room);
+    for (int s = 0; s < shard_count; s++) {
+        if (s == index || !(present & ((uint64_t)1 << s))) continue;
+        MailItem item;
+        item.payload = payload;
+        item.messages = 1;
+        item.room = room;
+        item.room_generation = generation;
+        outgoing[s].push_back(std::move(item));
+    }
+    deliver_room(payload, room, &conn);
+}
+
+// Queue a room's line for every member on THIS shard except the sender.
+// Same rules as deliver(), but it walks the room's members, not everyone.
+void Shard::deliver_room(const Payload& payload, uint32_t room, Connection* sender) {
+    auto it = room_members.find(room);
+    if (it == room_members.end()) return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<SOCKET> slow; // Can't close sockets (and change the members) while looping over them
+    uint64_t queued = 0;
+    for (Connection* member : it->second) {
+        Connection& conn = *member;
+        if (&conn == sender) continue;
+        if (!apply_slow_policy(conn, sender, slow)) continue;
+        if (conn.outbox.empty()) conn.queued_at = coalesce_ns > 0 ? now_ns() : 0;
+        conn.outbox.push(payload);
+        queued++;
+        if (!conn.in_flush_list) {
+            conn.in_flush_list = true;
+            flush_list.push_back(conn.sock);
+        }
+    }
+    metrics.messages_out.add(queued);
+    metrics.fanout_ns.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    for (SOCKET sock : slow) {
+        std::cout << "Disconnecting slow client." << std::endl;
+        metrics.slow_disconnects.add();
+        close_connection(sock);
+    }
+}
+
+// Another node opened a link to us, or answered ours: from now on this
+// connection gets relay frames instead of chat frames. It is also told who
+// is online here. Returns false if the link can't be taken (hang up): a
+// bad node number, or the wrong secret (chat_relay.h).
+bool Shard::start_link(Connection& conn, const Frame& hello) {
+    if (node_id == 0 || conn.link_node || conn.session || hello.length < 4) return false;
+    uint32_t peer = (uint32_t)read_be(hello.payload, 4);
+    if (peer == 0 || peer > NODE_MAX || peer == node_id || !link_secret_matches(hello.payload + 4, hello.length - 4, link_secret)) {
+        metrics.links_refused.add(); // Counted, not logged: anybody can ask as often as they like
+        return false;
+    }
+    conn.link_node = peer;
+    if (conn.link_peer >= 0) peers[conn.link_peer]->refused = false;
+    set_nodelay(conn.sock); // Relay frames are already batched; don't hold them back further
+    link_count++;
+    metrics.links.add();
+
+    std::string reply;
+    if (conn.link_peer < 0) encode_link_hello(reply, node_id, link_secret); // They dialled: say who we are
+    std::string roster;
+    sessions.append_roster(roster, 0);
+    if (!roster.empty()) encode_relay(reply, node_id, relay_seq++, roster.data(), roster.size());
+    if (!reply.empty()) {
+        conn.outbox.push(Payload::copy_of(reply.data(), reply.size()));
+        if (!conn.in_flush_list) {
+            conn.in_flush_list = true;
+            flush_list.push_back(conn.sock);
+        }
+    }
+    std::cout << "Linked with node " << peer << "." << std::endl;
+    return true;
+}
+
+// A relay frame came in over a link. Unless we have seen it before, its
+// frames go to our users (and into our log), and the relay frame itself goes
+// on, unchanged, down our other links. Returns false if it is malformed.
+bool Shard::relay_in(Connection& conn, const Frame& relay) {
+    if (relay.length < RELAY_HEADER_SIZE) return false;
+    uint32_t origin = (uint32_t)read_be(relay.payload, 4);
+    uint64_t seq = read_be(relay.payload + 4, 8);
+    if (origin == node_id || !relay_filter.accept(origin, seq)) {
+        metrics.relay_duplicates.add();
+        return true;
+    }
+    metrics.relayed_in.add();
+
+    // Check the frames inside, count the chat messages and learn who's who.
+    const char* frames = relay.payload + RELAY_HEADER_SIZE;
+    size_t length = relay.length - RELAY_HEADER_SIZE;
+    uint32_t messages = 0;
+    Frame frame;
+    for (size_t at = 0; at < length; at += frame.raw_length) {
+        if (!read_frame_at(frames + at, length - at, frame)) return false;
+        if (frame.type == FRAME_CHAT) messages++;
+        if (frame.type == FRAME_PRESENCE && frame.length >= SESSION_ID_SIZE) {
+            uint32_t id = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+            std::string name(frame.payload + SESSION_ID_SIZE, frame.length - SESSION_ID_SIZE);
+            if (frame.flags == PRESENCE_LEAVE) sessions.leave(id);
+            else sessions.learn(id, name, frame.flags != PRESENCE_KNOWN);
+        }
+    }
+    if (messages > 0 && !log_folder.empty()) message_log.append(frames, length);
+    publish(Payload::copy_of(frames, length), Payload::copy_of(relay.raw, relay.raw_length), messages ? messages : 1, &conn);
+    return true;
+}
+
+// Take the links our dialer threads have connected (shard 0 only) and
+// introduce ourselves on each.
+void Shard::adopt_dialed() {
+    std::vector<std::pair<SOCKET, int>> ready;
+    {
+        std::lock_guard<std::mutex> lock(dialed_mutex);
+        if (dialed.empty()) return;
+        ready.swap(dialed);
+    }
+    for (auto& entry : ready) {
+        Connection* conn = adopt(entry.first);
+        if (!conn) {
+            peers[entry.second]->up = false;
+            continue;
+        }
+        conn->link_peer = entry.second;
+        std::string hello;
+        encode_link_hello(hello, node_id, link_secret);
+        conn->outbox.push(Payload::copy_of(hello.data(), hello.size()));
+        conn->in_flush_list = true;
+        flush_list.push_back(conn->sock);
+    }
+}
+
+// A user asked for old messages. They are sent straight out of the mapped
+// log files (no copy), followed by a HISTORY_END frame saying how many there were.
+void Shard::send_history(Connection& conn, const Frame& request) {
+    std::vector<LogRange> ranges;
+    uint64_t count = 0;
+    if (request.flags == HISTORY_LAST && request.length == 4) {
+        if (!log_folder.empty()) count = message_log.last(read_be(request.payload, 4), ranges);
+    } else if (request.flags == HISTORY_SINCE && request.length == 8) {
+        if (!log_folder.empty()) count = message_log.since((int64_t)read_be(request.payload, 8), ranges);
+    } else {
+        return; // Not a request we understand: ignore it
+    }
+    metrics.history_requests.add();
+
+    // Names of the writers who are not online (so not in the roster) go first.
+    std::vector<uint32_t> writers;
+    Frame frame;
+    for (const LogRange& range : ranges) {
+        const char* data = range.segment->data + range.offset;
+        for (size_t at = 0; read_frame_at(data + at, (size_t)range.length - at, frame); at += frame.raw_length) {
+            uint32_t id = frame.type == FRAME_CHAT ? chat_sender(frame) : file_offer_sender(frame);
+            if (id) writers.push_back(id);
+        }
+    }
+    if (!writers.empty()) {
+        std::sort(writers.begin(), writers.end());
+        writers.erase(std::unique(writers.begin(), writers.end()), writers.end());
+        std::string known;
+        sessions.append_known(known, writers);
+        if (!known.empty()) conn.outbox.push(Payload::copy_of(known.data(), known.size()));
+    }
+
+    for (const LogRange& range : ranges) {
+        conn.outbox.push(Payload::view_of(range.segment->data + range.offset, (size_t)range.length, range.segment));
+    }
+    char end[FRAME_HEADER_SIZE + 8];
+    write_frame_header(end, FRAME_HISTORY, HISTORY_END, 8);
+    write_be(end + FRAME_HEADER_SIZE, count, 8);
+    conn.outbox.push(Payload::copy_of(end, sizeof(end)));
+
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// A user asked for numbered messages (chat_resume.h). If it says which
+// numbers it got before it lost its connection, it is sent every frame after
+// them that the shards' resume rings still hold (except its own), oldest
+// first, then RESUME_DONE; if some are gone it gets RESUME_GAP instead, and
+// nothing else. Both say where each shard's numbers stand now, and from here
+// on the user gets numbered messages.
+void Shard::resume_session(Connection& conn, const Frame& ask) {
+    if (ask.flags != RESUME_ASK || conn.numbered) return;
+    if (resume_ring.limit == 0) { // Not numbering: history is all there is
+        char gap[FRAME_HEADER_SIZE];
+        write_frame_header(gap, FRAME_RESUME, RESUME_GAP, 0);
+        conn.outbox.push_kept(Payload::copy_of(gap, sizeof(gap)));
+    } else {
+        bool asked = ask.length >= RESUME_ASK_FIXED;
+        bool gap = asked && (read_be(ask.payload, 8) != server_epoch ||
+                             ask.length != RESUME_ASK_FIXED + 8 * (size_t)shard_count); // Another server's numbers
+        uint32_t old_session = asked ? (uint32_t)read_be(ask.payload + 8, 4) : 0;
+        std::vector<ResumeEntry> missed;
+        uint64_t replayed = 0;
+        std::string reply(16 + 8 * (size_t)shard_count, '\0'); // Epoch, frames replayed, each shard's last number
+        write_be(&reply[0], server_epoch, 8);
+        for (int s = 0; s < shard_count; s++) {
+            uint64_t last;
+            if (asked && !gap) {
+                uint64_t after = read_be(ask.payload + RESUME_ASK_FIXED + 8 * s, 8);
+                size_t from = missed.size();
+                gap = !shards[s]->resume_ring.collect(after, old_session, missed, last);
+                for (size_t e = from; e < missed.size(); e++) {
+                    replayed += missed[e].first + missed[e].frames - std::max(after + 1, missed[e].first);
+                }
+            } else {
+                last = shards[s]->resume_ring.last();
+            }
+            write_be(&reply[16 + 8 * s], last, 8);
+        }
+        if (gap) {
+            metrics.resume_gaps.add();
+            missed.clear();
+        } else {
+            if (asked) metrics.resumes.add();
+            // Each shard's batches are in order already; interleave them by time.
+            std::stable_sort(missed.begin(), missed.end(), [](const ResumeEntry& a, const ResumeEntry& b) { return a.at < b.at; });
+            write_be(&reply[8], replayed, 8);
+        }
+        // The replay and the answer go out as ONE message that is never
+        // dropped: hundreds of them would fill the queue, and the live
+        // messages behind them would push them out.
+        std::string frame;
+        encode_frame(frame, FRAME_RESUME, gap ? RESUME_GAP : RESUME_DONE, reply.data(), reply.size());
+        size_t length = frame.size();
+        for (const ResumeEntry& entry : missed) length += entry.numbered.size();
+        char* bytes;
+        Payload answer = Payload::allocate(length, bytes);
+        for (const ResumeEntry& entry : missed) {
+            memcpy(bytes, entry.numbered.data(), entry.numbered.size());
+            bytes += entry.numbered.size();
+        }
+        memcpy(bytes, frame.data(), frame.size());
+        conn.outbox.push_kept(answer);
+    }
+    conn.numbered = true;
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// A name for a new channel that nothing else on this machine uses: our
+// process ID, the shard and the connection's ID.
+static std::string shm_channel_name(int shard, unsigned long long id) {
+#ifdef _WIN32
+    std::string name = "Local\\chat_shm_" + std::to_string(GetCurrentProcessId());
+#else
+    std::string name = "/chat_shm_" + std::to_string(getpid());
+#endif
+    return name + "_" + std::to_string(shard) + "_" + std::to_string(id);
+}
+
+// A step of moving a local client onto shared memory (see chat_shm_channel.h):
+// offer it a channel, or finish the switch once it has mapped it.
+void Shard::switch_shm(Connection& conn, const Frame& request) {
+    std::string reply;
+    if (request.flags == SHM_REQUEST) {
+        // Only for clients on this machine, and only on the poller (io_uring
+        // reads the socket on its own, which would swallow the doorbell).
+        std::string name;
+        if (offer_shm && !use_uring && !conn.shm && same_host(conn.sock)) {
+            name = shm_channel_name(index, conn.id);
+            conn.shm.reset(new ShmChannel());
+            if (!conn.shm->create(name)) {
+                conn.shm.reset();
+                name.clear();
+            }
+        }
+        encode_frame(reply, FRAME_SHM, name.empty() ? SHM_REFUSED : SHM_OFFER, name.data(), name.size());
+        conn.outbox.push(Payload::copy_of(reply.data(), reply.size()));
+    } else if (request.flags == SHM_ATTACHED && conn.shm && !conn.shm_up) {
+        // That was the client's last frame over TCP: from here on the socket
+        // only carries doorbell bytes, so what follows it in the buffer goes.
+        conn.shm->unlink();
+        conn.shm_up = true;
+        conn.decoder.clear();
+        metrics.shm_clients.add();
+        encode_frame(reply, FRAME_SHM, SHM_READY, "", 0);
+        conn.outbox.push(Payload::copy_of(reply.data(), reply.size()));
+        conn.tcp_left = conn.outbox.size(); // Everything up to SHM_READY still goes over TCP
+    } else {
+        if (request.flags == SHM_DECLINED && !conn.shm_up) conn.shm.reset(); // Couldn't map it: stay on TCP
+        return;
+    }
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// Copy as much of a shared-memory user's queue into their 'down' pipe as
+// fits - no system call - then wake them if they are asleep. If the pipe is
+// full, we ask them to ring the doorbell once they have made room.
+bool Shard::flush_shm(Connection& conn) {
+    if (conn.want_write) { // Left over from TCP: there is nothing to wait for on the socket now
+        conn.want_write = false;
+        update_interest(conn);
+    }
+    if (!conn.outbox.empty()) metrics.queue_depth.record(conn.outbox.size());
+    ShmPipe& pipe = conn.shm->down();
+    size_t written = 0;
     while (true) {
-        SOCKET new_socket;
-        int addrlen = sizeof(address);
-        
-        // accept() stops and waits here until someone tries to connect.
-        // When they do, it returns a NEW socket just for that person.
-        if ((new_socket = accept(server_socket, (sockaddr*)&address, &addrlen)) == INVALID_SOCKET) {
-            continue; // If connection failed, just try again (continue loop)
+        if (conn.outbox.empty()) {
+            if (!file_ready(conn)) break;
+            queue_file_chunk(conn); // Chat is out: the pipe's spare room goes to file data
+            continue;
+        }
+        size_t n = shm_pipe_write(pipe, conn.outbox.front_data(), conn.outbox.front_size());
+        if (n > 0) {
+            conn.outbox.consume(n);
+            written += n;
+            continue;
         }
+        shm_ask_doorbell(pipe);
+        if (shm_pipe_space(pipe) == 0) break; // Still full: wait for their doorbell
+    }
+    if (written > 0) {
+        metrics.bytes_out.add(written);
+        conn.shm->wake_client();
+    }
+    if (!conn.paused_senders.empty() && conn.outbox.size() <= queue_limit / 2) resume_paused_senders(conn);
+    return true;
+}
 
-        // Add the new person to our list (Thread safe!)
+// Take a shared-memory user's frames out of their 'up' pipe and handle them,
+// like read() does for a socket. When the pipe is empty we ask for a doorbell
+// before leaving. Returns false if they sent something that is not our protocol.
+bool Shard::pump_shm(Connection& conn) {
+    ShmPipe& pipe = conn.shm->up();
+    size_t taken = 0;
+    while (conn.paused_by == 0) { // A paused user stays in the pipe until resume_shm()
+        char* dst = conn.decoder.write_ptr();
+        size_t n = shm_pipe_read(pipe, dst, conn.decoder.write_space());
+        if (n == 0) {
+            shm_ask_doorbell(pipe);
+            if (shm_pipe_waiting(pipe) == 0) return true; // Really empty: they will ring
+            continue;
+        }
+        conn.decoder.commit(n);
+        metrics.bytes_in.add(n);
+        if (!process_input(conn)) return false;
+        if (conn.upload.file && (taken += n) >= FILE_READ_BUDGET) {
+            // An upload's turn is up: the rest is read on the next one.
+            shm_resume.push_back(std::make_pair(conn.sock, conn.id));
+            return true;
+        }
+    }
+    return true;
+}
+
+// A shared-memory user's socket is readable: a doorbell (they wrote to us,
+// or made room for us), or they hung up.
+void Shard::read_shm(Connection& conn) {
+    SOCKET sock = conn.sock;
+    char bells[64];
+    int n;
+    while ((n = recv(sock, bells, sizeof(bells), 0)) > 0) {} // Any number of rings means the same
+    if (n == 0 || !net_would_block()) {
+        close_connection(sock);
+        return;
+    }
+    if (!pump_shm(conn) || !flush(conn)) close_connection(sock);
+}
+
+// Read the shared-memory users that were unpaused during this tick (their
+// data is waiting in the pipe, not on the socket, so the poller won't say).
+void Shard::resume_shm() {
+    std::vector<std::pair<SOCKET, unsigned long long>> ready;
+    ready.swap(shm_resume);
+    for (auto& entry : ready) {
+        auto it = connections.find(entry.first);
+        if (it == connections.end() || it->second.id != entry.second || it->second.paused_by > 0) continue;
+        if (!pump_shm(it->second) || !flush(it->second)) close_connection(entry.first);
+    }
+}
+
+// A FRAME_FILE frame from a user: part of an upload, or a request to download
+// (see chat_files.h). Returns false if the frame is malformed.
+bool Shard::file_in(Connection& conn, const Frame& frame) {
+    std::string reply;
+    FileUpload& upload = conn.upload;
+    switch (frame.flags) {
+    case FILE_UPLOAD: {
+        if (frame.length < 8) return false;
+        if (upload.file) end_upload(conn, false); // A new upload replaces one that never finished
+        uint64_t size = read_be(frame.payload, 8);
+        if (files.enabled() && size <= files.max_bytes) upload.file = files.create(upload.id);
+        if (!upload.file) {
+            encode_frame(reply, FRAME_FILE, FILE_FAILED, "", 0);
+            break;
+        }
+        upload.size = size;
+        upload.received = 0;
+        upload.name = clean_file_name(std::string(frame.payload + 8, frame.length - 8));
+        return true;
+    }
+    case FILE_CHUNK: {
+        if (frame.length < FILE_HEADER_SIZE) return false;
+        if (!upload.file) return true; // The rest of an upload we refused
+        uint64_t offset = read_be(frame.payload + 8, 8);
+        size_t n = frame.length - FILE_HEADER_SIZE;
+        // Straight from the receive buffer to the file. Chunks must come in
+        // order and not add up to more than FILE_UPLOAD said.
+        if (offset == upload.received && n <= upload.size - upload.received) {
+            // Copied out of the receive buffer for the disk thread: the loop never waits for the disk.
+            FileJob job;
+            job.file = upload.file;
+            job.data = Payload::copy_of(frame.payload + FILE_HEADER_SIZE, n);
+            file_writer.post(job);
+            upload.received += n;
+            if (file_writer.backlog() >= FILE_WRITE_BACKLOG && !conn.disk_paused) {
+                // The disk is behind: stop reading this uploader until it catches up.
+                conn.disk_paused = true;
+                disk_paused.push_back(std::make_pair(conn.sock, conn.id));
+                if (conn.paused_by++ == 0) update_interest(conn);
+            }
+            return true;
+        }
+        end_upload(conn, false);
+        encode_frame(reply, FRAME_FILE, FILE_FAILED, "", 0);
+        break;
+    }
+    case FILE_COMPLETE:
+        if (!upload.file) return true;
+        if (end_upload(conn, upload.received == upload.size)) return true;
+        encode_frame(reply, FRAME_FILE, FILE_FAILED, "", 0);
+        break;
+    case FILE_GET: {
+        if (frame.length != 16) return false;
+        uint64_t id = read_be(frame.payload, 8);
+        uint64_t offset = read_be(frame.payload + 8, 8);
+        bool running = false;
+        for (FileDownload& d : conn.downloads) {
+            if (d.id != id) continue;
+            // Asked again: a queued chunk was dropped for them, so go back.
+            if (!d.mid_chunk()) {
+                d.offset = d.acked = std::min(offset, d.size);
+                d.done_sent = false;
+            }
+            running = true;
+        }
+        if (running) break;
+        FileDownload download;
+        if (files.enabled()) download.file = files.open_file(id, download.size);
+        if (!download.file) {
+            encode_file_id(reply, FILE_MISSING, id);
+            break;
+        }
+        download.id = id;
+        download.offset = download.acked = std::min(offset, download.size);
+        if (!conn.shm_down) set_unsent_limit(conn.sock, FILE_UNSENT_LIMIT); // POLL_WRITE only once the file data has mostly gone
+        conn.downloads.push_back(download);
+        break;
+    }
+    case FILE_ACK: {
+        if (frame.length != 16) return false;
+        uint64_t id = read_be(frame.payload, 8);
+        uint64_t offset = read_be(frame.payload + 8, 8);
+        for (FileDownload& d : conn.downloads) {
+            if (d.id == id && offset > d.acked) d.acked = std::min(offset, d.offset); // The window opens again
+        }
+        break;
+    }
+    default:
+        return true; // Not ours to send: ignore it
+    }
+    if (!reply.empty()) conn.outbox.push(Payload::copy_of(reply.data(), reply.size()));
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+    return true;
+}
+
+// Close a user's upload: have the disk thread store it ('complete') - it is
+// offered to everyone once that is done, in finish_uploads() - or throw it
+// away. Returns false if it is thrown away.
+bool Shard::end_upload(Connection& conn, bool complete) {
+    FileUpload& upload = conn.upload;
+    FileJob job;
+    job.kind = complete ? FILE_JOB_FINISH : FILE_JOB_DISCARD;
+    job.file = upload.file;
+    job.id = upload.id;
+    job.size = upload.size;
+    job.name = upload.name;
+    job.owner = index;
+    job.sock = conn.sock;
+    job.conn_id = conn.id;
+    job.session = conn.session;
+    file_writer.post(job);
+    upload.file = nullptr;
+    return complete;
+}
+
+// Uploads the disk thread has finished with: offer each stored one to
+// everyone, or tell its sender that it failed.
+void Shard::finish_uploads() {
+    stored.clear();
+    file_writer.take_finished(index, stored);
+    for (FileJob& job : stored) {
+        auto it = connections.find(job.sock);
+        Connection* sender = it != connections.end() && it->second.id == job.conn_id ? &it->second : nullptr;
+        std::string reply;
+        if (job.ok) {
+            metrics.files_uploaded.add();
+            std::cout << "File " << job.id << " stored: " << job.name << " (" << job.size << " bytes)." << std::endl;
+            // The offer is logged and sent like chat (the sender gets it too, to learn the ID).
+            encode_file_offer(reply, job.id, job.size, job.session, job.name);
+            if (!log_folder.empty()) message_log.append(reply.data(), reply.size());
+            publish(Payload::copy_of(reply.data(), reply.size()), make_relay(reply.data(), reply.size()), 1, sender);
+        } else {
+            encode_frame(reply, FRAME_FILE, FILE_FAILED, "", 0);
+        }
+        if (!sender) continue; // They left before it was stored
+        sender->outbox.push(Payload::copy_of(reply.data(), reply.size()));
+        if (!sender->in_flush_list) {
+            sender->in_flush_list = true;
+            flush_list.push_back(sender->sock);
+        }
+    }
+}
+
+// Once a loop turn: announce stored uploads, and read paused uploaders
+// again once the disk thread has caught up.
+void Shard::service_files() {
+    if (file_writer.finished_waiting()) finish_uploads();
+    if (disk_paused.empty() || file_writer.backlog() >= FILE_WRITE_BACKLOG / 2) return;
+    for (auto& entry : disk_paused) {
+        auto it = connections.find(entry.first);
+        if (it == connections.end() || it->second.id != entry.second) continue; // Already gone
+        it->second.disk_paused = false;
+        if (--it->second.paused_by == 0) update_interest(it->second);
+    }
+    disk_paused.clear();
+}
+
+// Read the next chunk of a user's first download into a payload and queue
+// it, or FILE_DONE once the file is all out. Only called while their queue is
+// empty and the download is ready(), so chat that comes later waits behind
+// this one chunk at most.
+// (Shared memory, io_uring and Windows; Linux sockets use send_file_data().)
+void Shard::queue_file_chunk(Connection& conn) {
+    FileDownload& d = conn.downloads.front();
+    size_t n = (size_t)std::min<uint64_t>(FILE_CHUNK_BYTES, d.size - d.offset);
+    std::string end;
+    if (n > 0) {
+        char* bytes;
+        Payload chunk = Payload::allocate(FRAME_HEADER_SIZE + FILE_HEADER_SIZE + n, bytes);
+        write_file_chunk_header(bytes, d.id, d.offset, n);
+        if (file_seek(d.file, d.offset) && fread(bytes + FRAME_HEADER_SIZE + FILE_HEADER_SIZE, 1, n, d.file) == n) {
+            conn.outbox.push(chunk);
+            d.offset += n;
+            metrics.file_bytes_out.add(n);
+            return;
+        }
+        encode_file_id(end, FILE_MISSING, d.id); // It shrank or went away under us
+    } else {
+        encode_file_id(end, FILE_DONE, d.id);
+    }
+    conn.outbox.push(Payload::copy_of(end.data(), end.size()));
+    fclose(d.file);
+    conn.downloads.erase(conn.downloads.begin());
+}
+
+#ifdef __linux__
+// Send a user's downloads straight from their files with sendfile(): a chunk
+// header, then its bytes, which never pass through our memory. A new chunk
+// starts only while no chat is queued and the socket has less than
+// FILE_UNSENT_LIMIT unsent bytes (and the user's window has room).
+// Returns false if the connection broke.
+bool Shard::send_file_data(Connection& conn) {
+    while (!conn.downloads.empty()) {
+        FileDownload& d = conn.downloads.front();
+        if (!d.mid_chunk()) {
+            if (!conn.outbox.empty() || !d.ready() || unsent_bytes(conn.sock) >= FILE_UNSENT_LIMIT) return true; // Chat first
+            size_t n = (size_t)std::min<uint64_t>(FILE_CHUNK_BYTES, d.size - d.offset);
+            if (n > 0) {
+                write_file_chunk_header(d.header, d.id, d.offset, n);
+                d.header_length = sizeof(d.header);
+            } else {
+                write_frame_header(d.header, FRAME_FILE, FILE_DONE, 8);
+                write_be(d.header + FRAME_HEADER_SIZE, d.id, 8);
+                d.header_length = FRAME_HEADER_SIZE + 8;
+                d.done_sent = true;
+            }
+            d.header_sent = 0;
+            d.data_left = n;
+        }
+        if (d.header_sent < d.header_length) {
+            // MSG_MORE: the kernel waits for the bytes, so header and data leave in the same packets.
+            ssize_t n = send(conn.sock, d.header + d.header_sent, d.header_length - d.header_sent, d.data_left ? MSG_MORE : 0);
+            metrics.send_calls.add();
+            if (n < 0) return net_would_block();
+            d.header_sent += n;
+            metrics.bytes_out.add(n);
+            if (d.header_sent < d.header_length) return true;
+        }
+        if (d.data_left > 0) {
+            off_t offset = (off_t)d.offset;
+            ssize_t n = sendfile(conn.sock, fileno(d.file), &offset, d.data_left);
+            metrics.send_calls.add();
+            if (n < 0) return net_would_block();
+            if (n == 0) return false; // The file shrank under us: the stream can't be finished
+            d.offset += n;
+            d.data_left -= n;
+            metrics.bytes_out.add(n);
+            metrics.file_bytes_out.add(n);
+            if (d.data_left > 0) return true; // Socket is full
+        }
+        d.header_length = d.header_sent = 0;
+        if (d.done_sent) {
+            fclose(d.file);
+            conn.downloads.erase(conn.downloads.begin());
+        }
+    }
+    return true;
+}
+#endif
+
+// Start looking after an accepted socket. Returns nullptr if it can't be watched.
+// 'handshake' = admit() counted it as a handshake.
+Connection* Shard::adopt(SOCKET sock, bool handshake) {
+    if (!use_uring) { // io_uring needs neither: the recv started below does the waiting
+        set_nonblocking(sock);
+        if (!poller.add(sock, POLL_READ)) {
+            closesocket(sock);
+            if (handshake) admission.end_handshake();
+            return nullptr;
+        }
+    }
+    Connection& conn = connections[sock];
+    conn.sock = sock;
+    conn.id = next_connection_id++;
+    metrics.accepted.add();
+    metrics.clients.add();
+    if (handshake) {
+        conn.handshaking = true;
+        handshakes.push_back(PendingHandshake{now_ns() + HANDSHAKE_TIMEOUT_MS * 1000000LL, sock, conn.id});
+    }
+    conn.heard_at = clock_ms;
+    if (heartbeat_ms > 0) {
+        conn.heartbeat.owner = &conn; // The table never moves its entries
+        timers.schedule(conn.heartbeat, clock_ms + heartbeat_ms);
+    }
+#ifdef CHAT_HAVE_URING
+    if (ring) arm_recv(conn);
+#endif
+    return &conn;
+}
+
+// A socket accept() just gave us: close it if its address is connecting too
+// often (chat_admission.h), otherwise count it as a handshake if those are limited.
+bool Shard::admit(SOCKET sock) {
+    if (admission.ip_rate > 0 && !admission.allow(peer_address(sock))) {
+        closesocket(sock); // Before it costs us anything
+        metrics.refused.add();
+        return false;
+    }
+    if (admission.max_handshakes > 0) admission.begin_handshake();
+    return true;
+}
+
+// A new user sent its first frame (or stayed quiet too long): one handshake fewer.
+void Shard::end_handshake(Connection& conn) {
+    conn.handshaking = false;
+    admission.end_handshake();
+}
+
+// Stop taking new users off the listener, so they wait in the backlog, or start again.
+void Shard::set_accepting(bool on) {
+    if (accepting == on || listener == INVALID_SOCKET) return;
+    accepting = on;
+#ifdef CHAT_HAVE_URING
+    if (ring) {
+        // Stopping cancels the multishot accept. Starting again re-arms it
+        // only once the cancelled one has finished (see on_completion).
+        if (!on) uring_prep_cancel(sqe(), URING_ACCEPT, URING_CANCEL);
+        else if (!accept_armed) {
+            uring_prep_multishot_accept(sqe(), listener, URING_ACCEPT);
+            accept_armed = true;
+        }
+        return;
+    }
+#endif
+    poller.modify(listener, on ? POLL_READ : 0);
+}
+
+// Once per tick, with handshakes limited: users that stayed quiet too long
+// stop counting, and a listener stopped for the limit starts again once
+// there is room. Returns the earlier of 'next_due' and when to look again.
+long long Shard::check_handshakes(long long next_due) {
+    if (admission.max_handshakes <= 0) return next_due;
+    long long now = now_ns();
+    while (!handshakes.empty() && handshakes.front().due <= now) {
+        PendingHandshake pending = handshakes.front();
+        handshakes.pop_front();
+        auto it = connections.find(pending.sock);
+        if (it != connections.end() && it->second.id == pending.id && it->second.handshaking) end_handshake(it->second);
+    }
+    if (!accepting && !admission.handshakes_full()) set_accepting(true);
+    // Handshakes on other shards finish without telling us: while stopped, look again every millisecond.
+    long long due = !accepting ? now + 1000000 : handshakes.empty() ? 0 : handshakes.front().due;
+    return due && (!next_due || due < next_due) ? due : next_due;
+}
+
+// Queue a heartbeat frame for a user.
+void Shard::send_heartbeat(Connection& conn, HeartbeatFlags kind) {
+    Payload& frame = heartbeat_frames[kind];
+    if (!frame.data()) {
+        char header[FRAME_HEADER_SIZE];
+        write_frame_header(header, FRAME_HEARTBEAT, kind, 0);
+        frame = Payload::copy_of(header, sizeof(header));
+    }
+    if (conn.outbox.empty()) conn.queued_at = coalesce_ns > 0 ? now_ns() : 0;
+    conn.outbox.push(frame);
+    if (!conn.in_flush_list) {
+        conn.in_flush_list = true;
+        flush_list.push_back(conn.sock);
+    }
+}
+
+// Once per tick: ping users that have been quiet for --heartbeat, and hang
+// up on users that have been quiet for --idle-timeout (a half-open
+// connection never says it closed). Each user has ONE timer, due when the
+// next of those could happen. Traffic doesn't move it, which would cost a
+// wheel operation per message: a timer that finds the user has spoken
+// meanwhile just sets itself again from then. Returns when the next timer
+// is due (ns), or 0 if none is.
+long long Shard::check_heartbeats() {
+    if (heartbeat_ms <= 0) return 0;
+    expired.clear();
+    timers.advance(clock_ms, expired);
+    // Closing one user can close others (a slow one, told about the leave),
+    // so look them up again by socket and id rather than keep pointers.
+    quiet.clear();
+    for (WheelTimer* t : expired) {
+        Connection& conn = *(Connection*)t->owner;
+        quiet.push_back(std::make_pair(conn.sock, conn.id));
+    }
+    for (auto& entry : quiet) {
+        auto it = connections.find(entry.first);
+        if (it == connections.end() || it->second.id != entry.second) continue;
+        Connection& conn = it->second;
+        // Not reading it (paused for a slow user, or for the disk) is our doing, not its.
+        if (conn.paused_by > 0 || conn.disk_paused) conn.heard_at = clock_ms;
+        long long silent = clock_ms - conn.heard_at;
+        if (silent >= idle_timeout_ms) {
+            std::cout << "Hanging up on a connection silent for " << silent / 1000 << " s." << std::endl;
+            metrics.reaped.add();
+            close_connection(entry.first);
+            continue;
+        }
+        if (silent >= heartbeat_ms && !conn.pinged) {
+            send_heartbeat(conn, HEARTBEAT_PING);
+            conn.pinged = true;
+            metrics.pings.add();
+        }
+        timers.schedule(conn.heartbeat, conn.heard_at + (conn.pinged ? idle_timeout_ms : heartbeat_ms));
+    }
+    long long due_ms = timers.next_due_ms();
+    if (due_ms < 0) return 0;
+    return (due_ms - clock_ms) * 1000000LL + now_ns(); // The wheel counts on the shard's clock
+}
+
+// Accept EVERY connection that is waiting, not just one - unless the
+// handshake limit is reached, when the rest wait in the backlog.
+void Shard::accept_all() {
+    bool handshake = admission.max_handshakes > 0;
+    while (true) {
+        if (admission.handshakes_full()) {
+            set_accepting(false); // check_handshakes() starts us again
+            break;
+        }
+        SOCKET new_socket = accept(listener, nullptr, nullptr);
+        if (new_socket == INVALID_SOCKET) break; // Nobody else waiting (or an error): back to the loop
+        if (!admit(new_socket)) continue;
+
+#ifndef SO_REUSEPORT
+        // Only shard 0 has a listener here, so it deals new users out to every shard in turn.
+        size_t target = next_handoff++ % shard_count;
+        if ((int)target != index) {
+            MailItem item;
+            item.adopt = new_socket;
+            outgoing[target].push_back(std::move(item));
+            continue;
+        }
+#endif
+        adopt(new_socket, handshake);
+    }
+}
+
+// Broadcast every complete frame waiting in a user's decoder.
+// Returns false if the user sent something that is not our protocol.
+bool Shard::process_input(Connection& conn) {
+    // Frames are forwarded exactly as they arrived, header included.
+    // Chat frames that sit back to back in the buffer are forwarded
+    // together, so a burst costs one broadcast instead of one per frame.
+    Frame frame;
+    const char* run = nullptr;
+    size_t run_length = 0;
+    uint32_t run_messages = 0;
+    FrameStatus status;
+    conn.heard_at = clock_ms; // Anything at all counts as a sign of life
+    conn.pinged = false;
+    while ((status = conn.decoder.next(frame)) == FRAME_OK) {
+        if (conn.handshaking) end_handshake(conn); // It has spoken: no longer a handshake
+        if (frame.type != FRAME_CHAT || conn.link_node) {
+            if (run) broadcast(run, run_length, run_messages, conn); // Earlier chat goes out first
+            run = nullptr;
+            bool ok = true;
+            if (frame.type == FRAME_HEARTBEAT) {
+                if (frame.flags == HEARTBEAT_PING) send_heartbeat(conn, HEARTBEAT_PONG);
+            }
+            else if (frame.type == FRAME_LINK) ok = start_link(conn, frame);
+            else if (conn.link_node) ok = frame.type != FRAME_RELAY || relay_in(conn, frame); // Links only relay
+            else if (frame.type == FRAME_HELLO) ok = start_session(conn, frame);
+            else if (frame.type == FRAME_HISTORY) send_history(conn, frame);
+            else if (frame.type == FRAME_RESUME) resume_session(conn, frame);
+            else if (frame.type == FRAME_DIRECT) direct_message(conn, frame);
+            else if (frame.type == FRAME_ROOM) room_request(conn, frame);
+            else if (frame.type == FRAME_SHM) switch_shm(conn, frame);
+            else if (frame.type == FRAME_FILE) ok = file_in(conn, frame);
+            if (!ok) return false;
+            continue;
+        }
+        if (frame.flags & CHAT_SENDER) {
+            if (frame.length < SESSION_ID_SIZE) continue;
+            // Stamp the real sender over whatever the client wrote, in place.
+            write_be((char*)frame.payload, conn.session, SESSION_ID_SIZE);
+        }
+        if (!chat_text_valid(frame)) {
+            metrics.invalid_utf8.add(); // Not passed on: every client can trust what it shows
+            continue;
+        }
+        if (frame.flags & CHAT_ROOM) { // For one room's members, not everyone
+            if (run) broadcast(run, run_length, run_messages, conn);
+            run = nullptr;
+            say_in_room(conn, frame);
+            continue;
+        }
+        metrics.messages_in.add();
+        conn.messages_sent++;
+        if (run && run + run_length == frame.raw) {
+            run_length += frame.raw_length;
+            run_messages++;
+            continue;
+        }
+        if (run) broadcast(run, run_length, run_messages, conn);
+        run = frame.raw;
+        run_length = frame.raw_length;
+        run_messages = 1;
+    }
+    if (run) broadcast(run, run_length, run_messages, conn);
+    return status != FRAME_BAD;
+}
+
+// A client's socket has data for us: read everything available and broadcast
+// every complete frame in it.
+void Shard::read(Connection& conn) {
+    SOCKET sock = conn.sock;
+    if (conn.shm_up) {
+        read_shm(conn);
+        return;
+    }
+    size_t taken = 0;
+    while (conn.paused_by == 0) { // Stop early if a slow user paused us
+        // recv() straight into the decoder's buffer: no extra copy.
+        char* dst = conn.decoder.write_ptr();
+        int bytes_received = recv(sock, dst, (int)conn.decoder.write_space(), 0);
+        if (bytes_received > 0) {
+            conn.decoder.commit(bytes_received);
+            metrics.bytes_in.add(bytes_received);
+            if (!process_input(conn)) break; // Not speaking our protocol: hang up
+            if (conn.shm_up) { // Just switched: the rest comes through shared memory
+                read_shm(conn);
+                return;
+            }
+            // An upload gets a turn's worth, then everyone else gets theirs;
+            // the poller reports the socket again for the rest.
+            if (conn.upload.file && (taken += bytes_received) >= FILE_READ_BUDGET) return;
+            continue;
+        }
+        if (bytes_received < 0 && net_would_block()) return; // Drained for now
+        break; // 0 = user left, <0 = connection error
+    }
+    if (conn.paused_by > 0) return; // Paused, not broken: the rest waits in the socket
+    close_connection(sock);
+}
+
+// Take everything other shards have posted to us.
+void Shard::drain_mailbox() {
+    MailItem item;
+    for (int s = 0; s < shard_count; s++) {
+        if (s == index) continue;
+        while (inbox[s]->pop(item)) {
+            if (item.adopt != INVALID_SOCKET) adopt(item.adopt, admission.max_handshakes > 0); // admit()ted by shard 0
+            else if (item.to != INVALID_SOCKET) deliver_direct(item.to, item.to_id, item.payload);
+            else if (item.room) {
+                if (rooms.generation_of(item.room) == item.room_generation) deliver_room(item.payload, item.room, nullptr);
+            }
+            else deliver(item.payload, item.numbered, item.relay, item.messages, nullptr);
+        }
+    }
+}
+
+// Hand this tick's cross-shard mail to the other shards, then wake each of
+// them once. Returns true if a mailbox was full and something is still waiting.
+bool Shard::post_outgoing() {
+    bool backlog = false;
+    for (int s = 0; s < shard_count; s++) {
+        std::vector<MailItem>& mail = outgoing[s];
+        if (mail.empty()) continue;
+        SpscRing<MailItem>& ring = *shards[s]->inbox[index];
+        size_t posted = 0;
+        while (posted < mail.size() && ring.push(mail[posted])) posted++;
+        if (posted > 0) shards[s]->wakeup.signal();
+        mail.erase(mail.begin(), mail.begin() + posted);
+        backlog = backlog || !mail.empty();
+    }
+    return backlog;
+}
+
+// How long the loop may sleep: until the earliest held-back user is due
+// ('next_due', 0 = none), or 1 ms if mail for another shard is still waiting.
+static int tick_timeout(long long next_due, bool backlog) {
+    int timeout = backlog ? 1 : -1;
+    if (next_due > 0) {
+        int wait_ms = (int)((next_due - now_ns() + 999999) / 1000000); // Poll timeouts are whole milliseconds
+        if (wait_ms < 0) wait_ms = 0;
+        if (timeout < 0 || wait_ms < timeout) timeout = wait_ms;
+    }
+    return timeout;
+}
+
+// The heart of the event-driven server: one of these runs per shard.
+void Shard::run() {
+    thread_metrics = &metrics; // Count this thread's heap allocations
+#ifdef CHAT_HAVE_URING
+    if (ring) {
+        run_uring();
+        return;
+    }
+#endif
+    if (listener != INVALID_SOCKET) {
+        set_nonblocking(listener);
+        poller.add(listener, POLL_READ);
+    }
+    poller.add(wakeup.socket(), POLL_READ);
+
+    std::vector<PollEvent> events;
+    int timeout = -1;
+    clock_ms = now_ns() / 1000000;
+    timers.start(clock_ms);
+#ifndef _WIN32
+    if (!taken.empty() || (index == 0 && !taken_dropped.empty())) adopt_taken();
+#endif
+    while (true) {
+        poller.wait(events, timeout); // Sleep until at least one socket is ready
+        clock_ms = now_ns() / 1000000;
+
+        for (const PollEvent& ev : events) {
+            if (ev.sock == listener) {
+                accept_all();
+                continue;
+            }
+            if (ev.sock == wakeup.socket()) {
+                wakeup.clear();
+                continue; // The mailbox is drained below on every tick anyway
+            }
+            // The socket may have been closed by an earlier event in this batch.
+            auto it = connections.find(ev.sock);
+            if (it == connections.end()) continue;
+
+            if (ev.flags & POLL_WRITE) {
+                if (!flush(it->second)) { close_connection(ev.sock); continue; }
+            }
+            if (ev.flags & (POLL_READ | POLL_ERROR)) {
+                read(it->second);
+            }
+        }
+        if (!shm_resume.empty()) resume_shm();
+        service_files();
+        drain_mailbox();
+        if (!peers.empty() && index == 0) adopt_dialed();
+
+        // Everything that was broadcast during this tick goes out now
+        // (or, with coalescing, by its deadline).
+        long long heartbeat_due = check_heartbeats(); // Before the flush, so pings go out with it
+        long long next_due = check_handshakes(flush_pending());
+        if (heartbeat_due && (!next_due || heartbeat_due < next_due)) next_due = heartbeat_due;
+        // If another shard's mailbox was full, retry soon instead of sleeping forever.
+        timeout = tick_timeout(next_due, post_outgoing());
+        if (!shm_resume.empty()) timeout = 0; // Someone's pipe still has input waiting
+#ifndef _WIN32
+        if (handoff.requested.load(std::memory_order_acquire)) {
+            hand_off(); // Returns only if the new server didn't take over
+            timeout = 0;
+        }
+#endif
+    }
+}
+
+#ifdef CHAT_HAVE_URING
+// --- IO_URING BACKEND (--io uring) ---
+// The same shard, but instead of asking "which sockets are ready?" and then
+// calling recv()/send() on each, the shard keeps long-running requests in the
+// kernel and reads their results from the completion ring:
+//   - one multishot accept per listener, one multishot poll for the wakeup,
+//   - one multishot recv per user, receiving into the shard's shared buffers,
+//   - at most one sendmsg per user at a time, covering its whole queue.
+// Everything started during a tick goes to the kernel in the single
+// io_uring_enter() that also waits for the next results.
+
+// Create the ring and its receive buffers.
+bool Shard::setup_uring(std::string& error) {
+    ring.reset(new IoUring());
+    return ring->init(URING_ENTRIES, error) && ring->setup_buffers(URING_GROUP, URING_BUFFERS, URING_BUFFER_SIZE, error);
+}
+
+// A blank request. If the submission ring is full, what is in it is handed over first.
+io_uring_sqe* Shard::sqe() {
+    io_uring_sqe* entry;
+    while (!(entry = ring->get_sqe())) ring->submit();
+    return entry;
+}
+
+// Start receiving from a user until it is cancelled or the user leaves.
+void Shard::arm_recv(Connection& conn) {
+    uring_prep_multishot_recv(sqe(), conn.sock, URING_GROUP, uring_tag(conn, URING_RECV));
+    conn.recv_armed = true;
+}
+
+// io_uring version of flush(): start ONE sendmsg over up to 'send_batch'
+// queued messages. It runs in the background; whatever it leaves over goes
+// out when its result comes in.
+bool Shard::flush_uring(Connection& conn) {
+    if (conn.sending) return true;
+    if (conn.outbox.empty() && file_ready(conn)) queue_file_chunk(conn); // Chat first, then file data
+    if (conn.outbox.empty()) return true;
+    metrics.queue_depth.record(conn.outbox.size());
+    if (!conn.send_op) conn.send_op.reset(new UringSend());
+    UringSend& op = *conn.send_op;
+    size_t count = conn.outbox.gather(op.slices, send_batch);
+    memset(&op.msg, 0, sizeof(op.msg));
+    op.msg.msg_iov = op.slices;
+    op.msg.msg_iovlen = count;
+    conn.outbox.hold(count); // drop_oldest() must not free what the kernel is reading
+    uring_prep_sendmsg(sqe(), conn.sock, &op.msg, uring_tag(conn, URING_SEND));
+    conn.sending = true;
+    metrics.send_calls.add(); // Counts send requests here; they share one system call per tick
+    return true;
+}
+
+// Handle one result from the completion ring.
+void Shard::on_completion(const io_uring_cqe& cqe) {
+    UringOp op = (UringOp)(cqe.user_data & 0xFF);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0; // Multishot request still running?
+    if (op == URING_CANCEL) return;
+    if (op == URING_ACCEPT) {
+        if (cqe.res >= 0 && admit((SOCKET)cqe.res)) {
+            adopt((SOCKET)cqe.res, admission.max_handshakes > 0);
+            if (admission.handshakes_full()) set_accepting(false); // Accepts already in the ring still arrive
+        }
+        if (!more) {
+            accept_armed = false;
+            if (accepting) {
+                uring_prep_multishot_accept(sqe(), listener, URING_ACCEPT);
+                accept_armed = true;
+            }
+        }
+        return;
+    }
+    if (op == URING_WAKEUP) {
+        wakeup.clear(); // The mailbox is drained after this batch anyway
+        if (!more) uring_prep_multishot_poll(sqe(), wakeup.socket(), URING_WAKEUP);
+        return;
+    }
+
+    // Receive and send results belong to a user, who may have left since
+    // (and whose socket number may already belong to someone new).
+    SOCKET sock = (SOCKET)(cqe.user_data >> 32);
+    auto it = connections.find(sock);
+    Connection* conn = it != connections.end() && uring_tag(it->second, op) == cqe.user_data ? &it->second : nullptr;
+
+    if (op == URING_RECV) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            // Copy out of the shared buffer and hand the buffer straight back.
+            uint16_t id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (conn && cqe.res > 0) {
+                memcpy(conn->decoder.write_ptr(cqe.res), ring->buffer(id), cqe.res);
+                conn->decoder.commit(cqe.res);
+                metrics.bytes_in.add(cqe.res);
+            }
+            ring->recycle_buffer(id);
+        }
+        if (!conn) return;
+        if (!more) conn->recv_armed = false;
+        // 0 = user left. Out of buffers or cancelled (paused) are not errors.
+        bool alive = cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED;
+        if (alive && conn->paused_by == 0) alive = process_input(*conn); // Paused: frames wait in the decoder
+        if (!alive) {
+            close_connection(sock);
+            return;
+        }
+        if (!conn->recv_armed && conn->paused_by == 0) arm_recv(*conn);
+        return;
+    }
+
+    // URING_SEND
+    if (!conn) {
+        graveyard.erase(cqe.user_data); // Its queue may be freed now
+        return;
+    }
+    conn->sending = false;
+    if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+        close_connection(sock);
+        return;
+    }
+    if (cqe.res > 0) {
+        conn->outbox.consume(cqe.res);
+        metrics.bytes_out.add(cqe.res);
+    }
+    conn->outbox.hold(0);
+    if (!conn->paused_senders.empty() && conn->outbox.size() <= queue_limit / 2) resume_paused_senders(*conn);
+    if ((!conn->outbox.empty() || file_ready(*conn)) && !conn->in_flush_list) { // The rest goes out with this tick's sends
+        conn->in_flush_list = true;
+        flush_list.push_back(sock);
+    }
+}
+
+void Shard::run_uring() {
+    if (listener != INVALID_SOCKET) {
+        uring_prep_multishot_accept(sqe(), listener, URING_ACCEPT);
+        accept_armed = true;
+    }
+    uring_prep_multishot_poll(sqe(), wakeup.socket(), URING_WAKEUP);
+
+    std::vector<std::pair<SOCKET, unsigned long long>> resumed;
+    int timeout = -1;
+    clock_ms = now_ns() / 1000000;
+    timers.start(clock_ms);
+    while (true) {
+        ring->submit(1, timeout); // Hand over this tick's requests and sleep until a result arrives
+        clock_ms = now_ns() / 1000000;
+        ring->for_each_completion([this](const io_uring_cqe& cqe) { on_completion(cqe); });
+        ring->publish_buffers();  // The kernel may fill the recycled buffers again
+
+        // Users that were paused and may read again: what they sent meanwhile
+        // is waiting in their decoder.
+        resumed.swap(resume_list);
+        for (auto& entry : resumed) {
+            auto it = connections.find(entry.first);
+            if (it == connections.end() || it->second.id != entry.second || it->second.paused_by > 0) continue;
+            if (!process_input(it->second)) {
+                close_connection(entry.first);
+                continue;
+            }
+            if (!it->second.recv_armed && it->second.paused_by == 0) arm_recv(it->second);
+        }
+        resumed.clear();
+        service_files();
+        drain_mailbox();
+        if (!peers.empty() && index == 0) adopt_dialed();
+
+        long long heartbeat_due = check_heartbeats(); // Before the flush, so pings go out with it
+        long long next_due = check_handshakes(flush_pending());
+        if (heartbeat_due && (!next_due || heartbeat_due < next_due)) next_due = heartbeat_due;
+        timeout = tick_timeout(next_due, post_outgoing());
+    }
+}
+#endif
+
+// Lock the calling thread onto one CPU core.
+void pin_to_core(int core) {
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % 64));
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % CPU_SETSIZE, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+#ifndef _WIN32
+// --- HOT RESTART (--handoff / --take-over) ---
+// See chat_handoff.h. The old server writes its users down without changing
+// anything, so if the new server gives up, every shard carries on as before.
+
+#define HANDOFF_TIMEOUT_MS 10000 // How long the old server waits for the new one to say it took over
+
+// Wait until every shard has got this far. Meanwhile keep delivering what
+// the others post to us (they may still be finishing their tick).
+void Shard::handoff_barrier(std::atomic<int>& arrived) {
+    arrived++;
+    while (arrived.load() < shard_count) {
+        drain_mailbox();
+        post_outgoing();
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+}
+
+// A new server is taking over. Stop reading, deliver the last messages that
+// are on their way between shards, and write down our users. Then wait:
+// either the new server takes them (and this process exits), or it doesn't
+// and we carry on.
+void Shard::hand_off() {
+    handoff_barrier(handoff.stopped);   // Nobody reads any more...
+    drain_mailbox();
+    post_outgoing();
+    handoff_barrier(handoff.delivered); // ...and everything read has been posted
+    drain_mailbox();
+    pack_handoff();
+
+    std::unique_lock<std::mutex> lock(handoff.mutex);
+    handoff.packed++;
+    handoff.cv.notify_all();
+    handoff.cv.wait(lock, [] { return handoff.carry_on; });
+    handoff.released++;
+    handoff.cv.notify_all();
+}
+
+// Write every user down for the new server: which descriptors are theirs,
+// their session, what they sent that isn't a whole frame yet, and every
+// message still queued for them.
+void Shard::pack_handoff() {
+    handed.clear();
+    handed_fds.clear();
+    handed_dropped.clear();
+    handed_count = 0;
+    for (auto& pair : connections) {
+        Connection& conn = pair.second;
+        // A file on its way up or down has open files and disk jobs that
+        // can't move: that user reconnects and tries again.
+        if (conn.upload.file || !conn.downloads.empty() || conn.disk_paused) {
+            if (conn.session) handed_dropped.push_back(conn.session);
+            continue;
+        }
+        handed_fds.push_back(conn.sock);
+        int shm_fd = conn.shm ? conn.shm->descriptor() : -1;
+        handoff_put(handed, shm_fd >= 0, 1);
+        if (shm_fd >= 0) {
+            handed_fds.push_back(shm_fd);
+            handoff_put_bytes(handed, conn.shm->name().data(), conn.shm->name().size());
+            handoff_put(handed, conn.shm->owns_name(), 1);
+            handoff_put(handed, conn.shm_up, 1);
+            handoff_put(handed, conn.shm_down, 1);
+            handoff_put(handed, conn.tcp_left, 8);
+        }
+        handoff_put(handed, conn.session, 4);
+        handoff_put(handed, conn.messages_sent, 8);
+        handoff_put(handed, conn.link_node, 4);
+        handoff_put(handed, (uint32_t)(conn.link_peer + 1), 4);
+        handoff_put(handed, conn.rooms.size(), 4);
+        for (uint32_t room : conn.rooms) handoff_put(handed, room, 4);
+        handoff_put_bytes(handed, conn.decoder.unread(), conn.decoder.buffered());
+        handoff_put(handed, conn.outbox.size(), 4);
+        conn.outbox.for_each([this](const char* data, size_t length) { handoff_put_bytes(handed, data, length); });
+        handed_count++;
+    }
+}
+
+// Carry on with the users the old server handed us, where it left off.
+void Shard::adopt_taken() {
+    std::vector<std::pair<SOCKET, unsigned long long>> adopted;
+    for (TakenConnection& t : taken) {
+        std::unique_ptr<ShmChannel> channel;
+        if (t.shm_fd >= 0) {
+            channel.reset(new ShmChannel());
+            if (!channel->adopt(t.shm_fd, t.shm_name, t.shm_owns_name)) channel.reset(); // (Closes the descriptor)
+        }
+        Connection* conn = t.shm_fd >= 0 && !channel ? nullptr : adopt(t.sock);
+        if (!conn) {
+            closesocket(t.sock);
+            if (t.session) end_session(t.session, t.messages_sent);
+            continue;
+        }
+        conn->session = t.session;
+        conn->messages_sent = t.messages_sent;
+        if (conn->session) direct_index.add(sessions.name_of(conn->session), DirectRoute{index, conn->sock, conn->id});
+        for (uint32_t room : t.rooms) enter_room(*conn, room);
+        conn->link_node = t.link_node;
+        conn->link_peer = t.link_peer;
+        if (conn->link_node) {
+            link_count++;
+            metrics.links.add();
+        }
+        conn->shm = std::move(channel);
+        conn->shm_up = t.shm_up;
+        conn->shm_down = t.shm_down;
+        conn->tcp_left = t.tcp_left;
+        if (conn->shm_up) {
+            metrics.shm_clients.add();
+            shm_resume.push_back(std::make_pair(conn->sock, conn->id)); // The pipe may hold frames nobody rang for
+        }
+        if (!t.unread.empty()) {
+            memcpy(conn->decoder.write_ptr(t.unread.size()), t.unread.data(), t.unread.size());
+            conn->decoder.commit(t.unread.size());
+        }
+        for (const std::string& message : t.queued) conn->outbox.push(Payload::copy_of(message.data(), message.size()));
+        if (!conn->outbox.empty()) {
+            conn->in_flush_list = true;
+            flush_list.push_back(conn->sock);
+        }
+        adopted.push_back(std::make_pair(conn->sock, conn->id));
+    }
+    taken.clear();
+    taken.shrink_to_fit();
+    // Whole frames may be waiting (from a user that was paused): handle them
+    // now that everyone is back in the tables.
+    for (auto& entry : adopted) {
+        auto it = connections.find(entry.first);
+        if (it == connections.end() || it->second.id != entry.second || it->second.decoder.buffered() == 0) continue;
+        if (!process_input(it->second)) close_connection(entry.first);
+    }
+    if (index == 0) {
+        for (uint32_t session : taken_dropped) end_session(session, 0);
+        taken_dropped.clear();
+    }
+}
+
+// The handoff thread (--handoff): waits for a new server at the Unix socket
+// and, when one comes, gives it everything and exits.
+void run_handoff(int listener) {
+    while (true) {
+        int successor = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (successor < 0) continue;
+        long long start = now_ns();
+        std::cout << "A new server is taking over..." << std::endl;
         {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            clients.push_back(new_socket);
+            std::lock_guard<std::mutex> lock(handoff.mutex);
+            handoff.stopped = 0;
+            handoff.delivered = 0;
+            handoff.packed = 0;
+            handoff.released = 0;
+            handoff.carry_on = false;
         }
-        
-        // Create a new thread (a worker) to handle this specific person.
-        // We pass the function 'handle_client' and the user's socket.
-        std::thread t(handle_client, new_socket);
-        
-        // detach() lets the thread run on its own in the background. 
-        // We don't need to wait for it to finish.
-        t.detach(); 
+        handoff.requested.store(true, std::memory_order_release);
+        for (Shard* shard : shards) shard->wakeup.signal();
+        {
+            std::unique_lock<std::mutex> lock(handoff.mutex);
+            handoff.cv.wait(lock, [] { return handoff.packed == shard_count; });
+        }
+
+        // Listeners first, then each user's socket (and channel), as written down.
+        std::string blob;
+        std::vector<int> fds;
+        std::string roster;
+        sessions.save(roster);
+        std::string room_list;
+        rooms.save(room_list);
+        size_t users = 0;
+        handoff_put(blob, HANDOFF_MAGIC, 4);
+        handoff_put(blob, relay_seq.load(), 8);
+        handoff_put_bytes(blob, roster.data(), roster.size());
+        handoff_put_bytes(blob, room_list.data(), room_list.size());
+        handoff_put(blob, shards.size(), 4);
+        for (Shard* shard : shards) {
+            fds.push_back(shard->listener);
+            handoff_put(blob, shard->handed_dropped.size(), 4);
+            for (uint32_t session : shard->handed_dropped) handoff_put(blob, session, 4);
+            handoff_put(blob, shard->handed_count, 4);
+            blob += shard->handed;
+            fds.insert(fds.end(), shard->handed_fds.begin(), shard->handed_fds.end());
+            users += shard->handed_count;
+        }
+
+        // The new server answers with one byte once it is ready to serve.
+        set_recv_timeout(successor, HANDOFF_TIMEOUT_MS);
+        char ready = 0;
+        if (handoff_send(successor, blob, fds) && recv(successor, &ready, 1, 0) == 1) {
+            std::cout << "Handed " << users << " connections to the new server after "
+                      << (now_ns() - start) / 1000000.0 << " ms. Goodbye." << std::endl;
+            _exit(0); // Its sockets live on in the new server; don't shut anything down
+        }
+        std::cout << "The new server did not take over; carrying on." << std::endl;
+        close(successor);
+        handoff.requested.store(false, std::memory_order_release);
+        std::unique_lock<std::mutex> lock(handoff.mutex);
+        handoff.carry_on = true;
+        handoff.cv.notify_all();
+        handoff.cv.wait(lock, [] { return handoff.released == shard_count; });
     }
+}
 
-    // Cleanup (Note: Code never actually reaches here because the while(true) loop is infinite)
-    closesocket(server_socket);
-    WSACleanup(); // Turn off Winsock
+// Take over from the server waiting at 'path' (--take-over): its listeners,
+// its users and who is who. The users are dealt out to our shards, which
+// adopt them when they start. Returns false (and the old server carries on)
+// if anything is wrong.
+bool take_over(const std::string& path, std::vector<std::vector<TakenConnection>>& users) {
+    handoff_peer = handoff_connect(path);
+    if (handoff_peer < 0) {
+        std::cerr << "No server to take over from at '" << path << "'.\n";
+        return false;
+    }
+    take_over_start = now_ns();
+    std::string blob;
+    std::vector<int> fds;
+    if (!handoff_receive(handoff_peer, blob, fds)) {
+        std::cerr << "The old server did not hand anything over.\n";
+        for (int fd : fds) close(fd);
+        return false;
+    }
+    HandoffReader in(blob.data(), blob.size());
+    size_t next_fd = 0;
+    auto take_fd = [&]() { return next_fd < fds.size() ? fds[next_fd++] : -1; };
+    if (in.get(4) != HANDOFF_MAGIC) in.ok = false;
+    uint64_t seq = in.get(8);
+    if (seq > relay_seq.load()) relay_seq = seq; // Carry on above what the old server sent
+    taken_roster = in.get_string();
+    taken_rooms = in.get_string();
+    size_t listener_count = (size_t)in.get(4);
+    users.assign(listener_count, std::vector<TakenConnection>());
+    for (size_t s = 0; s < listener_count && in.ok; s++) {
+        taken_listeners.push_back(take_fd());
+        size_t dropped = (size_t)in.get(4);
+        for (size_t i = 0; i < dropped && in.ok; i++) taken_dropped.push_back((uint32_t)in.get(4));
+        size_t count = (size_t)in.get(4);
+        for (size_t i = 0; i < count && in.ok; i++) {
+            TakenConnection t;
+            t.sock = take_fd();
+            if (in.get(1)) {
+                t.shm_fd = take_fd();
+                t.shm_name = in.get_string();
+                t.shm_owns_name = in.get(1) != 0;
+                t.shm_up = in.get(1) != 0;
+                t.shm_down = in.get(1) != 0;
+                t.tcp_left = (size_t)in.get(8);
+            }
+            t.session = (uint32_t)in.get(4);
+            t.messages_sent = in.get(8);
+            t.link_node = (uint32_t)in.get(4);
+            t.link_peer = (int)in.get(4) - 1;
+            if (t.link_peer >= (int)peers.size()) t.link_peer = -1; // Started without that --peer
+            if (t.link_peer >= 0) peers[t.link_peer]->up = true;      // Its dialer need not dial again
+            size_t room_count = (size_t)in.get(4);
+            for (size_t r = 0; r < room_count && in.ok; r++) t.rooms.push_back((uint32_t)in.get(4));
+            t.unread = in.get_string();
+            size_t queued = (size_t)in.get(4);
+            for (size_t q = 0; q < queued && in.ok; q++) t.queued.push_back(in.get_string());
+            users[s].push_back(std::move(t));
+        }
+    }
+    if (!in.ok || next_fd != fds.size() || listener_count == 0) {
+        std::cerr << "The old server handed over something we don't understand.\n";
+        for (int fd : fds) close(fd);
+        taken_listeners.clear();
+        return false;
+    }
+    return true;
+}
+
+// We are ready to serve: tell the old server, and wait until it is gone
+// (its ports and files are ours from then on).
+void finish_take_over() {
+    char ready = 1;
+    send_all(handoff_peer, &ready, 1);
+    while (recv(handoff_peer, &ready, 1, 0) > 0) {} // Closes when it exits
+    close(handoff_peer);
+    handoff_peer = -1;
+    std::cout << "Took over from the old server; users waited " << (now_ns() - take_over_start) / 1000000.0
+              << " ms." << std::endl;
+}
+#endif
+
+// --- DIALERS ---
+// One thread per --peer keeps our link to that node open. Whenever the link
+// is down it connects (blocking is fine: nothing else waits on this thread)
+// and hands the socket to shard 0, which introduces us with FRAME_LINK.
+void run_dialer(int index) {
+    RelayPeer& peer = *peers[index];
+    bool warned = false;
+    while (true) {
+        if (!peer.up.load()) {
+            sockaddr_in address;
+            SOCKET sock = make_address(address, peer.host, peer.port) ? socket(AF_INET, SOCK_STREAM, 0) : INVALID_SOCKET;
+            if (sock != INVALID_SOCKET && connect(sock, (sockaddr*)&address, sizeof(address)) == 0) {
+                set_nodelay(sock);
+                peer.up = true;
+                warned = false;
+                {
+                    std::lock_guard<std::mutex> lock(shards[0]->dialed_mutex);
+                    shards[0]->dialed.push_back(std::make_pair(sock, index));
+                }
+                shards[0]->wakeup.signal();
+            } else {
+                if (sock != INVALID_SOCKET) closesocket(sock);
+                if (!warned) std::cout << "Can't reach node " << peer.host << ":" << peer.port << " yet; will keep trying." << std::endl;
+                warned = true;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(LINK_RETRY_MS));
+    }
+}
+
+// Create the shards, give each one its listener and mailboxes, and run them.
+// Shard 0 runs on the calling thread. Never returns. 'taken' holds, per
+// shard, the users handed over by the server we took over from (if any).
+bool run_sharded(int port, std::vector<std::vector<TakenConnection>>& taken) {
+    // A shard's mailboxes share MAILBOX_SLOTS between them, so all of them
+    // together grow with the shard count, not with its square. A full one
+    // only means the writer keeps the rest for its next tick.
+    size_t mailbox_size = MAILBOX_MIN;
+    while (shard_count > 1 && mailbox_size * 2 * (shard_count - 1) <= MAILBOX_SLOTS) mailbox_size *= 2;
+    for (int i = 0; i < shard_count; i++) {
+        Shard* shard = new Shard();
+        shard->index = i;
+        shard->metrics.label = std::to_string(i);
+        shard->resume_ring.limit = resume_bytes;
+        metrics_registry.add(&shard->metrics);
+        shard->inbox.resize(shard_count, nullptr);
+        shard->outgoing.resize(shard_count);
+        for (int s = 0; s < shard_count; s++) {
+            if (s != i) shard->inbox[s] = new SpscRing<MailItem>(mailbox_size);
+        }
+        if (!shard->poller.ok() || !shard->wakeup.ok()) {
+            std::cerr << "Poller creation failed.\n";
+            return false;
+        }
+#ifdef CHAT_HAVE_URING
+        std::string error;
+        if (use_uring && !shard->setup_uring(error)) {
+            // e.g. not enough locked memory for the rings: carry on with the poller
+            std::cout << "io_uring setup failed (" << error << "); using the poller instead." << std::endl;
+            use_uring = false;
+            shard->ring.reset();
+            for (Shard* s : shards) s->ring.reset();
+        }
+#endif
+#ifdef SO_REUSEPORT
+        bool listens = true;   // Every shard listens; the kernel spreads new users out
+#else
+        bool listens = i == 0; // Only shard 0 listens and deals new users out to the others
+#endif
+#ifndef _WIN32
+        if (!taken_listeners.empty()) { // Taking over: the old server's listeners and users
+            shard->listener = taken_listeners[i];
+            shard->taken.swap(taken[i]);
+            listens = false;
+        }
+#endif
+        if (listens) {
+            shard->listener = open_listener(port, shard_count > 1);
+            if (shard->listener == INVALID_SOCKET) return false;
+        }
+        shards.push_back(shard);
+    }
+
+#ifndef _WIN32
+    if (!handoff_path.empty()) {
+        int handoff_listener = handoff_listen(handoff_path);
+        if (handoff_listener < 0) {
+            std::cerr << "Could not wait for a new server at '" << handoff_path << "'.\n";
+            return false;
+        }
+        std::thread t(run_handoff, handoff_listener);
+        t.detach();
+    }
+    if (handoff_peer >= 0) {
+        finish_take_over();
+        // The old server has gone, and with it its metrics endpoint.
+        if (!metrics_where.empty() && !start_metrics_endpoint(metrics_where, &metrics_registry)) {
+            std::cerr << "Could not open the metrics endpoint '" << metrics_where << "'.\n";
+        }
+    }
+#endif
+
+    for (int i = 1; i < shard_count; i++) {
+        std::thread t([i]() {
+            if (pin_threads) pin_to_core(i);
+            shards[i]->run();
+        });
+        t.detach();
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        std::thread t(run_dialer, (int)i);
+        t.detach();
+    }
+    if (pin_threads) pin_to_core(0);
+    shards[0]->run();
+    return true;
+}
+
+// --- MAIN FUNCTION ---
+// This is where the program starts.
+int main(int argc, char* argv[]) {
+    // Which design should we run? Default is the event loop, one shard per core.
+    bool thread_per_client = false;
+    shard_count = (int)std::thread::hardware_concurrency();
+    if (shard_count < 1) shard_count = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads") {
+            thread_per_client = true;
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shard_count = std::stoi(argv[++i]); // Number of event loops
+        } else if (arg == "--pin") {
+            pin_threads = true;                      // One core per event loop
+        } else if (arg == "--queue-limit" && i + 1 < argc) {
+            queue_limit = std::stoul(argv[++i]);   // Messages allowed to wait for one user
+        } else if (arg == "--slow-policy" && i + 1 < argc) {
+            if (!parse_slow_policy(argv[++i], slow_policy)) {
+                std::cerr << "--slow-policy must be drop, disconnect or pause.\n";
+                return 1;
+            }
+        } else if (arg == "--send-batch" && i + 1 < argc) {
+            send_batch = std::min<size_t>(MAX_SEND_BATCH, std::max(1, std::stoi(argv[++i]))); // 1 = one send per message
+        } else if (arg == "--coalesce-us" && i + 1 < argc) {
+            coalesce_ns = std::stoll(argv[++i]) * 1000; // Longest a small write may be held back
+        } else if (arg == "--coalesce-bytes" && i + 1 < argc) {
+            coalesce_bytes = std::stoul(argv[++i]);   // Send at once when this much is waiting
+        } else if (arg == "--io" && i + 1 < argc) {
+            std::string io = argv[++i];              // epoll (the poller) or uring
+            if (io != "epoll" && io != "uring") {
+                std::cerr << "--io must be epoll or uring.\n";
+                return 1;
+            }
+            use_uring = io == "uring";
+        } else if (arg == "--port" && i + 1 < argc) {
+            listen_port = std::stoi(argv[++i]);     // Port for users and other nodes
+        } else if (arg == "--node" && i + 1 < argc) {
+            node_id = (uint32_t)std::stoul(argv[++i]); // This server's number among linked nodes
+            if (node_id < 1 || node_id > NODE_MAX) {
+                std::cerr << "--node must be 1 to " << NODE_MAX << ".\n";
+                return 1;
+            }
+        } else if (arg == "--peer" && i + 1 < argc) {
+            RelayPeer* peer = new RelayPeer();       // Another node to link with (HOST:PORT)
+            if (!parse_peer(argv[++i], *peer)) {
+                std::cerr << "--peer needs HOST:PORT.\n";
+                return 1;
+            }
+            peers.push_back(peer);
+        } else if (arg == "--link-secret" && i + 1 < argc) {
+            link_secret = argv[++i];                 // Shared by all linked nodes; links without it are refused
+        } else if (arg == "--no-shm") {
+            offer_shm = false;                       // Local clients stay on TCP
+        } else if (arg == "--files" && i + 1 < argc) {
+            files_folder = argv[++i];                // Folder for uploaded attachments
+        } else if (arg == "--no-files") {
+            files_folder.clear();                    // Refuse attachments
+        } else if (arg == "--file-max-mb" && i + 1 < argc) {
+            files.max_bytes = std::stoull(argv[++i]) * 1024 * 1024; // Biggest attachment accepted
+        } else if (arg == "--backlog" && i + 1 < argc) {
+            listen_backlog = std::max(1, std::stoi(argv[++i])); // Connections the kernel holds until we accept them
+        } else if (arg == "--ip-rate" && i + 1 < argc) {
+            admission.ip_rate = std::stod(argv[++i]);  // New connections per second per address (0 = any)
+        } else if (arg == "--ip-burst" && i + 1 < argc) {
+            admission.ip_burst = std::max(1.0, std::stod(argv[++i])); // ...and how many in a row
+        } else if (arg == "--max-handshakes" && i + 1 < argc) {
+            admission.max_handshakes = std::max(0, std::stoi(argv[++i])); // New users not yet heard from (0 = any)
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            handoff_path = argv[++i];                // Unix socket where a new server can take over from us
+        } else if (arg == "--take-over" && i + 1 < argc) {
+            take_over_path = argv[++i];              // Unix socket of the running server to take over from
+        } else if (arg == "--resume-mb" && i + 1 < argc) {
+            resume_bytes = std::stoull(argv[++i]) * 1024 * 1024; // Recent messages kept per shard for reconnects (0 = none)
+        } else if (arg == "--heartbeat" && i + 1 < argc) {
+            heartbeat_ms = std::max(0LL, std::stoll(argv[++i])) * 1000; // Quiet seconds before a ping (0 = no heartbeats)
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idle_timeout_ms = std::max(1LL, std::stoll(argv[++i])) * 1000; // Quiet seconds before we hang up
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_where = argv[++i];               // Where to serve live metrics
+        } else if (arg == "--log" && i + 1 < argc) {
+            log_folder = argv[++i];                  // Folder for the message history
+        } else if (arg == "--no-log") {
+            log_folder.clear();                      // Keep no history at all
+        } else if (arg == "--log-segment-mb" && i + 1 < argc) {
+            message_log.segment_bytes = std::stoull(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--log-max-mb" && i + 1 < argc) {
+            message_log.max_bytes = std::stoull(argv[++i]) * 1024 * 1024; // Total history kept on disk
+        } else if (arg == "--log-max-age" && i + 1 < argc) {
+            message_log.max_age_s = std::stoll(argv[++i]); // Seconds of history kept
+        } else if (arg == "--log-fsync" && i + 1 < argc) {
+            std::string policy = argv[++i];          // always, never, or a period in milliseconds
+            if (policy == "always") message_log.fsync_policy = LOG_FSYNC_ALWAYS;
+            else if (policy == "never") message_log.fsync_policy = LOG_FSYNC_NEVER;
+            else message_log.fsync_interval_ms = std::max(1, std::stoi(policy));
+        } else {
+            std::cerr << "Usage: server.exe [--threads] [--shards N] [--pin] [--queue-limit N] [--slow-policy drop|disconnect|pause]\n"
+                      << "                  [--log DIR | --no-log] [--log-segment-mb N] [--log-max-mb N] [--log-max-age SECONDS]\n"
+                      << "                  [--log-fsync always|never|MS] [--metrics SOCKET_PATH|PORT]\n"
+                      << "                  [--send-batch N] [--coalesce-us N] [--coalesce-bytes N] [--io epoll|uring]\n"
+                      << "                  [--port N] [--node N --link-secret TEXT [--peer HOST:PORT]...] [--no-shm]\n"
+                      << "                  [--files DIR | --no-files] [--file-max-mb N]\n"
+                      << "                  [--backlog N] [--ip-rate PER_SECOND] [--ip-burst N] [--max-handshakes N]\n"
+                      << "                  [--heartbeat SECONDS] [--idle-timeout SECONDS] [--resume-mb N]\n"
+                      << "                  [--handoff SOCKET_PATH] [--take-over SOCKET_PATH]\n";
+            return 1;
+        }
+    }
+
+    // Linking servers needs node numbers, and the event loops.
+    if (!peers.empty() && node_id == 0) {
+        std::cerr << "--peer needs --node N as well (every linked server needs its own number).\n";
+        return 1;
+    }
+    if (node_id != 0 && link_secret.empty()) {
+        std::cerr << "--node needs --link-secret TEXT as well, the same on every linked server (or anybody could link in).\n";
+        return 1;
+    }
+    if (node_id != 0 && thread_per_client) {
+        std::cerr << "--node and --peer need the event-loop mode, not --threads.\n";
+        return 1;
+    }
+    // The ping has to go out before we give up, with time left to answer it.
+    if (heartbeat_ms > 0 && idle_timeout_ms <= heartbeat_ms) {
+        std::cerr << "--idle-timeout must be longer than --heartbeat.\n";
+        return 1;
+    }
+    // A hot restart moves the event loops' users; the threads have nothing to move.
+    if ((!handoff_path.empty() || !take_over_path.empty()) && (thread_per_client || use_uring)) {
+        std::cerr << "--handoff and --take-over need the event-loop mode on the poller (not --threads or --io uring).\n";
+        return 1;
+    }
+#ifdef _WIN32
+    if (!handoff_path.empty() || !take_over_path.empty()) {
+        std::cerr << "--handoff and --take-over are only available on Linux.\n";
+        return 1;
+    }
+#endif
+    // Rooms keep one bit per event loop (chat_room.h), so however many
+    // cores there are, or --shards asks for, there are at most ROOM_SHARDS_MAX.
+    if (shard_count < 1 || shard_count > ROOM_SHARDS_MAX) {
+        int asked = shard_count;
+        shard_count = std::max(1, std::min(ROOM_SHARDS_MAX, shard_count));
+        if (!thread_per_client) {
+            std::cout << "Running " << shard_count << (shard_count == 1 ? " event loop" : " event loops")
+                      << " instead of " << asked << " (1 to " << ROOM_SHARDS_MAX << ")." << std::endl;
+        }
+    }
+    sessions.set_node(node_id);
+    relay_seq = relay_first_seq();
+    server_epoch = relay_first_seq(); // Different for every run (and for a server that takes over)
+
+    // 1. STARTUP NETWORKING
+    // On Windows this is WSAStartup asking for Winsock version 2.2.
+    if (!net_startup()) {
+        std::cerr << "WSAStartup failed.\n"; // Print error if it fails
+        return 1; // Exit program with error code
+    }
+    raise_fd_limit(); // Let the OS give us enough sockets for thousands of users
+
+    // Taking over from a running server: it stops, and hands us its
+    // listeners and users. We run as many event loops as it did (each has
+    // a listener of the port).
+    std::vector<std::vector<TakenConnection>> taken;
+#ifndef _WIN32
+    if (!take_over_path.empty()) {
+        if (!take_over(take_over_path, taken)) return 1;
+        if (shard_count != (int)taken_listeners.size()) {
+            std::cout << "Running " << taken_listeners.size() << " event loops, like the server we took over from." << std::endl;
+        }
+        shard_count = (int)taken_listeners.size();
+    }
+#endif
+
+    // Serve live counters to monitoring tools (after a takeover, once the
+    // old server has let go of them).
+    if (!metrics_where.empty() && take_over_path.empty()) {
+        if (!start_metrics_endpoint(metrics_where, &metrics_registry)) {
+            std::cerr << "Could not open the metrics endpoint '" << metrics_where << "'.\n";
+            return 1;
+        }
+        std::cout << "Metrics available at " << metrics_where << std::endl;
+    }
+
+    // Open the message history (event-loop mode only; --threads keeps none).
+    if (!thread_per_client && !log_folder.empty() && !message_log.open(log_folder)) {
+        std::cerr << "Could not open the message log in '" << log_folder << "'.\n";
+        return 1;
+    }
+    // Session IDs are written into logged messages, so they must not repeat
+    // across restarts: reservations are kept next to the log.
+    if (!thread_per_client && !log_folder.empty() && !sessions.open(log_folder)) {
+        std::cerr << "Could not write the session file in '" << log_folder << "'.\n";
+        return 1;
+    }
+#ifndef _WIN32
+    sessions.load(taken_roster.data(), taken_roster.size()); // Everyone the old server knew
+    rooms.load(taken_rooms.data(), taken_rooms.size());      // and its rooms, under the same IDs
+#endif
+    // Attachments are kept in a folder of their own (event-loop mode only).
+    files.set_node(node_id);
+    if (!thread_per_client && !files_folder.empty()) {
+        if (!files.open(files_folder)) {
+            std::cerr << "Could not write to the attachments folder '" << files_folder << "'.\n";
+            return 1;
+        }
+        file_writer.start(&files, [](int owner) {
+            for (Shard* shard : shards) {
+                if (owner < 0 || shard->index == owner) shard->wakeup.signal();
+            }
+        });
+    }
+
+    if (thread_per_client) {
+        // 2. CREATE, BIND AND LISTEN on one socket
+        SOCKET server_socket = open_listener(listen_port, false);
+        if (server_socket == INVALID_SOCKET) return 1;
+        std::cout << "Server listening on port " << listen_port << " (thread per client)..." << std::endl;
+
+        // 3. ACCEPT LOOP (runs forever)
+        run_thread_per_client(server_socket);
+        closesocket(server_socket);
+    } else {
+        // io_uring only if this kernel can do everything we use; otherwise the poller.
+        std::string why;
+        if (use_uring && !uring_supported(why)) {
+            std::cout << "io_uring is not available (" << why << "); using the poller instead." << std::endl;
+            use_uring = false;
+        }
+        std::cout << "Server listening on port " << listen_port << " (" << shard_count
+                  << (shard_count == 1 ? " event loop" : " event loops") << (use_uring ? " on io_uring" : "")
+                  << ")" << (node_id ? " as node " + std::to_string(node_id) : std::string()) << "..." << std::endl;
+
+        // 2. One listener and one event loop per shard (runs forever)
+        if (!run_sharded(listen_port, taken)) return 1;
+    }
+
+    // Cleanup (Note: Code never actually reaches here because the loops above are infinite)
+    net_cleanup(); // Turn off Winsock
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,180 @@
+// --- SHARED-MEMORY RING BENCHMARK ---
+// Measures how many messages per second go through the shared-memory ring
+// between separate processes:
+//   - this process maps the ring and reads every message,
+//   - it starts P producer processes that each write M messages.
+// It reports millions of messages per second and how many the reader lost
+// because the producers lapped it.
+//
+// With --latency, ONE producer instead writes a timestamped message every
+// --interval-us microseconds and the reader reports how long each took to
+// arrive (p50 / p99 / p999 / max, in microseconds). --poll-ms N makes the
+// reader check every N ms the old way instead of sleeping until woken, for
+// comparison.
+//
+// Uses its own segment name, so it never disturbs a running chat.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <algorithm>
+#include "chat_shm_ring.h"
+
+#ifdef _WIN32
+#define BENCH_SHM_NAME "Local\\MyChatRingBench"
+#else
+#define BENCH_SHM_NAME "/my_chat_ring_bench"
+#include <sys/wait.h>   // waitpid
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// Nanoseconds on the steady clock. Both processes read the same system-wide
+// clock (CLOCK_MONOTONIC / QueryPerformanceCounter), so the numbers compare.
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Producer side: write 'count' messages of 'size' bytes. If 'interval_us' is
+// set, put the send time in each message and pause that long between them.
+static int produce(long long count, int size, int interval_us) {
+    ShmSegment segment;
+    if (!segment.open(BENCH_SHM_NAME)) {
+        std::cerr << "Producer could not open shared memory.\n";
+        return 1;
+    }
+    std::string text(size, 'x');
+    for (long long i = 0; i < count; i++) {
+        if (interval_us > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+            long long sent = now_ns();
+            memcpy(&text[0], &sent, sizeof(sent));
+        }
+        segment.publish("bench", text.data(), text.size());
+    }
+    return 0;
+}
+
+// Start one producer process.
+static bool spawn_producer(const char* self, long long count, int size, int interval_us) {
+#ifdef _WIN32
+    std::string cmd = std::string("\"") + self + "\" produce " + std::to_string(count) + " " + std::to_string(size)
+                    + " " + std::to_string(interval_us);
+    STARTUPINFOA si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    if (!CreateProcessA(NULL, &cmd[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) return false;
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return true;
+#else
+    (void)self;
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) _exit(produce(count, size, interval_us)); // Child: produce, then leave
+    return true;
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    // "produce <count> <size> <interval_us>" is how the benchmark starts its producer processes.
+    if (argc == 5 && std::string(argv[1]) == "produce") {
+        return produce(std::atoll(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]));
+    }
+
+    int producers = 2;
+    long long messages = 2000000; // Per producer
+    int size = 64;
+    bool latency = false;
+    int interval_us = 1000; // Gap between messages in --latency mode
+    int poll_ms = 0;        // 0 = sleep until woken; N = check every N ms (the old way)
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key == "--latency") { latency = true; continue; }
+        if (i + 1 >= argc) key = "";
+        if (key == "--producers") producers = std::atoi(argv[++i]);
+        else if (key == "--messages") messages = std::atoll(argv[++i]);
+        else if (key == "--size") size = std::atoi(argv[++i]);
+        else if (key == "--interval-us") interval_us = std::atoi(argv[++i]);
+        else if (key == "--poll-ms") poll_ms = std::atoi(argv[++i]);
+        else {
+            std::cerr << "Usage: shm_bench.exe [--producers P] [--messages M] [--size B]\n"
+                      << "                     [--latency [--interval-us U]] [--poll-ms N]\n";
+            return 1;
+        }
+    }
+    if (size > SHM_MESSAGE_SIZE - 1) size = SHM_MESSAGE_SIZE - 1;
+    if (latency) {
+        producers = 1; // One steady sender, so queueing behind other senders doesn't skew the numbers
+        if (messages > 100000) messages = 10000;
+        if (size < (int)sizeof(long long)) size = sizeof(long long);
+    } else {
+        interval_us = 0;
+    }
+
+    ShmSegment segment;
+    if (!segment.open(BENCH_SHM_NAME)) {
+        std::cerr << "Could not open shared memory.\n";
+        return 1;
+    }
+    ShmReader reader(segment.ring()); // Created BEFORE the producers start, so it sees everything
+
+    for (int p = 0; p < producers; p++) {
+        if (!spawn_producer(argv[0], messages, size, interval_us)) {
+            std::cerr << "Could not start producer " << p << ".\n";
+            return 1;
+        }
+    }
+
+    // Read until every message has either arrived or been reported lost.
+    long long expected = messages * producers;
+    long long received = 0;
+    ShmMessage msg;
+    std::vector<long long> delays; // Send-to-receive time of each message, --latency only
+    if (latency) delays.reserve((size_t)expected);
+    Clock::time_point first = Clock::now();
+    while (received + (long long)reader.lost < expected) {
+        ShmReadStatus status = reader.read(msg);
+        if (status == SHM_READ_OK) {
+            if (latency) {
+                long long sent;
+                memcpy(&sent, msg.message, sizeof(sent));
+                delays.push_back(now_ns() - sent);
+            }
+            if (received == 0) first = Clock::now(); // Start timing at the first message
+            received++;
+        } else if (status == SHM_READ_EMPTY) {
+            if (poll_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+            else reader.wait(segment);
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - first).count();
+
+#ifndef _WIN32
+    while (waitpid(-1, nullptr, 0) > 0) {} // Collect the producer processes
+    shm_unlink(BENCH_SHM_NAME);             // Remove the benchmark segment
+#endif
+
+    if (latency) {
+        std::sort(delays.begin(), delays.end());
+        auto percentile = [&](double p) {
+            if (delays.empty()) return 0.0;
+            size_t index = (size_t)(p * (delays.size() - 1));
+            return delays[index] / 1000.0;
+        };
+        std::cout << "Wake-up latency over " << delays.size() << " messages, one every " << interval_us << " us ("
+                  << (poll_ms > 0 ? "polling every " + std::to_string(poll_ms) + " ms" : std::string("spin, then sleep until woken"))
+                  << ")\n";
+        std::cout << "p50 " << percentile(0.50) << " us, p99 " << percentile(0.99) << " us, p999 "
+                  << percentile(0.999) << " us, max " << percentile(1.0) << " us\n";
+        return 0;
+    }
+
+    double total = (double)(received + reader.lost);
+    std::cout << producers << " producer process(es), " << size << "-byte messages\n";
+    std::cout << "Received " << received << " of " << expected << " (lost " << reader.lost << " to overruns)\n";
+    std::cout << "Throughput: " << (total / seconds) / 1e6 << " M msg/s written, "
+              << (received / seconds) / 1e6 << " M msg/s read\n";
+    return 0;
+}
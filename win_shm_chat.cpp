@@ -1,77 +1,79 @@
 #include <iostream>
 #include <string>
-#include <windows.h> // Required for Windows Shared Memory functions
 #include <thread>
+#include <cstdlib>
+#include "chat_shm_ring.h" // The shared message ring (Windows or Linux shared memory)
 
-// Unique names so both programs find the same memory location
-#define SHM_NAME "Local\\MyChatMemory" 
-#define SEM_NAME "Local\\MyChatSemaphore"
-#define SHM_SIZE 1024
-
-// This struct defines what the shared memory looks like
-struct ChatData {
-    char message[256];
-    char sender[50];
-    int message_id; // Acts like a version number. Increases when new message arrives.
-};
+// Unique name so every copy of the program finds the same memory location
+#ifdef _WIN32
+#define SHM_NAME "Local\\MyChatRing"
+#else
+#define SHM_NAME "/my_chat_ring"
+#endif
+#define SHM_REPLAY 20 // Earlier messages to show when we join
 
 // Thread to watch for new messages
-void receiver_thread(ChatData* shared_mem, std::string my_name) {
-    int last_seen_id = shared_mem->message_id;
+void receiver_thread(ShmSegment* segment, std::string my_name) {
+    ShmReader reader(segment->ring(), SHM_REPLAY); // Our own position in the ring, a few messages back
+    ShmMessage msg;
     while (true) {
-        // If the ID in memory is higher than what we last saw, it's a new message!
-        if (shared_mem->message_id > last_seen_id) {
+        // Read EVERY message written since we last looked, not just the newest one.
+        ShmReadStatus status;
+        while ((status = reader.read(msg)) != SHM_READ_EMPTY) {
+            if (status == SHM_READ_OVERRUN) {
+                std::cout << "\r[System]: missed " << reader.last_gap << " messages\n> " << std::flush;
+                continue;
+            }
             // Only print if it wasn't ME who sent it
-            if (std::string(shared_mem->sender) != my_name) {
-                std::cout << "\r[" << shared_mem->sender << "]: " << shared_mem->message << "\n> " << std::flush;
+            if (std::string(msg.sender) != my_name) {
+                std::cout << "\r[" << msg.sender << "]: " << msg.message << "\n> " << std::flush;
             }
-            last_seen_id = shared_mem->message_id; // Update our tracker
         }
-        Sleep(100); // Wait 0.1 seconds before checking again (saves CPU)
+        reader.wait(*segment); // Sleep until a writer wakes us (no CPU used while idle)
     }
 }
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cout << "Usage: win_shm_chat.exe <username>\n";
+        std::cout << "Usage: win_shm_chat.exe <username> [room]\n";
         return 1;
     }
     std::string username = argv[1];
+    std::string room = argc > 2 ? argv[2] : ""; // Each room is a segment of its own
+#ifdef _WIN32
+    SetConsoleCP(CP_UTF8);       // Type and show UTF-8, like the other chat clients
+    SetConsoleOutputCP(CP_UTF8);
+#endif
 
-    // 1. Create/Open Shared Memory in RAM
-    HANDLE hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SHM_SIZE, SHM_NAME);
-    
-    // 2. Map it so we can access it like a variable
-    ChatData* pBuf = (ChatData*)MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, SHM_SIZE);
-    
-    // 3. Create Semaphore (Lock) to prevent writing at exact same time
-    HANDLE hSemaphore = CreateSemaphore(NULL, 1, 1, SEM_NAME);
+    // 1. Create/Open Shared Memory in RAM and map it so we can access it like a variable.
+    // No semaphore is needed any more: writers claim slots with an atomic counter.
+    ShmSegment segment;
+    if (!segment.open(shm_room_name(SHM_NAME, room))) {
+        std::cout << "Failed to open shared memory.\n";
+        return 1;
+    }
 
-    system("cls"); 
-    std::cout << "--- SHARED MEMORY CHAT (" << username << ") ---\n> ";
+#ifdef _WIN32
+    system("cls");
+#else
+    system("clear");
+#endif
+    std::cout << "--- SHARED MEMORY CHAT (" << username << (room.empty() ? "" : " in #" + room) << ") ---\n> ";
 
     // Start background listener
-    std::thread t(receiver_thread, pBuf, username);
+    std::thread t(receiver_thread, &segment, username);
     t.detach();
 
     // Main Input Loop
     while (true) {
         std::string msg;
-        std::getline(std::cin, msg);
+        if (!std::getline(std::cin, msg)) break;
         if (msg == "exit") break;
 
-        // LOCK: Wait for permission to write
-        WaitForSingleObject(hSemaphore, INFINITE);
-        
-        // WRITE data to RAM
-        strcpy(pBuf->message, msg.c_str());
-        strcpy(pBuf->sender, username.c_str());
-        pBuf->message_id++; // Increment ID
-        
-        // UNLOCK: Give permission back
-        ReleaseSemaphore(hSemaphore, 1, NULL);
+        // WRITE data to RAM (long messages are cut to fit a slot) and wake the readers
+        segment.publish(username, msg);
 
         std::cout << "> ";
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -4,33 +4,32 @@
 #include <string>    // For std::string and std::wstring
 #include <thread>    // For the background receiver thread
 #include <mutex>     // For the chat log thread-safety
+#include "chat_shm_ring.h" // The shared message ring (same layout as the console app)
+#include "chat_log_model.h" // Recent lines, redrawn at most once per frame
+#include "chat_utf8.h"      // Chat text is UTF-8; Win32 wants UTF-16
 
-// --- SHARED MEMORY & SEMAPHORE CONSTANTS (UNCHANGED) ---
-// Note: L prefix makes these wide-character (WCHAR) strings, necessary for UNICODE build
-#define SHM_NAME L"Local\\MyChatMemory" 
-#define SEM_NAME L"Local\\MyChatSemaphore"
-#define SHM_SIZE 1024
-
-// This struct defines what the shared memory looks like (UNCHANGED)
-struct ChatData {
-    char message[256];
-    char sender[50];
-    int message_id; // Acts like a version number. Increases when new message arrives.
-};
+// --- SHARED MEMORY CONSTANTS ---
+// Same name as the console app, so both can chat together. The ring API takes
+// narrow (char) names, so there is no L prefix here.
+#define SHM_NAME "Local\\MyChatRing"
+#define SHM_REPLAY 20 // Earlier messages to show when we join
 
 // --- GLOBAL VARIABLES FOR GUI AND SHARED MEMORY (Aligned with Console App's Scope) ---
 // These are made global so the receiver thread and message handler can access them.
-ChatData* pBuf = nullptr;
-HANDLE hMapFile = NULL;
-HANDLE hSemaphore = NULL;
+ShmSegment g_segment;   // Owns the mapping of the shared ring
+ShmRing* pBuf = nullptr; // The ring itself, once mapped
 std::string g_username; // Global to store the user's name
+std::string g_room;     // The room (its own segment), or "" for everyone
 
 // --- GUI CONSTANTS AND GLOBALS ---
 #define ID_SEND_BUTTON 1001 // Unique ID for the Send button control
 #define ID_INPUT_BOX 1002   // Unique ID for the text input control
 #define ID_CHAT_LOG 1003    // Unique ID for the chat display area (EDIT control)
+#define ID_REDRAW_TIMER 1   // Timer that spaces out chat log redraws
+#define WM_CHAT_LOG (WM_APP + 1) // Posted when new lines are waiting in g_chat_log
 
-std::mutex g_chat_mutex;    // Mutex to protect the chat log (g_hChatLog) access from multiple threads
+ChatLogModel g_chat_log;    // Lines waiting to be shown; safe to add to from any thread
+HWND g_hWindow = NULL;      // Handle (pointer) to the main window
 HWND g_hChatLog = NULL;     // Handle (pointer) to the chat log window control
 HWND g_hInputBox = NULL;    // Handle (pointer) to the input box window control
 
@@ -38,55 +37,73 @@ HWND g_hInputBox = NULL;    // Handle (pointer) to the input box window control
 HBRUSH g_hBackgroundBrush = NULL; // Brush for the custom background color
 
 // Function to append text to the chat log (Thread-safe)
+// The line only goes into the model here; the window thread draws it later,
+// together with everything else that arrives in the same frame.
 void AppendToChatLog(const std::string& text) {
-    // Lock guard automatically locks the mutex on creation and unlocks on destruction
-    std::lock_guard<std::mutex> lock(g_chat_mutex);
+    // append() returns true for the first line since the last redraw, so a
+    // burst of messages posts just one WM_CHAT_LOG
+    if (g_chat_log.append(text) && g_hWindow) {
+        PostMessage(g_hWindow, WM_CHAT_LOG, 0, 0);
+    }
+}
 
-    if (g_hChatLog) {
+// Show what changed in the model since the last redraw (window thread only)
+void RedrawChatLog() {
+    const ChatLogUpdate& update = g_chat_log.take();
+    // Convert the UTF-8 std::string (message) to std::wstring (Windows expects UTF-16)
+    std::wstring wtext = utf8_to_wide(update.text);
+
+    // WM_SETREDRAW: Don't repaint between the edits below, only once at the end
+    SendMessage(g_hChatLog, WM_SETREDRAW, FALSE, 0);
+    if (update.replace) {
+        // Everything on screen has scrolled out of the model: start over
+        SetWindowText(g_hChatLog, wtext.c_str());
+    } else {
+        if (update.drop > 0) {
+            // Cut the lines that scrolled out of the model off the top
+            SendMessage(g_hChatLog, EM_SETSEL, 0, (LPARAM)update.drop);
+            SendMessage(g_hChatLog, EM_REPLACESEL, 0, (LPARAM)L"");
+        }
         int len = GetWindowTextLength(g_hChatLog);
-        // Convert the std::string (message) to std::wstring (Windows expects wide strings)
-        std::wstring wtext = std::wstring(text.begin(), text.end());
-
         // EM_SETSEL: Set selection to the end of the current text
         SendMessage(g_hChatLog, EM_SETSEL, (WPARAM)len, (LPARAM)len);
         // EM_REPLACESEL: Replace the current selection (which is at the end) with the new text
         SendMessage(g_hChatLog, EM_REPLACESEL, 0, (LPARAM)wtext.c_str());
-        // WM_VSCROLL: Scroll to the bottom to show the newest message
-        SendMessage(g_hChatLog, WM_VSCROLL, SB_BOTTOM, (LPARAM)NULL);
     }
+    SendMessage(g_hChatLog, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(g_hChatLog, NULL, TRUE);
+    // WM_VSCROLL: Scroll to the bottom to show the newest message
+    SendMessage(g_hChatLog, WM_VSCROLL, SB_BOTTOM, (LPARAM)NULL);
 }
 
 // --- CORE FUNCTIONALITY (Similar to receiver_thread in console app) ---
 // Thread to watch for new messages
-void receiver_thread(ChatData* shared_mem, std::string my_name) {
-    // Safety check: wait until shared memory is fully initialized in WinMain
-    while (!pBuf || !hSemaphore) {
-        Sleep(100);
-    }
-
-    int last_seen_id = pBuf->message_id;
+void receiver_thread(ShmRing* shared_mem, std::string my_name) {
+    ShmReader reader(shared_mem, SHM_REPLAY); // Our own position in the ring, a few messages back
+    ShmMessage msg;
 
     while (true) {
-        // If the ID in memory is higher than what we last saw, it's a new message!
-        if (pBuf->message_id > last_seen_id) {
-            std::string sender = pBuf->sender;
-            std::string message = pBuf->message;
-            
+        // Read EVERY message written since we last looked, not just the newest one.
+        ShmReadStatus status;
+        while ((status = reader.read(msg)) != SHM_READ_EMPTY) {
+            if (status == SHM_READ_OVERRUN) {
+                AppendToChatLog("[System]: missed " + std::to_string(reader.last_gap) + " messages\r\n");
+                continue;
+            }
             // Only display if it wasn't ME who sent it
-            if (sender != g_username) {
-                std::string log_msg = "[" + sender + "]: " + message + "\r\n";
+            if (my_name != msg.sender) {
+                std::string log_msg = "[" + std::string(msg.sender) + "]: " + msg.message + "\r\n";
                 // Use the thread-safe GUI function to update the chat log
                 AppendToChatLog(log_msg);
             }
-            last_seen_id = pBuf->message_id; // Update our tracker
         }
-        Sleep(100); // Wait 0.1 seconds before checking again (saves CPU)
+        reader.wait(g_segment); // Sleep until a writer wakes us (no CPU used while idle)
     }
 }
 
 // --- SEND MESSAGE LOGIC (Replaces the writing block in console app's main loop) ---
 void SendMessageAction() {
-    if (!pBuf || !hSemaphore) return;
+    if (!pBuf) return;
 
     // 1. Get text from input box
     int len = GetWindowTextLength(g_hInputBox);
@@ -97,9 +114,9 @@ void SendMessageAction() {
     // Get the text from the input control
     GetWindowText(g_hInputBox, wText, len + 1);
 
-    // 2. Convert from WCHAR* to std::string
+    // 2. Convert from WCHAR* to a UTF-8 std::string
     std::wstring wmsg(wText);
-    std::string msg(wmsg.begin(), wmsg.end());
+    std::string msg = wide_to_utf8(wmsg);
     delete[] wText;
 
     // 3. Clear input box and display my message locally
@@ -108,19 +125,8 @@ void SendMessageAction() {
     AppendToChatLog(log_msg);
 
     // 4. Write to Shared Memory (Identical logic to console app's main loop)
-    // LOCK: Wait for permission to write
-    WaitForSingleObject(hSemaphore, INFINITE);
-
-    // WRITE data to RAM
-    // Using strncpy to prevent buffer overflows, ensuring null termination
-    strncpy(pBuf->message, msg.c_str(), sizeof(pBuf->message) - 1);
-    pBuf->message[sizeof(pBuf->message) - 1] = '\0';
-    strncpy(pBuf->sender, g_username.c_str(), sizeof(pBuf->sender) - 1);
-    pBuf->sender[sizeof(pBuf->sender) - 1] = '\0';
-    pBuf->message_id++; // Increment ID
-    
-    // UNLOCK: Give permission back
-    ReleaseSemaphore(hSemaphore, 1, NULL);
+    // No lock needed: publish claims its own slot, cuts long text to fit and wakes the readers.
+    g_segment.publish(g_username, msg);
 }
 
 // --- WINDOWS API CALLBACK ---
@@ -128,9 +134,11 @@ void SendMessageAction() {
 LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
     switch (message) {
     case WM_CREATE: {
+        g_hWindow = hwnd; // From now on new lines can be posted to us
 
         // Create a variable to store the username for the static title message
-        std::wstring w_title_text = L"--- SHARED MEMORY CHAT (" + std::wstring(g_username.begin(), g_username.end()) + L") ---";
+        std::wstring w_title_text = L"--- SHARED MEMORY CHAT (" + utf8_to_wide(g_username) +
+                                    (g_room.empty() ? L"" : L" in #" + utf8_to_wide(g_room)) + L") ---";
 
         // Create a new STATIC element and give it SS_CENTER style for centering
         HWND hTitleStatic = CreateWindowEx(0, L"STATIC", w_title_text.c_str(), 
@@ -142,6 +150,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         g_hChatLog = CreateWindowEx(0, L"EDIT", L"", WS_CHILD | WS_VISIBLE | WS_VSCROLL | ES_MULTILINE | ES_READONLY | ES_AUTOVSCROLL,
             10, 30, 480, 230, // Start from position (10, 30)
             hwnd, (HMENU)ID_CHAT_LOG, GetModuleHandle(NULL), NULL);    
+        // EDIT controls stop at about 32K characters by default; the model keeps the size bounded instead
+        SendMessage(g_hChatLog, EM_SETLIMITTEXT, 0, 0);
 
         // Create the input box (single-line EDIT control)
         g_hInputBox = CreateWindowEx(0, L"EDIT", L"", WS_CHILD | WS_VISIBLE | WS_BORDER | ES_AUTOHSCROLL,
@@ -188,6 +198,24 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         return (LRESULT)g_hBackgroundBrush;
     }
 
+    // New lines are waiting in the model: redraw now, or when this frame is over
+    case WM_CHAT_LOG: {
+        int delay = g_chat_log.redraw_delay_ms();
+        if (delay == 0) {
+            RedrawChatLog();
+        } else {
+            SetTimer(hwnd, ID_REDRAW_TIMER, delay, NULL);
+        }
+        break;
+    }
+
+    case WM_TIMER:
+        if (wParam == ID_REDRAW_TIMER) {
+            KillTimer(hwnd, ID_REDRAW_TIMER); // We only want it once
+            RedrawChatLog();
+        }
+        break;
+
     case WM_COMMAND: {
         // This message is sent when a control generates a notification (e.g., button click)
         int wmId = LOWORD(wParam);
@@ -227,24 +255,17 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         g_username = "User" + std::to_string(GetCurrentProcessId());
         MessageBox(NULL, L"No username provided. Using default name.", L"Warning", MB_OK | MB_ICONWARNING); 
     } else {
-        // Convert the command-line argument (wide string) to std::string
+        // Convert the command-line argument (wide string) to a UTF-8 std::string
         std::wstring wname(argv[1]);
-        g_username = std::string(wname.begin(), wname.end());
+        g_username = wide_to_utf8(wname);
     }
+    if (argc > 2) g_room = wide_to_utf8(std::wstring(argv[2])); // Optional: a room of its own
     LocalFree(argv); // Free memory allocated by CommandLineToArgvW
 
-    // --- 1. Create/Open Shared Memory in RAM (Identical Logic Block) ---
-    hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SHM_SIZE, SHM_NAME);
-    
-    // --- 2. Map it so we can access it like a variable (Identical Logic Block) ---
-    pBuf = (ChatData*)MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, SHM_SIZE);
-    
-    // --- 3. Create Semaphore (Lock) (Identical Logic Block) ---
-    hSemaphore = CreateSemaphore(NULL, 1, 1, SEM_NAME);
-
-    // Initialize ID if new shared memory (optional logic for first process to run)
-    if (pBuf && hMapFile && GetLastError() != ERROR_ALREADY_EXISTS) {
-        pBuf->message_id = 0;
+    // --- 1. Create/Open Shared Memory in RAM and map it (Identical Logic Block) ---
+    // A brand-new segment is all zeros, which is already a valid empty ring.
+    if (g_segment.open(shm_room_name(SHM_NAME, g_room))) {
+        pBuf = g_segment.ring();
     }
 
     if (pBuf == NULL) {
@@ -291,9 +312,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
     // --- Cleanup (Replaces return 0; / automatic cleanup) ---
     // Cleanly unmap and close all Windows handles before exiting
-    if (pBuf) UnmapViewOfFile(pBuf);
-    if (hMapFile) CloseHandle(hMapFile);
-    if (hSemaphore) CloseHandle(hSemaphore);
+    g_segment.close();
 
     return msg.wParam; // Return the exit code
 }
\ No newline at end of file
@@ -5,11 +5,20 @@
 #include <ws2tcpip.h>   // <--- Keep this with it
 #include <windows.h>           // Win32 core functions
 #include <string>              // std::string and std::wstring
-#include <thread>              // For background receiving thread
+#include <thread>              // For the network loop's thread
 #include <mutex>               // For thread-safe access
-#include <atomic>              // For atomic flags
+#include <atomic>              // For the "online" flag
+#include <chrono>              // For the time the connection dropped
+#include <algorithm>           // For std::min
 #include <winsock2.h>          // Winsock socket API
 #include <ws2tcpip.h>          // IP helper functions
+#include "chat_frame.h"        // Length-prefixed message frames
+#include "chat_session.h"      // Session IDs and who is who
+#include "chat_log_model.h"    // Recent lines, redrawn at most once per frame
+#include "chat_client.h"       // Connecting, sending and receiving (shared memory for a server on this PC)
+#include "chat_utf8.h"         // Chat text is UTF-8; Win32 wants UTF-16
+#include "chat_direct.h"       // "/msg bob ...": messages for one user
+#include "chat_room.h"         // "/join games": rooms
 
 #pragma comment(lib, "Ws2_32.lib")  // Link Winsock library
 
@@ -17,84 +26,167 @@
 #define ID_SEND_BUTTON 1001    // Send button ID
 #define ID_INPUT_BOX   1002    // Input box ID
 #define ID_CHAT_LOG    1003    // Chat log ID
+#define ID_REDRAW_TIMER 1      // Timer that spaces out chat log redraws
+#define WM_CHAT_LOG (WM_APP + 1) // Posted when new lines are waiting in g_chat_log
+#define RECONNECT_MAX_MS 30000 // Longest wait between two tries to get back in
 
 // Global GUI handles
+HWND g_hWindow = NULL;         // Handle to main window
 HWND g_hChatLog = NULL;        // Handle to chat log
 HWND g_hInputBox = NULL;       // Handle to input box
 HBRUSH g_hBackgroundBrush = NULL; // Background brush
 
 std::string g_username;        // User name
-std::mutex g_chat_mutex;       // Mutex to protect chat log
-
-// Socket data
-SOCKET g_sock = INVALID_SOCKET; // Client socket
-std::atomic<bool> g_running(false); // Flag for running thread
-std::thread g_recv_thread;     // Thread for receiving messages
-
-// Append text to chat log (thread-safe)
+ChatLogModel g_chat_log;       // Lines waiting to be shown (thread-safe)
+
+// Network data
+EventLoop* g_loop = nullptr;   // Runs the connection, on g_net_thread
+ChatClient* g_client = nullptr; // Our connection to the server (TCP, or shared memory if the server is local)
+std::thread g_net_thread;      // Thread running g_loop
+bool g_leaving = false;        // We are hanging up ourselves (g_net_thread only)
+std::atomic<bool> g_online(false); // Connected and registered (the window thread checks it)
+long long g_lost_at_ms = 0;    // When the connection last dropped (Unix time; 0 = it never did)
+RoomList g_rooms;              // The rooms we are in (the window thread reads g_rooms.current)
+
+// Append text to chat log (thread-safe, the window redraws later)
 void AppendToChatLog(const std::string& text)
 {
-    std::lock_guard<std::mutex> lock(g_chat_mutex); // Lock mutex
-
-    if (!g_hChatLog) return;                       // Exit if chat log not ready
+    if (g_chat_log.append(text) && g_hWindow)      // First line since the last redraw?
+        PostMessageW(g_hWindow, WM_CHAT_LOG, 0, 0); // Ask the window thread for one
+}
 
-    std::wstring wtext(text.begin(), text.end());  // Convert string to wide string
+// Show what changed in g_chat_log since the last redraw (window thread only)
+void RedrawChatLog()
+{
+    const ChatLogUpdate& update = g_chat_log.take(); // Lines cut at the top, lines added at the bottom
+    std::wstring wtext = utf8_to_wide(update.text); // UTF-8 to the UTF-16 Win32 wants
 
-    int len = GetWindowTextLengthW(g_hChatLog);    // Get current text length
-    SendMessageW(g_hChatLog, EM_SETSEL, len, len); // Move cursor to end
-    SendMessageW(g_hChatLog, EM_REPLACESEL, FALSE, (LPARAM)wtext.c_str()); // Insert text
+    SendMessageW(g_hChatLog, WM_SETREDRAW, FALSE, 0); // Paint once, after both edits
+    if (update.replace)
+        SetWindowTextW(g_hChatLog, wtext.c_str());  // Everything shown has scrolled away
+    else
+    {
+        if (update.drop > 0)
+        {
+            SendMessageW(g_hChatLog, EM_SETSEL, 0, update.drop); // Select the oldest lines
+            SendMessageW(g_hChatLog, EM_REPLACESEL, FALSE, (LPARAM)L""); // Cut them
+        }
+        int len = GetWindowTextLengthW(g_hChatLog); // Get current text length
+        SendMessageW(g_hChatLog, EM_SETSEL, len, len); // Move cursor to end
+        SendMessageW(g_hChatLog, EM_REPLACESEL, FALSE, (LPARAM)wtext.c_str()); // Insert text
+    }
+    SendMessageW(g_hChatLog, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(g_hChatLog, NULL, TRUE);
     SendMessageW(g_hChatLog, WM_VSCROLL, SB_BOTTOM, 0); // Scroll to bottom
 }
 
-// Background receive thread
-void RecvLoop()
+// Receives messages until the connection is gone (a coroutine on g_net_thread)
+Task<void> ReceiveMessages(Roster& roster)
 {
-    g_running = true;                  // Set running flag
-    char buf[1024];                    // Buffer for received data
+    Frame frame;
 
-    while (g_running)
+    while (co_await g_client->next(frame)) // Every complete message, until the connection is gone
     {
-        ZeroMemory(buf, sizeof(buf));  // Clear buffer
-        int bytes = recv(g_sock, buf, sizeof(buf) - 1, 0); // Receive data
-
-        if (bytes > 0)
+        if (frame.type == FRAME_HISTORY && frame.flags == HISTORY_END && frame.length == 8)
         {
-            buf[bytes] = '\0';         // Null-terminate
-            AppendToChatLog(std::string("[Peer]: ") + buf + "\r\n"); // Show peer message
+            AppendToChatLog("--- " + std::to_string(read_be(frame.payload, 8)) + " earlier message(s) above ---\r\n");
+            continue;
         }
-        else
+        if (frame.type == FRAME_RESUME && g_lost_at_ms)  // Back after a drop
+        {
+            if (frame.flags == RESUME_DONE && frame.length >= 16 && read_be(frame.payload + 8, 8) > 0)
+                AppendToChatLog("--- " + std::to_string(read_be(frame.payload + 8, 8)) + " message(s) you missed above ---\r\n");
+            else if (frame.flags == RESUME_GAP)          // Too much for the server's memory: fetch it from the history
+                co_await g_client->send(history_request(HISTORY_SINCE, (uint64_t)g_lost_at_ms));
+            continue;
+        }
+        if (frame.type == FRAME_WELCOME || frame.type == FRAME_PRESENCE)
+        {
+            std::string notice = roster.apply(frame); // Someone joined or left
+            if (!notice.empty()) AppendToChatLog("[System]: " + notice + "\r\n");
+            continue;
+        }
+        if (frame.type == FRAME_ROOM)
+        {
+            std::string notice = g_rooms.apply(frame); // We joined or left a room
+            if (!notice.empty()) AppendToChatLog("[System]: " + notice + "\r\n");
+            continue;
+        }
+        if (frame.type == FRAME_DIRECT)
+        {
+            std::string line = format_direct(frame, roster); // A message for us alone
+            if (!line.empty()) AppendToChatLog(line + "\r\n");
+            continue;
+        }
+        if (frame.type != FRAME_CHAT) continue;
+        AppendToChatLog((chat_room(frame) ? g_rooms.format(frame, roster) : roster.format(frame)) + "\r\n"); // Show peer message
+    }
+}
+
+// Connect, register our name and ask for recent history (the first time;
+// after a drop the server sends just what we missed)
+Task<bool> JoinChat(bool first)
+{
+    bool connected = co_await g_client->connect("10.223.0.249", 60000);
+    if (!connected)
+        co_return false;
+
+// if andrew server (10.223.0.249)
+// if Bevnoty server (10.223.0.8)
+
+    g_client->request_shm();                       // Shared memory instead of TCP if the server is on this PC
+    g_client->request_resume();                    // Number what we get, so a reconnect can catch up
+    co_await g_client->send(hello_frame(g_username)); // Register our name, get a session ID back
+    if (first)
+        co_await g_client->send(history_request(HISTORY_LAST, 50)); // Show the last 50 messages sent before we joined
+    std::string rejoin;
+    g_rooms.rejoin(rejoin);                        // Back into our rooms after a drop
+    if (!rejoin.empty())
+        co_await g_client->send(rejoin);
+    co_return true;
+}
+
+// Stays in the chat until we leave: receives, and dials again (waiting
+// longer after each failed try) whenever the connection drops
+Task<void> StayConnected()
+{
+    Roster roster;                                 // Turns sender IDs back into names
+    while (true)
+    {
+        g_online = true;
+        co_await ReceiveMessages(roster);
+        g_online = false;
+        if (g_leaving) co_return;
+        g_lost_at_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        AppendToChatLog("[System]: Disconnected; reconnecting...\r\n"); // Show disconnect (or a garbled message)
+        int wait_ms = 500;
+        while (true)
         {
-            AppendToChatLog("[System]: Disconnected.\r\n"); // Show disconnect
-            g_running = false;          // Stop loop
-            break;
+            co_await g_loop->sleep(wait_ms);
+            if (g_leaving) co_return;
+            bool back = co_await JoinChat(false);
+            if (back) break;
+            wait_ms = std::min(wait_ms * 2, RECONNECT_MAX_MS);
         }
+        AppendToChatLog("[System]: Reconnected.\r\n");
     }
 }
 
-// Connect to server 127.0.0.1:8080
+// Connect to server 10.223.0.249:60000
 bool ConnectToServer()
 {
     WSADATA wsa;
     if (WSAStartup(MAKEWORD(2,2), &wsa) != 0)     // Initialize Winsock
         return false;
 
-    g_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Create TCP socket
-    if (g_sock == INVALID_SOCKET)
-        return false;
-
-    sockaddr_in addr;
-    addr.sin_family = AF_INET;                      // IPv4
-    addr.sin_port = htons(60000);                    // Port 8080
-    inet_pton(AF_INET, "10.223.0.249", &addr.sin_addr); // IP 127.0.0.1
-
-// if andrew server (10.223.0.249)
-// if Bevnoty server (10.223.0.8)
-
-    if (connect(g_sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) // Connect
+    g_loop = new EventLoop();
+    g_client = new ChatClient(*g_loop);
+    if (!g_loop->run_until_done(JoinChat(true)))   // Run the loop here until connected
         return false;
 
-    g_recv_thread = std::thread(RecvLoop);         // Start receive thread
-    g_recv_thread.detach();                        // Detach thread
+    StayConnected().detach();                      // Start receiving
+    g_net_thread = std::thread([]() { g_loop->run(); }); // From now on the loop runs on its own thread
 
     return true;                                   // Connected
 }
@@ -102,7 +194,12 @@ bool ConnectToServer()
 // Send message action
 void SendMessageAction()
 {
-    if (g_sock == INVALID_SOCKET) return;          // Exit if socket invalid
+    if (!g_net_thread.joinable()) return;          // Exit if not connected
+    if (!g_online)                                 // Between a drop and the reconnect
+    {
+        AppendToChatLog("[System]: Not connected right now; that was not sent.\r\n");
+        return;
+    }
 
     int len = GetWindowTextLengthW(g_hInputBox);  // Get input length
     if (len == 0) return;                          // Exit if empty
@@ -110,10 +207,29 @@ void SendMessageAction()
     std::wstring wmsg(len, L'\0');                // Prepare buffer
     GetWindowTextW(g_hInputBox, &wmsg[0], len + 1); // Get input text
 
-    std::string msg(wmsg.begin(), wmsg.end());    // Convert to string
-    std::string full = "[" + g_username + "]: " + msg; // Format message
+    std::string msg = wide_to_utf8(wmsg);         // Convert to UTF-8
+    std::string frame;
+    uint32_t room = g_rooms.current;
+    if (msg.compare(0, 6, "/join ") == 0)         // "/join games": what we type goes to #games
+        frame = room_join_frame(msg.substr(6));
+    else if (msg == "/leave")                     // Out of the current room, back to everyone
+    {
+        room = g_rooms.current.exchange(0);
+        if (room) frame = room_leave_frame(room);
+        else AppendToChatLog("[System]: You are not in a room.\r\n");
+    }
+    else if (!direct_command(frame, msg))         // "/msg bob ..." goes to bob alone
+    {
+        if (room) build_room_chat_frame(frame, room, msg.data(), msg.size()); // Only the room's members see it
+        else build_chat_frame(frame, msg.data(), msg.size()); // The server adds our session ID
+    }
+    if (frame.empty())
+    {
+        SetWindowTextW(g_hInputBox, L"");
+        return;
+    }
 
-    send(g_sock, full.c_str(), (int)full.size(), 0); // Send to server
+    g_client->send_from_thread(frame);            // Send to server as one frame
 
     AppendToChatLog("[You]: " + msg + "\r\n");    // Show in chat log
 
@@ -123,13 +239,19 @@ void SendMessageAction()
 // Cleanup socket
 void CleanupSocket()
 {
-    g_running = false;                             // Stop thread
-    if (g_sock != INVALID_SOCKET)
+    if (g_net_thread.joinable())
     {
-        shutdown(g_sock, SD_BOTH);                // Shutdown socket
-        closesocket(g_sock);                       // Close socket
-        g_sock = INVALID_SOCKET;                  // Reset
+        g_loop->post([]() {                        // On the loop's thread:
+            g_leaving = true;
+            g_client->close();                     // Close socket
+            g_loop->stop();                        // Stop thread
+        });
+        g_net_thread.join();
     }
+    delete g_client;
+    g_client = nullptr;
+    delete g_loop;
+    g_loop = nullptr;
     WSACleanup();                                  // Cleanup Winsock
 }
 
@@ -140,9 +262,10 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     {
     case WM_CREATE:
     {
+        g_hWindow = hwnd;                          // Lines may be posted from now on
         std::wstring title = 
             L"--- SOCKET CHAT (" 
-            + std::wstring(g_username.begin(), g_username.end()) 
+            + utf8_to_wide(g_username) 
             + L") ---";                         // Title with username
 
         CreateWindowW(L"STATIC", title.c_str(),
@@ -154,6 +277,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             WS_CHILD | WS_VISIBLE | WS_VSCROLL | ES_READONLY | ES_MULTILINE,
             10, 30, 480, 230,
             hwnd, (HMENU)ID_CHAT_LOG, NULL, NULL); // Chat log
+        SendMessageW(g_hChatLog, EM_SETLIMITTEXT, 0, 0); // No 32K cap: g_chat_log bounds it instead
 
         g_hInputBox = CreateWindowW(L"EDIT", L"",
             WS_CHILD | WS_VISIBLE | WS_BORDER,
@@ -177,6 +301,22 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         return 0;
     }
 
+    case WM_CHAT_LOG:                                  // New lines are waiting
+    {
+        int delay = g_chat_log.redraw_delay_ms();       // At most one redraw per frame
+        if (delay == 0) RedrawChatLog();
+        else SetTimer(hwnd, ID_REDRAW_TIMER, delay, NULL);
+        return 0;
+    }
+
+    case WM_TIMER:
+        if (wParam == ID_REDRAW_TIMER)
+        {
+            KillTimer(hwnd, ID_REDRAW_TIMER);           // One-shot
+            RedrawChatLog();
+        }
+        return 0;
+
     case WM_COMMAND:
         if (LOWORD(wParam) == ID_SEND_BUTTON)
             SendMessageAction();                       // Send button clicked
@@ -203,7 +343,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE, LPSTR, int nCmdShow)
     else
     {
         std::wstring w(argv[1]);
-        g_username = std::string(w.begin(), w.end());   // Use provided username
+        g_username = wide_to_utf8(w);                    // Use provided username
     }
 
     LocalFree(argv);                                     // Free argv
@@ -0,0 +1,198 @@
+// --- TIMER WHEEL BENCHMARK ---
+// What do heartbeat timers cost the server per connection? Runs the timer
+// wheel the server uses (chat_timer_wheel.h) against the obvious
+// alternative, a std::multimap sorted by due time, with --connections
+// timers (no sockets, no server):
+//   1. Insert: one timer per connection, due somewhere in the next
+//      --heartbeat seconds. Reports ns per insert.
+//   2. Cancel: every timer is cancelled again (a connection closing).
+//      Reports ns per cancel.
+//   3. Churn: --minutes of simulated time in 100 ms ticks, the way the
+//      server's event loop does it. Each connection speaks on its own about
+//      every --talk seconds (which costs the timers nothing: only the time is
+//      noted); when its timer comes due it is pinged if it has been quiet for
+//      --heartbeat seconds, answers straight away, and its timer is set
+//      again. Reports ns per expired timer and CPU per connection per minute.
+// Also prints the memory each timer takes. Returns 1 if the two ever
+// disagree about how many timers expired.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include "chat_timer_wheel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    size_t connections = 100000;
+    long long heartbeat_ms = 30000; // Quiet time before a ping
+    long long talk_ms = 60000;      // Average time between a connection's messages
+    int minutes = 10;               // Simulated time for the churn step
+};
+
+// One simulated connection: when it last spoke and when it speaks next.
+struct Conn {
+    WheelTimer timer;
+    std::multimap<long long, Conn*>::iterator entry; // Its place in the multimap
+    long long heard_at = 0;
+    long long next_talk = 0;
+    uint64_t seed = 0;
+};
+
+struct Result {
+    double insert_ns = 0;   // Per insert
+    double cancel_ns = 0;   // Per cancel
+    double expiry_ns = 0;   // Per expired timer during the churn
+    double per_conn_us = 0; // Churn CPU per connection per simulated minute
+    long long expired = 0;  // Timers that expired during the churn
+};
+
+// The next step of a connection's own random sequence (splitmix64), so both
+// runs see the same talk times whatever order their timers expire in.
+static uint64_t next_random(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Catch a connection's "last heard" up to 'now' and return when its timer
+// should fire next (pinging it if it has been quiet too long: it answers
+// at once, so it is heard from now).
+static long long due_after(Conn& c, long long now, const Options& opt) {
+    while (c.next_talk <= now) {
+        c.heard_at = c.next_talk;
+        c.next_talk += 1 + (long long)(next_random(c.seed) % (uint64_t)(2 * opt.talk_ms));
+    }
+    if (now - c.heard_at >= opt.heartbeat_ms) c.heard_at = now; // Ping, pong
+    return c.heard_at + opt.heartbeat_ms;
+}
+
+static void reset(std::vector<Conn>& conns, const Options& opt) {
+    for (size_t i = 0; i < conns.size(); i++) {
+        Conn& c = conns[i];
+        c.seed = i;
+        c.heard_at = -(long long)(next_random(c.seed) % (uint64_t)opt.heartbeat_ms); // Spread over one period
+        c.next_talk = 1 + (long long)(next_random(c.seed) % (uint64_t)(2 * opt.talk_ms));
+    }
+}
+
+static Result run_wheel(std::vector<Conn>& conns, const Options& opt) {
+    Result r;
+    TimerWheel wheel;
+    wheel.start(0);
+    reset(conns, opt);
+
+    long long start = now_ns();
+    for (Conn& c : conns) wheel.schedule(c.timer, c.heard_at + opt.heartbeat_ms);
+    r.insert_ns = (double)(now_ns() - start) / conns.size();
+
+    start = now_ns();
+    for (Conn& c : conns) wheel.cancel(c.timer);
+    r.cancel_ns = (double)(now_ns() - start) / conns.size();
+
+    for (Conn& c : conns) wheel.schedule(c.timer, c.heard_at + opt.heartbeat_ms);
+    std::vector<WheelTimer*> expired;
+    long long end = opt.minutes * 60000LL;
+    start = now_ns();
+    for (long long now = WHEEL_TICK_MS; now <= end; now += WHEEL_TICK_MS) {
+        expired.clear();
+        wheel.advance(now, expired);
+        for (WheelTimer* t : expired) {
+            Conn& c = *(Conn*)t->owner;
+            wheel.schedule(c.timer, due_after(c, now, opt));
+        }
+        r.expired += (long long)expired.size();
+    }
+    long long took = now_ns() - start;
+    r.expiry_ns = r.expired ? (double)took / r.expired : 0;
+    r.per_conn_us = (double)took / 1000 / conns.size() / opt.minutes;
+    for (Conn& c : conns) wheel.cancel(c.timer);
+    return r;
+}
+
+static Result run_multimap(std::vector<Conn>& conns, const Options& opt) {
+    Result r;
+    std::multimap<long long, Conn*> timers;
+    reset(conns, opt);
+
+    long long start = now_ns();
+    for (Conn& c : conns) c.entry = timers.emplace(c.heard_at + opt.heartbeat_ms, &c);
+    r.insert_ns = (double)(now_ns() - start) / conns.size();
+
+    start = now_ns();
+    for (Conn& c : conns) timers.erase(c.entry);
+    r.cancel_ns = (double)(now_ns() - start) / conns.size();
+
+    for (Conn& c : conns) c.entry = timers.emplace(c.heard_at + opt.heartbeat_ms, &c);
+    std::vector<Conn*> expired;
+    long long end = opt.minutes * 60000LL;
+    start = now_ns();
+    for (long long now = WHEEL_TICK_MS; now <= end; now += WHEEL_TICK_MS) {
+        // The same rounding as the wheel: due on the tick that reaches it.
+        expired.clear();
+        while (!timers.empty() && (timers.begin()->first + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS * WHEEL_TICK_MS <= now) {
+            expired.push_back(timers.begin()->second);
+            timers.erase(timers.begin());
+        }
+        for (Conn* c : expired) c->entry = timers.emplace(std::max(due_after(*c, now, opt), now + 1), c);
+        r.expired += (long long)expired.size();
+    }
+    long long took = now_ns() - start;
+    r.expiry_ns = r.expired ? (double)took / r.expired : 0;
+    r.per_conn_us = (double)took / 1000 / conns.size() / opt.minutes;
+    return r;
+}
+
+static void report(const char* name, const Result& r) {
+    std::cout << name << "insert " << r.insert_ns << " ns, cancel " << r.cancel_ns << " ns, "
+              << r.expired << " expiries at " << r.expiry_ns << " ns each ("
+              << r.per_conn_us << " us per connection per minute)\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--connections") opt.connections = std::max(1LL, std::stoll(argv[++i]));
+        else if (arg == "--heartbeat") opt.heartbeat_ms = std::max(1LL, std::stoll(argv[++i])) * 1000;
+        else if (arg == "--talk") opt.talk_ms = std::max(1LL, std::stoll(argv[++i])) * 1000;
+        else if (arg == "--minutes") opt.minutes = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: timer_bench.exe [--connections N] [--heartbeat SECONDS] [--talk SECONDS] [--minutes N]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Conn> conns(opt.connections);
+    for (Conn& c : conns) c.timer.owner = &c;
+    Result wheel = run_wheel(conns, opt);
+    Result tree = run_multimap(conns, opt);
+
+    std::cout << opt.connections << " connections, heartbeat " << opt.heartbeat_ms / 1000 << " s, one message every "
+              << opt.talk_ms / 1000 << " s on average, " << opt.minutes << " simulated minutes\n";
+    report("wheel:    ", wheel);
+    report("multimap: ", tree);
+    // The wheel's slots are a fixed cost; each timer is a node inside its connection.
+    size_t slots = (size_t)1 << WHEEL_ROOT_BITS;
+    for (int level = 1; level < WHEEL_LEVELS; level++) slots += (size_t)1 << WHEEL_LEVEL_BITS;
+    std::cout << "memory:   wheel " << sizeof(WheelTimer) << " bytes per timer + " << slots * sizeof(WheelTimer) / 1024
+              << " KB of slots; multimap about " << sizeof(std::multimap<long long, Conn*>::value_type) + 4 * sizeof(void*)
+              << " bytes per timer (node and links, before malloc's own overhead) + an iterator in each connection\n";
+
+    if (wheel.expired != tree.expired) {
+        std::cerr << "The wheel and the multimap disagree: " << wheel.expired << " vs " << tree.expired << " expiries\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,303 @@
+// --- HOT RESTART TEST ---
+// Does upgrading the server really go unnoticed? This tool starts a server
+// itself (--server, with --handoff), connects --clients chat sessions to it
+// with the client library (chat_client.h) and keeps them talking at --rate
+// lines per second in total. Every --before seconds it starts a NEW server
+// with --take-over (--upgrades times), which takes the connections over
+// while the lines keep coming (chat_handoff.h).
+//
+// Each line carries its sender, a number counting that sender's lines, and
+// the time it was sent, so every receiver can tell:
+//   - lost lines (a gap in a sender's numbers), repeated or reordered ones,
+//   - how long each line took to arrive: the worst of these, for a line sent
+//     while a handoff was running, is the pause the users saw.
+// Also counts connections that closed. Returns 1 unless no line was lost,
+// none repeated, no connection closed, every old server exited and no line
+// sent during a handoff took --max-pause-ms (default 50) or more to arrive.
+//
+// Linux only (the server's handoff needs SCM_RIGHTS; this tool starts it
+// with fork/exec).
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include "chat_client.h"
+#include "chat_session.h"
+#include "chat_histogram.h"
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string server = "./server";
+    int port = 60100;
+    int shards = 2;            // Event loops in the server
+    int clients = 50;
+    int rate = 500;            // Lines per second, all clients together
+    int before = 2;            // Seconds of chat before each upgrade (and after the last)
+    int upgrades = 1;          // Servers that take over, one after another
+    bool shm = false;          // Clients move to shared memory (they are on the same machine)
+    std::string log;           // The server's --log folder ("" = --no-log)
+    int max_pause_ms = 50;
+    int timeout_sec = 10;
+    bool verbose = false;      // Show the servers' output
+};
+
+// What all clients add up together (one thread: no atomics needed).
+struct Totals {
+    int welcomed = 0;
+    int closed = 0;             // Connections that went away
+    long long sent = 0;
+    long long delivered = 0;
+    long long lost = 0;         // Lines missing from a sender's numbers
+    long long repeated = 0;     // Lines that came twice, or out of order
+    long long upgrading_since = 0; // When the running handoff started (0 = none)
+    long long upgrade_from = 0;    // The last handoff, from starting the new server
+    long long upgrade_to = 0;      // to the old one exiting (LLONG_MAX while it runs)
+    Histogram latency_ns;       // All deliveries
+    Histogram upgrade_ns;       // Deliveries of lines sent during a handoff
+};
+
+struct Client {
+    int index;
+    ChatClient chat;
+    std::vector<uint64_t> next_from; // The number we expect next from each sender
+    uint64_t next_seq = 0;           // Our own next line
+    Client(int index, int clients, EventLoop& loop) : index(index), chat(loop), next_from(clients, 0) {}
+};
+
+#ifndef _WIN32
+// Start a server with 'extra' options on top of the common ones.
+static pid_t start_server(const Options& opt, const std::string& handoff, const std::vector<std::string>& extra) {
+    std::vector<std::string> args = { opt.server, "--port", std::to_string(opt.port), "--shards", std::to_string(opt.shards),
+                                      "--no-files", "--handoff", handoff };
+    if (opt.log.empty()) args.push_back("--no-log");
+    else {
+        args.push_back("--log");
+        args.push_back(opt.log);
+    }
+    args.insert(args.end(), extra.begin(), extra.end());
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!opt.verbose) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+        }
+        std::vector<char*> argv;
+        for (std::string& a : args) argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        std::cerr << "Could not start " << opt.server << "\n";
+        _exit(127);
+    }
+    return pid;
+}
+
+// Has 'pid' exited? (Reaps it if so.)
+static bool exited(pid_t pid) {
+    int status;
+    return waitpid(pid, &status, WNOHANG) == pid;
+}
+
+// A client's reader: checks every line from the other clients.
+static Task<void> read_lines(Client& c, Totals& totals) {
+    Frame frame;
+    uint32_t self = 0;
+    while (co_await c.chat.next(frame)) {
+        if (frame.type == FRAME_WELCOME && frame.length >= SESSION_ID_SIZE) {
+            self = (uint32_t)read_be(frame.payload, SESSION_ID_SIZE);
+            totals.welcomed++;
+            continue;
+        }
+        if (frame.type != FRAME_CHAT || frame.length != SESSION_ID_SIZE + 40 || chat_sender(frame) == self) continue;
+        const char* line = frame.payload + SESSION_ID_SIZE;
+        uint32_t from = (uint32_t)read_hex(line, 8);
+        uint64_t seq = read_hex(line + 8, 16);
+        long long sent_at = (long long)read_hex(line + 24, 16);
+        if (from >= c.next_from.size()) continue;
+        uint64_t& expected = c.next_from[from];
+        if (seq < expected) totals.repeated++;
+        else {
+            totals.lost += (long long)(seq - expected);
+            expected = seq + 1;
+        }
+        long long took = now_ns() - sent_at;
+        totals.latency_ns.record((uint64_t)took);
+        if (sent_at >= totals.upgrade_from && sent_at <= totals.upgrade_to) totals.upgrade_ns.record((uint64_t)took);
+        totals.delivered++;
+    }
+    totals.closed++;
+}
+
+static Task<bool> join(Client& c, const Options& opt, Totals& totals) {
+    bool connected = co_await c.chat.connect("127.0.0.1", opt.port);
+    if (!connected) co_return false;
+    if (opt.shm) c.chat.request_shm();
+    co_await c.chat.send(hello_frame("tester" + std::to_string(c.index)));
+    read_lines(c, totals).detach();
+    co_return true;
+}
+
+// The whole test. Returns true if it passed.
+static Task<bool> run_test(EventLoop& loop, const Options& opt, std::vector<std::unique_ptr<Client>>& clients,
+                           Totals& totals, std::vector<pid_t>& servers, const std::string& handoff) {
+    for (auto& c : clients) {
+        bool joined = co_await join(*c, opt, totals);
+        if (!joined) {
+            std::cerr << "Client " << c->index << " could not connect.\n";
+            co_return false;
+        }
+    }
+    long long deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while (totals.welcomed < opt.clients && now_ns() < deadline) co_await loop.sleep(5);
+    if (totals.welcomed < opt.clients) {
+        std::cerr << "Only " << totals.welcomed << " of " << opt.clients << " clients were welcomed.\n";
+        co_return false;
+    }
+    std::cout << opt.clients << " clients in; chatting at " << opt.rate << " lines/s" << std::endl;
+
+    // Talk, round-robin across the clients, and start a new server every
+    // --before seconds. A handoff counts as running until the old server exits.
+    long long start = now_ns();
+    long long interval = 1000000000LL / opt.rate;
+    long long next_upgrade = start + opt.before * 1000000000LL;
+    long long end = start + (long long)(opt.upgrades + 1) * opt.before * 1000000000LL;
+    int upgraded = 0;
+    bool ok = true;
+    std::string line;
+    char body[40]; // Sender, counter and time sent, in hex (chat lines are text)
+    for (long long i = 0; now_ns() < end; i++) {
+        long long due = start + i * interval;
+        if (due > now_ns()) co_await loop.sleep((int)((due - now_ns()) / 1000000));
+        if (upgraded < opt.upgrades && now_ns() >= next_upgrade && !totals.upgrading_since) {
+            totals.upgrading_since = totals.upgrade_from = now_ns();
+            totals.upgrade_to = LLONG_MAX;
+            servers.push_back(start_server(opt, handoff, { "--take-over", handoff }));
+            upgraded++;
+            next_upgrade += opt.before * 1000000000LL;
+        }
+        if (totals.upgrading_since && exited(servers[servers.size() - 2])) {
+            std::cout << "upgrade " << upgraded << ": old server gone after "
+                      << (now_ns() - totals.upgrading_since) / 1e6 << " ms" << std::endl;
+            totals.upgrade_to = now_ns();
+            totals.upgrading_since = 0;
+        }
+        Client& c = *clients[i % clients.size()];
+        if (!c.chat.is_open()) continue;
+        write_hex(body, (uint64_t)c.index, 8);
+        write_hex(body + 8, c.next_seq++, 16);
+        write_hex(body + 24, (uint64_t)now_ns(), 16);
+        build_chat_frame(line, body, sizeof(body));
+        bool sent = co_await c.chat.send(line);
+        if (sent) totals.sent++;
+    }
+    if (totals.upgrading_since) {
+        std::cerr << "The old server is still running " << (now_ns() - totals.upgrading_since) / 1e6
+                  << " ms after the upgrade started.\n";
+        ok = false;
+    }
+
+    long long expected = totals.sent * (opt.clients - 1);
+    deadline = now_ns() + opt.timeout_sec * 1000000000LL;
+    while (totals.delivered + totals.lost < expected && now_ns() < deadline && totals.closed == 0) co_await loop.sleep(5);
+    co_return ok;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--shm") {
+            opt.shm = true;
+            continue;
+        }
+        if (arg == "--verbose") {
+            opt.verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--server") opt.server = argv[++i];
+        else if (arg == "--port") opt.port = std::stoi(argv[++i]);
+        else if (arg == "--shards") opt.shards = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--clients") opt.clients = std::max(2, std::stoi(argv[++i]));
+        else if (arg == "--rate") opt.rate = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--before") opt.before = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--upgrades") opt.upgrades = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--log") opt.log = argv[++i];
+        else if (arg == "--max-pause-ms") opt.max_pause_ms = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--timeout") opt.timeout_sec = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "Usage: upgrade_bench [--server PATH] [--port N] [--shards N] [--clients N] [--rate PER_SECOND]\n"
+                      << "                     [--before SECONDS] [--upgrades N] [--shm] [--log DIR]\n"
+                      << "                     [--max-pause-ms N] [--timeout SECONDS] [--verbose]\n";
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    std::string handoff = "/tmp/chat_upgrade_" + std::to_string(getpid()) + ".sock";
+    std::vector<pid_t> servers;
+    servers.push_back(start_server(opt, handoff, {}));
+    // Wait until the first server listens.
+    for (int tries = 0; tries < 500; tries++) {
+        SOCKET probe = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        make_address(address, "127.0.0.1", opt.port);
+        bool up = connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+        closesocket(probe);
+        if (up) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    bool ok;
+    Totals totals;
+    {
+        EventLoop loop;
+        std::vector<std::unique_ptr<Client>> clients;
+        for (int i = 0; i < opt.clients; i++) clients.emplace_back(new Client(i, opt.clients, loop));
+        ok = loop.run_until_done(run_test(loop, opt, clients, totals, servers, handoff));
+        int closed_during_test = totals.closed;
+        for (auto& c : clients) c->chat.close();
+        totals.closed = closed_during_test; // Our own hang-ups don't count
+    }
+    for (pid_t pid : servers) kill(pid, SIGTERM);
+    for (pid_t pid : servers) waitpid(pid, nullptr, 0);
+    unlink(handoff.c_str());
+
+    long long expected = totals.sent * (opt.clients - 1);
+    const Histogram& l = totals.latency_ns;
+    const Histogram& u = totals.upgrade_ns;
+    std::cout << "lines:   " << totals.sent << " sent, " << totals.delivered << " of " << expected << " deliveries arrived, "
+              << totals.lost << " lost, " << totals.repeated << " repeated or out of order\n"
+              << "latency: p50 " << l.percentile(0.50) / 1e3 << " us, p99 " << l.percentile(0.99) / 1e3
+              << " us, max " << l.max() / 1e6 << " ms\n"
+              << "upgrade: " << u.count() << " deliveries during handoffs, worst " << u.max() / 1e6 << " ms\n"
+              << "closed:  " << totals.closed << " connections\n";
+    bool passed = ok && totals.lost == 0 && totals.repeated == 0 && totals.closed == 0 &&
+                  totals.delivered == expected && u.max() < (uint64_t)opt.max_pause_ms * 1000000;
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return passed ? 0 : 1;
+}
+#else
+int main() {
+    std::cerr << "The hot restart needs Linux.\n";
+    return 1;
+}
+#endif
@@ -0,0 +1,361 @@
+// --- UTF-8 BENCHMARK ---
+// Are the UTF-8 validators and converters in chat_utf8.h right, and how fast
+// are they? No server needed:
+//   1. Fuzz: hand-picked edge cases (overlong forms, surrogates, U+10FFFF and
+//      just past it, characters cut short) and --fuzz generated cases
+//      (random well-formed text of every kind of character, then damaged:
+//      a byte changed, inserted, dropped, or the end cut off). Every
+//      validator must agree with a reference decoder written the plain way
+//      (decode first, then check the range), and the UTF-8 -> UTF-16
+//      converter must give the reference's characters, a U+FFFD for every
+//      bad byte. Random UTF-16 (lone surrogates included) must come back
+//      from UTF-16 -> UTF-8 as the reference encodes it.
+//   2. Speed: --mb MB of English, European (accented Latin), Chinese and
+//      emoji-heavy chat text. Reports GB/s for each validator, for both
+//      converters, and for the byte-by-byte widening the GUIs used to do;
+//      then the time to validate one short chat line, as the server does.
+// Returns 1 if anything disagrees with the reference.
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "chat_utf8.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    size_t mb = 16;          // Text per kind for the speed test
+    int rounds = 5;          // Best of this many passes
+    long long fuzz = 200000; // Generated fuzz cases
+};
+
+// --- THE REFERENCE ---
+// Decodes the character at 'p' the plain way: the lead byte says how many
+// continuation bytes follow, and the value they make must be in the range
+// for that length, not a surrogate and not past U+10FFFF. Returns its length,
+// or 0 if there is no well-formed character there.
+static size_t reference_decode(const unsigned char* p, size_t left, uint32_t& c) {
+    size_t need;
+    uint32_t min;
+    if (p[0] < 0x80) {
+        c = p[0];
+        return 1;
+    } else if ((p[0] & 0xE0) == 0xC0) {
+        need = 1, min = 0x80, c = p[0] & 0x1F;
+    } else if ((p[0] & 0xF0) == 0xE0) {
+        need = 2, min = 0x800, c = p[0] & 0x0F;
+    } else if ((p[0] & 0xF8) == 0xF0) {
+        need = 3, min = 0x10000, c = p[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if (left < need + 1) return 0;
+    for (size_t k = 1; k <= need; k++) {
+        if ((p[k] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (p[k] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    return need + 1;
+}
+
+static bool reference_valid(const std::string& s) {
+    uint32_t c;
+    for (size_t i = 0; i < s.size();) {
+        size_t n = reference_decode((const unsigned char*)s.data() + i, s.size() - i, c);
+        if (n == 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+// UTF-16 the way the converter should make it: bad bytes become U+FFFD one by one.
+static std::u16string reference_to_utf16(const std::string& s) {
+    std::u16string out;
+    uint32_t c;
+    for (size_t i = 0; i < s.size();) {
+        size_t n = reference_decode((const unsigned char*)s.data() + i, s.size() - i, c);
+        if (n == 0) {
+            out.push_back(u'\xFFFD');
+            i++;
+            continue;
+        }
+        if (c >= 0x10000) {
+            out.push_back((char16_t)(0xD800 + ((c - 0x10000) >> 10)));
+            out.push_back((char16_t)(0xDC00 + ((c - 0x10000) & 0x3FF)));
+        } else {
+            out.push_back((char16_t)c);
+        }
+        i += n;
+    }
+    return out;
+}
+
+static void reference_append(std::string& out, uint32_t c) {
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xC0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += (char)(0xE0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    } else {
+        out += (char)(0xF0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3F));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+static std::string reference_to_utf8(const std::u16string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        uint32_t c = s[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < s.size() && s[i + 1] >= 0xDC00 && s[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00u);
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD; // Half a pair
+        }
+        reference_append(out, c);
+    }
+    return out;
+}
+
+// --- TEXT ---
+// A random character of one kind: 0 ASCII, 1 two bytes, 2 three bytes, 3 four bytes.
+static uint32_t random_char(std::mt19937& random, int kind) {
+    switch (kind) {
+    case 0: return 0x20 + random() % 0x5F;
+    case 1: return 0x80 + random() % (0x800 - 0x80);
+    case 2: {
+        uint32_t c = 0x800 + random() % (0x10000 - 0x800 - 0x800);
+        return c >= 0xD800 ? c + 0x800 : c; // Not a surrogate
+    }
+    default: return 0x10000 + random() % (0x110000 - 0x10000);
+    }
+}
+
+// Text in one of the speed test's styles: the chance of each kind of character.
+struct Style {
+    const char* name;
+    int percent[4]; // ASCII, 2, 3, 4 bytes
+    uint32_t low, high; // Where its non-ASCII characters come from
+};
+
+static std::string make_text(std::mt19937& random, const Style& style, size_t bytes) {
+    std::string out;
+    while (out.size() < bytes) {
+        int roll = (int)(random() % 100), kind = 0;
+        while (kind < 3 && roll >= style.percent[kind]) roll -= style.percent[kind++];
+        uint32_t c = kind == 0 ? (random() % 6 == 0 ? ' ' : 'a' + random() % 26) : style.low + random() % (style.high - style.low);
+        reference_append(out, c);
+    }
+    return out;
+}
+
+// --- FUZZ ---
+struct Fuzz {
+    long long cases = 0;
+    long long invalid = 0; // Cases the reference calls invalid
+    int failures = 0;
+};
+
+static std::string hex(const std::string& s) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    for (size_t i = 0; i < s.size() && i < 48; i++) {
+        out += digits[(unsigned char)s[i] >> 4];
+        out += digits[(unsigned char)s[i] & 15];
+        out += ' ';
+    }
+    return s.size() > 48 ? out + "..." : out;
+}
+
+static void check(Fuzz& fuzz, const std::string& s) {
+    fuzz.cases++;
+    bool expected = reference_valid(s);
+    if (!expected) fuzz.invalid++;
+    const char* wrong = nullptr;
+    std::u16string wide = utf8_to_utf16(s);
+    if (utf8_valid_scalar(s.data(), s.size()) != expected) wrong = "The scalar validator";
+#ifdef CHAT_UTF8_X86
+    else if (utf8_valid_sse2(s.data(), s.size()) != expected) wrong = "The SSE2 validator";
+    else if (utf8_have_avx2() && utf8_valid_avx2(s.data(), s.size()) != expected) wrong = "The AVX2 validator";
+#endif
+    else if (utf8_valid(s.data(), s.size()) != expected) wrong = "utf8_valid";
+    else if (wide != reference_to_utf16(s)) wrong = "UTF-8 -> UTF-16";
+    else if (expected && utf16_to_utf8(wide) != s) wrong = "UTF-16 -> UTF-8 (round trip)";
+    if (wrong && fuzz.failures++ < 10) {
+        std::cerr << wrong << " disagrees with the reference (" << (expected ? "valid" : "invalid") << ", " << s.size()
+                  << " bytes): " << hex(s) << "\n";
+    }
+}
+
+static void check_utf16(Fuzz& fuzz, const std::u16string& s) {
+    fuzz.cases++;
+    if (utf16_to_utf8(s) != reference_to_utf8(s) && fuzz.failures++ < 10) {
+        std::cerr << "UTF-16 -> UTF-8 disagrees with the reference (" << s.size() << " units)\n";
+    }
+}
+
+static void run_fuzz(const Options& opt, Fuzz& fuzz) {
+    // The edges of table 3-7, each alone, after ASCII that ends it at every
+    // position of a 16- and a 32-byte block, and cut short.
+    const char* edges[] = {
+        "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xE0\xBF\xBF", "\xE1\x80\x80", "\xEC\xBF\xBF", "\xED\x80\x80",
+        "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF", "\xF0\x90\x80\x80", "\xF0\xBF\xBF\xBF", "\xF1\x80\x80\x80",
+        "\xF3\xBF\xBF\xBF", "\xF4\x80\x80\x80", "\xF4\x8F\xBF\xBF",
+        // Not well-formed:
+        "\x80", "\xBF", "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xED\xA0\x80", "\xED\xBF\xBF",
+        "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF8\x88\x80\x80\x80",
+        "\xFE", "\xFF", "\xC2", "\xE2\x82", "\xF0\x9F\x98", "\xC2\xC2\x80", "\xE2\x28\xA1", "\xE2\x82\x28",
+        "\xF0\x28\x8C\xBC", "\xC3\xA9\x80", "\xEF\xBB\xBF\xBF"};
+    for (const char* edge : edges) {
+        std::string e(edge);
+        for (size_t pad = 0; pad <= 66; pad++) {
+            std::string ascii(pad, 'a');
+            check(fuzz, ascii + e);
+            check(fuzz, ascii + e + "tail of the line, long enough to fill another block or two");
+            for (size_t cut = 1; cut < e.size(); cut++) check(fuzz, ascii + e.substr(0, cut));
+        }
+    }
+
+    std::mt19937 random(20261017);
+    for (long long n = 0; n < opt.fuzz; n++) {
+        // Well-formed text of random kinds, 0-200 characters.
+        std::string s;
+        size_t chars = random() % 200;
+        int mix = (int)(random() % 16); // Which kinds may appear
+        for (size_t k = 0; k < chars; k++) {
+            int kind = (int)(random() % 4);
+            if (!(mix & (1 << kind))) kind = 0;
+            reference_append(s, random_char(random, kind));
+        }
+        // Then damage it (or not, one time in five).
+        switch (s.empty() ? 0 : random() % 5) {
+        case 1: s[random() % s.size()] = (char)random(); break;
+        case 2: s.insert(s.begin() + random() % (s.size() + 1), (char)(0x80 + random() % 0x80)); break;
+        case 3: s.erase(s.begin() + random() % s.size()); break;
+        case 4: s.resize(s.size() - 1 - random() % std::min<size_t>(s.size(), 3)); break;
+        }
+        check(fuzz, s);
+        // Random bytes, mostly high ones.
+        if (n % 8 == 0) {
+            std::string bytes(random() % 80, '\0');
+            for (char& b : bytes) b = (char)(random() % 3 ? 0x80 + random() % 0x80 : random() % 0x80);
+            check(fuzz, bytes);
+        }
+        // Random UTF-16, surrogates (paired or not) one unit in four.
+        if (n % 4 == 0) {
+            std::u16string units(random() % 60, u'\0');
+            for (char16_t& u : units) u = (char16_t)(random() % 4 ? random() % 0x800 : 0xD800 + random() % 0x800);
+            check_utf16(fuzz, units);
+        }
+    }
+}
+
+// --- SPEED ---
+static volatile size_t sink; // Keeps the compiler from skipping the work
+
+// Best GB/s of 'opt.rounds' passes of 'work' over 'bytes' bytes.
+template <class Work>
+static double gbps(const Options& opt, size_t bytes, Work work) {
+    long long best = -1;
+    for (int r = 0; r < opt.rounds; r++) {
+        long long start = now_ns();
+        sink = work();
+        long long took = now_ns() - start;
+        if (best < 0 || took < best) best = took;
+    }
+    return (double)bytes / (double)std::max(best, 1LL);
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Option " << arg << " needs a value\n";
+            return 1;
+        }
+        if (arg == "--mb") opt.mb = (size_t)std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--rounds") opt.rounds = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--fuzz") opt.fuzz = std::max(0LL, std::stoll(argv[++i]));
+        else {
+            std::cerr << "Usage: utf8_bench.exe [--mb N] [--rounds N] [--fuzz N]\n";
+            return 1;
+        }
+    }
+
+    Fuzz fuzz;
+    run_fuzz(opt, fuzz);
+    std::cout << "fuzz: " << fuzz.cases << " cases (" << fuzz.invalid << " not well-formed), " << fuzz.failures
+              << " disagreements with the reference" << std::endl;
+#ifdef CHAT_UTF8_X86
+    bool avx2 = utf8_have_avx2();
+    if (!avx2) std::cout << "(this CPU has no AVX2: that validator is skipped)\n";
+#endif
+
+    const Style styles[] = {
+        {"English", {100, 0, 0, 0}, 0, 1},
+        {"European", {85, 15, 0, 0}, 0xC0, 0x180},
+        {"Chinese", {15, 0, 85, 0}, 0x4E00, 0x9FFF},
+        {"emoji", {80, 0, 0, 20}, 0x1F300, 0x1F650},
+    };
+    std::mt19937 random(1);
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "GB/s over " << opt.mb << " MB   scalar    SSE2    AVX2   to UTF-16  to UTF-8  byte-widening\n";
+    for (const Style& style : styles) {
+        std::string text = make_text(random, style, opt.mb << 20);
+        std::u16string wide(text.size(), u'\0');
+        std::string back(text.size() * 3, '\0');
+        size_t units = utf8_to_utf16(text.data(), text.size(), &wide[0]);
+        wide.resize(units);
+        std::cout << std::left << std::setw(20) << style.name << std::right << std::setw(7)
+                  << gbps(opt, text.size(), [&] { return (size_t)utf8_valid_scalar(text.data(), text.size()); });
+#ifdef CHAT_UTF8_X86
+        std::cout << std::setw(8) << gbps(opt, text.size(), [&] { return (size_t)utf8_valid_sse2(text.data(), text.size()); });
+        if (avx2) std::cout << std::setw(8) << gbps(opt, text.size(), [&] { return (size_t)utf8_valid_avx2(text.data(), text.size()); });
+        else std::cout << std::setw(8) << "-";
+#else
+        std::cout << std::setw(8) << "-" << std::setw(8) << "-";
+#endif
+        std::u16string into(text.size(), u'\0');
+        std::cout << std::setw(11) << gbps(opt, text.size(), [&] { return utf8_to_utf16(text.data(), text.size(), &into[0]); })
+                  << std::setw(10) << gbps(opt, text.size(), [&] { return utf16_to_utf8(wide.data(), wide.size(), &back[0]); })
+                  << std::setw(15) << gbps(opt, text.size(), [&] {
+                         // What the GUIs used to do (wrong for all but ASCII), without the allocation
+                         std::copy((const unsigned char*)text.data(), (const unsigned char*)text.data() + text.size(), into.begin());
+                         return (size_t)into[0];
+                     })
+                  << "\n";
+    }
+
+    // One chat line at a time, the way the server sees them.
+    const size_t line_bytes = 48, lines = 1000000;
+    std::string line = make_text(random, styles[0], line_bytes).substr(0, line_bytes);
+    std::string european = make_text(random, styles[1], line_bytes + 4);
+    european.resize(line_bytes);
+    while (!reference_valid(european)) european.pop_back(); // Don't end in half a character
+    for (const std::string* s : {&line, &european}) {
+        double per_line = 1.0 / gbps(opt, (size_t)lines, [&] {
+            size_t ok = 0;
+            for (size_t n = 0; n < lines; n++) ok += utf8_valid(s->data(), s->size());
+            return ok;
+        });
+        std::cout << "one " << s->size() << "-byte " << (s == &line ? "English" : "European") << " line: " << per_line
+                  << " ns (utf8_valid)\n";
+    }
+
+    bool passed = fuzz.failures == 0;
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return passed ? 0 : 1;
+}